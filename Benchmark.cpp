@@ -0,0 +1,900 @@
+﻿#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <filesystem>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "FileSystemUtil.h"
+
+using namespace FileSystemUtil;
+
+namespace {
+const int DEFAULT_ROUNDS = 5;
+const int DEFAULT_QUEUE_DEPTH = 64;
+const size_t ZERO_SCAN_BUFFER_SIZE = 1024 * 1024;
+const int FILTER_RULE_COUNT = 1000; /* patterns of each kind in the walktree_filter rule set */
+const std::string FIXTURE_TREE_DIR = "tree";
+const std::string FIXTURE_FLAT_DIR = "flat";
+const std::string FIXTURE_SPARSE_DIR = "sparse";
+const std::string FIXTURE_COPY_DIR = "copy";
+#ifdef _WIN32
+const std::string SEPARATOR = "\\";
+#else
+const std::string SEPARATOR = "/";
+#endif
+}
+
+/* shape of the synthetic fixture generated by -fixture */
+struct FixtureOptions {
+    int depth = 4; /* levels of subdirectories of the deep/wide tree */
+    int fanout = 4; /* subdirectories per directory */
+    int filesPerDir = 16;
+    uint64_t flatFiles = 50000; /* entries of the huge flat directory */
+    int sparseFiles = 2;
+    int sparseExtents = 256; /* allocated extents per sparse file */
+    uint64_t extentSize = 64 * 1024;
+    uint64_t gapSize = 64 * 1024; /* hole between two extents */
+};
+
+/* every operator new of the process is counted to report the heap allocations per op */
+static std::atomic<uint64_t> g_allocations { 0 };
+
+void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+class Stopwatch {
+public:
+    Stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+    double ElapsedSeconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+    uint64_t ElapsedNanoseconds() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_start).count());
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+/**
+* count the syscalls of this process with the raw_syscalls:sys_enter tracepoint,
+* threads created while counting are included, requires tracefs and perf_event permission
+*/
+class SyscallCounter {
+public:
+    SyscallCounter()
+    {
+#ifdef __linux__
+        for (const char* idPath : {
+            "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+            "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" }) {
+            std::ifstream idFile(idPath);
+            uint64_t tracepointId = 0;
+            if (!(idFile >> tracepointId)) {
+                continue;
+            }
+            struct perf_event_attr attr {};
+            attr.type = PERF_TYPE_TRACEPOINT;
+            attr.size = sizeof(attr);
+            attr.config = tracepointId;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            m_fd = static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            break;
+        }
+        if (m_fd >= 0) {
+            /* enabling/disabling is a syscall itself, measure it to subtract it from every pause */
+            Start();
+            Pause();
+            m_pauseOverhead = Stop();
+        }
+#endif
+    }
+
+    ~SyscallCounter()
+    {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+#endif
+    }
+
+    bool Available() const { return m_fd >= 0; }
+
+    void Start()
+    {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            /* PERF_EVENT_IOC_RESET doesn't clear the counts of exited inherited threads, use deltas */
+            m_startCount = ReadCount();
+            ::ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+            m_pauses = 0;
+        }
+#endif
+    }
+
+    void Pause()
+    {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ::ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            m_pauses++;
+        }
+#endif
+    }
+
+    void Resume()
+    {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ::ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /* syscalls issued since Start() excluding the paused intervals */
+    uint64_t Stop()
+    {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ::ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            count = ReadCount() - m_startCount;
+        }
+#endif
+        uint64_t overhead = m_pauseOverhead * (m_pauses + 1);
+        return count > overhead ? count - overhead : 0;
+    }
+
+private:
+    uint64_t ReadCount() const
+    {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (::read(m_fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+#endif
+        return count;
+    }
+
+    int m_fd = -1;
+    uint64_t m_startCount = 0;
+    uint64_t m_pauseOverhead = 0;
+    uint64_t m_pauses = 0;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    uint64_t ops = 0;
+    uint64_t items = 0; /* entries, paths or bytes processed by all ops */
+    std::string itemUnit;
+    double seconds = 0;
+    double p50Micro = 0;
+    double p99Micro = 0;
+    double syscallsPerOp = -1; /* negative if syscall counting is unavailable */
+    double allocationsPerOp = 0; /* operator new calls, allocations of libc (opendir etc.) excluded */
+};
+
+class BenchmarkRunner {
+public:
+    explicit BenchmarkRunner(const std::string& filter) : m_filter(filter) {}
+
+    /**
+    * invoke op(index) ops times, op returns the items it processed,
+    * reset is invoked before every op and excluded from time and syscall accounting
+    */
+    void Run(
+        const std::string& name,
+        const std::string& itemUnit,
+        uint64_t ops,
+        const std::function<uint64_t(uint64_t)>& op,
+        const std::function<void()>& reset = nullptr)
+    {
+        if (!m_filter.empty() && name.find(m_filter) == std::string::npos) {
+            return;
+        }
+        BenchmarkResult result;
+        result.name = name;
+        result.itemUnit = itemUnit;
+        result.ops = ops;
+        std::vector<uint64_t> latencies;
+        latencies.reserve(ops);
+        uint64_t allocations = 0;
+        m_counter.Start();
+        for (uint64_t index = 0; index < ops; ++index) {
+            if (reset) {
+                m_counter.Pause();
+                reset();
+                m_counter.Resume();
+            }
+            uint64_t allocationsBefore = g_allocations.load(std::memory_order_relaxed);
+            Stopwatch watch;
+            result.items += op(index);
+            latencies.push_back(watch.ElapsedNanoseconds());
+            allocations += g_allocations.load(std::memory_order_relaxed) - allocationsBefore;
+        }
+        uint64_t syscalls = m_counter.Stop();
+        for (uint64_t latency : latencies) {
+            result.seconds += latency / 1e9;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        if (!latencies.empty()) {
+            result.p50Micro = latencies[(latencies.size() - 1) * 50 / 100] / 1e3;
+            result.p99Micro = latencies[(latencies.size() - 1) * 99 / 100] / 1e3;
+        }
+        if (m_counter.Available() && ops != 0) {
+            result.syscallsPerOp = static_cast<double>(syscalls) / ops;
+        }
+        if (ops != 0) {
+            result.allocationsPerOp = static_cast<double>(allocations) / ops;
+        }
+        PrintResult(result);
+        m_results.push_back(result);
+    }
+
+    std::string ToJson() const
+    {
+        std::ostringstream json;
+        json << "{\n  \"benchmarks\": [";
+        for (size_t index = 0; index < m_results.size(); ++index) {
+            const BenchmarkResult& result = m_results[index];
+            json << (index == 0 ? "\n" : ",\n") << "    {"
+                << "\"name\": \"" << result.name << "\", "
+                << "\"ops\": " << result.ops << ", "
+                << "\"seconds\": " << result.seconds << ", "
+                << "\"ops_per_sec\": " << Rate(result.ops, result.seconds) << ", "
+                << "\"items\": " << result.items << ", "
+                << "\"item_unit\": \"" << result.itemUnit << "\", "
+                << "\"items_per_sec\": " << Rate(result.items, result.seconds) << ", "
+                << "\"p50_us\": " << result.p50Micro << ", "
+                << "\"p99_us\": " << result.p99Micro << ", "
+                << "\"allocs_per_op\": " << result.allocationsPerOp << ", "
+                << "\"syscalls_per_op\": ";
+            if (result.syscallsPerOp < 0) {
+                json << "null";
+            } else {
+                json << result.syscallsPerOp;
+            }
+            json << "}";
+        }
+        json << "\n  ]\n}\n";
+        return json.str();
+    }
+
+private:
+    static double Rate(uint64_t count, double seconds)
+    {
+        return seconds > 0 ? count / seconds : 0;
+    }
+
+    static void PrintResult(const BenchmarkResult& result)
+    {
+        std::cout << result.name << ": \t"
+            << static_cast<uint64_t>(Rate(result.ops, result.seconds)) << " ops/s, "
+            << static_cast<uint64_t>(Rate(result.items, result.seconds)) << " " << result.itemUnit << "/s, "
+            << "p50 " << result.p50Micro << " us, "
+            << "p99 " << result.p99Micro << " us, "
+            << result.allocationsPerOp << " allocs/op";
+        if (result.syscallsPerOp >= 0) {
+            std::cout << ", " << result.syscallsPerOp << " syscalls/op";
+        }
+        std::cout << std::endl;
+    }
+
+    std::string m_filter;
+    std::vector<BenchmarkResult> m_results;
+    SyscallCounter m_counter;
+};
+
+void PrintHelp()
+{
+    std::cout << "fsutil_bench , benchmark for fsutil fast paths" << std::endl;
+    std::cout << "Usage: " << std::endl;
+    std::cout << "fsutil_bench -fixture <directory path> [-depth N] [-fanout N] [-files N] [-flat N]"
+        " [-sparse N] [-extents N] [-extentsize BYTES] [-gapsize BYTES] \t: generate benchmark fixture" << std::endl;
+    std::cout << "fsutil_bench -run <fixture path> [-rounds N] [-queuedepth N] [-filter NAME] [-json FILE]"
+        " \t: run benchmarks against a fixture" << std::endl;
+}
+
+static bool CreateEmptyFile(const std::string& path)
+{
+    std::ofstream file(path, std::ios::binary);
+    return static_cast<bool>(file);
+}
+
+static bool GenerateTree(const std::string& path, int depth, const FixtureOptions& options)
+{
+    if (!Mkdir(path)) {
+        return false;
+    }
+    for (int index = 0; index < options.filesPerDir; ++index) {
+        if (!CreateEmptyFile(path + SEPARATOR + "file_" + std::to_string(index))) {
+            return false;
+        }
+    }
+    if (depth == 0) {
+        return true;
+    }
+    for (int index = 0; index < options.fanout; ++index) {
+        if (!GenerateTree(path + SEPARATOR + "dir_" + std::to_string(index), depth - 1, options)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* extents of extentSize bytes separated by holes of gapSize bytes, file ends with a hole */
+static bool GenerateSparseFile(const std::string& path, const FixtureOptions& options)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::vector<char> data(options.extentSize);
+    for (size_t index = 0; index < data.size(); ++index) {
+        data[index] = static_cast<char>((index * 131 + 7) % 251 + 1); /* non zero */
+    }
+    uint64_t stride = options.extentSize + options.gapSize;
+    for (int extent = 0; extent < options.sparseExtents; ++extent) {
+        file.seekp(static_cast<std::streamoff>(extent * stride));
+        file.write(data.data(), data.size());
+    }
+    file.close();
+    /* extend to the logical size, the trailing gap stays a hole */
+    std::ofstream tail(path, std::ios::binary | std::ios::in | std::ios::out);
+    tail.seekp(static_cast<std::streamoff>(options.sparseExtents * stride - 1));
+    tail.put('\0');
+    return static_cast<bool>(tail);
+}
+
+int DoGenerateFixtureCommand(const std::string& path, const FixtureOptions& options)
+{
+    if (Exists(path)) {
+        std::cout << path << " already exists" << std::endl;
+        return 1;
+    }
+    if (!MkdirRecursive(path)) {
+        std::cout << "create directory " << path << " failed" << std::endl;
+        return 1;
+    }
+    if (!GenerateTree(path + SEPARATOR + FIXTURE_TREE_DIR, options.depth, options)) {
+        std::cout << "generate tree failed" << std::endl;
+        return 1;
+    }
+    std::string flatPath = path + SEPARATOR + FIXTURE_FLAT_DIR;
+    if (!Mkdir(flatPath)) {
+        std::cout << "create directory " << flatPath << " failed" << std::endl;
+        return 1;
+    }
+    for (uint64_t index = 0; index < options.flatFiles; ++index) {
+        if (!CreateEmptyFile(flatPath + SEPARATOR + "file_" + std::to_string(index))) {
+            std::cout << "create flat file failed at index " << index << std::endl;
+            return 1;
+        }
+    }
+    std::string sparsePath = path + SEPARATOR + FIXTURE_SPARSE_DIR;
+    if (!Mkdir(sparsePath) || !Mkdir(path + SEPARATOR + FIXTURE_COPY_DIR)) {
+        std::cout << "create sparse directory failed" << std::endl;
+        return 1;
+    }
+    for (int index = 0; index < options.sparseFiles; ++index) {
+        if (!GenerateSparseFile(sparsePath + SEPARATOR + "sparse_" + std::to_string(index), options)) {
+            std::cout << "generate sparse file failed at index " << index << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "fixture generated in " << path << std::endl;
+    return 0;
+}
+
+static std::vector<std::string> CollectTreePaths(const std::string& root)
+{
+    std::mutex mutex;
+    std::vector<std::string> paths;
+    WalkTreeOptions options;
+    options.statEntries = false;
+    WalkTree(root, options, [&](const OpenDirEntry& entry, const std::optional<StatResult>&, const WalkTreeContext&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        paths.push_back(entry.FullPath());
+        return true;
+    });
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+static std::vector<std::string> CollectDirectFiles(const std::string& dirPath)
+{
+    std::vector<std::string> paths;
+    std::optional<OpenDirEntry> openDirEntry = OpenDir(dirPath);
+    if (!openDirEntry) {
+        return paths;
+    }
+    do {
+        if (openDirEntry->Name() == "." || openDirEntry->Name() == "..") {
+            continue;
+        }
+        paths.push_back(openDirEntry->FullPath());
+    } while (openDirEntry->Next());
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+static uint64_t ListWithOpenDir(const std::string& path)
+{
+    uint64_t total = 0;
+    std::optional<OpenDirEntry> openDirEntry = OpenDir(path);
+    if (!openDirEntry) {
+        return 0;
+    }
+    do {
+        if (openDirEntry->NameView() == "." || openDirEntry->NameView() == "..") {
+            continue;
+        }
+        total++;
+    } while (openDirEntry->Next());
+    return total;
+}
+
+static uint64_t ListWithDirRange(const std::string& path)
+{
+    uint64_t total = 0;
+    for (const OpenDirEntry& entry : ListDir(path)) {
+        total += entry.NameView().empty() ? 0 : 1;
+    }
+    return total;
+}
+
+/* build the full path of every entry, by FullPath() or in place by a PathBuffer */
+static uint64_t ListFullPaths(const std::string& path, bool usePathBuffer)
+{
+    uint64_t total = 0;
+    std::optional<OpenDirEntry> openDirEntry = OpenDir(path);
+    if (!openDirEntry) {
+        return 0;
+    }
+    PathBuffer pathBuffer(path);
+    do {
+        if (openDirEntry->NameView() == "." || openDirEntry->NameView() == "..") {
+            continue;
+        }
+        if (usePathBuffer) {
+            pathBuffer.Push(openDirEntry->NameView());
+            total += pathBuffer.Size() > 0 ? 1 : 0;
+            pathBuffer.Pop();
+        } else {
+            total += openDirEntry->FullPath().size() > 0 ? 1 : 0;
+        }
+    } while (openDirEntry->Next());
+    return total;
+}
+
+#ifdef __linux__
+static uint64_t ListWithBatchReader(const std::string& path)
+{
+    uint64_t total = 0;
+    std::optional<DirentBatchReader> reader = OpenDirBatch(path);
+    if (!reader) {
+        return 0;
+    }
+    std::vector<DirentView> batch;
+    while (reader->NextBatch(batch)) {
+        for (const DirentView& entry : batch) {
+            if (entry.name == "." || entry.name == "..") {
+                continue;
+            }
+            total++;
+        }
+    }
+    return total;
+}
+#endif
+
+static uint64_t CountWalkTree(const std::string& root, bool statEntries, const PathFilter& filter = PathFilter())
+{
+    std::atomic<uint64_t> total { 0 };
+    WalkTreeOptions options;
+    options.statEntries = statEntries;
+    options.filter = filter;
+    WalkTree(root, options, [&](const OpenDirEntry&, const std::optional<StatResult>&, const WalkTreeContext&) {
+        total.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    });
+    return total.load();
+}
+
+/* thousands of rules matching nothing in the fixture, plus a few pruning part of it */
+static PathFilter MakeBenchmarkFilter()
+{
+    std::vector<std::string> rules;
+    for (int index = 0; index < FILTER_RULE_COUNT; ++index) {
+        rules.push_back("*.ext" + std::to_string(index));
+        rules.push_back("/build_" + std::to_string(index) + "/");
+        rules.push_back("cache_" + std::to_string(index) + "_*/**");
+        rules.push_back("**/log_" + std::to_string(index) + "/[0-9]*.tmp");
+    }
+    rules.push_back("file_1?");
+    rules.push_back("!file_13");
+    rules.push_back("dir_3/");
+    return CompilePathFilter(rules);
+}
+
+#ifdef __linux__
+/* evict the page cache, dentries and inodes so the inode tables are read from the device, root only */
+static void DropInodeCaches()
+{
+    ::sync();
+    std::ofstream("/proc/sys/vm/drop_caches") << "3";
+}
+#endif
+
+static uint64_t AllocatedBytes(const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    uint64_t total = 0;
+    for (const std::pair<uint64_t, uint64_t>& range : ranges) {
+        total += range.second;
+    }
+    return total;
+}
+
+#ifdef FSUTIL_HAVE_COROUTINES
+static Task<uint64_t> AsyncStatPath(const std::string& path, IoExecutor& executor)
+{
+    std::optional<StatResult> statResult = co_await AsyncStat(path, executor);
+    co_return statResult ? 1 : 0;
+}
+
+/* one coroutine per path, all of them in flight at once */
+static Task<uint64_t> AsyncStatPaths(const std::vector<std::string>& paths, IoExecutor& executor)
+{
+    std::vector<Task<uint64_t>> tasks;
+    tasks.reserve(paths.size());
+    for (const std::string& path : paths) {
+        tasks.push_back(AsyncStatPath(path, executor));
+    }
+    co_await WhenAll(tasks);
+    uint64_t total = 0;
+    for (Task<uint64_t>& task : tasks) {
+        total += co_await task;
+    }
+    co_return total;
+}
+#endif
+
+static void RunStatBenchmarks(BenchmarkRunner& runner, const std::string& fixturePath, int rounds, int queueDepth)
+{
+    std::vector<std::string> paths = CollectTreePaths(fixturePath + SEPARATOR + FIXTURE_TREE_DIR);
+    if (paths.empty()) {
+        return;
+    }
+    uint64_t ops = paths.size() * rounds;
+    runner.Run("stat", "paths", ops, [&](uint64_t index) -> uint64_t {
+        return Stat(paths[index % paths.size()]) ? 1 : 0;
+    });
+#ifdef __linux__
+    runner.Run("statx_size_mtime", "paths", ops, [&](uint64_t index) -> uint64_t {
+        return StatX(paths[index % paths.size()], STATX_SIZE | STATX_MTIME) ? 1 : 0;
+    });
+#endif
+    for (BulkIoEngine engine : { BulkIoEngine::ThreadPool, BulkIoEngine::IoUring }) {
+#ifdef _WIN32
+        if (engine == BulkIoEngine::IoUring) {
+            continue;
+        }
+#endif
+        BulkIoOptions options;
+        options.engine = engine;
+        options.queueDepth = queueDepth;
+        runner.Run(engine == BulkIoEngine::IoUring ? "bulkstat_uring" : "bulkstat_pool", "paths", rounds,
+            [&](uint64_t) -> uint64_t {
+                std::vector<BulkStatResult> results = BulkStat(paths, options);
+                return std::count_if(results.begin(), results.end(),
+                    [](const BulkStatResult& result) { return result.statResult.has_value(); });
+            });
+#ifdef FSUTIL_HAVE_COROUTINES
+        std::unique_ptr<IoExecutor> executor = CreateIoExecutor(options);
+        if (executor) {
+            runner.Run(engine == BulkIoEngine::IoUring ? "async_stat_uring" : "async_stat_pool", "paths", rounds,
+                [&](uint64_t) { return SyncWait(AsyncStatPaths(paths, *executor)); });
+        }
+#endif
+    }
+}
+
+static void RunListBenchmarks(BenchmarkRunner& runner, const std::string& fixturePath, int rounds)
+{
+    std::string flatPath = fixturePath + SEPARATOR + FIXTURE_FLAT_DIR;
+    std::string treePath = fixturePath + SEPARATOR + FIXTURE_TREE_DIR;
+    runner.Run("opendir_next", "entries", rounds, [&](uint64_t) { return ListWithOpenDir(flatPath); });
+    runner.Run("opendir_range", "entries", rounds, [&](uint64_t) { return ListWithDirRange(flatPath); });
+    runner.Run("opendir_fullpath", "entries", rounds, [&](uint64_t) { return ListFullPaths(flatPath, false); });
+    runner.Run("opendir_pathbuffer", "entries", rounds, [&](uint64_t) { return ListFullPaths(flatPath, true); });
+#ifdef __linux__
+    runner.Run("opendir_batch", "entries", rounds, [&](uint64_t) { return ListWithBatchReader(flatPath); });
+    /* readdir order is the name hash order on ext4, so fstatat() jumps randomly across the inode tables */
+    for (bool inodeOrder : { false, true }) {
+        StatDirOptions options;
+        options.inodeOrder = inodeOrder;
+        runner.Run(inodeOrder ? "statdir_inode_order" : "statdir_readdir_order", "entries", rounds,
+            [&](uint64_t) -> uint64_t {
+                std::optional<std::vector<StatDirEntry>> entries = StatDir(flatPath, options);
+                return entries ? entries->size() : 0;
+            }, DropInodeCaches);
+    }
+#endif
+    runner.Run("walktree_stat", "entries", rounds, [&](uint64_t) { return CountWalkTree(treePath, true); });
+    runner.Run("walktree_nostat", "entries", rounds, [&](uint64_t) { return CountWalkTree(treePath, false); });
+    PathFilter filter = MakeBenchmarkFilter();
+    runner.Run("walktree_filter", "entries", rounds, [&](uint64_t) { return CountWalkTree(treePath, true, filter); });
+    runner.Run("disk_usage", "entries", rounds, [&](uint64_t) -> uint64_t {
+        std::optional<DiskUsageResult> result = DiskUsage(treePath);
+        return result ? result->nodes.front().files + result->nodes.front().directories : 0;
+    });
+    runner.Run("hash_tree_xxh64", "files", rounds, [&](uint64_t) -> uint64_t {
+        std::atomic<uint64_t> files { 0 };
+        HashTree(treePath, HashTreeOptions(), [&](const std::string&, const StatResult&, const std::optional<std::string>& digest) {
+            files += digest ? 1 : 0;
+        });
+        return files.load();
+    });
+}
+
+static void RunSparseBenchmarks(BenchmarkRunner& runner, const std::string& fixturePath, int rounds)
+{
+    std::vector<std::string> sparsePaths = CollectDirectFiles(fixturePath + SEPARATOR + FIXTURE_SPARSE_DIR);
+    if (sparsePaths.empty()) {
+        return;
+    }
+    uint64_t ops = sparsePaths.size() * rounds;
+    runner.Run("query_sparse_ranges", "ranges", ops, [&](uint64_t index) -> uint64_t {
+        SparseRangeResult ranges = QuerySparseAllocateRanges(sparsePaths[index % sparsePaths.size()]);
+        return ranges ? ranges->size() : 0;
+    });
+#ifdef __linux__
+    runner.Run("query_sparse_fiemap", "ranges", ops, [&](uint64_t index) -> uint64_t {
+        SparseExtentResult extents = QuerySparsePosixExtents(sparsePaths[index % sparsePaths.size()]);
+        return extents ? extents->size() : 0;
+    });
+#endif
+    std::string srcPath = sparsePaths.front();
+    std::string dstPath = fixturePath + SEPARATOR + FIXTURE_COPY_DIR + SEPARATOR + "copy_target";
+    SparseRangeResult ranges = QuerySparseAllocateRanges(srcPath);
+    if (!ranges) {
+        return; /* not a sparse file on windows */
+    }
+    auto removeTarget = [&]() { std::remove(dstPath.c_str()); };
+    runner.Run("copy_sparse", "bytes", rounds, [&](uint64_t) -> uint64_t {
+        return CopySparseFile(srcPath, dstPath, ranges.value()) ? AllocatedBytes(ranges.value()) : 0;
+    }, removeTarget);
+    runner.Run("copy_sparse_parallel", "bytes", rounds, [&](uint64_t) -> uint64_t {
+        return CopySparseFileParallel(srcPath, dstPath, ranges.value()) ? AllocatedBytes(ranges.value()) : 0;
+    }, removeTarget);
+    SparseCopyOptions alwaysOptions;
+    alwaysOptions.mode = SparseMode::Always;
+    runner.Run("copy_sparse_always", "bytes", rounds, [&](uint64_t) -> uint64_t {
+        SparseCopyStrategy strategy = SparseCopyStrategy::None;
+        return CopySparseFile(srcPath, dstPath, ranges.value(), alwaysOptions, strategy) ?
+            AllocatedBytes(ranges.value()) : 0;
+    }, removeTarget);
+    /* one pass over the source against reading the copy again */
+    runner.Run("copy_then_hash", "bytes", rounds, [&](uint64_t) -> uint64_t {
+        return CopySparseFile(srcPath, dstPath, ranges.value()) && HashFile(dstPath) ?
+            AllocatedBytes(ranges.value()) : 0;
+    }, removeTarget);
+    runner.Run("copy_hash_fused", "bytes", rounds, [&](uint64_t) -> uint64_t {
+        std::unique_ptr<Hasher> hasher = CreateHasher(HashAlgorithm::XXH64);
+        SparseCopyOptions hashOptions;
+        hashOptions.hasher = hasher.get();
+        SparseCopyStrategy strategy = SparseCopyStrategy::None;
+        return CopySparseFile(srcPath, dstPath, ranges.value(), hashOptions, strategy) && !hasher->Final().empty() ?
+            AllocatedBytes(ranges.value()) : 0;
+    }, removeTarget);
+#ifdef __linux__
+    /* refresh of an up to date target, every block is compared and none is written */
+    CopySparseFile(srcPath, dstPath, ranges.value());
+    runner.Run("copy_delta_unchanged", "bytes", rounds, [&](uint64_t) -> uint64_t {
+        std::optional<DeltaCopyStats> stats = CopySparseFileDelta(srcPath, dstPath, ranges.value());
+        return stats && stats->bytesWritten == 0 ? AllocatedBytes(ranges.value()) : 0;
+    });
+    removeTarget();
+#endif
+    std::vector<char> zeros(ZERO_SCAN_BUFFER_SIZE, 0);
+    /* suffixed with the code path, results of different CPUs are not mixed up */
+    runner.Run(std::string("zero_scan_") + IsZeroBufferImplementation(), "bytes", rounds * 100,
+        [&](uint64_t) -> uint64_t {
+            return IsZeroBuffer(zeros.data(), zeros.size()) ? zeros.size() : 0;
+        });
+    removeTarget();
+    for (HashAlgorithm algorithm : { HashAlgorithm::XXH64, HashAlgorithm::SHA256 }) {
+        HashFileOptions options;
+        options.algorithm = algorithm;
+        runner.Run(algorithm == HashAlgorithm::XXH64 ? "hash_sparse_xxh64" : "hash_sparse_sha256", "bytes", ops,
+            [&](uint64_t index) -> uint64_t {
+                const std::string& path = sparsePaths[index % sparsePaths.size()];
+                std::optional<StatResult> statResult = Stat(path);
+                return (statResult && HashFile(path, options)) ? statResult->Size() : 0;
+            });
+    }
+    runner.Run("find_duplicates", "groups", rounds, [&](uint64_t) -> uint64_t {
+        std::optional<FindDuplicatesResult> result = FindDuplicates(fixturePath + SEPARATOR + FIXTURE_SPARSE_DIR);
+        return result ? result->groups.size() : 0;
+    });
+}
+
+static void RunSnapshotBenchmarks(BenchmarkRunner& runner, const std::string& fixturePath, int rounds)
+{
+    std::string treePath = fixturePath + SEPARATOR + FIXTURE_TREE_DIR;
+    std::string snapshotPath = fixturePath + SEPARATOR + FIXTURE_COPY_DIR + SEPARATOR + "tree.snapshot";
+    runner.Run("snapshot_capture", "entries", rounds, [&](uint64_t) -> uint64_t {
+        if (!CaptureTreeSnapshot(treePath, snapshotPath)) {
+            return 0;
+        }
+        std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+        return snapshot ? snapshot->Size() : 0;
+    });
+    std::vector<std::string> paths;
+    {
+        std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+        if (!snapshot || snapshot->Size() == 0) {
+            return;
+        }
+        for (uint64_t index = 0; index < snapshot->Size(); index += std::max<uint64_t>(1, snapshot->Size() / 1000)) {
+            paths.push_back(snapshot->Path(index));
+        }
+    }
+    runner.Run("snapshot_open", "entries", rounds * 100, [&](uint64_t) -> uint64_t {
+        std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+        return snapshot ? snapshot->Size() : 0;
+    });
+    std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+    runner.Run("snapshot_find", "paths", paths.size() * rounds, [&](uint64_t index) -> uint64_t {
+        return snapshot->Find(paths[index % paths.size()]) ? 1 : 0;
+    });
+    /* an unchanged tree, measures the merge of the two path streams */
+    runner.Run("snapshot_diff", "entries", rounds, [&](uint64_t) -> uint64_t {
+        bool success = DiffTreeSnapshot(snapshot.value(), snapshot.value(), TreeDiffOptions(),
+            [](const TreeDiffEntry&) { return true; });
+        return success ? snapshot->Size() : 0;
+    });
+    /* every round restores into a new directory, removing a tree in between makes the filesystem busy */
+    std::string restorePath = fixturePath + SEPARATOR + FIXTURE_COPY_DIR + SEPARATOR + "restore";
+    auto removeRestored = [&]() {
+        std::error_code error;
+        std::filesystem::remove_all(restorePath, error);
+    };
+    removeRestored();
+    /* baseline, MkdirRecursive() of every parent and a file stream per file */
+    runner.Run("restore_naive", "entries", rounds, [&](uint64_t index) -> uint64_t {
+        std::string rootPath = restorePath + SEPARATOR + "naive_" + std::to_string(index);
+        uint64_t entries = 0;
+        for (TreeSnapshotCursor cursor(snapshot.value()); cursor.Valid(); cursor.Next()) {
+            std::string path = rootPath + SEPARATOR + std::string(cursor.Path());
+            MkdirRecursive(ParentDirectoryPath(path));
+            bool isDirectory = IsDirectory(treePath + SEPARATOR + std::string(cursor.Path()));
+            entries += (isDirectory ? MkdirRecursive(path) || IsDirectory(path) : std::ofstream(path).good()) ? 1 : 0;
+        }
+        return entries;
+    });
+    runner.Run("restore_tree", "entries", rounds, [&](uint64_t index) -> uint64_t {
+        std::string rootPath = restorePath + SEPARATOR + "tree_" + std::to_string(index);
+        std::optional<RestoreTreeResult> result = RestoreTree(rootPath, snapshot.value());
+        return result ? result->directories + result->files : 0;
+    });
+    removeRestored();
+}
+
+int DoRunCommand(const std::string& fixturePath, int rounds, int queueDepth,
+    const std::string& filter, const std::string& jsonPath)
+{
+    if (!IsDirectory(fixturePath + SEPARATOR + FIXTURE_TREE_DIR)) {
+        std::cout << fixturePath << " is not a fixture generated by -fixture" << std::endl;
+        return 1;
+    }
+    BenchmarkRunner runner(filter);
+    RunStatBenchmarks(runner, fixturePath, rounds, queueDepth);
+    RunListBenchmarks(runner, fixturePath, rounds);
+    RunSparseBenchmarks(runner, fixturePath, rounds);
+    RunSnapshotBenchmarks(runner, fixturePath, rounds);
+    if (!jsonPath.empty()) {
+        std::ofstream jsonFile(jsonPath);
+        jsonFile << runner.ToJson();
+        if (!jsonFile) {
+            std::cout << "write " << jsonPath << " failed" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        PrintHelp();
+        std::cout << "insufficient paramaters" << std::endl;
+        return 1;
+    }
+    std::string command = argv[1];
+    std::string path = argv[2];
+    FixtureOptions fixtureOptions;
+    int rounds = DEFAULT_ROUNDS;
+    int queueDepth = DEFAULT_QUEUE_DEPTH;
+    std::string filter;
+    std::string jsonPath;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "-depth") {
+            fixtureOptions.depth = std::stoi(value);
+        } else if (option == "-fanout") {
+            fixtureOptions.fanout = std::stoi(value);
+        } else if (option == "-files") {
+            fixtureOptions.filesPerDir = std::stoi(value);
+        } else if (option == "-flat") {
+            fixtureOptions.flatFiles = std::stoull(value);
+        } else if (option == "-sparse") {
+            fixtureOptions.sparseFiles = std::stoi(value);
+        } else if (option == "-extents") {
+            fixtureOptions.sparseExtents = std::stoi(value);
+        } else if (option == "-extentsize") {
+            fixtureOptions.extentSize = std::stoull(value);
+        } else if (option == "-gapsize") {
+            fixtureOptions.gapSize = std::stoull(value);
+        } else if (option == "-rounds") {
+            rounds = std::stoi(value);
+        } else if (option == "-queuedepth") {
+            queueDepth = std::stoi(value);
+        } else if (option == "-filter") {
+            filter = value;
+        } else if (option == "-json") {
+            jsonPath = value;
+        } else {
+            PrintHelp();
+            std::cout << "unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (command == "-fixture") {
+        return DoGenerateFixtureCommand(path, fixtureOptions);
+    } else if (command == "-run") {
+        return DoRunCommand(path, rounds, queueDepth, filter, jsonPath);
+    }
+    PrintHelp();
+    std::cout << "invalid parameters" << std::endl;
+    return 1;
+}
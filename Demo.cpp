@@ -1,449 +1,919 @@
-﻿#include <iostream>
-#include <optional>
-#include <fstream>
-#include <chrono>
-#include <ctime>
-
-#ifdef _WIN32
-#pragma execution_character_set("utf-8")
-#endif
-
-#include "FileSystemUtil.h"
-
-using namespace FileSystemUtil;
-
-#ifdef _WIN32
-static std::wstring GetLastErrorAsStringW(DWORD errorID)
-{
-    LPWSTR buffer = nullptr;
-
-    DWORD length = ::FormatMessageW(
-        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-        nullptr,
-        errorID,
-        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-        (LPWSTR)&buffer,
-        0,
-        nullptr);
-
-    std::wstring errorMessage(buffer, length);
-    ::LocalFree(buffer);
-
-    return errorMessage;
-}
-#endif
-
-static std::string ErrorMessage()
-{
-#ifdef _WIN32
-    return Utf16ToUtf8(GetLastErrorAsStringW(::GetLastError()));
-#endif
-#ifdef __linux__
-    return std::string(strerror(errno)) + "(" + std::to_string(errno) + ")";
-#endif
-}
-
-static std::string TimestampSecondsToDate(uint64_t timestamp)
-{
-    auto millsec = std::chrono::seconds(timestamp);
-    auto tp = std::chrono::time_point<
-    std::chrono::system_clock, std::chrono::seconds>(millsec);
-    auto tt = std::chrono::system_clock::to_time_t(tp);
-    std::tm* now = std::gmtime(&tt);
-    char strtime[100] = "";
-    if (std::strftime(strtime, sizeof(strtime), "%Y-%m-%d %H:%M:%S", now) > 0) {
-        return std::string(strtime);
-    }
-    return std::to_string(timestamp);
-}
-
-#ifdef _WIN32
-std::string Win32FileAttributeFlagsToString(const StatResult& statResult)
-{
-    std::string ret;
-    if (statResult.IsArchive()) { ret += "ARCHIVE | "; }
-    if (statResult.IsCompressed()) { ret += "COMPRESSED | "; }
-    if (statResult.IsEncrypted()) { ret += "ENCRYPTED | "; }
-    if (statResult.IsSparseFile()) { ret += "SPARSE | "; }
-    if (statResult.IsHidden()) { ret += "HIDDEN | "; }
-    if (statResult.IsOffline()) { ret += "OFFLINE | "; }
-    if (statResult.IsReadOnly()) { ret += "READONLY | "; }
-    if (statResult.IsSystem()) { ret += "SYSTEM | "; }
-    if (statResult.IsTemporary()) { ret += "TEMP | "; }
-    if (statResult.IsNormal()) { ret += "NORMAL | "; }
-    if (statResult.IsReparsePoint()) { ret += "REPARSE | "; }
-    if (!ret.empty() && ret.back() == ' ') {
-        ret.pop_back();
-        ret.pop_back();
-    }
-    return ret;
-}
-#endif
-
-#ifdef __linux__
-std::string LinuxFileModeFlagsToString(const StatResult& statResult)
-{
-    std::string ret;
-    if (statResult.IsRegular()) { ret += "REGULAR | "; }
-    if (statResult.IsPipe()) { ret += "PIPE | "; }
-    if (statResult.IsCharDevice()) { ret += "CHAR | "; }
-    if (statResult.IsBlockDevice()) { ret += "BLOCK | "; }
-    if (statResult.IsSymLink()) { ret += "SYMLINK | "; }
-    if (statResult.IsSocket()) { ret += "SOCKET | "; }
-    if (!ret.empty() && ret.back() == ' ') {
-        ret.pop_back();
-        ret.pop_back();
-    }
-    return ret;
-}
-#endif
-
-void PrintHelp()
-{
-    std::cout << "fsutil  , stat/opendir demo for windows/linux" << std::endl;
-    std::cout << "Usage: " << std::endl;
-    std::cout << "fsutil -ls <directory path> \t: list subdirectory/file of a directory" << std::endl;
-    std::cout << "fsutil -stat <path> \t\t: print the detail info of directory/file" << std::endl;
-    std::cout << "fsutil -mkdir <path> \t\t: create directory recursively" << std::endl;
-    std::cout << "fsutil -sparse <path> \t\t: query sparse file allocate ranges" << std::endl;
-    std::cout << "fsutil -cpsparse <src> <dst> \t: copy sparse file" << std::endl;
-#ifdef _WIN32
-    std::cout << "fsutil -getsd <path> \t\t: list security descriptor string of _WIN32 path" << std::endl;
-    std::cout << "fsutil -copysd <path> \t\t: copy security descriptor from src to target" << std::endl;
-    std::cout << "fsutil -mksymlink <link> <target> \t\t: create symbolic link" << std::endl;
-    std::cout << "fsutil --drivers \t\t: list drivers" << std::endl;
-    std::cout << "fsutil --volumes \t\t: list volumes" << std::endl;
-#endif
-}
-
-int DoStatCommand(const std::string& path)
-{
-    std::optional<StatResult> statResult = Stat(path);
-    if (!statResult) {
-        std::cout << "stat failed, error: " << ErrorMessage() << std::endl;
-        return 1;
-    }
-    std::cout << "Name: \t\t" << statResult->CanonicalPath() << std::endl;
-    std::cout << "Type: \t\t" << (statResult->IsDirectory() ? "Directory" : "File") << std::endl;
-    std::cout << "UniqueID: \t" << statResult->UniqueID() << std::endl;
-    std::cout << "Size: \t\t" << statResult->Size() << std::endl;
-    std::cout << "Device: \t" << statResult->DeviceID() << std::endl;
-    std::cout << "Links: \t\t" << statResult->LinksCount() << std::endl;
-    std::cout << "Atime: \t\t" << TimestampSecondsToDate(statResult->AccessTime())  << std::endl;
-    std::cout << "CTime: \t\t" << TimestampSecondsToDate(statResult->CreationTime()) << std::endl;
-    std::cout << "MTime: \t\t" << TimestampSecondsToDate(statResult->ModifyTime()) << std::endl;
-#ifdef _WIN32
-    std::cout << "Attr: \t\t" << statResult->Attribute() << std::endl;
-    std::cout << "Flags: \t\t" << Win32FileAttributeFlagsToString(statResult.value()) << std::endl;
-    if (statResult->IsReparsePoint()) {
-        if (statResult->HasReparseMountPointTag()) { std::cout << "Reparse: \tMountPoint" << std::endl; }
-        if (statResult->HasReparseNfsTag()) { std::cout << "Reparse: \tNFS" << std::endl; }
-        if (statResult->HasReparseOneDriveTag()) { std::cout << "Reparse: \tOnedrive" << std::endl; }
-        if (statResult->HasReparseSymbolicLinkTag()) { std::cout << "Reparse: \tSymlink" << std::endl; }
-        if (statResult->IsMountedDevice()) {
-            std::wcout << L"Device: \t" << statResult->MountedDeviceNameW().value() << std::endl;
-        }
-        if (statResult->IsJunctionPoint()) {
-            std::wcout << L"Junction: \t" << statResult->JunctionsPointTargetPathW().value() << std::endl;
-        }
-        if (statResult->IsSymbolicLink()) {
-            std::wcout << L"Symlink: \t" << statResult->SymbolicLinkTargetPathW().value() << std::endl;
-        }
-        if (statResult->FinalPathW()) {
-            std::wcout << L"FinalPath: \t" << statResult->FinalPathW().value() << std::endl;
-        }
-    }
-    /* check ADS file */
-    std::optional<AlternateDataStreamEntry> adsEntry = OpenAlternateDataStreamW(Utf8ToUtf16(path));
-    if (!adsEntry) {
-        if (::GetLastError() != ERROR_HANDLE_EOF) {
-            std::cout << "open ADS stream failed, error: " << ErrorMessage() << std::endl;
-            return -1;
-        } else {
-            /* no other data stream */
-            return 0;
-        }
-    }
-    int adsIndex = 1;
-    do {
-        std::wstring wStreamName = adsEntry->StreamNameW();
-        if (wStreamName == L"::$DATA") {
-            continue; // skip main data stream
-        }
-        std::wcout << L"Stream[" << adsIndex++ << L"] " << wStreamName << std::endl;
-    } while (adsEntry->Next());
-#endif
-#ifdef __linux__
-    std::cout << "Mode: \t\t" << statResult->Mode() << std::endl;
-    std::cout << "Flags: \t\t" << LinuxFileModeFlagsToString(statResult.value()) << std::endl;
-#endif
-    return 0;
-}
-
-int DoListCommand(const std::string& path)
-{
-    int total = 0;
-    std::optional<OpenDirEntry> openDirEntry = OpenDir(path);
-    if (!openDirEntry) {
-#ifdef _WIN32
-        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
-#endif
-#ifdef __linux__
-        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
-#endif
-        return 1;
-    }
-    else {
-        do {
-            if (openDirEntry->Name() == "." || openDirEntry->Name() == "..") {
-                continue;
-            }
-            std::optional<StatResult> subStatResult = Stat(openDirEntry->FullPath());
-            if (subStatResult) {
-                std::string type = subStatResult->IsDirectory() ? "Directory" : "File";
-
-#ifdef _WIN32
-                if (subStatResult->IsReparsePoint()) {
-                    if (subStatResult->SymbolicLinkTargetPathW()) {
-                        type = "Symbolic";
-                    } else if (subStatResult->JunctionsPointTargetPathW()) {
-                        type = "Junction";
-                    } else if (subStatResult->MountedDeviceNameW()) {
-                        type = "MountDev";
-                    } else {
-                        type = "Invalid";
-                    }
-                }
-#endif
-                std::cout
-                    << "UniqueID: " << subStatResult->UniqueID() << "\t"
-#ifdef _WIN32
-                    << "Attribute: " << subStatResult->Attribute() << "\t"
-#endif
-                    << "Type: " << type << "\t"
-                    << "Path: " << openDirEntry->FullPath()
-                    << std::endl;
-                total++;
-            }
-            else {
-                std::cout << "Stat " << openDirEntry->FullPath() << " Failed, error: " << ErrorMessage() << std::endl;
-            }
-        } while (openDirEntry->Next());
-    }
-    std::cout << "Total SubItems = " << total << std::endl;
-    return 0;
-}
-
-int DoMkdirCommand(const std::string& path)
-{
-    if (MkdirRecursive(path)) {
-        std::cout << "Success" << std::endl;
-        return 0;
-    } else {
-        std::cout << "Failed" << std::endl;
-        return -1;
-    }
-}
-
-int DoQuerySparseCommand(const std::string& path)
-{
-    std::optional<StatResult> statResult = Stat(path);
-    if (!statResult) {
-        std::cout << "File Not Exist" << std::endl;
-        return -1;
-    }
-    SparseRangeResult result = QuerySparseAllocateRanges(path);
-    if (!result) {
-        std::cout << "file is not a sparse file" << std::endl;
-        return -1;
-    }
-    std::cout << "Logical Size: " << statResult->Size() << std::endl;
-    std::cout << "Sparse Allocate Range:" << std::endl;
-    uint64_t physicAllocTotal = 0;
-    for (const std::pair<uint64_t, uint64_t>& range: result.value()) {
-        physicAllocTotal += range.second;
-        std::cout << "offset = " << range.first << " , length = " << range.second << std::endl;
-    }
-    std::cout << "Physic Allocate Size: " << physicAllocTotal << std::endl;
-    std::cout << "Hole Size: " << statResult->Size() - physicAllocTotal << std::endl;
-    return 0;
-}
-
-int DoCopySparseCommand(const std::string& srcPath, const std::string& dstPath)
-{
-    std::optional<StatResult> statResult = Stat(srcPath);
-    if (!statResult) {
-        std::cout << "Source File Not Exist" << std::endl;
-        return -1;
-    }
-    SparseRangeResult result = QuerySparseAllocateRanges(srcPath);
-    if (!result) {
-        std::cout << "Source file is not a sparse file" << std::endl;
-        return -1;
-    }
-    if (!CopySparseFile(srcPath, dstPath, result.value())) {
-        std::cout << "Copy Failed" << std::endl;
-        return -1;
-    }
-    std::cout << "Copy Succeed" << std::endl;
-    return 0;
-}
-
-#ifdef _WIN32
-int DoGetSecurityDescriptorWCommand(const std::wstring& wPath)
-{
-    DWORD retCode = 0;
-    std::optional<std::wstring> wSd = GetSecurityDescriptorW(wPath, retCode);
-    if (wSd) {
-        std::wcout << L"SecurityDescriptor:\n" << wSd.value() << std::endl;
-        return 0;
-    }
-    std::wcout << L"error: " << retCode << std::endl;
-    return -1;
-}
-
-int DoCopySecurityDescriptorWCommand(const std::wstring& wPathSrc, const std::wstring wPathTarget)
-{
-    DWORD retCode = 0;
-    std::optional<std::wstring> wSd = GetSecurityDescriptorW(wPathSrc, retCode);
-    std::wcout << wPathSrc << L" ==> " << wPathTarget << std::endl;
-    if (!wSd) {
-        std::wcerr << L"get security descriptor failed, error: " << retCode << std::endl;
-        return -1;
-    }
-    std::wcout << L"SecurityDescriptor:\n" << wSd.value() << std::endl;
-    if (!SetSecurityDescriptorW(wPathTarget, wSd.value(), retCode)) {
-        std::wcerr << L"set security descriptor failed, error: " << retCode << std::endl;
-        return -1;
-    }
-    std::wcout << "Success" << std::endl;
-}
-
-void ListWin32Drivers()
-{
-    std::vector<std::wstring> wDrivers = GetWin32DriverListW();
-    for (const std::wstring& wDriver : wDrivers) {
-        std::wcout << wDriver << std::endl;
-    }
-    return;
-}
-
-void ListWin32Volumes()
-{
-    std::optional<std::vector<Win32VolumesDetail>> wVolumes = GetWin32VolumeList();
-    if (!wVolumes) {
-        std::wcout << L"failed to list volumes, error: " << Utf8ToUtf16(ErrorMessage()) << std::endl;
-        return;
-    }
-    for (Win32VolumesDetail& volumeDetail: wVolumes.value()) {
-        std::wcout << L"Name: \t\t" << volumeDetail.VolumeNameW() << std::endl;
-        if (volumeDetail.GetVolumeDeviceNameW()) {
-            std::wcout << L"Device: \t" << volumeDetail.GetVolumeDeviceNameW().value() << std::endl;
-        }
-        if (volumeDetail.GetVolumePathListW()) {
-            int index = 0;
-            std::vector<std::wstring> wPathList = volumeDetail.GetVolumePathListW().value();
-            for (const std::wstring& wPath : wPathList) {
-                std::wcout << L"Path" << ++index << L": \t\t" << wPath << std::endl;
-            }
-        }
-        std::wcout << std::endl;
-    }
-    return;
-}
-
-int DoMakeSymlinkCommand(const std::wstring& wLinkFilePath, const std::wstring& wTargetPath)
-{
-    if (CreateSymbolicLinkW(wLinkFilePath, wTargetPath, true, true)) {
-        std::wcout << wLinkFilePath << L" ===> " << wTargetPath << std::endl;
-        return 0;
-    } else {
-        std::wcout << L"create symbolic link failed" << std::endl;
-        return -1;
-    }
-}
-
-void TryRequiringPrivilege()
-{
-    // Set ACL
-    if (!EnablePrivilegeW(SE_RESTORE_NAME)) {
-        std::cerr << "== Warning: Error enabling SeRestorePrivilege! == " << std::endl;
-    }
-}
-
-int wmain(int argc, WCHAR** argv)
-{
-    ::SetConsoleOutputCP(65001); // forcing cmd to use UTF-8 output encoding
-    TryRequiringPrivilege();
-    if (argc < 2) {
-        PrintHelp();
-        std::wcout << L"insufficient paramaters" << std::endl;
-        return 1;
-    }
-    bool commandExecuted = false;
-    for (int i = 1; i < argc; ++i) {
-        if (std::wstring(argv[i]) == L"-ls" && i + 1 < argc) {
-            return DoListCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
-        } else if (std::wstring(argv[i]) == L"-stat" && i + 1 < argc) {
-            return DoStatCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
-        } else if (std::wstring(argv[i]) == L"-mkdir" && i + 1 < argc) {
-            return DoMkdirCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
-        } else if (std::wstring(argv[i]) == L"-sparse" && i + 1 < argc) {
-            return DoQuerySparseCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
-        } else if (std::wstring(argv[i]) == L"-cpsparse" && i + 2 < argc) {
-            return DoCopySparseCommand(Utf16ToUtf8(std::wstring(argv[i + 1])), Utf16ToUtf8(std::wstring(argv[i + 2])));
-        } else if (std::wstring(argv[i]) == L"-getsd" && i + 1 < argc) {
-            return DoGetSecurityDescriptorWCommand(std::wstring(argv[i + 1]));
-        } else if (std::wstring(argv[i]) == L"-copysd" && i + 2 < argc) {
-            return DoCopySecurityDescriptorWCommand(std::wstring(argv[i + 1]), std::wstring(argv[i + 2]));
-        } else if (std::wstring(argv[i]) == L"-mksymlink" && i + 2 < argc) {
-            return DoMakeSymlinkCommand(std::wstring(argv[i + 1]), std::wstring(argv[i + 2]));
-        } else if (std::wstring(argv[i]) == L"--drivers") {
-            ListWin32Drivers();
-            return 0;
-        } else if (std::wstring(argv[i]) == L"--volumes") {
-            ListWin32Volumes();
-            return 0;
-        } else {
-            return DoStatCommand(Utf16ToUtf8(std::wstring(argv[i])));
-        }
-    }
-    PrintHelp();
-    std::cout << "invalid parameters";
-    return 1;
-
-
-
-}
-
-#else
-
-int main(int argc, char** argv)
-{
-    if (argc < 2) {
-        PrintHelp();
-        std::cout << "insufficient paramaters" << std::endl;
-        return 1;
-    }
-    bool commandExecuted = false;
-    for (int i = 1; i < argc; ++i) {
-        if (std::string(argv[i]) == "-ls" && i + 1 < argc) {
-            return DoListCommand(std::string(argv[i + 1]));
-        } else if (std::string(argv[i]) == "-stat" && i + 1 < argc) {
-            return DoStatCommand(std::string(argv[i + 1]));
-        } else if (std::string(argv[i]) == "-mkdir" && i + 1 < argc) {
-            return DoMkdirCommand(std::string(argv[i + 1]));
-        } else if (std::string(argv[i]) == "-sparse" && i + 1 < argc) {
-            return DoQuerySparseCommand(std::string(argv[i + 1]));
-        } else if (std::string(argv[i]) == "-cpsparse" && i + 2 < argc) {
-            return DoCopySparseCommand(std::string(argv[i + 1]), std::string(argv[i + 2]));
-        } else {
-            return DoStatCommand(std::string(argv[i]));
-        }
-    }
-    PrintHelp();
-    std::cout << "invalid parameters";
-    return 1;
-}
-
-#endif
+﻿#include <iostream>
+#include <optional>
+#include <fstream>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+#include <mutex>
+
+#ifdef _WIN32
+#pragma execution_character_set("utf-8")
+#endif
+
+#include "FileSystemUtil.h"
+
+using namespace FileSystemUtil;
+
+#ifdef _WIN32
+static std::wstring GetLastErrorAsStringW(DWORD errorID)
+{
+    LPWSTR buffer = nullptr;
+
+    DWORD length = ::FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        nullptr,
+        errorID,
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+        (LPWSTR)&buffer,
+        0,
+        nullptr);
+
+    std::wstring errorMessage(buffer, length);
+    ::LocalFree(buffer);
+
+    return errorMessage;
+}
+#endif
+
+static std::string ErrorMessage()
+{
+#ifdef _WIN32
+    return Utf16ToUtf8(GetLastErrorAsStringW(::GetLastError()));
+#endif
+#ifdef __linux__
+    return std::string(strerror(errno)) + "(" + std::to_string(errno) + ")";
+#endif
+}
+
+static std::string TimestampSecondsToDate(uint64_t timestamp)
+{
+    auto millsec = std::chrono::seconds(timestamp);
+    auto tp = std::chrono::time_point<
+    std::chrono::system_clock, std::chrono::seconds>(millsec);
+    auto tt = std::chrono::system_clock::to_time_t(tp);
+    std::tm* now = std::gmtime(&tt);
+    char strtime[100] = "";
+    if (std::strftime(strtime, sizeof(strtime), "%Y-%m-%d %H:%M:%S", now) > 0) {
+        return std::string(strtime);
+    }
+    return std::to_string(timestamp);
+}
+
+#ifdef _WIN32
+std::string Win32FileAttributeFlagsToString(const StatResult& statResult)
+{
+    std::string ret;
+    if (statResult.IsArchive()) { ret += "ARCHIVE | "; }
+    if (statResult.IsCompressed()) { ret += "COMPRESSED | "; }
+    if (statResult.IsEncrypted()) { ret += "ENCRYPTED | "; }
+    if (statResult.IsSparseFile()) { ret += "SPARSE | "; }
+    if (statResult.IsHidden()) { ret += "HIDDEN | "; }
+    if (statResult.IsOffline()) { ret += "OFFLINE | "; }
+    if (statResult.IsReadOnly()) { ret += "READONLY | "; }
+    if (statResult.IsSystem()) { ret += "SYSTEM | "; }
+    if (statResult.IsTemporary()) { ret += "TEMP | "; }
+    if (statResult.IsNormal()) { ret += "NORMAL | "; }
+    if (statResult.IsReparsePoint()) { ret += "REPARSE | "; }
+    if (!ret.empty() && ret.back() == ' ') {
+        ret.pop_back();
+        ret.pop_back();
+    }
+    return ret;
+}
+#endif
+
+#ifdef __linux__
+std::string LinuxFileModeFlagsToString(const StatResult& statResult)
+{
+    std::string ret;
+    if (statResult.IsRegular()) { ret += "REGULAR | "; }
+    if (statResult.IsPipe()) { ret += "PIPE | "; }
+    if (statResult.IsCharDevice()) { ret += "CHAR | "; }
+    if (statResult.IsBlockDevice()) { ret += "BLOCK | "; }
+    if (statResult.IsSymLink()) { ret += "SYMLINK | "; }
+    if (statResult.IsSocket()) { ret += "SOCKET | "; }
+    if (!ret.empty() && ret.back() == ' ') {
+        ret.pop_back();
+        ret.pop_back();
+    }
+    return ret;
+}
+#endif
+
+void PrintHelp()
+{
+    std::cout << "fsutil  , stat/opendir demo for windows/linux" << std::endl;
+    std::cout << "Usage: " << std::endl;
+    std::cout << "fsutil -ls <directory path> \t: list subdirectory/file of a directory" << std::endl;
+    std::cout << "fsutil -stat <path> \t\t: print the detail info of directory/file" << std::endl;
+    std::cout << "fsutil -mkdir <path> \t\t: create directory recursively" << std::endl;
+    std::cout << "fsutil -sparse <path> \t\t: query sparse file allocate ranges" << std::endl;
+    std::cout << "fsutil -cpsparse <src> <dst> [--sparse=always] [--hash] : copy sparse file, always also skips zero blocks, "
+        "hash prints the SHA-256 computed while copying" << std::endl;
+    std::cout << "fsutil -snapshot <dir> <file> \t: capture snapshot of a directory tree" << std::endl;
+    std::cout << "fsutil -lssnapshot <file> [dir] : list a directory from a snapshot" << std::endl;
+    std::cout << "fsutil -diffsnapshot <old> <new> : diff two snapshots" << std::endl;
+    std::cout << "fsutil -hash <path> \t\t: SHA-256 of a file or of every file under a directory" << std::endl;
+    std::cout << "fsutil -dupes <directory path> \t: find duplicate files" << std::endl;
+    std::cout << "fsutil -du <directory path> \t: disk usage and largest subtrees of a directory" << std::endl;
+    std::cout << "fsutil -restore <file> <dir> \t: restore the directories/files layout of a snapshot" << std::endl;
+    std::cout << "fsutil -filter <dir> <rules> \t: list a directory tree without entries excluded by gitignore rules" << std::endl;
+    std::cout << "fsutil --metrics <command> \t: print the metrics of the command as JSON to stderr on exit" << std::endl;
+#ifdef __linux__
+    std::cout << "fsutil -extents <path> \t\t: query file extents by FIEMAP" << std::endl;
+    std::cout << "fsutil -punch <path> \t\t: punch holes in place of the zero blocks of a file" << std::endl;
+    std::cout << "fsutil -lsstat <directory path> : list and stat a directory in inode order" << std::endl;
+    std::cout << "fsutil -cpdelta <src> <dst> 	: update an existing copy writing only the changed blocks" << std::endl;
+#endif
+#ifdef FSUTIL_HAVE_COROUTINES
+    std::cout << "fsutil -astat <directory path> \t: list and stat a directory by the coroutine async API" << std::endl;
+#endif
+#ifdef _WIN32
+    std::cout << "fsutil -getsd <path> \t\t: list security descriptor string of _WIN32 path" << std::endl;
+    std::cout << "fsutil -copysd <path> \t\t: copy security descriptor from src to target" << std::endl;
+    std::cout << "fsutil -mksymlink <link> <target> \t\t: create symbolic link" << std::endl;
+    std::cout << "fsutil --drivers \t\t: list drivers" << std::endl;
+    std::cout << "fsutil --volumes \t\t: list volumes" << std::endl;
+#endif
+}
+
+int DoStatCommand(const std::string& path)
+{
+#ifdef __linux__
+    std::optional<StatResult> statResult = StatX(path, STATX_BASIC_STATS | STATX_BTIME);
+#else
+    std::optional<StatResult> statResult = Stat(path);
+#endif
+    if (!statResult) {
+        std::cout << "stat failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    std::cout << "Name: \t\t" << statResult->CanonicalPath() << std::endl;
+    std::cout << "Type: \t\t" << (statResult->IsDirectory() ? "Directory" : "File") << std::endl;
+    std::cout << "UniqueID: \t" << statResult->UniqueID() << std::endl;
+    std::cout << "Size: \t\t" << statResult->Size() << std::endl;
+    std::cout << "Device: \t" << statResult->DeviceID() << std::endl;
+    std::cout << "Links: \t\t" << statResult->LinksCount() << std::endl;
+    std::cout << "Atime: \t\t" << TimestampSecondsToDate(statResult->AccessTime())  << std::endl;
+    std::cout << "CTime: \t\t" << TimestampSecondsToDate(statResult->CreationTime()) << std::endl;
+    std::cout << "MTime: \t\t" << TimestampSecondsToDate(statResult->ModifyTime()) << std::endl;
+#ifdef _WIN32
+    std::cout << "Attr: \t\t" << statResult->Attribute() << std::endl;
+    std::cout << "Flags: \t\t" << Win32FileAttributeFlagsToString(statResult.value()) << std::endl;
+    if (statResult->IsReparsePoint()) {
+        if (statResult->HasReparseMountPointTag()) { std::cout << "Reparse: \tMountPoint" << std::endl; }
+        if (statResult->HasReparseNfsTag()) { std::cout << "Reparse: \tNFS" << std::endl; }
+        if (statResult->HasReparseOneDriveTag()) { std::cout << "Reparse: \tOnedrive" << std::endl; }
+        if (statResult->HasReparseSymbolicLinkTag()) { std::cout << "Reparse: \tSymlink" << std::endl; }
+        if (statResult->IsMountedDevice()) {
+            std::wcout << L"Device: \t" << statResult->MountedDeviceNameW().value() << std::endl;
+        }
+        if (statResult->IsJunctionPoint()) {
+            std::wcout << L"Junction: \t" << statResult->JunctionsPointTargetPathW().value() << std::endl;
+        }
+        if (statResult->IsSymbolicLink()) {
+            std::wcout << L"Symlink: \t" << statResult->SymbolicLinkTargetPathW().value() << std::endl;
+        }
+        if (statResult->FinalPathW()) {
+            std::wcout << L"FinalPath: \t" << statResult->FinalPathW().value() << std::endl;
+        }
+    }
+    /* check ADS file */
+    std::optional<AlternateDataStreamEntry> adsEntry = OpenAlternateDataStreamW(Utf8ToUtf16(path));
+    if (!adsEntry) {
+        if (::GetLastError() != ERROR_HANDLE_EOF) {
+            std::cout << "open ADS stream failed, error: " << ErrorMessage() << std::endl;
+            return -1;
+        } else {
+            /* no other data stream */
+            return 0;
+        }
+    }
+    int adsIndex = 1;
+    do {
+        std::wstring wStreamName = adsEntry->StreamNameW();
+        if (wStreamName == L"::$DATA") {
+            continue; // skip main data stream
+        }
+        std::wcout << L"Stream[" << adsIndex++ << L"] " << wStreamName << std::endl;
+    } while (adsEntry->Next());
+#endif
+#ifdef __linux__
+    std::cout << "ChTime: \t" << TimestampSecondsToDate(statResult->ChangeTime()) << std::endl;
+    std::cout << "MTimeNs: \t" << statResult->ModifyTimeNano() << std::endl;
+    std::cout << "Birth: \t\t" << (statResult->HasBirthTime() ? "Yes" : "No") << std::endl;
+    std::cout << "Mode: \t\t" << statResult->Mode() << std::endl;
+    std::cout << "Flags: \t\t" << LinuxFileModeFlagsToString(statResult.value()) << std::endl;
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+static std::string DirEntryTypeName(const OpenDirEntry& entry)
+{
+    switch (entry.Type()) {
+        case DT_DIR: return "Directory";
+        case DT_REG: return "File";
+        case DT_LNK: return "Symbolic";
+        case DT_FIFO: return "Pipe";
+        case DT_CHR: return "CharDev";
+        case DT_BLK: return "BlockDev";
+        case DT_SOCK: return "Socket";
+        default: return "Unknown";
+    }
+}
+#endif
+
+int DoListCommand(const std::string& path)
+{
+    int total = 0;
+    std::optional<OpenDirEntry> openDirEntry = OpenDir(path);
+    if (!openDirEntry) {
+#ifdef _WIN32
+        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
+#endif
+#ifdef __linux__
+        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
+#endif
+        return 1;
+    }
+    else {
+        PathBuffer fullPath(path);
+        do {
+            std::string_view name = openDirEntry->NameView();
+            if (name == "." || name == "..") {
+                continue;
+            }
+            fullPath.Push(name);
+#ifdef __linux__
+            /* inode and type come from the dirent, no stat is issued unless d_type is DT_UNKNOWN */
+            std::cout
+                << "UniqueID: " << openDirEntry->INode() << "\t"
+                << "Type: " << DirEntryTypeName(openDirEntry.value()) << "\t"
+                << "Path: " << fullPath.View()
+                << std::endl;
+            total++;
+#endif
+#ifdef _WIN32
+            /* the reparse point target kind needs the file to be opened */
+            std::optional<StatResult> subStatResult = Stat(fullPath.CStr());
+            if (subStatResult) {
+                std::string type = subStatResult->IsDirectory() ? "Directory" : "File";
+                if (subStatResult->IsReparsePoint()) {
+                    if (subStatResult->SymbolicLinkTargetPathW()) {
+                        type = "Symbolic";
+                    } else if (subStatResult->JunctionsPointTargetPathW()) {
+                        type = "Junction";
+                    } else if (subStatResult->MountedDeviceNameW()) {
+                        type = "MountDev";
+                    } else {
+                        type = "Invalid";
+                    }
+                }
+                std::cout
+                    << "UniqueID: " << subStatResult->UniqueID() << "\t"
+                    << "Attribute: " << subStatResult->Attribute() << "\t"
+                    << "Type: " << type << "\t"
+                    << "Path: " << fullPath.View()
+                    << std::endl;
+                total++;
+            }
+            else {
+                std::cout << "Stat " << fullPath.View() << " Failed, error: " << ErrorMessage() << std::endl;
+            }
+#endif
+            fullPath.Pop();
+        } while (openDirEntry->Next());
+    }
+    std::cout << "Total SubItems = " << total << std::endl;
+    return 0;
+}
+
+#ifdef __linux__
+int DoListStatCommand(const std::string& path)
+{
+    std::optional<std::vector<StatDirEntry>> entries = StatDir(path);
+    if (!entries) {
+        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    for (const StatDirEntry& entry : entries.value()) {
+        if (!entry.statResult) {
+            std::cout << "Stat " << entry.name << " Failed" << std::endl;
+            continue;
+        }
+        std::cout
+            << "UniqueID: " << entry.inode << "\t"
+            << "Type: " << (entry.statResult->IsDirectory() ? "Directory" : "File") << "\t"
+            << "Size: " << entry.statResult->Size() << "\t"
+            << "Name: " << entry.name
+            << std::endl;
+    }
+    std::cout << "Total SubItems = " << entries->size() << std::endl;
+    return 0;
+}
+#endif
+
+int DoMkdirCommand(const std::string& path)
+{
+    if (MkdirRecursive(path)) {
+        std::cout << "Success" << std::endl;
+        return 0;
+    } else {
+        std::cout << "Failed" << std::endl;
+        return -1;
+    }
+}
+
+int DoQuerySparseCommand(const std::string& path)
+{
+    std::optional<StatResult> statResult = Stat(path);
+    if (!statResult) {
+        std::cout << "File Not Exist" << std::endl;
+        return -1;
+    }
+    SparseRangeResult result = QuerySparseAllocateRanges(path);
+    if (!result) {
+        std::cout << "file is not a sparse file" << std::endl;
+        return -1;
+    }
+    std::cout << "Logical Size: " << statResult->Size() << std::endl;
+    std::cout << "Sparse Allocate Range:" << std::endl;
+    uint64_t physicAllocTotal = 0;
+    for (const std::pair<uint64_t, uint64_t>& range: result.value()) {
+        physicAllocTotal += range.second;
+        std::cout << "offset = " << range.first << " , length = " << range.second << std::endl;
+    }
+    std::cout << "Physic Allocate Size: " << physicAllocTotal << std::endl;
+    std::cout << "Hole Size: " << statResult->Size() - physicAllocTotal << std::endl;
+    return 0;
+}
+
+#ifdef __linux__
+int DoQueryExtentsCommand(const std::string& path)
+{
+    SparseExtentResult result = QuerySparsePosixExtents(path);
+    if (!result) {
+        std::cout << "query extents failed, error: " << ErrorMessage() << std::endl;
+        return -1;
+    }
+    for (const SparseExtent& extent : result.value()) {
+        std::cout << "offset = " << extent.logicalOffset
+            << " , physical = " << extent.physicalOffset
+            << " , length = " << extent.length
+            << (extent.unwritten ? " , UNWRITTEN" : "")
+            << (extent.shared ? " , SHARED" : "")
+            << (extent.last ? " , LAST" : "") << std::endl;
+    }
+    std::cout << "Total Extents: " << result->size() << std::endl;
+    return 0;
+}
+#endif
+
+static std::string SparseCopyStrategyToString(SparseCopyStrategy strategy)
+{
+    switch (strategy) {
+        case SparseCopyStrategy::Reflink: return "Reflink";
+        case SparseCopyStrategy::ReflinkRange: return "ReflinkRange";
+        case SparseCopyStrategy::CopyFileRange: return "CopyFileRange";
+        case SparseCopyStrategy::ReadWrite: return "ReadWrite";
+        case SparseCopyStrategy::ZeroDetect: return "ZeroDetect";
+        default: return "None";
+    }
+}
+
+int DoCopySparseCommand(const std::string& srcPath, const std::string& dstPath, const std::vector<std::string>& flags)
+{
+    std::optional<StatResult> statResult = Stat(srcPath);
+    if (!statResult) {
+        std::cout << "Source File Not Exist" << std::endl;
+        return -1;
+    }
+    SparseRangeResult result = QuerySparseAllocateRanges(srcPath);
+    if (!result) {
+        std::cout << "Source file is not a sparse file" << std::endl;
+        return -1;
+    }
+    SparseCopyOptions options;
+    std::unique_ptr<Hasher> hasher;
+    for (const std::string& flag: flags) {
+        if (flag == "--sparse=always") {
+            options.mode = SparseMode::Always;
+        } else if (flag == "--hash") {
+            hasher = CreateHasher(HashAlgorithm::SHA256);
+            options.hasher = hasher.get();
+        }
+    }
+    SparseCopyStrategy strategy = SparseCopyStrategy::None;
+    if (!CopySparseFile(srcPath, dstPath, result.value(), options, strategy)) {
+        std::cout << "Copy Failed" << std::endl;
+        return -1;
+    }
+    std::cout << "Copy Succeed, Strategy: " << SparseCopyStrategyToString(strategy) << std::endl;
+    if (hasher) {
+        std::cout << "SHA-256: " << hasher->Final() << std::endl;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+int DoPunchZeroHolesCommand(const std::string& path)
+{
+    std::optional<uint64_t> punched = PunchZeroHoles(path);
+    if (!punched) {
+        std::cout << "punch holes failed, error: " << ErrorMessage() << std::endl;
+        return -1;
+    }
+    std::cout << "Punched Bytes: " << punched.value() << std::endl;
+    return 0;
+}
+
+int DoCopyDeltaCommand(const std::string& srcPath, const std::string& dstPath)
+{
+    SparseRangeResult ranges = QuerySparseAllocateRanges(srcPath);
+    if (!ranges) {
+        std::cout << "query source ranges failed, error: " << ErrorMessage() << std::endl;
+        return -1;
+    }
+    std::optional<DeltaCopyStats> stats = CopySparseFileDelta(srcPath, dstPath, ranges.value());
+    if (!stats) {
+        std::cout << "delta copy failed, error: " << ErrorMessage() << std::endl;
+        return -1;
+    }
+    std::cout << "Blocks: " << stats->blocks << ", Changed: " << stats->changedBlocks
+        << ", Written Bytes: " << stats->bytesWritten << ", Punched Bytes: " << stats->bytesPunched << std::endl;
+    return 0;
+}
+#endif
+
+int DoSnapshotCommand(const std::string& root, const std::string& snapshotPath)
+{
+    auto begin = std::chrono::steady_clock::now();
+    if (!CaptureTreeSnapshot(root, snapshotPath)) {
+        std::cout << "capture snapshot failed, error: " << ErrorMessage() << std::endl;
+        return -1;
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+    if (!snapshot) {
+        std::cout << "open snapshot failed" << std::endl;
+        return -1;
+    }
+    std::cout << "Total Entries = " << snapshot->Size() << ", Cost = "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
+    return 0;
+}
+
+/* list the direct children of dirPath (relative to the snapshot root, empty for the root) */
+int DoListSnapshotCommand(const std::string& snapshotPath, const std::string& dirPath)
+{
+    std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+    if (!snapshot) {
+        std::cout << "open snapshot failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    std::string prefix = dirPath;
+    while (!prefix.empty() && prefix.back() == '/') {
+        prefix.pop_back();
+    }
+    if (!prefix.empty()) {
+        prefix.push_back('/');
+    }
+    int total = 0;
+    snapshot->Scan(snapshot->LowerBound(prefix),
+        [&](uint64_t, std::string_view path, const TreeSnapshotRecord& record) {
+            if (path.compare(0, prefix.size(), prefix) != 0) {
+                return false;
+            }
+            if (path.find('/', prefix.size()) != std::string_view::npos) {
+                return true; /* entry of a subdirectory */
+            }
+            std::cout
+                << "UniqueID: " << record.uniqueId << "\t"
+                << "Size: " << record.size << "\t"
+                << "Mode: " << record.mode << "\t"
+                << "Path: " << path
+                << std::endl;
+            total++;
+            return true;
+        });
+    std::cout << "Total SubItems = " << total << std::endl;
+    return 0;
+}
+
+static std::string TreeDiffTypeToString(TreeDiffType type)
+{
+    switch (type) {
+        case TreeDiffType::Added: return "A";
+        case TreeDiffType::Removed: return "D";
+        case TreeDiffType::Modified: return "M";
+        case TreeDiffType::Renamed: return "R";
+        default: return "?";
+    }
+}
+
+int DoDiffSnapshotCommand(const std::string& oldSnapshotPath, const std::string& newSnapshotPath)
+{
+    std::optional<TreeSnapshot> oldSnapshot = OpenTreeSnapshot(oldSnapshotPath);
+    std::optional<TreeSnapshot> newSnapshot = OpenTreeSnapshot(newSnapshotPath);
+    if (!oldSnapshot || !newSnapshot) {
+        std::cout << "open snapshot failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    uint64_t total = 0;
+    bool success = DiffTreeSnapshot(oldSnapshot.value(), newSnapshot.value(), TreeDiffOptions(),
+        [&](const TreeDiffEntry& entry) {
+            std::cout << TreeDiffTypeToString(entry.type) << "\t";
+            if (entry.type == TreeDiffType::Renamed) {
+                std::cout << entry.oldPath << " -> ";
+            }
+            std::cout << entry.path << std::endl;
+            total++;
+            return true;
+        });
+    if (!success) {
+        std::cout << "diff failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    std::cout << "Total Changes = " << total << std::endl;
+    return 0;
+}
+
+/* print "<sha256>  <path>" like sha256sum, directories are hashed recursively */
+int DoHashCommand(const std::string& path)
+{
+    HashFileOptions fileOptions;
+    fileOptions.algorithm = HashAlgorithm::SHA256;
+    if (!IsDirectory(path)) {
+        std::optional<std::string> digest = HashFile(path, fileOptions);
+        if (!digest) {
+            std::cout << "hash failed, error: " << ErrorMessage() << std::endl;
+            return -1;
+        }
+        std::cout << digest.value() << "  " << path << std::endl;
+        return 0;
+    }
+    HashTreeOptions options;
+    options.fileOptions = fileOptions;
+    std::mutex outputMutex;
+    bool success = HashTree(path, options,
+        [&](const std::string& filePath, const StatResult&, const std::optional<std::string>& digest) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout << (digest ? digest.value() : std::string("FAILED")) << "  " << filePath << std::endl;
+        });
+    return success ? 0 : -1;
+}
+
+int DoFindDuplicatesCommand(const std::string& path)
+{
+    std::optional<FindDuplicatesResult> result = FindDuplicates(path);
+    if (!result) {
+        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    uint64_t wastedBytes = 0;
+    for (const DuplicateGroup& group : result->groups) {
+        std::cout << "Size: " << group.size << "\tDigest: " << group.digest << std::endl;
+        for (const std::string& filePath : group.paths) {
+            std::cout << "\t" << filePath << std::endl;
+        }
+        wastedBytes += group.size * (group.paths.size() - 1);
+    }
+    std::cout << "Duplicate Groups = " << result->groups.size()
+        << ", Wasted Bytes = " << wastedBytes << std::endl;
+    std::cout << "Files = " << result->files << ", Total Bytes = " << result->totalBytes
+        << ", Hashed Bytes = " << result->bytesHashed << std::endl;
+    return 0;
+}
+
+int DoDiskUsageCommand(const std::string& path)
+{
+    std::optional<DiskUsageResult> result = DiskUsage(path);
+    if (!result) {
+        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    const DiskUsageNode& root = result->nodes.front();
+    std::cout << "Apparent Size: \t" << root.apparentSize << std::endl;
+    std::cout << "Allocated Size: " << root.allocatedSize << std::endl;
+    std::cout << "Files: \t\t" << root.files << std::endl;
+    std::cout << "Directories: \t" << root.directories << std::endl;
+    std::cout << "Largest Subtrees:" << std::endl;
+    for (size_t index : result->top) {
+        const DiskUsageNode& node = result->nodes[index];
+        std::cout << "Allocated: " << node.allocatedSize << "\t"
+            << "Apparent: " << node.apparentSize << "\t"
+            << "Path: " << node.path << std::endl;
+    }
+    return 0;
+}
+
+int DoRestoreCommand(const std::string& snapshotPath, const std::string& root)
+{
+    std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(snapshotPath);
+    if (!snapshot) {
+        std::cout << "open snapshot failed" << std::endl;
+        return 1;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::optional<RestoreTreeResult> result = RestoreTree(root, snapshot.value());
+    auto end = std::chrono::steady_clock::now();
+    if (!result) {
+        std::cout << "restore failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    for (const std::pair<std::string, int>& error : result->errors) {
+        std::cout << "Failed: " << error.first << ", error: " << error.second << std::endl;
+    }
+    std::cout << "Directories = " << result->directories << ", Files = " << result->files
+        << ", Skipped = " << result->skipped << ", Failed = " << result->errors.size() << ", Cost = "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
+    return result->errors.empty() ? 0 : 1;
+}
+
+/* print the entries left by the rules file, excluded directories are not descended */
+int DoFilterCommand(const std::string& root, const std::string& rulesPath)
+{
+    std::optional<PathFilter> filter = LoadPathFilter(rulesPath);
+    if (!filter) {
+        std::cout << "open rules file failed" << std::endl;
+        return 1;
+    }
+    WalkTreeOptions options;
+    options.filter = filter.value();
+    std::mutex outputMutex;
+    bool success = WalkTree(root, options,
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>&, const WalkTreeContext& context) {
+            PathBuffer path(context.dirPath);
+            path.Push(entry.NameView());
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout << path.View() << std::endl;
+            return true;
+        });
+    if (!success) {
+        std::cout << "open dir failed, error: " << ErrorMessage() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/* registered by --metrics, counters are only collected by a FSUTIL_ENABLE_METRICS build */
+void PrintMetrics()
+{
+    std::cerr << GetMetricsSnapshot().ToJson();
+}
+
+#ifdef FSUTIL_HAVE_COROUTINES
+Task<std::optional<StatResult>> AsyncStatEntry(std::string path)
+{
+    co_return co_await AsyncStat(std::move(path));
+}
+
+Task<int> AsyncListAndStat(std::string path)
+{
+    std::vector<Task<std::optional<StatResult>>> tasks;
+    PathBuffer entryPath(path);
+    AsyncGenerator<AsyncDirEntry> entries = AsyncListDir(path);
+    while (std::optional<AsyncDirEntry> entry = co_await entries.Next()) {
+        entryPath.Push(entry->name);
+        tasks.push_back(AsyncStatEntry(std::string(entryPath.View())));
+        entryPath.Pop();
+    }
+    /* every stat is in flight at once */
+    co_await WhenAll(tasks);
+    for (Task<std::optional<StatResult>>& task : tasks) {
+        std::optional<StatResult> statResult = co_await task;
+        if (!statResult) {
+            continue;
+        }
+        std::cout << (statResult->IsDirectory() ? "Dir " : "File ") << statResult->Size()
+            << "\t" << statResult->CanonicalPath() << std::endl;
+    }
+    co_return 0;
+}
+
+int DoAsyncStatCommand(const std::string& path)
+{
+    return SyncWait(AsyncListAndStat(path));
+}
+#endif
+
+#ifdef _WIN32
+int DoGetSecurityDescriptorWCommand(const std::wstring& wPath)
+{
+    DWORD retCode = 0;
+    std::optional<std::wstring> wSd = GetSecurityDescriptorW(wPath, retCode);
+    if (wSd) {
+        std::wcout << L"SecurityDescriptor:\n" << wSd.value() << std::endl;
+        return 0;
+    }
+    std::wcout << L"error: " << retCode << std::endl;
+    return -1;
+}
+
+int DoCopySecurityDescriptorWCommand(const std::wstring& wPathSrc, const std::wstring wPathTarget)
+{
+    DWORD retCode = 0;
+    std::optional<std::wstring> wSd = GetSecurityDescriptorW(wPathSrc, retCode);
+    std::wcout << wPathSrc << L" ==> " << wPathTarget << std::endl;
+    if (!wSd) {
+        std::wcerr << L"get security descriptor failed, error: " << retCode << std::endl;
+        return -1;
+    }
+    std::wcout << L"SecurityDescriptor:\n" << wSd.value() << std::endl;
+    if (!SetSecurityDescriptorW(wPathTarget, wSd.value(), retCode)) {
+        std::wcerr << L"set security descriptor failed, error: " << retCode << std::endl;
+        return -1;
+    }
+    std::wcout << "Success" << std::endl;
+}
+
+void ListWin32Drivers()
+{
+    std::vector<std::wstring> wDrivers = GetWin32DriverListW();
+    for (const std::wstring& wDriver : wDrivers) {
+        std::wcout << wDriver << std::endl;
+    }
+    return;
+}
+
+void ListWin32Volumes()
+{
+    std::optional<std::vector<Win32VolumesDetail>> wVolumes = GetWin32VolumeList();
+    if (!wVolumes) {
+        std::wcout << L"failed to list volumes, error: " << Utf8ToUtf16(ErrorMessage()) << std::endl;
+        return;
+    }
+    for (Win32VolumesDetail& volumeDetail: wVolumes.value()) {
+        std::wcout << L"Name: \t\t" << volumeDetail.VolumeNameW() << std::endl;
+        if (volumeDetail.GetVolumeDeviceNameW()) {
+            std::wcout << L"Device: \t" << volumeDetail.GetVolumeDeviceNameW().value() << std::endl;
+        }
+        if (volumeDetail.GetVolumePathListW()) {
+            int index = 0;
+            std::vector<std::wstring> wPathList = volumeDetail.GetVolumePathListW().value();
+            for (const std::wstring& wPath : wPathList) {
+                std::wcout << L"Path" << ++index << L": \t\t" << wPath << std::endl;
+            }
+        }
+        std::wcout << std::endl;
+    }
+    return;
+}
+
+int DoMakeSymlinkCommand(const std::wstring& wLinkFilePath, const std::wstring& wTargetPath)
+{
+    if (CreateSymbolicLinkW(wLinkFilePath, wTargetPath, true, true)) {
+        std::wcout << wLinkFilePath << L" ===> " << wTargetPath << std::endl;
+        return 0;
+    } else {
+        std::wcout << L"create symbolic link failed" << std::endl;
+        return -1;
+    }
+}
+
+void TryRequiringPrivilege()
+{
+    // Set ACL
+    if (!EnablePrivilegeW(SE_RESTORE_NAME)) {
+        std::cerr << "== Warning: Error enabling SeRestorePrivilege! == " << std::endl;
+    }
+}
+
+int wmain(int argc, WCHAR** argv)
+{
+    ::SetConsoleOutputCP(65001); // forcing cmd to use UTF-8 output encoding
+    TryRequiringPrivilege();
+    if (argc < 2) {
+        PrintHelp();
+        std::wcout << L"insufficient paramaters" << std::endl;
+        return 1;
+    }
+    bool commandExecuted = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::wstring(argv[i]) == L"--metrics") {
+            std::atexit(PrintMetrics);
+            continue;
+        } else if (std::wstring(argv[i]) == L"-ls" && i + 1 < argc) {
+            return DoListCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-stat" && i + 1 < argc) {
+            return DoStatCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-mkdir" && i + 1 < argc) {
+            return DoMkdirCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-sparse" && i + 1 < argc) {
+            return DoQuerySparseCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-cpsparse" && i + 2 < argc) {
+            std::vector<std::string> flags;
+            for (int j = i + 3; j < argc; ++j) {
+                flags.push_back(Utf16ToUtf8(std::wstring(argv[j])));
+            }
+            return DoCopySparseCommand(Utf16ToUtf8(std::wstring(argv[i + 1])), Utf16ToUtf8(std::wstring(argv[i + 2])),
+                flags);
+        } else if (std::wstring(argv[i]) == L"-snapshot" && i + 2 < argc) {
+            return DoSnapshotCommand(Utf16ToUtf8(std::wstring(argv[i + 1])), Utf16ToUtf8(std::wstring(argv[i + 2])));
+        } else if (std::wstring(argv[i]) == L"-lssnapshot" && i + 1 < argc) {
+            return DoListSnapshotCommand(Utf16ToUtf8(std::wstring(argv[i + 1])),
+                i + 2 < argc ? Utf16ToUtf8(std::wstring(argv[i + 2])) : std::string());
+        } else if (std::wstring(argv[i]) == L"-diffsnapshot" && i + 2 < argc) {
+            return DoDiffSnapshotCommand(Utf16ToUtf8(std::wstring(argv[i + 1])), Utf16ToUtf8(std::wstring(argv[i + 2])));
+        } else if (std::wstring(argv[i]) == L"-hash" && i + 1 < argc) {
+            return DoHashCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-dupes" && i + 1 < argc) {
+            return DoFindDuplicatesCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-du" && i + 1 < argc) {
+            return DoDiskUsageCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+        } else if (std::wstring(argv[i]) == L"-restore" && i + 2 < argc) {
+            return DoRestoreCommand(Utf16ToUtf8(std::wstring(argv[i + 1])), Utf16ToUtf8(std::wstring(argv[i + 2])));
+        } else if (std::wstring(argv[i]) == L"-filter" && i + 2 < argc) {
+            return DoFilterCommand(Utf16ToUtf8(std::wstring(argv[i + 1])), Utf16ToUtf8(std::wstring(argv[i + 2])));
+#ifdef FSUTIL_HAVE_COROUTINES
+        } else if (std::wstring(argv[i]) == L"-astat" && i + 1 < argc) {
+            return DoAsyncStatCommand(Utf16ToUtf8(std::wstring(argv[i + 1])));
+#endif
+        } else if (std::wstring(argv[i]) == L"-getsd" && i + 1 < argc) {
+            return DoGetSecurityDescriptorWCommand(std::wstring(argv[i + 1]));
+        } else if (std::wstring(argv[i]) == L"-copysd" && i + 2 < argc) {
+            return DoCopySecurityDescriptorWCommand(std::wstring(argv[i + 1]), std::wstring(argv[i + 2]));
+        } else if (std::wstring(argv[i]) == L"-mksymlink" && i + 2 < argc) {
+            return DoMakeSymlinkCommand(std::wstring(argv[i + 1]), std::wstring(argv[i + 2]));
+        } else if (std::wstring(argv[i]) == L"--drivers") {
+            ListWin32Drivers();
+            return 0;
+        } else if (std::wstring(argv[i]) == L"--volumes") {
+            ListWin32Volumes();
+            return 0;
+        } else {
+            return DoStatCommand(Utf16ToUtf8(std::wstring(argv[i])));
+        }
+    }
+    PrintHelp();
+    std::cout << "invalid parameters";
+    return 1;
+
+
+
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        PrintHelp();
+        std::cout << "insufficient paramaters" << std::endl;
+        return 1;
+    }
+    bool commandExecuted = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--metrics") {
+            std::atexit(PrintMetrics);
+            continue;
+        } else if (std::string(argv[i]) == "-ls" && i + 1 < argc) {
+            return DoListCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-stat" && i + 1 < argc) {
+            return DoStatCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-mkdir" && i + 1 < argc) {
+            return DoMkdirCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-sparse" && i + 1 < argc) {
+            return DoQuerySparseCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-cpsparse" && i + 2 < argc) {
+            return DoCopySparseCommand(std::string(argv[i + 1]), std::string(argv[i + 2]),
+                std::vector<std::string>(argv + i + 3, argv + argc));
+        } else if (std::string(argv[i]) == "-snapshot" && i + 2 < argc) {
+            return DoSnapshotCommand(std::string(argv[i + 1]), std::string(argv[i + 2]));
+        } else if (std::string(argv[i]) == "-lssnapshot" && i + 1 < argc) {
+            return DoListSnapshotCommand(std::string(argv[i + 1]), i + 2 < argc ? std::string(argv[i + 2]) : std::string());
+        } else if (std::string(argv[i]) == "-diffsnapshot" && i + 2 < argc) {
+            return DoDiffSnapshotCommand(std::string(argv[i + 1]), std::string(argv[i + 2]));
+        } else if (std::string(argv[i]) == "-hash" && i + 1 < argc) {
+            return DoHashCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-dupes" && i + 1 < argc) {
+            return DoFindDuplicatesCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-du" && i + 1 < argc) {
+            return DoDiskUsageCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-restore" && i + 2 < argc) {
+            return DoRestoreCommand(std::string(argv[i + 1]), std::string(argv[i + 2]));
+        } else if (std::string(argv[i]) == "-filter" && i + 2 < argc) {
+            return DoFilterCommand(std::string(argv[i + 1]), std::string(argv[i + 2]));
+#ifdef FSUTIL_HAVE_COROUTINES
+        } else if (std::string(argv[i]) == "-astat" && i + 1 < argc) {
+            return DoAsyncStatCommand(std::string(argv[i + 1]));
+#endif
+        } else if (std::string(argv[i]) == "-extents" && i + 1 < argc) {
+            return DoQueryExtentsCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-punch" && i + 1 < argc) {
+            return DoPunchZeroHolesCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-lsstat" && i + 1 < argc) {
+            return DoListStatCommand(std::string(argv[i + 1]));
+        } else if (std::string(argv[i]) == "-cpdelta" && i + 2 < argc) {
+            return DoCopyDeltaCommand(std::string(argv[i + 1]), std::string(argv[i + 2]));
+        } else {
+            return DoStatCommand(std::string(argv[i]));
+        }
+    }
+    PrintHelp();
+    std::cout << "invalid parameters";
+    return 1;
+}
+
+#endif
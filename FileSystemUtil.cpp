@@ -1,1636 +1,6973 @@
-﻿#include "FileSystemUtil.h"
-#include <cstdint>
-
-#ifdef _WIN32
-#ifndef _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
-#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
-#endif
-#include <locale>
-#include <codecvt>
-#include <sddl.h>
-#include <winioctl.h>
-
-#pragma comment(lib, "mpr.lib") /* required by network volume API */
-#endif
-
-#ifdef __linux__
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-#endif
-
-#include <algorithm>
-
-using namespace std;
-
-namespace {
-#ifdef _WIN32
-constexpr auto WIN32_UID = 0;
-constexpr auto WIN32_GID = 0;
-constexpr auto VOLUME_BUFFER_MAX_LEN = MAX_PATH;
-constexpr auto VOLUME_PATH_MAX_LEN = MAX_PATH + 1;
-constexpr auto DEVICE_BUFFER_MAX_LEN = MAX_PATH;
-constexpr auto DEFAULT_REPARSE_TAG = 0;
-const int SYMLINK_FLAG_RELATIVE = 1;
-const std::wstring WPATH_PREFIX = LR"(\\?\)";
-#endif
-}
-
-#ifdef _WIN32
-/*
- * These structure is used for Interal Windows API. 
- * There's no associated import library to define them, so developers must define them maunally
- */
-
-/* https://learn.microsoft.com/en-us/windows-hardware/drivers/ddi/ntifs/ns-ntifs-_reparse_data_buffer?redirectedfrom=MSDN */
-typedef struct _REPARSE_DATA_BUFFER {
-    ULONG  ReparseTag;
-    USHORT ReparseDataLength;
-    USHORT Reserved;
-    union {
-        struct {
-            USHORT SubstituteNameOffset;
-            USHORT SubstituteNameLength;
-            USHORT PrintNameOffset;
-            USHORT PrintNameLength;
-            ULONG  Flags;
-            WCHAR  PathBuffer[1];
-        } SymbolicLinkReparseBuffer;
-        struct {
-            USHORT SubstituteNameOffset;
-            USHORT SubstituteNameLength;
-            USHORT PrintNameOffset;
-            USHORT PrintNameLength;
-            WCHAR  PathBuffer[1];
-        } MountPointReparseBuffer;
-        struct {
-            UCHAR DataBuffer[1];
-        } GenericReparseBuffer;
-    } DUMMYUNIONNAME;
-} REPARSE_DATA_BUFFER, * PREPARSE_DATA_BUFFER;
-#endif
-
-/* Implement Section Begin */
-namespace FileSystemUtil {
-
-#ifdef _WIN32
-std::wstring Utf8ToUtf16(const std::string& str)
-{
-    using ConvertTypeX = std::codecvt_utf8_utf16<wchar_t>;
-    std::wstring_convert<ConvertTypeX> converterX;
-    std::wstring wstr = converterX.from_bytes(str);
-    return wstr;
-}
-
-std::string Utf16ToUtf8(const std::wstring& wstr)
-{
-    using ConvertTypeX = std::codecvt_utf8_utf16<wchar_t>;
-    std::wstring_convert<ConvertTypeX> converterX;
-    return converterX.to_bytes(wstr);
-}
-
-inline std::wstring ConvertWin32UnicodePath(const std::wstring& wPath)
-{
-    if (wPath.length() > WPATH_PREFIX.length() && wPath.find(WPATH_PREFIX) == 0) {
-        /* already have prefix */
-        return wPath;
-    }
-    return WPATH_PREFIX + wPath;
-}
-
-bool EnablePrivilegeW(const wchar_t* wPrivilegeName)
-{
-    HANDLE hToken;
-    char buf[sizeof(TOKEN_PRIVILEGES) * 2];
-    TOKEN_PRIVILEGES& tkp = *((TOKEN_PRIVILEGES*) buf);
-
-    if (!::OpenProcessToken(
-            GetCurrentProcess(),
-            TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
-            &hToken)) {
-        return false;
-    }
-
-    /* enable SeBackupPrivilege, SeRestorePrivilege */
-    if (!::LookupPrivilegeValue(
-            nullptr,
-            wPrivilegeName,
-            &tkp.Privileges[0].Luid)) { 
-        return false;
-    }
-
-    if (!::LookupPrivilegeValue(
-            nullptr,
-            SE_RESTORE_NAME,
-            &tkp.Privileges[1].Luid)) {
-        return false;
-    }
-
-    tkp.PrivilegeCount = 2;
-    tkp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-    tkp.Privileges[1].Attributes = SE_PRIVILEGE_ENABLED;
-
-    ::AdjustTokenPrivileges(hToken, false, &tkp, sizeof(tkp), nullptr, nullptr);
-    return true;   
-}
-#endif
-
-
-#ifdef __linux__
-StatResult::StatResult(const std::string& path, const struct stat& statbuff)
-    : m_path(path)
-{
-    memcpy(&m_stat, &statbuff, sizeof(struct stat));
-}
-#endif
-
-#ifdef _WIN32
-StatResult::StatResult(const std::wstring& wPath, const BY_HANDLE_FILE_INFORMATION& handleFileInformation)
-    : m_wPath(wPath)
-{
-    memcpy_s(&m_handleFileInformation, sizeof(BY_HANDLE_FILE_INFORMATION),
-        &handleFileInformation, sizeof(BY_HANDLE_FILE_INFORMATION));
-}
-#endif
-
-uint64_t StatResult::UserID() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_gid);
-#endif
-#ifdef _WIN32
-    return WIN32_UID;
-#endif
-}
-
-uint64_t StatResult::GroupID() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_uid);
-#endif
-#ifdef _WIN32
-    return WIN32_GID;
-#endif
-}
-
-uint64_t StatResult::AccessTime() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_atime);
-#endif
-#ifdef _WIN32
-    return ConvertWin32Time(m_handleFileInformation.ftLastAccessTime.dwLowDateTime,
-        m_handleFileInformation.ftLastAccessTime.dwHighDateTime);
-#endif
-}
-
-uint64_t StatResult::CreationTime() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_ctime);
-#endif
-#ifdef _WIN32
-    return ConvertWin32Time(m_handleFileInformation.ftCreationTime.dwLowDateTime,
-        m_handleFileInformation.ftCreationTime.dwHighDateTime);
-#endif
-}
-
-uint64_t StatResult::ModifyTime() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_mtime);
-#endif
-#ifdef _WIN32
-    return ConvertWin32Time(m_handleFileInformation.ftLastWriteTime.dwLowDateTime,
-        m_handleFileInformation.ftLastWriteTime.dwHighDateTime);
-#endif
-}
-
-uint64_t StatResult::UniqueID() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_ino);
-#endif
-#ifdef _WIN32
-    return CombineDWORD(m_handleFileInformation.nFileIndexLow,
-        m_handleFileInformation.nFileIndexHigh);
-#endif
-}
-
-uint64_t StatResult::Size() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_size);
-#endif
-#ifdef _WIN32
-    return CombineDWORD(m_handleFileInformation.nFileSizeLow,
-        m_handleFileInformation.nFileSizeHigh);
-#endif
-}
-
-uint64_t StatResult::DeviceID() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_rdev);
-#endif
-#ifdef _WIN32
-    return static_cast<uint64_t>(m_handleFileInformation.dwVolumeSerialNumber);
-#endif
-}
-
-uint64_t StatResult::LinksCount() const
-{
-#ifdef __linux__
-    return static_cast<uint64_t>(m_stat.st_nlink);
-#endif
-#ifdef _WIN32
-    return static_cast<uint64_t>(m_handleFileInformation.nNumberOfLinks);
-#endif
-}
-
-bool StatResult::IsDirectory() const
-{
-#ifdef _WIN32
-    return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-#endif
-#ifdef __linux__
-    return (m_stat.st_mode & S_IFDIR) != 0;
-#endif
-}
-
-std::string StatResult::CanonicalPath() const
-{
-#ifdef _WIN32
-    return Utf16ToUtf8(CanonicalPathW());
-#endif
-#ifdef __linux__
-    char* posixPathPtr = ::realpath(m_path.c_str(), nullptr);
-    if (posixPathPtr == nullptr) {
-        return "";
-    }
-    std::string posixPath(posixPathPtr);
-    ::free(posixPathPtr);
-    return posixPath;
-#endif
-}
-
-#ifdef _WIN32
-bool StatResult::IsArchive() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) != 0; }
-bool StatResult::IsCompressed() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED) != 0; }
-bool StatResult::IsEncrypted() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED) != 0; }
-bool StatResult::IsSparseFile() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0; }
-bool StatResult::IsHidden() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) != 0; }
-bool StatResult::IsOffline() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_OFFLINE) != 0; }
-bool StatResult::IsReadOnly() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0; }
-bool StatResult::IsSystem() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) != 0; }
-bool StatResult::IsTemporary() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_TEMPORARY) != 0; }
-bool StatResult::IsNormal() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_NORMAL) != 0; }
-bool StatResult::IsReparsePoint() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0; }
-uint64_t StatResult::Attribute() const { return m_handleFileInformation.dwFileAttributes; }
-
-
-/* 
- * return pointer to REPARSE_DATA_BUFFER which store target info of file with reparse attribute,
- * need to free memory if return non-nullptr value
- */
-static REPARSE_DATA_BUFFER* GetReparseDataBufferW(const std::wstring& wPath)
-{
-    REPARSE_DATA_BUFFER* pReparseBuffer = nullptr;
-    DWORD dwSize;
-    /* Open the file for read */
-    std::wstring unicodePath = ConvertWin32UnicodePath(wPath);
-    HANDLE hFile = ::CreateFileW(
-        unicodePath.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
-        0);
-    if (hFile == INVALID_HANDLE_VALUE) {
-        /* failed */
-        return nullptr;
-    }
-    /* Allocated areas info */
-    pReparseBuffer = (REPARSE_DATA_BUFFER*)::malloc(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
-    if (pReparseBuffer == nullptr) {
-        /* malloc failed */
-        ::CloseHandle(hFile);
-        return nullptr;
-    }
-    bool ret = ::DeviceIoControl(
-        hFile,
-        FSCTL_GET_REPARSE_POINT,
-        nullptr,
-        0,
-        pReparseBuffer,
-        MAXIMUM_REPARSE_DATA_BUFFER_SIZE,
-        &dwSize,
-        nullptr);
-    if (!ret) {
-        /* failed */
-        ::free(pReparseBuffer);
-        ::CloseHandle(hFile);
-        return nullptr;
-    }
-    ::CloseHandle(hFile);
-    return pReparseBuffer;
-}
-
-DWORD StatResult::ReparseTag() const
-{
-    if (!IsReparsePoint()) {
-        return DEFAULT_REPARSE_TAG;
-    }
-    WIN32_FIND_DATAW findFileData{};
-    std::wstring wCanonicalPath = CanonicalPathW();
-    std::wstring unicodePath = ConvertWin32UnicodePath(wCanonicalPath);
-    HANDLE fileHandle = ::FindFirstFileW(unicodePath.c_str(), &findFileData);
-    if (fileHandle == INVALID_HANDLE_VALUE || fileHandle == nullptr) {
-        return DEFAULT_REPARSE_TAG;
-    }
-    ::FindClose(fileHandle);
-    fileHandle = nullptr;
-    return findFileData.dwReserved0;
-}
-
-
-bool StatResult::IsSymbolicLink() const { return HasReparseSymbolicLinkTag();}
-
-bool StatResult::IsJunctionPoint() const
-{
-    std::optional<std::wstring> wPath = JunctionsPointTargetPathW();
-    if (!wPath) {
-        return false;
-    }
-    return true;
-}
-
-bool StatResult::IsMountedDevice() const {
-    std::optional<std::wstring> wDeviceName = MountedDeviceNameW();
-    if (!wDeviceName) {
-        return false;
-    }
-    return true;
-}
-
-/*
- * If this sparse point has IO_REPARSE_TAG_MOUNT_POINT tag, it maybe a device mount point or a junction link
- * if it's device   point, GetVolumeNameForVolumeMountPointW can accquire device name
- * if it's junction link, GetVolumeNameForVolumeMountPointW will return false
- */
-std::optional<std::wstring> StatResult::MountedDeviceNameW() const
-{
-    if (!HasReparseMountPointTag()) {
-        return std::nullopt;
-    }
-    WCHAR deviceNameBuff[DEVICE_BUFFER_MAX_LEN] = L"";
-    std::wstring wCanonicalPath = CanonicalPathW();
-    /* GetVolumeNameForVolumeMountPointW require input path to end with backslash */
-    if (wCanonicalPath.back() != L'\\') {
-        wCanonicalPath.push_back(L'\\');
-    }
-    if (::GetVolumeNameForVolumeMountPointW(wCanonicalPath.c_str(), deviceNameBuff, DEVICE_BUFFER_MAX_LEN)) {
-        return std::make_optional<std::wstring>(deviceNameBuff);
-    }
-    return std::nullopt;
-}
-
-std::optional<std::wstring> StatResult::JunctionsPointTargetPathW() const
-{
-    REPARSE_DATA_BUFFER* pReparseBuffer = GetReparseDataBufferW(m_wPath);
-    if (pReparseBuffer == nullptr) {
-        /* failed */
-        return std::nullopt;
-    }
-    if (pReparseBuffer->ReparseTag != IO_REPARSE_TAG_MOUNT_POINT) {
-        /* not a symbolic link */
-        ::free(pReparseBuffer);
-        return std::nullopt;
-    }
-
-    std::wstring wTarget;
-    std::wstring wPrintName;
-
-    USHORT targetNameIndex = pReparseBuffer->MountPointReparseBuffer.SubstituteNameOffset / sizeof(WCHAR);
-    USHORT targetNameLength = pReparseBuffer->MountPointReparseBuffer.SubstituteNameLength / sizeof(WCHAR);
-    USHORT displayNameIndex = pReparseBuffer->MountPointReparseBuffer.PrintNameOffset / sizeof(WCHAR);
-    USHORT displayNameLength = pReparseBuffer->MountPointReparseBuffer.PrintNameLength / sizeof(WCHAR);
-    WCHAR* targetName = &pReparseBuffer->MountPointReparseBuffer.PathBuffer[targetNameIndex];
-    WCHAR* displayName = &pReparseBuffer->MountPointReparseBuffer.PathBuffer[displayNameIndex];
-    wTarget.assign(targetName, targetName + targetNameLength);
-    wPrintName.assign(displayName, displayName + displayNameLength);
-    ::free(pReparseBuffer);
-    
-    /*
-    * Due to lack to offical api to determine if a reparse point with IO_REPARSE_TAG_MOUNT_POINT tag is a junction point,
-    * (both directory junction and device mount point has IO_REPARSE_TAG_MOUNT_POINT tag)
-    * if this directory is a mounted device, wPrintName and wTarget name will also be meaningful (returned as to device ame),
-    * To make sure this method return a target of directory junction, this method will check if it can obtain device name.
-    * If it's a device mount point, return std::nullopt
-    */
-    std::optional<std::wstring> wDeviceName = MountedDeviceNameW();
-    if (wDeviceName) {
-        return std::nullopt;
-    }
-    return std::make_optional<std::wstring>(wPrintName);
-}
-
-std::optional<std::wstring> StatResult::SymbolicLinkTargetPathW() const
-{
-    REPARSE_DATA_BUFFER* pReparseBuffer = GetReparseDataBufferW(m_wPath);
-    if (pReparseBuffer == nullptr) {
-        /* failed */
-        return std::nullopt;
-    }
-    if (pReparseBuffer->ReparseTag != IO_REPARSE_TAG_SYMLINK) {
-        /* not a symbolic link */
-        ::free(pReparseBuffer);
-        return std::nullopt;
-    }
-
-    std::wstring wTarget;
-    std::wstring wPrintName;
-
-    USHORT targetNameIndex = pReparseBuffer->SymbolicLinkReparseBuffer.SubstituteNameOffset >> 1;
-    USHORT targetNameLength = pReparseBuffer->SymbolicLinkReparseBuffer.SubstituteNameLength >> 1;
-    USHORT displayNameIndex = pReparseBuffer->SymbolicLinkReparseBuffer.PrintNameOffset >> 1;
-    USHORT displayNameLength = pReparseBuffer->SymbolicLinkReparseBuffer.PrintNameLength >> 1;
-    WCHAR* targetName = &pReparseBuffer->SymbolicLinkReparseBuffer.PathBuffer[targetNameIndex];
-    WCHAR* displayName = &pReparseBuffer->SymbolicLinkReparseBuffer.PathBuffer[displayNameIndex];
-    wTarget.assign(targetName, targetName + targetNameLength);
-    wPrintName.assign(displayName, displayName + displayNameLength);
-
-    ::free(pReparseBuffer);
-    return std::make_optional<std::wstring>(wPrintName);
-}
-
-// https://learn.microsoft.com/en-us/windows/_WIN32/fileio/reparse-point-tags
-bool StatResult::HasReparseSymbolicLinkTag() const { return ReparseTag() == IO_REPARSE_TAG_SYMLINK; }
-bool StatResult::HasReparseMountPointTag() const { return ReparseTag() == IO_REPARSE_TAG_MOUNT_POINT; }
-bool StatResult::HasReparseNfsTag() const { return ReparseTag() == IO_REPARSE_TAG_NFS; }
-bool StatResult::HasReparseOneDriveTag() const { return ReparseTag() == IO_REPARSE_TAG_ONEDRIVE; }
-
-/* return final path of reparse target */
-std::optional<std::wstring> StatResult::FinalPathW() const
-{
-    BY_HANDLE_FILE_INFORMATION handleFileInformation{};
-    HANDLE hFile = ::CreateFileW(
-        m_wPath.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_FLAG_BACKUP_SEMANTICS,
-        0);
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return std::nullopt;
-    }
-    WCHAR wPathBuff[MAX_PATH] = L"";
-    DWORD length = ::GetFinalPathNameByHandleW(hFile, wPathBuff, MAX_PATH, FILE_NAME_NORMALIZED);
-    if (length == 0) {
-        /* failed */
-        ::CloseHandle(hFile);
-        return std::nullopt;
-    }
-    if (length >= MAX_PATH) {
-        DWORD extendLength = length + 1;
-        WCHAR* wPathExtendBuff = new WCHAR[extendLength];
-        if (::GetFinalPathNameByHandleW(hFile, wPathExtendBuff, extendLength, FILE_NAME_NORMALIZED) == 0) {
-            /* failed */
-            delete[] wPathExtendBuff;
-            ::CloseHandle(hFile);
-            return std::nullopt;
-        }
-        /* succeed */
-        ::CloseHandle(hFile);
-        std::wstring wTargetPath(wPathExtendBuff);
-        delete[] wPathExtendBuff;
-        return NormalizeWin32PathW(wTargetPath);
-    }
-    /* succeed */
-    ::CloseHandle(hFile);
-    std::wstring wTargetPath(wPathBuff);
-    return NormalizeWin32PathW(wTargetPath);
-}
-
-std::wstring StatResult::CanonicalPathW() const
-{
-    WCHAR wPathBuff[MAX_PATH] = L"";
-    DWORD length = ::GetFullPathNameW(m_wPath.c_str(), MAX_PATH, wPathBuff, nullptr);
-    if (length == 0) {
-        /* failed */
-        return L"";
-    }
-    if (length >= MAX_PATH) {
-        DWORD extendLength = length + 1;
-        WCHAR* wPathExtendBuff = new WCHAR[extendLength];
-        if (::GetFullPathNameW(m_wPath.c_str(), extendLength, wPathExtendBuff, nullptr) == 0) {
-            /* failed */
-            delete[] wPathExtendBuff;
-            return L"";
-        }
-        /* succeed */
-        std::wstring wCanonicalPath(wPathExtendBuff);
-        delete[] wPathExtendBuff;
-        return NormalizeWin32PathW(wCanonicalPath);
-    }
-    /* succeed */
-    std::wstring wCanonicalPath(wPathBuff);
-    return NormalizeWin32PathW(wCanonicalPath);
-}
-#endif
-
-#ifdef __linux__
-bool StatResult::IsRegular() const { return (m_stat.st_mode & S_IFREG) != 0; }
-bool StatResult::IsPipe() const { return (m_stat.st_mode & S_IFIFO) != 0; }
-bool StatResult::IsCharDevice() const { return (m_stat.st_mode & S_IFCHR) != 0; }
-bool StatResult::IsBlockDevice() const { return (m_stat.st_mode & S_IFBLK) != 0; }
-bool StatResult::IsSymLink() const { return (m_stat.st_mode & S_IFLNK) != 0; }
-bool StatResult::IsSocket() const { return (m_stat.st_mode & S_IFSOCK) != 0; }
-uint64_t StatResult::Mode() const { return m_stat.st_mode; }
-#endif
-
-std::optional<StatResult> Stat(const std::string& path)
-{
-#ifdef __linux__
-    struct stat statbuff {};
-    if (stat(path.c_str(), &statbuff) < 0) {
-        return std::nullopt;
-    }
-    return std::make_optional<StatResult>(path, statbuff);
-#endif
-#ifdef _WIN32
-    return StatW(Utf8ToUtf16(path));
-#endif
-}
-
-#ifdef _WIN32
-std::optional<StatResult> StatW(const std::wstring& wPath)
-{
-    std::wstring unicodePath = ConvertWin32UnicodePath(wPath);
-    BY_HANDLE_FILE_INFORMATION handleFileInformation{};
-    HANDLE hFile = ::CreateFileW(
-        unicodePath.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
-        0);
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return std::nullopt;
-    }
-    if (::GetFileInformationByHandle(hFile, &handleFileInformation) == 0) {
-        ::CloseHandle(hFile);
-        return std::nullopt;
-    }
-    ::CloseHandle(hFile);
-    return std::make_optional<StatResult>(wPath, handleFileInformation);
-}
-#endif
-
-#ifdef _WIN32
-OpenDirEntry::OpenDirEntry(
-    const std::string&      dirPath,
-    const WIN32_FIND_DATAW& findFileData,
-    const HANDLE&           fileHandle)
-    : m_dirPath(Utf8ToUtf16(dirPath)), m_findFileData(findFileData), m_fileHandle(fileHandle) {}
-
-bool OpenDirEntry::IsArchive() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) != 0; }
-bool OpenDirEntry::IsCompressed() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED) != 0; }
-bool OpenDirEntry::IsEncrypted() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED) != 0; }
-bool OpenDirEntry::IsSparseFile() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0; }
-bool OpenDirEntry::IsHidden() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) != 0; }
-bool OpenDirEntry::IsOffline() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_OFFLINE) != 0; }
-bool OpenDirEntry::IsReadOnly() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0; }
-bool OpenDirEntry::IsSystem() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) != 0; }
-bool OpenDirEntry::IsTemporary() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_TEMPORARY) != 0; }
-bool OpenDirEntry::IsNormal() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_NORMAL) != 0; }
-bool OpenDirEntry::IsReparsePoint() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0; }
-uint64_t OpenDirEntry::Attribute() const { return m_findFileData.dwFileAttributes; }
-
-uint64_t OpenDirEntry::AccessTime() const
-{
-    return ConvertWin32Time(m_findFileData.ftLastAccessTime.dwLowDateTime,
-        m_findFileData.ftLastAccessTime.dwHighDateTime);
-}
-
-uint64_t OpenDirEntry::CreationTime() const
-{
-    return ConvertWin32Time(m_findFileData.ftCreationTime.dwLowDateTime,
-        m_findFileData.ftCreationTime.dwHighDateTime);
-}
-
-uint64_t OpenDirEntry::ModifyTime() const
-{
-    return ConvertWin32Time(m_findFileData.ftLastWriteTime.dwLowDateTime,
-        m_findFileData.ftLastWriteTime.dwHighDateTime);
-}
-
-uint64_t OpenDirEntry::Size() const
-{
-    return CombineDWORD(m_findFileData.nFileSizeLow, m_findFileData.nFileSizeHigh);
-}
-#endif
-
-#ifdef __linux__
-OpenDirEntry::OpenDirEntry(const std::string& dirPath, DIR* dirPtr, struct dirent* direntPtr)
-    :m_dirPath(dirPath), m_dir(dirPtr), m_dirent(direntPtr) {}
-
-bool OpenDirEntry::IsUnknown() const { return (m_dirent->d_type & DT_UNKNOWN != 0); }
-bool OpenDirEntry::IsPipe() const { return (m_dirent->d_type & DT_FIFO != 0); }
-bool OpenDirEntry::IsCharDevice() const { return (m_dirent->d_type & DT_CHR != 0); }
-bool OpenDirEntry::IsBlockDevice() const { return (m_dirent->d_type & DT_BLK != 0); }
-bool OpenDirEntry::IsSymLink() const { return (m_dirent->d_type & DT_LNK != 0); }
-bool OpenDirEntry::IsSocket() const { return (m_dirent->d_type & DT_SOCK != 0); }
-bool OpenDirEntry::IsRegular() const { return (m_dirent->d_type & DT_REG != 0); }
-uint64_t OpenDirEntry::INode() const { return static_cast<uint64_t>(m_dirent->d_ino); }
-#endif
-
-
-bool OpenDirEntry::IsDirectory() const
-{
-#ifdef _WIN32
-    return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
-#endif
-#ifdef __linux__
-    return (m_dirent->d_type & DT_DIR) != 0;
-#endif
-}
-
-std::string OpenDirEntry::Name() const
-{
-#ifdef _WIN32
-    return Utf16ToUtf8(std::wstring(m_findFileData.cFileName));
-#endif
-#ifdef __linux__
-    return std::string(m_dirent->d_name);
-#endif
-}
-
-std::string OpenDirEntry::FullPath() const
-{
-#ifdef __linux__
-    const std::string separator = "/";
-    if (!m_dirPath.empty() && m_dirPath.back() == separator[0]) {
-        return m_dirPath + Name();
-    }
-    else {
-        return m_dirPath + separator + Name();
-    }
-#endif
-#ifdef _WIN32
-    std::wstring wfullpath = FullPathW();
-    return Utf16ToUtf8(wfullpath);
-#endif
-}
-
-#ifdef _WIN32
-
-std::wstring OpenDirEntry::NameW() const
-{
-    return std::wstring(m_findFileData.cFileName);
-}
-
-std::wstring OpenDirEntry::FullPathW() const
-{
-    const std::wstring separator = L"\\";
-    std::wstring wfullpath;
-    if (!m_dirPath.empty() && m_dirPath.back() == separator[0]) {
-        wfullpath = m_dirPath + NameW();
-    }
-    else {
-        wfullpath = m_dirPath + separator + NameW();
-    }
-    return wfullpath;
-}
-
-#endif
-
-bool OpenDirEntry::Next()
-{
-#ifdef _WIN32
-    if (m_fileHandle == nullptr || m_fileHandle == INVALID_HANDLE_VALUE) {
-        return false;
-    }
-    if (!::FindNextFileW(m_fileHandle, &m_findFileData)) {
-        m_fileHandle = nullptr;
-        return false;
-    }
-    return true;
-#endif
-#ifdef __linux__
-    if (m_dir == nullptr) {
-        return false;
-    }
-    m_dirent = readdir(m_dir);
-    if (m_dirent == nullptr) {
-        return false;
-    }
-    return true;
-#endif
-}
-
-void OpenDirEntry::Close()
-{
-#ifdef _WIN32
-    if (m_fileHandle != nullptr && m_fileHandle != INVALID_HANDLE_VALUE) {
-        ::FindClose(m_fileHandle);
-        m_fileHandle = nullptr;
-    }
-#endif
-#ifdef __linux__
-    if (m_dir != nullptr) {
-        ::closedir(m_dir);
-        m_dir = nullptr;
-        m_dirent = nullptr;
-    }
-#endif
-}
-
-std::optional<OpenDirEntry> OpenDir(const std::string& path)
-{
-#ifdef _WIN32
-    std::wstring wpathPattern = ConvertWin32UnicodePath(Utf8ToUtf16(path));
-    if (!wpathPattern.empty() && wpathPattern.back() != L'\\') {
-        wpathPattern.push_back(L'\\');
-    }
-    wpathPattern += L"*.*";
-    WIN32_FIND_DATAW findFileData{};
-    HANDLE fileHandle = ::FindFirstFileW(wpathPattern.c_str(), &findFileData);
-    if (fileHandle == INVALID_HANDLE_VALUE) {
-        return std::nullopt;
-    }
-    return std::make_optional<OpenDirEntry>(path, findFileData, fileHandle);
-#endif
-#ifdef __linux__
-    DIR* dirPtr = ::opendir(path.c_str());
-    if (dirPtr == nullptr) {
-        return std::nullopt;
-    }
-    struct dirent* direntPtr = readdir(dirPtr);
-    if (direntPtr == nullptr) {
-        return std::nullopt;
-    }
-    return std::make_optional<OpenDirEntry>(path, dirPtr, direntPtr);
-#endif
-}
-
-OpenDirEntry::~OpenDirEntry() {
-    Close();
-}
-
-
-SparseRangeResult QuerySparseAllocateRanges(const std::string& path)
-{
-    std::optional<StatResult> statResult = Stat(path);
-    /* check if is a file */
-    if (!statResult || statResult->IsDirectory()) {
-        return std::nullopt;
-    }
-#ifdef _WIN32
-    if (!statResult->IsSparseFile()) {
-        return std::nullopt;
-    }
-    return QuerySparseWin32AllocateRangesW(Utf8ToUtf16(path));
-#endif
-#ifdef __linux__
-    return QuerySparsePosixAllocateRanges(path);
-#endif
-}
-
-bool CopySparseFile(const std::string& srcPath, const std::string& dstPath,
-    const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
-{
-    std::optional<StatResult> srcResult = Stat(srcPath);
-    std::optional<StatResult> dstResult = Stat(dstPath);
-    /* check if is a file */
-    if (!srcResult || dstResult || srcResult->IsDirectory()) {
-        return false;
-    }
-#ifdef _WIN32
-    if (!srcResult->IsSparseFile()) {
-        return false;
-    }
-    return CopySparseFileWin32W(Utf8ToUtf16(srcPath), Utf8ToUtf16(dstPath), ranges);
-#endif
-#ifdef __linux__
-    return CopySparseFilePosix(srcPath, dstPath, ranges);
-#endif
-}
-
-#ifdef _WIN32
-/*
- * Invoke Stat() and check if it's sparse file
- * Represent the range using [<offset, length>] in bytes
- * Exmple from:
- * https://github.com/microsoft/cpprestsdk/blob/master/Release/tests/functional/streams/CppSparseFile.cpp
- */
-SparseRangeResult QuerySparseWin32AllocateRangesW(const std::wstring& wPath)
-{
-    std::vector<std::pair<uint64_t, uint64_t>> ranges;
-    /* Open the file for read */
-    std::wstring unicodePath = ConvertWin32UnicodePath(wPath);
-    HANDLE hFile = ::CreateFileW(
-                        unicodePath.c_str(),
-                        GENERIC_READ,
-                        FILE_SHARE_READ,
-                        nullptr,
-                        OPEN_EXISTING,
-                        FILE_ATTRIBUTE_NORMAL,
-                        nullptr);
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return std::nullopt;
-    }
-    LARGE_INTEGER liFileSize;
-    GetFileSizeEx(hFile, &liFileSize);
-    /* Range to be examined (the whole file) */
-    FILE_ALLOCATED_RANGE_BUFFER queryRange;
-    queryRange.FileOffset.QuadPart = 0;
-    queryRange.Length = liFileSize;
-    /* Allocated areas info */
-    FILE_ALLOCATED_RANGE_BUFFER allocRanges[1024];
-    DWORD nbytes;
-    bool fFinished;
-    do
-    {
-        fFinished = DeviceIoControl(
-                        hFile,
-                        FSCTL_QUERY_ALLOCATED_RANGES,
-                        &queryRange,
-                        sizeof(queryRange),
-                        allocRanges,
-                        sizeof(allocRanges),
-                        &nbytes,
-                        nullptr);
-        if (!fFinished) {
-            DWORD dwError = GetLastError();
-            /* ERROR_MORE_DATA is the only error that is normal */
-            if (dwError != ERROR_MORE_DATA) {
-                ::CloseHandle(hFile);
-                return std::nullopt;
-            }
-        }
-        /* Calculate the number of records returned */
-        DWORD dwAllocRangeCount = nbytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
-        /* Print each allocated range */
-        for (DWORD i = 0; i < dwAllocRangeCount; i++) {
-            ranges.emplace_back(allocRanges[i].FileOffset.QuadPart, allocRanges[i].Length.QuadPart);
-        }
-        // Set starting address and size for the next query
-        if (!fFinished && dwAllocRangeCount > 0)
-        {
-            queryRange.FileOffset.QuadPart = 
-                allocRanges[dwAllocRangeCount - 1].FileOffset.QuadPart +
-                allocRanges[dwAllocRangeCount - 1].Length.QuadPart;
-            queryRange.Length.QuadPart = liFileSize.QuadPart - queryRange.FileOffset.QuadPart;
-        }
-    } while (!fFinished);
-    ::CloseHandle(hFile);
-    return std::make_optional(ranges);
-}
-
-bool CopySparseFileWin32W(const std::wstring& wSrcPath, const std::wstring& wDstPath,
-    const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
-{
-    const int DEFAULT_BUFF_SIZE = 1024;
-    char buff[DEFAULT_BUFF_SIZE] = "\0";
-    /* open file for read */
-    std::wstring wSrcUnicodePath = ConvertWin32UnicodePath(wSrcPath);
-    HANDLE hInFile = ::CreateFileW(
-        wSrcUnicodePath.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        nullptr,
-        OPEN_EXISTING,
-        0,
-        nullptr);
-    if (hInFile == INVALID_HANDLE_VALUE) {
-        return false;
-    }
-    /* open file for write */
-    std::wstring wDstUnicodePath = ConvertWin32UnicodePath(wDstPath);
-    HANDLE hOutFile = ::CreateFileW(
-        wDstUnicodePath.c_str(),
-        GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        nullptr,
-        CREATE_NEW,
-        0,
-        nullptr);
-    if (hOutFile == INVALID_HANDLE_VALUE) {
-        ::CloseHandle(hInFile);
-        return false;
-    }
-    /* set taget file sparse */
-    DWORD dwTemp; /* store the setted attribute */
-    ::DeviceIoControl(hOutFile,
-        FSCTL_SET_SPARSE,
-        nullptr,
-        0,
-        nullptr,
-        0,
-        &dwTemp,
-        nullptr);
-    /* truncate target file at first */
-    LARGE_INTEGER sizeEx;
-    if (!::GetFileSizeEx(hInFile, &sizeEx)) {
-        ::CloseHandle(hInFile);
-        return false;
-    }
-    ::SetFilePointerEx(hOutFile, sizeEx, nullptr, FILE_BEGIN);
-    ::SetEndOfFile(hOutFile);
-    /* write allocated range */
-    for (const std::pair<uint64_t, uint64_t>& range : ranges) {
-        uint64_t offset = range.first;
-        uint64_t len = range.second;
-        sizeEx.QuadPart = offset;
-        do {
-            DWORD nbytes = 0; /* n bytes to copy in this batch */
-            ::SetFilePointerEx(hInFile, sizeEx, nullptr, FILE_BEGIN); /* set fd to the beginning of the range */
-            ::SetFilePointerEx(hOutFile, sizeEx, nullptr, FILE_BEGIN);
-            nbytes = len < sizeof(buff) ? static_cast<DWORD>(len): sizeof(buff); /* if the range can be copied in this batch */
-            if (!::ReadFile(hInFile, buff, nbytes, nullptr, nullptr)) {
-                /* read failed */
-                ::CloseHandle(hInFile);
-                ::CloseHandle(hOutFile);
-                return false;
-            }
-            DWORD nWritten = 0;
-            if (!::WriteFile(hOutFile, buff, nbytes, &nWritten, nullptr)) {
-                /* write failed */
-                ::CloseHandle(hInFile);
-                ::CloseHandle(hOutFile);
-                return false;
-            }
-            offset = offset + nbytes; /* reset offset and length */
-            len = len - nbytes;
-        } while (len != 0);
-    }
-    /* copy success */
-    ::CloseHandle(hInFile);
-    ::CloseHandle(hOutFile);
-    return true;
-}
-#endif
-
-#ifdef __linux__
-SparseRangeResult QuerySparsePosixAllocateRanges(const std::string& path)
-{
-#ifdef SEEK_HOLE
-    std::vector<std::pair<uint64_t, uint64_t>> ranges;
-    int fd = ::open(path.c_str() , O_RDONLY | O_NONBLOCK);
-    if (fd < 0) {
-        return std::nullopt;
-    }
-    off_t end = ::lseek(fd, 0, SEEK_END);
-    off_t hole = ::lseek(fd, 0, SEEK_HOLE);
-    off_t cur = 0, offset = 0 , len = 0;
-    while (cur < end) {
-        cur = ::lseek(fd, cur, SEEK_DATA);
-        if (cur == -1 && errno == ENXIO) {
-            cur = end;
-            continue;
-        }
-        if (cur < 0) {
-            return std::nullopt; /* query failed */
-        }
-        offset = cur;
-        cur = ::lseek(fd, cur, SEEK_HOLE);
-        if (cur < 0) {
-            return std::nullopt; /* query failed */
-        }
-        len = cur - offset;
-        ranges.emplace_back(offset, len);
-    }
-    return std::make_optional(ranges);
-#else
-    /* kernel not support sparse file */
-    return std::nullopt;
-#endif
-}
-
-bool CopySparseFilePosix(const std::string& srcPath, const std::string& dstPath,
-    const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
-{
-    const int DEFAULT_BUFF_SIZE = 1024;
-    char buff[DEFAULT_BUFF_SIZE] = "\0";
-    int inFd = ::open(srcPath.c_str(), O_RDONLY);
-    if (inFd < 0) {
-        return false;
-    }
-    int outFd = ::open(dstPath.c_str() ,O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-    if (outFd < 0) {
-        ::close(inFd);
-        return false;
-    }
-    /* truncate target file at first */
-    off_t srcSize = ::lseek(inFd, 0, SEEK_END);
-    if (::ftruncate(outFd, srcSize) < 0) {
-        /* truncate failed */
-        ::close(inFd);
-        ::close(outFd);
-        return false;
-    }
-    /* write allocated range */
-    for (const std::pair<uint64_t, uint64_t>& range: ranges) {
-        uint64_t offset = range.first;
-        uint64_t len = range.second;
-        do {
-            int nbytes = 0; /* n bytes to copy in this batch */
-            ::lseek(inFd, offset, SEEK_SET); /* set fd to the beginning of the range */
-            ::lseek(outFd, offset, SEEK_SET);
-            nbytes = min(len, sizeof(buff)); /* if the range can be copied in this batch */
-            int n = ::read(inFd, buff, nbytes);
-            if (n != nbytes) {
-                /* read failed */
-                ::close(inFd);
-                ::close(outFd);
-                return false;
-            }
-            n = ::write(outFd, buff, nbytes);
-            if (n != nbytes) {
-                /* write failed */
-                ::close(inFd);
-                ::close(outFd);
-                return false;
-            }
-            offset = offset + nbytes; /* reset offset and length */
-            len = len - nbytes;
-        } while (len != 0);
-    }
-    /* copy success */
-    ::close(inFd);
-    ::close(outFd);
-    return true;
-}
-#endif
-
-#ifdef _WIN32
-/* _WIN32 Volumes related API */
-std::vector<std::wstring> GetWin32DriverListW()
-{
-    std::vector<std::wstring> wdrivers;
-    DWORD dwLen = ::GetLogicalDriveStrings(0, nullptr); /* the length of volumes str */
-    if (dwLen <= 0) {
-        return wdrivers;
-    }
-    wchar_t* pszDriver = new wchar_t[dwLen];
-    ::GetLogicalDriveStringsW(dwLen, pszDriver);
-    wchar_t* pDriver = pszDriver;
-    while (*pDriver != '\0') {
-        std::wstring wDriver = std::wstring(pDriver);
-        wdrivers.push_back(wDriver);
-        pDriver += wDriver.length() + 1;
-    }
-    delete[] pszDriver;
-    pszDriver = nullptr;
-    pDriver = nullptr;
-    return wdrivers;
-}
-
-std::vector<std::string> GetWin32DriverList()
-{
-    std::vector<std::string> drivers;
-    std::vector<std::wstring> wdrivers = GetWin32DriverListW();
-    for (const std::wstring& wDriver : wdrivers) {
-        drivers.push_back(Utf16ToUtf8(wDriver));
-    }
-    return drivers;
-}
-
-/* member methods implementation for Win32VolumeDetail */
-Win32VolumesDetail::Win32VolumesDetail(const std::wstring& wVolumeName) : m_wVolumeName(wVolumeName) {}
-
-std::wstring Win32VolumesDetail::VolumeNameW() const { return m_wVolumeName; }
-
-std::string Win32VolumesDetail::VolumeName() const { return Utf16ToUtf8(m_wVolumeName); }
-
-std::optional<std::wstring> Win32VolumesDetail::GetVolumeDeviceNameW()
-{
-    if (m_wVolumeName.size() < 4 ||
-        m_wVolumeName[0] != L'\\' ||
-        m_wVolumeName[1] != L'\\' ||
-        m_wVolumeName[2] != L'?' ||
-        m_wVolumeName[3] != L'\\' ||
-        m_wVolumeName.back() != L'\\') { /* illegal volume name */
-        return std::nullopt;
-    }
-    std::wstring wVolumeParam = m_wVolumeName;
-    wVolumeParam.pop_back(); /* QueryDosDeviceW does not allow a trailing backslash */
-    wVolumeParam = wVolumeParam.substr(4);
-    WCHAR deviceNameBuf[DEVICE_BUFFER_MAX_LEN] = L"";
-    DWORD charCount = ::QueryDosDeviceW(wVolumeParam.c_str(), deviceNameBuf, ARRAYSIZE(deviceNameBuf));
-    if (charCount == 0) {
-        return std::nullopt;
-    }
-    return std::make_optional<std::wstring>(deviceNameBuf);
-}
-
-std::optional<std::string> Win32VolumesDetail::GetVolumeDeviceName()
-{
-    std::optional<std::wstring> wDeviceName = GetVolumeDeviceNameW();
-    if (!wDeviceName) {
-        return std::nullopt;
-    }
-    return std::make_optional<std::string>(Utf16ToUtf8(wDeviceName.value()));
-}
-
-std::optional<std::vector<std::wstring>> Win32VolumesDetail::GetVolumePathListW()
-{
-    /* https://learn.microsoft.com/en-us/windows/_WIN32/fileio/displaying-volume-paths */
-    if (m_wVolumeName.size() < 4 ||
-        m_wVolumeName[0] != L'\\' ||
-        m_wVolumeName[1] != L'\\' ||
-        m_wVolumeName[2] != L'?' ||
-        m_wVolumeName[3] != L'\\' ||
-        m_wVolumeName.back() != L'\\') { /* illegal volume name */
-        return std::nullopt;
-    }
-    std::vector<std::wstring> wPathList;
-    PWCHAR devicePathNames = nullptr;
-    DWORD charCount = MAX_PATH + 1;
-    bool success = false;
-    while (true) {
-        devicePathNames = (PWCHAR) new BYTE[charCount * sizeof(WCHAR)];
-        if (!devicePathNames) { /* failed to malloc on heap */
-            return std::nullopt;
-        }
-        success = ::GetVolumePathNamesForVolumeNameW(
-            m_wVolumeName.c_str(),
-            devicePathNames,
-            charCount,
-            &charCount
-        );
-        if (success || ::GetLastError() != ERROR_MORE_DATA) {
-            break;
-        }
-        delete[] devicePathNames;
-        devicePathNames = nullptr;
-    }
-    if (success) {
-        for (PWCHAR nameIdx = devicePathNames;
-            nameIdx[0] != L'\0';
-            nameIdx += ::wcslen(nameIdx) + 1) {
-            wPathList.push_back(std::wstring(nameIdx));
-        }
-    }
-    if (devicePathNames != nullptr) {
-        delete[] devicePathNames;
-        devicePathNames = nullptr;
-    }
-    return std::make_optional<std::vector<std::wstring>>(wPathList);
-}
-
-std::optional<std::vector<std::string>> Win32VolumesDetail::GetVolumePathList()
-{
-    std::optional<std::vector<std::wstring>> wPathList = GetVolumePathListW();
-    if (!wPathList) {
-        return std::nullopt;
-    }
-    std::vector<std::string> pathList;
-    for (const std::wstring& wPath : wPathList.value()) {
-        pathList.push_back(Utf16ToUtf8(wPath));
-    }
-    return std::make_optional<std::vector<std::string>>(pathList);
-}
-
-std::optional<std::vector<Win32VolumesDetail>> GetWin32LocalVolumeList()
-{
-    std::vector<std::wstring> wVolumes;
-    std::vector<Win32VolumesDetail> volumeDetails;
-    WCHAR wVolumeNameBuffer[VOLUME_BUFFER_MAX_LEN] = L"";
-    HANDLE handle = ::FindFirstVolumeW(wVolumeNameBuffer, VOLUME_BUFFER_MAX_LEN);
-    if (handle == INVALID_HANDLE_VALUE) {
-        ::FindVolumeClose(handle);
-        /* find failed */
-        return std::nullopt;
-    }
-    wVolumes.push_back(std::wstring(wVolumeNameBuffer));
-    while (::FindNextVolumeW(handle, wVolumeNameBuffer, VOLUME_BUFFER_MAX_LEN)) {
-        wVolumes.push_back(std::wstring(wVolumeNameBuffer));
-    }
-    ::FindVolumeClose(handle);
-    handle = INVALID_HANDLE_VALUE;
-    for (const std::wstring& wVolumeName : wVolumes) {
-        Win32VolumesDetail volumeDetail(wVolumeName);
-        volumeDetails.push_back(volumeDetail);
-    }
-    return volumeDetails;
-}
-
-std::optional<std::vector<Win32VolumesDetail>> GetWin32NetworkVolumeList()
-{
-    std::vector<Win32VolumesDetail> networkVolumes;
-
-    DWORD dwResult;
-    DWORD dwSize = 0;
-    LPNETRESOURCE lpnr = NULL;
-    HANDLE hEnum = NULL;
-    DWORD dwCount = 0;
-    DWORD i;
-
-    dwResult = ::WNetOpenEnum(RESOURCE_CONNECTED, RESOURCETYPE_DISK, 0, lpnr, &hEnum);
-    if (dwResult != NO_ERROR) {
-        /* WNetOpenEnum failed with error dwResult */
-        return std::nullopt;
-    }
-
-    do
-    {
-        dwSize = 16384; 
-        lpnr = (LPNETRESOURCE)::GlobalAlloc(GPTR, dwSize);
-        if (lpnr == NULL) {
-            std::cout << "Memory allocation error." << std::endl;
-            return std::nullopt;
-        }
-        dwResult = ::WNetEnumResource(hEnum, &dwCount, lpnr, &dwSize);
-        if (dwResult == NO_ERROR) {
-            for (i = 0; i < dwCount; i++) {
-                if (lpnr[i].dwDisplayType == RESOURCEDISPLAYTYPE_SHARE) {
-                    std::wstring wstr(lpnr[i].lpRemoteName);
-                    std::wcout << wstr << std::endl;
-                }
-            }
-        }
-        ::GlobalFree((HGLOBAL)lpnr);
-        if (dwResult != ERROR_NO_MORE_ITEMS) {
-            /* WNetEnumResource failed with error dwResult */
-            return std::nullopt;
-        }
-    } while (dwResult != ERROR_NO_MORE_ITEMS);
-
-    ::WNetCloseEnum(hEnum);
-    return networkVolumes;
-}
-
-
-std::optional<std::vector<Win32VolumesDetail>> GetWin32VolumeList()
-{
-    std::vector<Win32VolumesDetail> res;
-    std::optional<std::vector<Win32VolumesDetail>> localVolumes {}; // TODO:: not support
-    std::optional<std::vector<Win32VolumesDetail>> netVolumes = GetWin32LocalVolumeList();
-    if (localVolumes) {
-        std::copy(localVolumes->begin(), localVolumes->end(), std::back_inserter(res));
-    }
-    if (netVolumes) {
-        std::copy(netVolumes->begin(), netVolumes->end(), std::back_inserter(res));
-    }
-    return res;
-}
-
-/* _WIN32 Security Descriptor related API */
-
-/**
-* https://learn.microsoft.com/en-us/windows/_WIN32/api/aclapi/nf-aclapi-getnamedsecurityinfoa?redirectedfrom=MSDN
-* https://learn.microsoft.com/en-us/previous-versions/windows/hardware/device-stage/drivers/ff556610(v=vs.85)
-* https://learn.microsoft.com/en-us/windows/_WIN32/secauthz/security-information
-* https://learn.microsoft.com/en-us/windows/_WIN32/api/accctrl/ne-accctrl-se_object_type
-* https://learn.microsoft.com/en-us/windows/_WIN32/api/aclapi/nf-aclapi-getnamedsecurityinfoa
-* https://blog.csdn.net/eggfly178/article/details/41773601
-* https://learn.microsoft.com/en-us/windows/_WIN32/secauthz/security-descriptor-string-format
-*/
-std::optional<std::wstring> GetSecurityDescriptorW(const std::wstring& wPath, DWORD& errCode)
-{
-    PSECURITY_DESCRIPTOR pSecurityDescriptor = nullptr;
-    PACL pDacl      = nullptr;
-    PACL pSacl      = nullptr;
-    PSID psidOwner  = nullptr;
-    PSID psidGroup  = nullptr;
-    LPWSTR wSddlStr = nullptr;
-    errCode = 0;
-    std::wstring wPathUnicode = ConvertWin32UnicodePath(wPath);
-
-    DWORD result = ::GetNamedSecurityInfoW(
-        wPathUnicode.c_str(),
-        SE_FILE_OBJECT,
-        DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION | OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION,
-        &psidOwner,
-        &psidGroup,
-        &pDacl,
-        &pSacl,
-        &pSecurityDescriptor);
-    if (result != ERROR_SUCCESS) {
-        errCode = result;
-        return std::nullopt;
-    }
-    bool ret = ::ConvertSecurityDescriptorToStringSecurityDescriptorW(
-        pSecurityDescriptor,
-        SDDL_REVISION_1,
-        DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION | OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION,
-        &wSddlStr,
-        nullptr);
-    if (!ret) {
-        errCode = ::GetLastError();
-        ::LocalFree(pSecurityDescriptor);
-        return std::nullopt;
-    }
-    ::LocalFree(pSecurityDescriptor);
-    std::wstring res(wSddlStr);
-    ::LocalFree(wSddlStr);
-    return std::make_optional<std::wstring>(res);
-}
-
-bool SetSecurityDescriptorW(const std::wstring& wPath, const std::wstring& wSddlStr, DWORD& errCode)
-{
-    PSECURITY_DESCRIPTOR pSecurityDescriptor = nullptr;
-    PACL pDacl      = nullptr;
-    PACL pSacl      = nullptr;
-    PSID psidOwner  = nullptr;
-    PSID psidGroup  = nullptr;
-    std::wstring wPathUnicode = ConvertWin32UnicodePath(wPath);
-
-    /* convert sddlStr back to pSecurityDescriptor */
-    if (!::ConvertStringSecurityDescriptorToSecurityDescriptor(
-            wSddlStr.c_str(),
-            SDDL_REVISION_1,
-            &pSecurityDescriptor,
-            nullptr)) {
-        errCode = ::GetLastError();
-        return false;
-    }
-
-    /* Get Owner from pSecurityDescriptor */
-    BOOL ownerDefaulted = false;
-    if (!::GetSecurityDescriptorOwner(pSecurityDescriptor, &psidOwner, &ownerDefaulted)) {
-        errCode = ::GetLastError();
-        ::LocalFree(pSecurityDescriptor);
-        return false;
-    }
-
-    /* Get Group from pSecurityDescriptor */
-    BOOL groupDefaulted = false;
-    if (!::GetSecurityDescriptorGroup(pSecurityDescriptor, &psidGroup, &groupDefaulted)) {
-        errCode = ::GetLastError();
-        ::LocalFree(pSecurityDescriptor);
-        return false;
-    }
-
-    /* Get DACL from pSecurityDescriptor */
-    BOOL bDaclPresent = false;
-    BOOL bDaclDefaulted = false;
-    if (!::GetSecurityDescriptorDacl(pSecurityDescriptor, &bDaclPresent, &pDacl, &bDaclDefaulted) || !bDaclPresent) {
-        errCode = ::GetLastError();
-        ::LocalFree(pSecurityDescriptor);
-        return false;
-    }
-
-    /* Get SACL from pSecurityDescriptor */
-    BOOL bSaclPresent = false;
-    BOOL bSaclDefaulted = false;
-    if (!::GetSecurityDescriptorSacl(pSecurityDescriptor, &bSaclPresent, &pSacl, &bSaclDefaulted) || !bSaclPresent) {
-        errCode = ::GetLastError();
-        ::LocalFree(pSecurityDescriptor);
-        return false;
-    }
-
-    // some nullptr value fields with corresponding flag set may cause the SetNamedSecurityInfo call to fail
-    DWORD securityFlags = 0;
-    if (psidOwner != nullptr) {
-        securityFlags |= OWNER_SECURITY_INFORMATION;
-    }
-    if (psidGroup != nullptr) {
-        securityFlags |= GROUP_SECURITY_INFORMATION;
-    }
-    if (pDacl != nullptr) {
-        securityFlags |= DACL_SECURITY_INFORMATION;
-    }
-    if (pSacl != nullptr) {
-        securityFlags |= SACL_SECURITY_INFORMATION;
-    }
-
-    // set pSecurityDescriptor to file
-    if (::SetNamedSecurityInfo(
-        const_cast<LPWSTR>(wPathUnicode.c_str()),
-        SE_FILE_OBJECT,
-        securityFlags,
-        psidOwner,
-        psidGroup,
-        pDacl,
-        pSacl) != ERROR_SUCCESS) {
-        errCode = ::GetLastError();
-        ::LocalFree(pSecurityDescriptor);
-        return false;
-    }
-
-    if (pSecurityDescriptor) {
-        ::LocalFree(pSecurityDescriptor);
-    }
-    errCode = 0;
-    return true;
-}
-
-bool SetSecurityDescriptor(const std::string& path, const std::string& sddlStr, DWORD& errCode)
-{
-    return SetSecurityDescriptorW(Utf8ToUtf16(path), Utf8ToUtf16(sddlStr), errCode);
-}
-
-std::optional<std::string> GetSecurityDescriptor(const std::string& path, DWORD& errCode)
-{
-    std::optional<std::wstring> result = GetSecurityDescriptorW(Utf8ToUtf16(path), errCode);
-    if (!result) {
-        return std::nullopt;
-    }
-    return std::make_optional<std::string>(Utf16ToUtf8(result.value()));
-}
-
-std::wstring NormalizeWin32PathW(std::wstring& wPath)
-{
-    std::wstring wNormalizedPath = wPath;
-    /* example: \\?\C:\Test\Dir1 => C:\Test\Dir1 */
-    if (wNormalizedPath.find(WPATH_PREFIX) == 0) {
-        wNormalizedPath = wNormalizedPath.substr(WPATH_PREFIX.length());
-    }
-    while (!wNormalizedPath.empty() && wNormalizedPath.back() == L'\\') {
-        wNormalizedPath.pop_back();
-    }
-    /* example: C: */
-    if (wNormalizedPath.length() == 2 && wNormalizedPath[1] == L':') {
-        wNormalizedPath.push_back(L'\\');
-    }
-    return wNormalizedPath;
-}
-
-/*
- * reparse point related methods 
- * https://github.com/googleprojectzero/symboliclink-testing-tools/blob/main/CommonUtils/ReparsePoint.cpp
- */
-bool CreateSymbolicLinkW(
-    const std::wstring& wLinkFilePath,
-    const std::wstring& wTagetPath,
-    bool isDirectory,
-    bool isRelative)
-{
-    std::wstring wLinkFilePathFinal = ConvertWin32UnicodePath(wLinkFilePath);
-    std::wstring wTagetPathFinal = ConvertWin32UnicodePath(wTagetPath);;
-
-    /* check if target exist */
-    if (Exists(Utf16ToUtf8(wLinkFilePath))) {
-        return false;
-    }
-
-    return ::CreateSymbolicLinkW(
-        wLinkFilePathFinal.c_str(),
-        wTagetPathFinal.c_str(),
-        isDirectory ? SYMBOLIC_LINK_FLAG_DIRECTORY : 0);
-}
-
-bool CreateJunctionPointW(const std::wstring& wSrcPath, const std::wstring& wTargetPath)
-{
-    // TODO:: not support 
-    return CreateSymbolicLinkW(wSrcPath, wTargetPath, true, true);
-    return false;
-}
-
-
-/* ADS releated API */
-std::optional<AlternateDataStreamEntry> OpenAlternateDataStreamW(const std::wstring& wPath)
-{
-    std::wstring wPathUnicode = ConvertWin32UnicodePath(wPath); 
-    WIN32_FIND_STREAM_DATA findStreamData{};
-    HANDLE hStream = ::FindFirstStreamW(
-        wPathUnicode.c_str(),
-        _STREAM_INFO_LEVELS::FindStreamInfoStandard,
-        &findStreamData,
-        0
-    );
-    if (hStream == INVALID_HANDLE_VALUE) {
-        /* get stream handle failed */
-        return std::nullopt;
-    }
-    return std::make_optional<AlternateDataStreamEntry>(hStream, findStreamData);
-}
-
-AlternateDataStreamEntry::AlternateDataStreamEntry(HANDLE hStream, WIN32_FIND_STREAM_DATA findStreamData)
- : m_hStream(hStream), m_findStreamData(findStreamData), m_eof(false) {}
-
-std::wstring AlternateDataStreamEntry::StreamNameW()
-{
-    return m_findStreamData.cStreamName;
-}
-
-bool AlternateDataStreamEntry::Eof() const
-{
-    return m_eof;
-}
-
-DWORD AlternateDataStreamEntry::Error() const
-{
-    return m_error;
-}
-
-bool AlternateDataStreamEntry::Next()
-{
-    if (m_hStream == INVALID_HANDLE_VALUE) {
-        return false;
-    }
-    if (::FindNextStreamW(m_hStream, &m_findStreamData)) {
-        return true;
-    }
-    m_error = ::GetLastError();
-    if (m_error == ERROR_HANDLE_EOF) {
-        /* read succeed and reached EOF */
-        m_eof = true;
-    }
-    m_hStream = INVALID_HANDLE_VALUE;
-    return false;
-}
-
-AlternateDataStreamEntry::~AlternateDataStreamEntry()
-{
-    if (m_hStream != INVALID_HANDLE_VALUE || m_hStream != nullptr) {
-        ::FindClose(m_hStream);
-    }
-    m_hStream = INVALID_HANDLE_VALUE;
-}
-
-#endif
-
-
-bool IsDirectory(const std::string& path)
-{
-    std::optional<StatResult> result = Stat(path);
-    if (!result) {
-        return false;
-    }
-    return result->IsDirectory();
-}
-
-bool IsEmptyDirectory(const std::string& path)
-{
-    std::optional<OpenDirEntry> entry = OpenDir(path);
-    if (!entry) {
-        return false;
-    }
-    do {
-        if (entry->Name() != "." || entry->Name() != "..") {
-            return false;
-        }
-    } while (entry->Next());
-    return true;
-}
-
-bool Exists(const std::string& path)
-{
-    std::optional<StatResult> result = Stat(path);
-    if (!result) {
-        return false;
-    }
-    return true;
-}
-
-bool Mkdir(const std::string& path)
-{
-#ifdef _WIN32
-    std::wstring wPathUnicode = ConvertWin32UnicodePath(Utf8ToUtf16(path));
-    return CreateDirectoryW(wPathUnicode.c_str(), nullptr);
-#endif
-#ifdef __linux__
-    int ret = mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    return ret == 0;
-#endif
-}
-
-bool MkdirRecursive(const std::string& path)
-{
-    if (!Exists(ParentDirectoryPath(path))) {
-        bool success = MkdirRecursive(ParentDirectoryPath(path));
-        if (!success) {
-            return false;
-        }
-    }
-    return Mkdir(path);
-}
-
-std::string ParentDirectoryPath(const std::string& path)
-{
-    const std::string currendDirPath = ".";
-#ifdef _WIN32
-    std::string win32Path = path;
-    std::replace(win32Path.begin(), win32Path.end(), '/', '\\');
-    if (!win32Path.empty() && win32Path.back() != '\\') {
-        win32Path.pop_back();
-    }
-    size_t pos = win32Path.find_last_of('\\');
-    if (pos == std::string::npos) {
-        return currendDirPath;
-    }
-    return win32Path.substr(0, pos);
-#endif
-#ifdef __linux__
-    std::string posixPath = path;
-    std::replace(posixPath.begin(), posixPath.end(), '\\', '/');
-    if (!posixPath.empty() && posixPath.back() != '/') {
-        posixPath.pop_back();
-    }
-    size_t pos = posixPath.find_last_of('/');
-    if (pos == std::string::npos) {
-        return currendDirPath;
-    }
-    return posixPath.substr(0, pos);
-#endif
-}
-
+﻿#include "FileSystemUtil.h"
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
+#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
+#endif
+#include <locale>
+#include <codecvt>
+#include <sddl.h>
+#include <winioctl.h>
+
+#pragma comment(lib, "mpr.lib") /* required by network volume API */
+#endif
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* IORING_OP_STATX and IORING_OP_OPENAT are available since the 5.6 uapi headers */
+#if defined(IORING_SETUP_CLAMP) && defined(FSUTIL_HAVE_STATX)
+#define FSUTIL_HAVE_IO_URING
+#endif
+#endif
+#include <cstddef>
+#include <cerrno>
+#include <climits>
+#endif
+
+/* SSE2 is part of x86-64, AVX2 is compiled for its own functions and selected at runtime */
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define FSUTIL_HAVE_X86_SIMD
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+#ifdef _WIN32
+constexpr auto WIN32_UID = 0;
+constexpr auto WIN32_GID = 0;
+constexpr auto VOLUME_BUFFER_MAX_LEN = MAX_PATH;
+constexpr auto VOLUME_PATH_MAX_LEN = MAX_PATH + 1;
+constexpr auto DEVICE_BUFFER_MAX_LEN = MAX_PATH;
+constexpr auto DEFAULT_REPARSE_TAG = 0;
+const int SYMLINK_FLAG_RELATIVE = 1;
+const std::wstring WPATH_PREFIX = LR"(\\?\)";
+#endif
+#ifdef __linux__
+/* close the owned fd on scope exit */
+class ScopedFd {
+public:
+    explicit ScopedFd(int fd) : m_fd(fd) {}
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator = (const ScopedFd&) = delete;
+    ~ScopedFd()
+    {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+    int Get() const { return m_fd; }
+
+private:
+    int m_fd = -1;
+};
+
+/* record layout returned by getdents64, glibc before 2.30 does not export it */
+struct LinuxDirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[1];
+};
+#endif
+}
+
+#ifdef _WIN32
+/*
+ * These structure is used for Interal Windows API. 
+ * There's no associated import library to define them, so developers must define them maunally
+ */
+
+/* https://learn.microsoft.com/en-us/windows-hardware/drivers/ddi/ntifs/ns-ntifs-_reparse_data_buffer?redirectedfrom=MSDN */
+typedef struct _REPARSE_DATA_BUFFER {
+    ULONG  ReparseTag;
+    USHORT ReparseDataLength;
+    USHORT Reserved;
+    union {
+        struct {
+            USHORT SubstituteNameOffset;
+            USHORT SubstituteNameLength;
+            USHORT PrintNameOffset;
+            USHORT PrintNameLength;
+            ULONG  Flags;
+            WCHAR  PathBuffer[1];
+        } SymbolicLinkReparseBuffer;
+        struct {
+            USHORT SubstituteNameOffset;
+            USHORT SubstituteNameLength;
+            USHORT PrintNameOffset;
+            USHORT PrintNameLength;
+            WCHAR  PathBuffer[1];
+        } MountPointReparseBuffer;
+        struct {
+            UCHAR DataBuffer[1];
+        } GenericReparseBuffer;
+    } DUMMYUNIONNAME;
+} REPARSE_DATA_BUFFER, * PREPARSE_DATA_BUFFER;
+#endif
+
+/* Implement Section Begin */
+namespace FileSystemUtil {
+
+#ifdef FSUTIL_ENABLE_METRICS
+namespace {
+enum MetricsField { METRICS_CALLS, METRICS_ERRORS, METRICS_SYSCALLS, METRICS_BYTES, METRICS_NANOS, METRICS_FIELD_COUNT };
+const size_t METRICS_API_COUNT = static_cast<size_t>(MetricsApi::COUNT);
+const char* const METRICS_API_NAMES[METRICS_API_COUNT] = {
+    "Stat", "OpenDir", "DirNext", "CanonicalPath", "QuerySparseRanges", "CopySparseFile", "HashFile"
+};
+
+/* plain totals of the exited threads and of the ResetMetrics() baseline */
+struct MetricsTotals {
+    uint64_t fields[METRICS_API_COUNT][METRICS_FIELD_COUNT] {};
+    uint64_t histogram[METRICS_API_COUNT][METRICS_HISTOGRAM_BUCKETS] {};
+};
+
+/* written by the owner thread only, relaxed atomics keep the concurrent snapshot well defined */
+struct ThreadMetrics {
+    std::atomic<uint64_t> fields[METRICS_API_COUNT][METRICS_FIELD_COUNT] {};
+    std::atomic<uint64_t> histogram[METRICS_API_COUNT][METRICS_HISTOGRAM_BUCKETS] {};
+};
+
+struct MetricsRegistry {
+    std::mutex mutex;
+    std::vector<ThreadMetrics*> threads;
+    MetricsTotals exited;
+    MetricsTotals baseline;
+};
+}
+
+/* never destroyed, threads may still exit after the static destructors ran */
+static MetricsRegistry& GetMetricsRegistry()
+{
+    static MetricsRegistry* registry = new MetricsRegistry();
+    return *registry;
+}
+
+static void AddThreadMetrics(MetricsTotals& totals, const ThreadMetrics& metrics)
+{
+    for (size_t api = 0; api < METRICS_API_COUNT; ++api) {
+        for (size_t field = 0; field < METRICS_FIELD_COUNT; ++field) {
+            totals.fields[api][field] += metrics.fields[api][field].load(std::memory_order_relaxed);
+        }
+        for (size_t bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket) {
+            totals.histogram[api][bucket] += metrics.histogram[api][bucket].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+namespace {
+/* registers the counters of the thread on first use, merges them into the exited totals on thread exit */
+class ThreadMetricsOwner {
+public:
+    ThreadMetricsOwner() : m_metrics(new ThreadMetrics())
+    {
+        MetricsRegistry& registry = GetMetricsRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.threads.push_back(m_metrics.get());
+    }
+
+    ~ThreadMetricsOwner()
+    {
+        MetricsRegistry& registry = GetMetricsRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        AddThreadMetrics(registry.exited, *m_metrics);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), m_metrics.get()));
+    }
+
+    ThreadMetrics& Get() { return *m_metrics; }
+
+private:
+    std::unique_ptr<ThreadMetrics> m_metrics;
+};
+}
+
+static ThreadMetrics& CurrentThreadMetrics()
+{
+    thread_local ThreadMetricsOwner owner;
+    return owner.Get();
+}
+
+/* single writer, a plain load/store pair instead of a locked read-modify-write */
+static inline void IncreaseMetric(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static void AddMetric(MetricsApi api, MetricsField field, uint64_t value)
+{
+    IncreaseMetric(CurrentThreadMetrics().fields[static_cast<size_t>(api)][field], value);
+}
+
+static size_t LatencyBucket(uint64_t nanos)
+{
+    if (nanos < METRICS_LINEAR_BUCKETS) {
+        return static_cast<size_t>(nanos);
+    }
+    uint64_t exponent = 63;
+    while ((nanos >> exponent) == 0) {
+        exponent--;
+    }
+    uint64_t subBucket = (nanos >> (exponent - 3)) & (METRICS_SUB_BUCKETS - 1);
+    return static_cast<size_t>(METRICS_LINEAR_BUCKETS + (exponent - 4) * METRICS_SUB_BUCKETS + subBucket);
+}
+
+static uint64_t LatencyBucketUpperBound(size_t bucket)
+{
+    if (bucket < METRICS_LINEAR_BUCKETS) {
+        return bucket;
+    }
+    uint64_t exponent = (bucket - METRICS_LINEAR_BUCKETS) / METRICS_SUB_BUCKETS + 4;
+    uint64_t subBucket = (bucket - METRICS_LINEAR_BUCKETS) % METRICS_SUB_BUCKETS;
+    uint64_t width = uint64_t(1) << (exponent - 3);
+    return ((METRICS_SUB_BUCKETS + subBucket) << (exponent - 3)) + (width - 1);
+}
+
+namespace {
+/* count a call of the api and its latency when going out of scope, and an error if Failed() was called */
+class MetricsScope {
+public:
+    explicit MetricsScope(MetricsApi api) : m_api(api), m_begin(std::chrono::steady_clock::now()) {}
+
+    ~MetricsScope()
+    {
+        uint64_t nanos = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_begin).count());
+        ThreadMetrics& metrics = CurrentThreadMetrics();
+        size_t api = static_cast<size_t>(m_api);
+        IncreaseMetric(metrics.fields[api][METRICS_CALLS], 1);
+        if (m_failed) {
+            IncreaseMetric(metrics.fields[api][METRICS_ERRORS], 1);
+        }
+        IncreaseMetric(metrics.fields[api][METRICS_NANOS], nanos);
+        IncreaseMetric(metrics.histogram[api][LatencyBucket(nanos)], 1);
+    }
+
+    void Failed() { m_failed = true; }
+
+private:
+    MetricsApi m_api;
+    std::chrono::steady_clock::time_point m_begin;
+    bool m_failed = false;
+};
+}
+
+#define FSUTIL_METRICS_SCOPE(api) MetricsScope metricsScope(MetricsApi::api)
+/* mark the call of the enclosing FSUTIL_METRICS_SCOPE as failed */
+#define FSUTIL_METRICS_FAILED() metricsScope.Failed()
+#define FSUTIL_METRICS_SYSCALLS(api, count) AddMetric(MetricsApi::api, METRICS_SYSCALLS, (count))
+#define FSUTIL_METRICS_BYTES(api, count) AddMetric(MetricsApi::api, METRICS_BYTES, (count))
+#else
+#define FSUTIL_METRICS_SCOPE(api)
+#define FSUTIL_METRICS_FAILED()
+#define FSUTIL_METRICS_SYSCALLS(api, count)
+#define FSUTIL_METRICS_BYTES(api, count)
+#endif
+
+uint64_t ApiMetrics::PercentileNanos(double percentile) const
+{
+    uint64_t total = 0;
+    for (const std::pair<uint64_t, uint64_t>& bucket : latency) {
+        total += bucket.second;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(total)));
+    uint64_t seen = 0;
+    for (const std::pair<uint64_t, uint64_t>& bucket : latency) {
+        seen += bucket.second;
+        if (seen >= std::max<uint64_t>(rank, 1)) {
+            return bucket.first;
+        }
+    }
+    return 0;
+}
+
+std::string MetricsSnapshot::ToJson() const
+{
+    std::ostringstream json;
+    json << "{\n  \"enabled\": " << (enabled ? "true" : "false") << ",\n  \"apis\": [";
+    for (size_t index = 0; index < apis.size(); ++index) {
+        const ApiMetrics& api = apis[index];
+        json << (index == 0 ? "\n" : ",\n") << "    {"
+            << "\"name\": \"" << api.name << "\", "
+            << "\"calls\": " << api.calls << ", "
+            << "\"errors\": " << api.errors << ", "
+            << "\"syscalls\": " << api.syscalls << ", "
+            << "\"bytes\": " << api.bytes << ", "
+            << "\"total_ns\": " << api.totalNanos << ", "
+            << "\"p50_ns\": " << api.PercentileNanos(50) << ", "
+            << "\"p99_ns\": " << api.PercentileNanos(99) << ", "
+            << "\"max_ns\": " << api.PercentileNanos(100) << ", "
+            << "\"latency_ns\": [";
+        for (size_t bucket = 0; bucket < api.latency.size(); ++bucket) {
+            json << (bucket == 0 ? "" : ", ") << "[" << api.latency[bucket].first << ", "
+                << api.latency[bucket].second << "]";
+        }
+        json << "]}";
+    }
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+
+#ifdef FSUTIL_ENABLE_METRICS
+/* sum of the live and exited threads, the counters of the live ones may be slightly behind */
+static void CollectMetrics(MetricsTotals& totals)
+{
+    MetricsRegistry& registry = GetMetricsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    totals = registry.exited;
+    for (const ThreadMetrics* metrics : registry.threads) {
+        AddThreadMetrics(totals, *metrics);
+    }
+}
+#endif
+
+MetricsSnapshot GetMetricsSnapshot()
+{
+    MetricsSnapshot snapshot;
+#ifdef FSUTIL_ENABLE_METRICS
+    snapshot.enabled = true;
+    std::unique_ptr<MetricsTotals> totals(new MetricsTotals());
+    CollectMetrics(*totals);
+    MetricsRegistry& registry = GetMetricsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (size_t api = 0; api < METRICS_API_COUNT; ++api) {
+        const uint64_t* fields = totals->fields[api];
+        const uint64_t* baseline = registry.baseline.fields[api];
+        ApiMetrics metrics;
+        metrics.name = METRICS_API_NAMES[api];
+        metrics.calls = fields[METRICS_CALLS] - baseline[METRICS_CALLS];
+        metrics.errors = fields[METRICS_ERRORS] - baseline[METRICS_ERRORS];
+        metrics.syscalls = fields[METRICS_SYSCALLS] - baseline[METRICS_SYSCALLS];
+        metrics.bytes = fields[METRICS_BYTES] - baseline[METRICS_BYTES];
+        metrics.totalNanos = fields[METRICS_NANOS] - baseline[METRICS_NANOS];
+        for (size_t bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket) {
+            uint64_t count = totals->histogram[api][bucket] - registry.baseline.histogram[api][bucket];
+            if (count != 0) {
+                metrics.latency.emplace_back(LatencyBucketUpperBound(bucket), count);
+            }
+        }
+        if (metrics.calls != 0 || metrics.syscalls != 0) {
+            snapshot.apis.push_back(std::move(metrics));
+        }
+    }
+#endif
+    return snapshot;
+}
+
+/* counters are never cleared under the writers, the snapshot is taken relative to the current totals */
+void ResetMetrics()
+{
+#ifdef FSUTIL_ENABLE_METRICS
+    std::unique_ptr<MetricsTotals> totals(new MetricsTotals());
+    CollectMetrics(*totals);
+    MetricsRegistry& registry = GetMetricsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.baseline = *totals;
+#endif
+}
+
+#ifdef _WIN32
+std::wstring Utf8ToUtf16(const std::string& str)
+{
+    using ConvertTypeX = std::codecvt_utf8_utf16<wchar_t>;
+    std::wstring_convert<ConvertTypeX> converterX;
+    std::wstring wstr = converterX.from_bytes(str);
+    return wstr;
+}
+
+std::string Utf16ToUtf8(const std::wstring& wstr)
+{
+    using ConvertTypeX = std::codecvt_utf8_utf16<wchar_t>;
+    std::wstring_convert<ConvertTypeX> converterX;
+    return converterX.to_bytes(wstr);
+}
+
+inline std::wstring ConvertWin32UnicodePath(const std::wstring& wPath)
+{
+    if (wPath.length() > WPATH_PREFIX.length() && wPath.find(WPATH_PREFIX) == 0) {
+        /* already have prefix */
+        return wPath;
+    }
+    return WPATH_PREFIX + wPath;
+}
+
+bool EnablePrivilegeW(const wchar_t* wPrivilegeName)
+{
+    HANDLE hToken;
+    char buf[sizeof(TOKEN_PRIVILEGES) * 2];
+    TOKEN_PRIVILEGES& tkp = *((TOKEN_PRIVILEGES*) buf);
+
+    if (!::OpenProcessToken(
+            GetCurrentProcess(),
+            TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+            &hToken)) {
+        return false;
+    }
+
+    /* enable SeBackupPrivilege, SeRestorePrivilege */
+    if (!::LookupPrivilegeValue(
+            nullptr,
+            wPrivilegeName,
+            &tkp.Privileges[0].Luid)) { 
+        return false;
+    }
+
+    if (!::LookupPrivilegeValue(
+            nullptr,
+            SE_RESTORE_NAME,
+            &tkp.Privileges[1].Luid)) {
+        return false;
+    }
+
+    tkp.PrivilegeCount = 2;
+    tkp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    tkp.Privileges[1].Attributes = SE_PRIVILEGE_ENABLED;
+
+    ::AdjustTokenPrivileges(hToken, false, &tkp, sizeof(tkp), nullptr, nullptr);
+    return true;   
+}
+#endif
+
+
+#ifdef __linux__
+StatResult::StatResult(const std::string& path, const struct stat& statbuff)
+    : m_path(path)
+{
+    memcpy(&m_stat, &statbuff, sizeof(struct stat));
+}
+
+void StatResult::Assign(std::string_view path, const struct stat& statbuff)
+{
+    m_path.assign(path.data(), path.size());
+    memcpy(&m_stat, &statbuff, sizeof(struct stat));
+    m_fieldMask = STATX_BASIC_STATS;
+    m_birthTime = {};
+}
+
+#ifdef FSUTIL_HAVE_STATX
+StatResult::StatResult(const std::string& path, const struct statx& statxbuff)
+    : m_path(path), m_fieldMask(statxbuff.stx_mask)
+{
+    m_stat.st_dev = makedev(statxbuff.stx_dev_major, statxbuff.stx_dev_minor);
+    m_stat.st_rdev = makedev(statxbuff.stx_rdev_major, statxbuff.stx_rdev_minor);
+    m_stat.st_ino = statxbuff.stx_ino;
+    m_stat.st_mode = statxbuff.stx_mode;
+    m_stat.st_nlink = statxbuff.stx_nlink;
+    m_stat.st_uid = statxbuff.stx_uid;
+    m_stat.st_gid = statxbuff.stx_gid;
+    m_stat.st_size = statxbuff.stx_size;
+    m_stat.st_blksize = statxbuff.stx_blksize;
+    m_stat.st_blocks = statxbuff.stx_blocks;
+    m_stat.st_atim = { statxbuff.stx_atime.tv_sec, statxbuff.stx_atime.tv_nsec };
+    m_stat.st_mtim = { statxbuff.stx_mtime.tv_sec, statxbuff.stx_mtime.tv_nsec };
+    m_stat.st_ctim = { statxbuff.stx_ctime.tv_sec, statxbuff.stx_ctime.tv_nsec };
+    m_birthTime = { statxbuff.stx_btime.tv_sec, statxbuff.stx_btime.tv_nsec };
+}
+#endif
+
+static uint64_t TimespecToNano(const struct timespec& ts)
+{
+    const uint64_t NANOSECONDS_PER_SECOND = 1000000000;
+    return static_cast<uint64_t>(ts.tv_sec) * NANOSECONDS_PER_SECOND + static_cast<uint64_t>(ts.tv_nsec);
+}
+#endif
+
+#ifdef _WIN32
+StatResult::StatResult(const std::wstring& wPath, const BY_HANDLE_FILE_INFORMATION& handleFileInformation)
+    : m_wPath(wPath)
+{
+    memcpy_s(&m_handleFileInformation, sizeof(BY_HANDLE_FILE_INFORMATION),
+        &handleFileInformation, sizeof(BY_HANDLE_FILE_INFORMATION));
+}
+#endif
+
+uint64_t StatResult::UserID() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_uid);
+#endif
+#ifdef _WIN32
+    return WIN32_UID;
+#endif
+}
+
+uint64_t StatResult::GroupID() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_gid);
+#endif
+#ifdef _WIN32
+    return WIN32_GID;
+#endif
+}
+
+uint64_t StatResult::AccessTime() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_atime);
+#endif
+#ifdef _WIN32
+    return ConvertWin32Time(m_handleFileInformation.ftLastAccessTime.dwLowDateTime,
+        m_handleFileInformation.ftLastAccessTime.dwHighDateTime);
+#endif
+}
+
+uint64_t StatResult::CreationTime() const
+{
+#ifdef __linux__
+    if (HasBirthTime()) {
+        return static_cast<uint64_t>(m_birthTime.tv_sec);
+    }
+    return static_cast<uint64_t>(m_stat.st_ctime);
+#endif
+#ifdef _WIN32
+    return ConvertWin32Time(m_handleFileInformation.ftCreationTime.dwLowDateTime,
+        m_handleFileInformation.ftCreationTime.dwHighDateTime);
+#endif
+}
+
+uint64_t StatResult::ModifyTime() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_mtime);
+#endif
+#ifdef _WIN32
+    return ConvertWin32Time(m_handleFileInformation.ftLastWriteTime.dwLowDateTime,
+        m_handleFileInformation.ftLastWriteTime.dwHighDateTime);
+#endif
+}
+
+uint64_t StatResult::AccessTimeNano() const
+{
+#ifdef __linux__
+    return TimespecToNano(m_stat.st_atim);
+#endif
+#ifdef _WIN32
+    return ConvertWin32TimeNano(m_handleFileInformation.ftLastAccessTime.dwLowDateTime,
+        m_handleFileInformation.ftLastAccessTime.dwHighDateTime);
+#endif
+}
+
+uint64_t StatResult::CreationTimeNano() const
+{
+#ifdef __linux__
+    return HasBirthTime() ? TimespecToNano(m_birthTime) : TimespecToNano(m_stat.st_ctim);
+#endif
+#ifdef _WIN32
+    return ConvertWin32TimeNano(m_handleFileInformation.ftCreationTime.dwLowDateTime,
+        m_handleFileInformation.ftCreationTime.dwHighDateTime);
+#endif
+}
+
+uint64_t StatResult::ModifyTimeNano() const
+{
+#ifdef __linux__
+    return TimespecToNano(m_stat.st_mtim);
+#endif
+#ifdef _WIN32
+    return ConvertWin32TimeNano(m_handleFileInformation.ftLastWriteTime.dwLowDateTime,
+        m_handleFileInformation.ftLastWriteTime.dwHighDateTime);
+#endif
+}
+
+uint64_t StatResult::UniqueID() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_ino);
+#endif
+#ifdef _WIN32
+    return CombineDWORD(m_handleFileInformation.nFileIndexLow,
+        m_handleFileInformation.nFileIndexHigh);
+#endif
+}
+
+uint64_t StatResult::Size() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_size);
+#endif
+#ifdef _WIN32
+    return CombineDWORD(m_handleFileInformation.nFileSizeLow,
+        m_handleFileInformation.nFileSizeHigh);
+#endif
+}
+
+uint64_t StatResult::AllocatedSize() const
+{
+#ifdef __linux__
+    const uint64_t STAT_BLOCK_SIZE = 512; /* st_blocks unit, regardless of st_blksize */
+    return static_cast<uint64_t>(m_stat.st_blocks) * STAT_BLOCK_SIZE;
+#endif
+#ifdef _WIN32
+    DWORD high = 0;
+    DWORD low = ::GetCompressedFileSizeW(ConvertWin32UnicodePath(m_wPath).c_str(), &high);
+    if (low == INVALID_FILE_SIZE && ::GetLastError() != NO_ERROR) {
+        return Size();
+    }
+    return CombineDWORD(low, high);
+#endif
+}
+
+uint64_t StatResult::DeviceID() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_dev);
+#endif
+#ifdef _WIN32
+    return static_cast<uint64_t>(m_handleFileInformation.dwVolumeSerialNumber);
+#endif
+}
+
+uint64_t StatResult::LinksCount() const
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(m_stat.st_nlink);
+#endif
+#ifdef _WIN32
+    return static_cast<uint64_t>(m_handleFileInformation.nNumberOfLinks);
+#endif
+}
+
+bool StatResult::IsDirectory() const
+{
+#ifdef _WIN32
+    return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#endif
+#ifdef __linux__
+    return S_ISDIR(m_stat.st_mode);
+#endif
+}
+
+std::string StatResult::CanonicalPath() const
+{
+    FSUTIL_METRICS_SCOPE(CanonicalPath);
+#ifdef _WIN32
+    return Utf16ToUtf8(CanonicalPathW());
+#endif
+#ifdef __linux__
+    char* posixPathPtr = ::realpath(m_path.c_str(), nullptr);
+    FSUTIL_METRICS_SYSCALLS(CanonicalPath, 1); /* realpath() issues one readlink() per component */
+    if (posixPathPtr == nullptr) {
+        FSUTIL_METRICS_FAILED();
+        return "";
+    }
+    std::string posixPath(posixPathPtr);
+    ::free(posixPathPtr);
+    return posixPath;
+#endif
+}
+
+#ifdef _WIN32
+bool StatResult::IsArchive() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) != 0; }
+bool StatResult::IsCompressed() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED) != 0; }
+bool StatResult::IsEncrypted() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED) != 0; }
+bool StatResult::IsSparseFile() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0; }
+bool StatResult::IsHidden() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) != 0; }
+bool StatResult::IsOffline() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_OFFLINE) != 0; }
+bool StatResult::IsReadOnly() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0; }
+bool StatResult::IsSystem() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) != 0; }
+bool StatResult::IsTemporary() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_TEMPORARY) != 0; }
+bool StatResult::IsNormal() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_NORMAL) != 0; }
+bool StatResult::IsReparsePoint() const { return (m_handleFileInformation.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0; }
+uint64_t StatResult::Attribute() const { return m_handleFileInformation.dwFileAttributes; }
+
+
+/* 
+ * return pointer to REPARSE_DATA_BUFFER which store target info of file with reparse attribute,
+ * need to free memory if return non-nullptr value
+ */
+static REPARSE_DATA_BUFFER* GetReparseDataBufferW(const std::wstring& wPath)
+{
+    REPARSE_DATA_BUFFER* pReparseBuffer = nullptr;
+    DWORD dwSize;
+    /* Open the file for read */
+    std::wstring unicodePath = ConvertWin32UnicodePath(wPath);
+    HANDLE hFile = ::CreateFileW(
+        unicodePath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+        0);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        /* failed */
+        return nullptr;
+    }
+    /* Allocated areas info */
+    pReparseBuffer = (REPARSE_DATA_BUFFER*)::malloc(MAXIMUM_REPARSE_DATA_BUFFER_SIZE);
+    if (pReparseBuffer == nullptr) {
+        /* malloc failed */
+        ::CloseHandle(hFile);
+        return nullptr;
+    }
+    bool ret = ::DeviceIoControl(
+        hFile,
+        FSCTL_GET_REPARSE_POINT,
+        nullptr,
+        0,
+        pReparseBuffer,
+        MAXIMUM_REPARSE_DATA_BUFFER_SIZE,
+        &dwSize,
+        nullptr);
+    if (!ret) {
+        /* failed */
+        ::free(pReparseBuffer);
+        ::CloseHandle(hFile);
+        return nullptr;
+    }
+    ::CloseHandle(hFile);
+    return pReparseBuffer;
+}
+
+DWORD StatResult::ReparseTag() const
+{
+    if (!IsReparsePoint()) {
+        return DEFAULT_REPARSE_TAG;
+    }
+    WIN32_FIND_DATAW findFileData{};
+    std::wstring wCanonicalPath = CanonicalPathW();
+    std::wstring unicodePath = ConvertWin32UnicodePath(wCanonicalPath);
+    HANDLE fileHandle = ::FindFirstFileW(unicodePath.c_str(), &findFileData);
+    if (fileHandle == INVALID_HANDLE_VALUE || fileHandle == nullptr) {
+        return DEFAULT_REPARSE_TAG;
+    }
+    ::FindClose(fileHandle);
+    fileHandle = nullptr;
+    return findFileData.dwReserved0;
+}
+
+
+bool StatResult::IsSymbolicLink() const { return HasReparseSymbolicLinkTag();}
+
+bool StatResult::IsJunctionPoint() const
+{
+    std::optional<std::wstring> wPath = JunctionsPointTargetPathW();
+    if (!wPath) {
+        return false;
+    }
+    return true;
+}
+
+bool StatResult::IsMountedDevice() const {
+    std::optional<std::wstring> wDeviceName = MountedDeviceNameW();
+    if (!wDeviceName) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * If this sparse point has IO_REPARSE_TAG_MOUNT_POINT tag, it maybe a device mount point or a junction link
+ * if it's device   point, GetVolumeNameForVolumeMountPointW can accquire device name
+ * if it's junction link, GetVolumeNameForVolumeMountPointW will return false
+ */
+std::optional<std::wstring> StatResult::MountedDeviceNameW() const
+{
+    if (!HasReparseMountPointTag()) {
+        return std::nullopt;
+    }
+    WCHAR deviceNameBuff[DEVICE_BUFFER_MAX_LEN] = L"";
+    std::wstring wCanonicalPath = CanonicalPathW();
+    /* GetVolumeNameForVolumeMountPointW require input path to end with backslash */
+    if (wCanonicalPath.back() != L'\\') {
+        wCanonicalPath.push_back(L'\\');
+    }
+    if (::GetVolumeNameForVolumeMountPointW(wCanonicalPath.c_str(), deviceNameBuff, DEVICE_BUFFER_MAX_LEN)) {
+        return std::make_optional<std::wstring>(deviceNameBuff);
+    }
+    return std::nullopt;
+}
+
+std::optional<std::wstring> StatResult::JunctionsPointTargetPathW() const
+{
+    REPARSE_DATA_BUFFER* pReparseBuffer = GetReparseDataBufferW(m_wPath);
+    if (pReparseBuffer == nullptr) {
+        /* failed */
+        return std::nullopt;
+    }
+    if (pReparseBuffer->ReparseTag != IO_REPARSE_TAG_MOUNT_POINT) {
+        /* not a symbolic link */
+        ::free(pReparseBuffer);
+        return std::nullopt;
+    }
+
+    std::wstring wTarget;
+    std::wstring wPrintName;
+
+    USHORT targetNameIndex = pReparseBuffer->MountPointReparseBuffer.SubstituteNameOffset / sizeof(WCHAR);
+    USHORT targetNameLength = pReparseBuffer->MountPointReparseBuffer.SubstituteNameLength / sizeof(WCHAR);
+    USHORT displayNameIndex = pReparseBuffer->MountPointReparseBuffer.PrintNameOffset / sizeof(WCHAR);
+    USHORT displayNameLength = pReparseBuffer->MountPointReparseBuffer.PrintNameLength / sizeof(WCHAR);
+    WCHAR* targetName = &pReparseBuffer->MountPointReparseBuffer.PathBuffer[targetNameIndex];
+    WCHAR* displayName = &pReparseBuffer->MountPointReparseBuffer.PathBuffer[displayNameIndex];
+    wTarget.assign(targetName, targetName + targetNameLength);
+    wPrintName.assign(displayName, displayName + displayNameLength);
+    ::free(pReparseBuffer);
+    
+    /*
+    * Due to lack to offical api to determine if a reparse point with IO_REPARSE_TAG_MOUNT_POINT tag is a junction point,
+    * (both directory junction and device mount point has IO_REPARSE_TAG_MOUNT_POINT tag)
+    * if this directory is a mounted device, wPrintName and wTarget name will also be meaningful (returned as to device ame),
+    * To make sure this method return a target of directory junction, this method will check if it can obtain device name.
+    * If it's a device mount point, return std::nullopt
+    */
+    std::optional<std::wstring> wDeviceName = MountedDeviceNameW();
+    if (wDeviceName) {
+        return std::nullopt;
+    }
+    return std::make_optional<std::wstring>(wPrintName);
+}
+
+std::optional<std::wstring> StatResult::SymbolicLinkTargetPathW() const
+{
+    REPARSE_DATA_BUFFER* pReparseBuffer = GetReparseDataBufferW(m_wPath);
+    if (pReparseBuffer == nullptr) {
+        /* failed */
+        return std::nullopt;
+    }
+    if (pReparseBuffer->ReparseTag != IO_REPARSE_TAG_SYMLINK) {
+        /* not a symbolic link */
+        ::free(pReparseBuffer);
+        return std::nullopt;
+    }
+
+    std::wstring wTarget;
+    std::wstring wPrintName;
+
+    USHORT targetNameIndex = pReparseBuffer->SymbolicLinkReparseBuffer.SubstituteNameOffset >> 1;
+    USHORT targetNameLength = pReparseBuffer->SymbolicLinkReparseBuffer.SubstituteNameLength >> 1;
+    USHORT displayNameIndex = pReparseBuffer->SymbolicLinkReparseBuffer.PrintNameOffset >> 1;
+    USHORT displayNameLength = pReparseBuffer->SymbolicLinkReparseBuffer.PrintNameLength >> 1;
+    WCHAR* targetName = &pReparseBuffer->SymbolicLinkReparseBuffer.PathBuffer[targetNameIndex];
+    WCHAR* displayName = &pReparseBuffer->SymbolicLinkReparseBuffer.PathBuffer[displayNameIndex];
+    wTarget.assign(targetName, targetName + targetNameLength);
+    wPrintName.assign(displayName, displayName + displayNameLength);
+
+    ::free(pReparseBuffer);
+    return std::make_optional<std::wstring>(wPrintName);
+}
+
+// https://learn.microsoft.com/en-us/windows/_WIN32/fileio/reparse-point-tags
+bool StatResult::HasReparseSymbolicLinkTag() const { return ReparseTag() == IO_REPARSE_TAG_SYMLINK; }
+bool StatResult::HasReparseMountPointTag() const { return ReparseTag() == IO_REPARSE_TAG_MOUNT_POINT; }
+bool StatResult::HasReparseNfsTag() const { return ReparseTag() == IO_REPARSE_TAG_NFS; }
+bool StatResult::HasReparseOneDriveTag() const { return ReparseTag() == IO_REPARSE_TAG_ONEDRIVE; }
+
+/* return final path of reparse target */
+std::optional<std::wstring> StatResult::FinalPathW() const
+{
+    BY_HANDLE_FILE_INFORMATION handleFileInformation{};
+    HANDLE hFile = ::CreateFileW(
+        m_wPath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        0);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    WCHAR wPathBuff[MAX_PATH] = L"";
+    DWORD length = ::GetFinalPathNameByHandleW(hFile, wPathBuff, MAX_PATH, FILE_NAME_NORMALIZED);
+    if (length == 0) {
+        /* failed */
+        ::CloseHandle(hFile);
+        return std::nullopt;
+    }
+    if (length >= MAX_PATH) {
+        DWORD extendLength = length + 1;
+        WCHAR* wPathExtendBuff = new WCHAR[extendLength];
+        if (::GetFinalPathNameByHandleW(hFile, wPathExtendBuff, extendLength, FILE_NAME_NORMALIZED) == 0) {
+            /* failed */
+            delete[] wPathExtendBuff;
+            ::CloseHandle(hFile);
+            return std::nullopt;
+        }
+        /* succeed */
+        ::CloseHandle(hFile);
+        std::wstring wTargetPath(wPathExtendBuff);
+        delete[] wPathExtendBuff;
+        return NormalizeWin32PathW(wTargetPath);
+    }
+    /* succeed */
+    ::CloseHandle(hFile);
+    std::wstring wTargetPath(wPathBuff);
+    return NormalizeWin32PathW(wTargetPath);
+}
+
+std::wstring StatResult::CanonicalPathW() const
+{
+    WCHAR wPathBuff[MAX_PATH] = L"";
+    DWORD length = ::GetFullPathNameW(m_wPath.c_str(), MAX_PATH, wPathBuff, nullptr);
+    if (length == 0) {
+        /* failed */
+        return L"";
+    }
+    if (length >= MAX_PATH) {
+        DWORD extendLength = length + 1;
+        WCHAR* wPathExtendBuff = new WCHAR[extendLength];
+        if (::GetFullPathNameW(m_wPath.c_str(), extendLength, wPathExtendBuff, nullptr) == 0) {
+            /* failed */
+            delete[] wPathExtendBuff;
+            return L"";
+        }
+        /* succeed */
+        std::wstring wCanonicalPath(wPathExtendBuff);
+        delete[] wPathExtendBuff;
+        return NormalizeWin32PathW(wCanonicalPath);
+    }
+    /* succeed */
+    std::wstring wCanonicalPath(wPathBuff);
+    return NormalizeWin32PathW(wCanonicalPath);
+}
+#endif
+
+#ifdef __linux__
+bool StatResult::IsRegular() const { return S_ISREG(m_stat.st_mode); }
+bool StatResult::IsPipe() const { return S_ISFIFO(m_stat.st_mode); }
+bool StatResult::IsCharDevice() const { return S_ISCHR(m_stat.st_mode); }
+bool StatResult::IsBlockDevice() const { return S_ISBLK(m_stat.st_mode); }
+bool StatResult::IsSymLink() const { return S_ISLNK(m_stat.st_mode); }
+bool StatResult::IsSocket() const { return S_ISSOCK(m_stat.st_mode); }
+uint64_t StatResult::Mode() const { return m_stat.st_mode; }
+uint64_t StatResult::ChangeTime() const { return static_cast<uint64_t>(m_stat.st_ctime); }
+uint64_t StatResult::ChangeTimeNano() const { return TimespecToNano(m_stat.st_ctim); }
+bool StatResult::HasBirthTime() const { return (m_fieldMask & STATX_BTIME) != 0; }
+uint32_t StatResult::FieldMask() const { return m_fieldMask; }
+#endif
+
+std::optional<StatResult> Stat(const std::string& path)
+{
+    FSUTIL_METRICS_SCOPE(Stat);
+#ifdef __linux__
+    struct stat statbuff {};
+    FSUTIL_METRICS_SYSCALLS(Stat, 1);
+    if (stat(path.c_str(), &statbuff) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    return std::make_optional<StatResult>(path, statbuff);
+#endif
+#ifdef _WIN32
+    std::optional<StatResult> result = StatW(Utf8ToUtf16(path));
+    if (!result) {
+        FSUTIL_METRICS_FAILED();
+    }
+    return result;
+#endif
+}
+
+#ifdef __linux__
+/* statx/fstatat relative to dirFd, path is the one recorded in the result */
+static std::optional<StatResult> StatAtFd(
+    int dirFd, const char* name, const std::string& path, int flags, uint32_t mask)
+{
+    FSUTIL_METRICS_SCOPE(Stat);
+    FSUTIL_METRICS_SYSCALLS(Stat, 1);
+#ifdef FSUTIL_HAVE_STATX
+    /* remember ENOSYS to avoid a failing syscall per call on kernels before 4.11 */
+    static std::atomic<bool> statxUnsupported { false };
+    if (!statxUnsupported.load(std::memory_order_relaxed)) {
+        struct statx statxbuff {};
+        if (::statx(dirFd, name, flags, mask, &statxbuff) == 0) {
+            return std::make_optional<StatResult>(path, statxbuff);
+        }
+        if (errno != ENOSYS) {
+            FSUTIL_METRICS_FAILED();
+            return std::nullopt;
+        }
+        statxUnsupported.store(true, std::memory_order_relaxed);
+        FSUTIL_METRICS_SYSCALLS(Stat, 1);
+    }
+#endif
+    struct stat statbuff {};
+    if (::fstatat(dirFd, name, &statbuff, flags & AT_SYMLINK_NOFOLLOW) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    return std::make_optional<StatResult>(path, statbuff);
+}
+
+std::optional<StatResult> StatX(const std::string& path, uint32_t mask, int flags)
+{
+    return StatAtFd(AT_FDCWD, path.c_str(), path, flags, mask);
+}
+#endif
+
+#ifdef _WIN32
+std::optional<StatResult> StatW(const std::wstring& wPath)
+{
+    std::wstring unicodePath = ConvertWin32UnicodePath(wPath);
+    BY_HANDLE_FILE_INFORMATION handleFileInformation{};
+    HANDLE hFile = ::CreateFileW(
+        unicodePath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+        0);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    if (::GetFileInformationByHandle(hFile, &handleFileInformation) == 0) {
+        ::CloseHandle(hFile);
+        return std::nullopt;
+    }
+    ::CloseHandle(hFile);
+    return std::make_optional<StatResult>(wPath, handleFileInformation);
+}
+#endif
+
+/* run task(index, workerIndex) for every index in [0, count) on up to threads workers */
+static void ParallelFor(size_t count, int threads, const std::function<void(size_t, int)>& task)
+{
+    threads = std::max(1, std::min(threads, static_cast<int>(std::min<size_t>(count, INT32_MAX))));
+    std::atomic<size_t> nextIndex { 0 };
+    auto worker = [&](int workerIndex) {
+        for (size_t index = nextIndex.fetch_add(1); index < count; index = nextIndex.fetch_add(1)) {
+            task(index, workerIndex);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int workerIndex = 1; workerIndex < threads; ++workerIndex) {
+        workers.emplace_back(worker, workerIndex);
+    }
+    worker(0);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+}
+
+#ifdef FSUTIL_HAVE_IO_URING
+/**
+* minimal io_uring submission/completion queue pair on top of the raw syscalls,
+* only used by one thread at a time
+*/
+class IoUringQueue {
+public:
+    IoUringQueue() = default;
+    IoUringQueue(const IoUringQueue&) = delete;
+    IoUringQueue& operator = (const IoUringQueue&) = delete;
+    ~IoUringQueue();
+
+    bool Init(unsigned entries);
+    unsigned Entries() const { return m_sqEntries; }
+    /* return nullptr if the submission queue is full */
+    struct io_uring_sqe* GetSqe();
+    /* submit prepared requests and wait for at least waitNr completions */
+    int SubmitAndWait(unsigned waitNr);
+    /* Submit() and Wait() may be called concurrently, by a producer thread and a consumer thread */
+    int Submit();
+    int Wait(unsigned waitNr);
+    /* consume one completion, return false if the completion queue is empty */
+    bool PopCqe(struct io_uring_cqe& cqe);
+    /* prepared requests the kernel has not consumed yet, they are not in flight */
+    unsigned Unsubmitted() const { return *m_sqTail + m_pending - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE); }
+
+private:
+    int m_fd = -1;
+    void* m_sqRing = MAP_FAILED;
+    void* m_cqRing = MAP_FAILED;
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    struct io_uring_sqe* m_sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    size_t m_sqesSize = 0;
+    unsigned m_sqEntries = 0;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqMask = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned* m_cqMask = nullptr;
+    struct io_uring_cqe* m_cqes = nullptr;
+    unsigned m_pending = 0; /* prepared but not yet submitted */
+};
+
+IoUringQueue::~IoUringQueue()
+{
+    if (m_sqes != MAP_FAILED) {
+        ::munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+        ::munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing != MAP_FAILED) {
+        ::munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+bool IoUringQueue::Init(unsigned entries)
+{
+    struct io_uring_params params {};
+    params.flags = IORING_SETUP_CLAMP;
+    m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+        return false;
+    }
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = ::mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        return false;
+    }
+    m_cqRing = singleMmap ? m_sqRing : ::mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if (m_cqRing == MAP_FAILED) {
+        return false;
+    }
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = static_cast<struct io_uring_sqe*>(::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if (m_sqes == MAP_FAILED) {
+        return false;
+    }
+    char* sqRing = static_cast<char*>(m_sqRing);
+    char* cqRing = static_cast<char*>(m_cqRing);
+    m_sqEntries = params.sq_entries;
+    m_sqHead = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+    m_cqHead = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe*>(cqRing + params.cq_off.cqes);
+    return true;
+}
+
+struct io_uring_sqe* IoUringQueue::GetSqe()
+{
+    unsigned tail = *m_sqTail + m_pending;
+    if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+        return nullptr;
+    }
+    unsigned index = tail & *m_sqMask;
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    std::memset(sqe, 0, sizeof(struct io_uring_sqe));
+    m_sqArray[index] = index;
+    m_pending++;
+    return sqe;
+}
+
+int IoUringQueue::SubmitAndWait(unsigned waitNr)
+{
+    unsigned toSubmit = m_pending;
+    __atomic_store_n(m_sqTail, *m_sqTail + m_pending, __ATOMIC_RELEASE);
+    m_pending = 0;
+    int ret = 0;
+    do {
+        ret = static_cast<int>(::syscall(__NR_io_uring_enter, m_fd, toSubmit, waitNr,
+            IORING_ENTER_GETEVENTS, nullptr, 0));
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int IoUringQueue::Submit()
+{
+    unsigned tail = *m_sqTail + m_pending;
+    __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+    m_pending = 0;
+    /* entries left by a failed submission are submitted again */
+    unsigned toSubmit = tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    int ret = 0;
+    do {
+        ret = static_cast<int>(::syscall(__NR_io_uring_enter, m_fd, toSubmit, 0, 0, nullptr, 0));
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int IoUringQueue::Wait(unsigned waitNr)
+{
+    int ret = 0;
+    do {
+        ret = static_cast<int>(::syscall(__NR_io_uring_enter, m_fd, 0, waitNr, IORING_ENTER_GETEVENTS, nullptr, 0));
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+bool IoUringQueue::PopCqe(struct io_uring_cqe& cqe)
+{
+    unsigned head = *m_cqHead;
+    if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    cqe = m_cqes[head & *m_cqMask];
+    __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+* keep up to queueDepth requests in flight, prepare(sqe, index, slot) fills a request,
+* complete(index, slot, res) receives the result, slots identify per request buffers in [0, queueDepth)
+*/
+static bool RunIoUringBatch(
+    size_t count,
+    unsigned queueDepth,
+    const std::function<void(struct io_uring_sqe*, size_t, unsigned)>& prepare,
+    const std::function<void(size_t, unsigned, int)>& complete)
+{
+    IoUringQueue ring;
+    if (!ring.Init(queueDepth)) {
+        return false;
+    }
+    queueDepth = std::min(queueDepth, ring.Entries());
+    std::vector<unsigned> freeSlots;
+    for (unsigned slot = queueDepth; slot > 0; --slot) {
+        freeSlots.push_back(slot - 1);
+    }
+    std::vector<size_t> slotIndex(queueDepth, 0);
+    size_t nextIndex = 0;
+    size_t completed = 0;
+    while (completed < count) {
+        while (nextIndex < count && !freeSlots.empty()) {
+            struct io_uring_sqe* sqe = ring.GetSqe();
+            if (sqe == nullptr) {
+                break;
+            }
+            unsigned slot = freeSlots.back();
+            freeSlots.pop_back();
+            slotIndex[slot] = nextIndex;
+            prepare(sqe, nextIndex, slot);
+            sqe->user_data = slot;
+            nextIndex++;
+        }
+        if (ring.SubmitAndWait(1) < 0) {
+            /**
+            * the kernel keeps writing the buffers of the requests already consumed after the ring is closed,
+            * they belong to the caller so wait for all of them before returning, results are still completed
+            * so that e.g. opened fds can be released by the caller
+            */
+            size_t inFlight = nextIndex - completed - ring.Unsubmitted();
+            struct io_uring_cqe cqe {};
+            while (inFlight > 0) {
+                if (ring.PopCqe(cqe)) {
+                    unsigned slot = static_cast<unsigned>(cqe.user_data);
+                    complete(slotIndex[slot], slot, cqe.res);
+                    inFlight--;
+                } else if (ring.Wait(1) < 0 && errno != EAGAIN && errno != EBUSY) {
+                    break; /* the ring itself is unusable, nothing can be waited for */
+                }
+            }
+            return false;
+        }
+        struct io_uring_cqe cqe {};
+        while (ring.PopCqe(cqe)) {
+            unsigned slot = static_cast<unsigned>(cqe.user_data);
+            complete(slotIndex[slot], slot, cqe.res);
+            freeSlots.push_back(slot);
+            completed++;
+        }
+    }
+    return true;
+}
+#endif
+
+std::vector<BulkStatResult> BulkStat(const std::vector<std::string>& paths, const BulkIoOptions& options)
+{
+#ifdef __linux__
+    return BulkStatX(paths, STATX_BASIC_STATS, 0, options);
+#endif
+#ifdef _WIN32
+    std::vector<BulkStatResult> results(paths.size());
+    ParallelFor(paths.size(), options.queueDepth, [&](size_t index, int) {
+        results[index].statResult = Stat(paths[index]);
+        if (!results[index].statResult) {
+            results[index].error = static_cast<int>(::GetLastError());
+        }
+    });
+    return results;
+#endif
+}
+
+#ifdef __linux__
+std::vector<BulkStatResult> BulkStatX(
+    const std::vector<std::string>& paths, uint32_t mask, int flags, const BulkIoOptions& options)
+{
+    std::vector<BulkStatResult> results(paths.size());
+    if (paths.empty()) {
+        return results;
+    }
+#ifdef FSUTIL_HAVE_IO_URING
+    if (options.engine != BulkIoEngine::ThreadPool) {
+        unsigned queueDepth = static_cast<unsigned>(std::max(1, options.queueDepth));
+        std::vector<struct statx> statxbuffs(queueDepth);
+        bool success = RunIoUringBatch(paths.size(), queueDepth,
+            [&](struct io_uring_sqe* sqe, size_t index, unsigned slot) {
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = reinterpret_cast<uint64_t>(paths[index].c_str());
+                sqe->len = mask;
+                sqe->off = reinterpret_cast<uint64_t>(&statxbuffs[slot]);
+                sqe->statx_flags = static_cast<uint32_t>(flags);
+            },
+            [&](size_t index, unsigned slot, int res) {
+                if (res == -EINVAL) {
+                    /* opcode not supported by the running kernel, or a real EINVAL reproduced by StatX */
+                    results[index].statResult = StatX(paths[index], mask, flags);
+                    results[index].error = results[index].statResult ? 0 : errno;
+                } else if (res < 0) {
+                    results[index].error = -res;
+                } else {
+                    results[index].statResult = StatResult(paths[index], statxbuffs[slot]);
+                }
+            });
+        if (success) {
+            return results;
+        }
+        if (options.engine == BulkIoEngine::IoUring) {
+            for (BulkStatResult& result : results) {
+                result.error = ENOSYS;
+            }
+            return results;
+        }
+    }
+#else
+    if (options.engine == BulkIoEngine::IoUring) {
+        for (BulkStatResult& result : results) {
+            result.error = ENOSYS;
+        }
+        return results;
+    }
+#endif
+    ParallelFor(paths.size(), options.queueDepth, [&](size_t index, int) {
+        results[index].statResult = StatX(paths[index], mask, flags);
+        results[index].error = results[index].statResult ? 0 : errno;
+    });
+    return results;
+}
+
+std::vector<int> BulkOpen(const std::vector<std::string>& paths, int openFlags, const BulkIoOptions& options)
+{
+    const mode_t DEFAULT_CREATE_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    std::vector<int> fds(paths.size(), -ENOSYS);
+    if (paths.empty()) {
+        return fds;
+    }
+#ifdef FSUTIL_HAVE_IO_URING
+    if (options.engine != BulkIoEngine::ThreadPool) {
+        bool success = RunIoUringBatch(paths.size(), static_cast<unsigned>(std::max(1, options.queueDepth)),
+            [&](struct io_uring_sqe* sqe, size_t index, unsigned) {
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = reinterpret_cast<uint64_t>(paths[index].c_str());
+                sqe->len = DEFAULT_CREATE_MODE;
+                sqe->open_flags = static_cast<uint32_t>(openFlags);
+            },
+            [&](size_t index, unsigned, int res) {
+                if (res == -EINVAL) {
+                    int fd = ::open(paths[index].c_str(), openFlags, DEFAULT_CREATE_MODE);
+                    res = fd < 0 ? -errno : fd;
+                }
+                fds[index] = res;
+            });
+        if (success || options.engine == BulkIoEngine::IoUring) {
+            return fds;
+        }
+        /* ring failed half way, reopen everything with the thread pool */
+        for (int& fd : fds) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            fd = -ENOSYS;
+        }
+    }
+#else
+    if (options.engine == BulkIoEngine::IoUring) {
+        return fds;
+    }
+#endif
+    ParallelFor(paths.size(), options.queueDepth, [&](size_t index, int) {
+        int fd = ::open(paths[index].c_str(), openFlags, DEFAULT_CREATE_MODE);
+        fds[index] = fd < 0 ? -errno : fd;
+    });
+    return fds;
+}
+#endif
+
+#ifdef _WIN32
+OpenDirEntry::OpenDirEntry(
+    const std::string&      dirPath,
+    const WIN32_FIND_DATAW& findFileData,
+    const HANDLE&           fileHandle)
+    : m_dirPath(Utf8ToUtf16(dirPath)), m_findFileData(findFileData), m_fileHandle(fileHandle), m_dirPathUtf8(dirPath) {}
+
+bool OpenDirEntry::IsArchive() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) != 0; }
+bool OpenDirEntry::IsCompressed() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED) != 0; }
+bool OpenDirEntry::IsEncrypted() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED) != 0; }
+bool OpenDirEntry::IsSparseFile() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0; }
+bool OpenDirEntry::IsHidden() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) != 0; }
+bool OpenDirEntry::IsOffline() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_OFFLINE) != 0; }
+bool OpenDirEntry::IsReadOnly() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0; }
+bool OpenDirEntry::IsSystem() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) != 0; }
+bool OpenDirEntry::IsTemporary() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_TEMPORARY) != 0; }
+bool OpenDirEntry::IsNormal() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_NORMAL) != 0; }
+bool OpenDirEntry::IsReparsePoint() const { return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0; }
+uint64_t OpenDirEntry::Attribute() const { return m_findFileData.dwFileAttributes; }
+
+uint64_t OpenDirEntry::AccessTime() const
+{
+    return ConvertWin32Time(m_findFileData.ftLastAccessTime.dwLowDateTime,
+        m_findFileData.ftLastAccessTime.dwHighDateTime);
+}
+
+uint64_t OpenDirEntry::CreationTime() const
+{
+    return ConvertWin32Time(m_findFileData.ftCreationTime.dwLowDateTime,
+        m_findFileData.ftCreationTime.dwHighDateTime);
+}
+
+uint64_t OpenDirEntry::ModifyTime() const
+{
+    return ConvertWin32Time(m_findFileData.ftLastWriteTime.dwLowDateTime,
+        m_findFileData.ftLastWriteTime.dwHighDateTime);
+}
+
+uint64_t OpenDirEntry::Size() const
+{
+    return CombineDWORD(m_findFileData.nFileSizeLow, m_findFileData.nFileSizeHigh);
+}
+#endif
+
+#ifdef __linux__
+OpenDirEntry::OpenDirEntry(const std::string& dirPath, DIR* dirPtr, struct dirent* direntPtr)
+    :m_dirPath(dirPath), m_dir(dirPtr), m_dirent(direntPtr) {}
+
+/* d_type is an enumeration rather than a bit mask, DT_BLK and DT_SOCK share bits with DT_DIR */
+bool OpenDirEntry::IsUnknown() const { return Type() == DT_UNKNOWN; }
+bool OpenDirEntry::IsPipe() const { return Type() == DT_FIFO; }
+bool OpenDirEntry::IsCharDevice() const { return Type() == DT_CHR; }
+bool OpenDirEntry::IsBlockDevice() const { return Type() == DT_BLK; }
+bool OpenDirEntry::IsSymLink() const { return Type() == DT_LNK; }
+bool OpenDirEntry::IsSocket() const { return Type() == DT_SOCK; }
+bool OpenDirEntry::IsRegular() const { return Type() == DT_REG; }
+
+unsigned char OpenDirEntry::Type() const
+{
+    if (m_type >= 0) {
+        return static_cast<unsigned char>(m_type);
+    }
+    m_type = m_dirent->d_type;
+    if (m_type == DT_UNKNOWN) {
+        /* some filesystems (e.g. older xfs, reiserfs, some network filesystems) never fill d_type */
+        struct stat statbuff {};
+        if (::fstatat(DirFd(), m_dirent->d_name, &statbuff, AT_SYMLINK_NOFOLLOW) == 0) {
+            m_type = IFTODT(statbuff.st_mode);
+        }
+    }
+    return static_cast<unsigned char>(m_type);
+}
+
+uint64_t OpenDirEntry::INode() const { return static_cast<uint64_t>(m_dirent->d_ino); }
+int OpenDirEntry::DirFd() const { return m_dir == nullptr ? -1 : ::dirfd(m_dir); }
+#endif
+
+
+bool OpenDirEntry::IsDirectory() const
+{
+#ifdef _WIN32
+    return (m_findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#endif
+#ifdef __linux__
+    return Type() == DT_DIR;
+#endif
+}
+
+std::string OpenDirEntry::Name() const
+{
+#ifdef _WIN32
+    return Utf16ToUtf8(std::wstring(m_findFileData.cFileName));
+#endif
+#ifdef __linux__
+    return std::string(m_dirent->d_name);
+#endif
+}
+
+std::string OpenDirEntry::FullPath() const
+{
+#ifdef __linux__
+    const char separator = '/';
+    std::string_view name = NameView();
+    std::string fullPath;
+    fullPath.reserve(m_dirPath.size() + 1 + name.size());
+    fullPath += m_dirPath;
+    if (m_dirPath.empty() || m_dirPath.back() != separator) {
+        fullPath += separator;
+    }
+    fullPath += name;
+    return fullPath;
+#endif
+#ifdef _WIN32
+    std::wstring wfullpath = FullPathW();
+    return Utf16ToUtf8(wfullpath);
+#endif
+}
+
+std::string_view OpenDirEntry::NameView() const
+{
+#ifdef _WIN32
+    int length = ::WideCharToMultiByte(CP_UTF8, 0, m_findFileData.cFileName, -1, nullptr, 0, nullptr, nullptr);
+    m_nameUtf8.resize(length > 0 ? length : 1);
+    ::WideCharToMultiByte(CP_UTF8, 0, m_findFileData.cFileName, -1, &m_nameUtf8[0], length, nullptr, nullptr);
+    m_nameUtf8.resize(length > 0 ? length - 1 : 0); /* drop the null terminator */
+    return m_nameUtf8;
+#endif
+#ifdef __linux__
+    return std::string_view(m_dirent->d_name);
+#endif
+}
+
+std::string_view OpenDirEntry::DirPathView() const
+{
+#ifdef _WIN32
+    return m_dirPathUtf8;
+#endif
+#ifdef __linux__
+    return m_dirPath;
+#endif
+}
+
+#ifdef _WIN32
+
+std::wstring OpenDirEntry::NameW() const
+{
+    return std::wstring(m_findFileData.cFileName);
+}
+
+std::wstring OpenDirEntry::FullPathW() const
+{
+    const std::wstring separator = L"\\";
+    std::wstring wfullpath;
+    if (!m_dirPath.empty() && m_dirPath.back() == separator[0]) {
+        wfullpath = m_dirPath + NameW();
+    }
+    else {
+        wfullpath = m_dirPath + separator + NameW();
+    }
+    return wfullpath;
+}
+
+#endif
+
+bool OpenDirEntry::Next()
+{
+    FSUTIL_METRICS_SCOPE(DirNext);
+#ifdef _WIN32
+    if (m_fileHandle == nullptr || m_fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!::FindNextFileW(m_fileHandle, &m_findFileData)) {
+        if (::GetLastError() != ERROR_NO_MORE_FILES) {
+            FSUTIL_METRICS_FAILED();
+        }
+        Close();
+        return false;
+    }
+    return true;
+#endif
+#ifdef __linux__
+    if (m_dir == nullptr) {
+        return false;
+    }
+    errno = 0; /* readdir() only sets it on error, not at the end of the directory */
+    m_dirent = readdir(m_dir);
+    m_type = -1;
+    if (m_dirent == nullptr) {
+        if (errno != 0) {
+            FSUTIL_METRICS_FAILED();
+        }
+        return false;
+    }
+    return true;
+#endif
+}
+
+void OpenDirEntry::Close()
+{
+#ifdef _WIN32
+    if (m_fileHandle != nullptr && m_fileHandle != INVALID_HANDLE_VALUE) {
+        ::FindClose(m_fileHandle);
+        m_fileHandle = nullptr;
+    }
+#endif
+#ifdef __linux__
+    if (m_dir != nullptr) {
+        ::closedir(m_dir);
+        m_dir = nullptr;
+        m_dirent = nullptr;
+    }
+#endif
+}
+
+PathBuffer::PathBuffer(std::string_view root) : m_path(root) {}
+
+void PathBuffer::Assign(std::string_view root)
+{
+    m_path.assign(root.data(), root.size());
+    m_lengths.clear();
+}
+
+void PathBuffer::Push(std::string_view component)
+{
+#ifdef _WIN32
+    const char separator = '\\';
+#endif
+#ifdef __linux__
+    const char separator = '/';
+#endif
+    m_lengths.push_back(m_path.size());
+    if (!m_path.empty() && m_path.back() != separator) {
+        m_path += separator;
+    }
+    m_path.append(component.data(), component.size());
+}
+
+void PathBuffer::Pop()
+{
+    if (!m_lengths.empty()) {
+        m_path.resize(m_lengths.back());
+        m_lengths.pop_back();
+    }
+}
+
+std::string_view PathBuffer::View() const { return m_path; }
+
+const char* PathBuffer::CStr() const { return m_path.c_str(); }
+
+size_t PathBuffer::Size() const { return m_path.size(); }
+
+size_t PathBuffer::Depth() const { return m_lengths.size(); }
+
+std::optional<OpenDirEntry> OpenDir(const std::string& path)
+{
+    FSUTIL_METRICS_SCOPE(OpenDir);
+#ifdef _WIN32
+    std::wstring wpathPattern = ConvertWin32UnicodePath(Utf8ToUtf16(path));
+    if (!wpathPattern.empty() && wpathPattern.back() != L'\\') {
+        wpathPattern.push_back(L'\\');
+    }
+    wpathPattern += L"*.*";
+    WIN32_FIND_DATAW findFileData{};
+    HANDLE fileHandle = ::FindFirstFileW(wpathPattern.c_str(), &findFileData);
+    FSUTIL_METRICS_SYSCALLS(OpenDir, 1);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    return std::make_optional<OpenDirEntry>(path, findFileData, fileHandle);
+#endif
+#ifdef __linux__
+    DIR* dirPtr = ::opendir(path.c_str());
+    FSUTIL_METRICS_SYSCALLS(OpenDir, 1);
+    if (dirPtr == nullptr) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    struct dirent* direntPtr = readdir(dirPtr);
+    FSUTIL_METRICS_SYSCALLS(OpenDir, 1); /* the first getdents64() */
+    if (direntPtr == nullptr) {
+        ::closedir(dirPtr);
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    return std::make_optional<OpenDirEntry>(path, dirPtr, direntPtr);
+#endif
+}
+
+OpenDirEntry::~OpenDirEntry() {
+    Close();
+}
+
+OpenDirEntry::OpenDirEntry(OpenDirEntry&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+OpenDirEntry& OpenDirEntry::operator = (OpenDirEntry&& other) noexcept
+{
+    if (this == &other) {
+        return *this;
+    }
+    Close();
+    m_dirPath = std::move(other.m_dirPath);
+#ifdef _WIN32
+    m_fileHandle = other.m_fileHandle;
+    m_findFileData = other.m_findFileData;
+    m_dirPathUtf8 = std::move(other.m_dirPathUtf8);
+    other.m_fileHandle = nullptr;
+#endif
+#ifdef __linux__
+    m_dir = other.m_dir;
+    m_dirent = other.m_dirent;
+    m_type = other.m_type;
+    other.m_dir = nullptr;
+    other.m_dirent = nullptr;
+#endif
+    return *this;
+}
+
+DirRange::Iterator::Iterator(DirRange* range) : m_range(range) {}
+
+DirRange::Iterator::reference DirRange::Iterator::operator * () const { return m_range->m_entry.value(); }
+
+DirRange::Iterator::pointer DirRange::Iterator::operator -> () const { return &m_range->m_entry.value(); }
+
+DirRange::Iterator& DirRange::Iterator::operator ++ ()
+{
+    if (m_range != nullptr && !m_range->Advance()) {
+        m_range = nullptr;
+    }
+    return *this;
+}
+
+DirRange::Iterator::Proxy DirRange::Iterator::operator ++ (int)
+{
+    Proxy proxy;
+    if (m_range != nullptr) {
+        proxy.m_name = m_range->m_entry->NameView();
+        proxy.m_isDirectory = m_range->m_entry->IsDirectory();
+    }
+    ++(*this);
+    return proxy;
+}
+
+const DirRange::Iterator::Proxy& DirRange::Iterator::Proxy::operator * () const { return *this; }
+
+const DirRange::Iterator::Proxy* DirRange::Iterator::Proxy::operator -> () const { return this; }
+
+std::string_view DirRange::Iterator::Proxy::NameView() const { return m_name; }
+
+bool DirRange::Iterator::Proxy::IsDirectory() const { return m_isDirectory; }
+
+bool DirRange::Iterator::operator == (const Iterator& other) const { return m_range == other.m_range; }
+
+bool DirRange::Iterator::operator != (const Iterator& other) const { return m_range != other.m_range; }
+
+DirRange::DirRange(std::optional<OpenDirEntry> entry, const ListDirOptions& options)
+    : m_entry(std::move(entry)), m_options(options), m_end(!m_entry) {}
+
+DirRange::DirRange(DirRange&& other) noexcept
+    : m_entry(std::move(other.m_entry)),
+    m_options(std::move(other.m_options)),
+    m_started(other.m_started),
+    m_end(other.m_end)
+{
+    other.m_entry.reset();
+    other.m_end = true;
+}
+
+DirRange& DirRange::operator = (DirRange&& other) noexcept
+{
+    if (this != &other) {
+        m_entry = std::move(other.m_entry);
+        m_options = std::move(other.m_options);
+        m_started = other.m_started;
+        m_end = other.m_end;
+        other.m_entry.reset();
+        other.m_end = true;
+    }
+    return *this;
+}
+
+bool DirRange::Opened() const { return m_entry.has_value(); }
+
+DirRange::Iterator DirRange::begin()
+{
+    if (!m_started) {
+        /* OpenDir() has already read the first entry */
+        m_started = true;
+        if (!m_end && !Accept()) {
+            Advance();
+        }
+    }
+    return m_end ? end() : Iterator(this);
+}
+
+DirRange::Iterator DirRange::end() { return Iterator(nullptr); }
+
+bool DirRange::Accept() const
+{
+    std::string_view name = m_entry->NameView();
+    if (m_options.skipDots && (name == "." || name == "..")) {
+        return false;
+    }
+    return !m_options.filter || m_options.filter(name);
+}
+
+bool DirRange::Advance()
+{
+    while (!m_end) {
+        if (!m_entry->Next()) {
+            m_end = true;
+            m_entry->Close();
+        } else if (Accept()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+DirRange ListDir(const std::string& path, const ListDirOptions& options)
+{
+    return DirRange(OpenDir(path), options);
+}
+
+#ifdef __linux__
+DirHandle::DirHandle(int fd) : m_fd(fd) {}
+
+DirHandle::DirHandle(DirHandle&& other) noexcept : m_fd(other.m_fd)
+{
+    other.m_fd = -1;
+}
+
+DirHandle& DirHandle::operator = (DirHandle&& other) noexcept
+{
+    if (this != &other) {
+        Close();
+        m_fd = other.m_fd;
+        other.m_fd = -1;
+    }
+    return *this;
+}
+
+DirHandle::~DirHandle()
+{
+    Close();
+}
+
+int DirHandle::Fd() const { return m_fd; }
+
+void DirHandle::Close()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+std::optional<DirHandle> OpenDirHandle(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    return std::make_optional<DirHandle>(fd);
+}
+
+std::optional<DirHandle> OpenDirHandleAt(const DirHandle& dir, const char* name)
+{
+    int fd = ::openat(dir.Fd(), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    return std::make_optional<DirHandle>(fd);
+}
+
+std::optional<StatResult> StatAt(const DirHandle& dir, const char* name, int flags, uint32_t mask)
+{
+    return StatAtFd(dir.Fd(), name, "", flags, mask);
+}
+
+std::optional<OpenDirEntry> OpenDirAt(const DirHandle& dir, const char* name)
+{
+    FSUTIL_METRICS_SCOPE(OpenDir);
+    FSUTIL_METRICS_SYSCALLS(OpenDir, 2); /* openat() and the first getdents64() */
+    int fd = ::openat(dir.Fd(), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    DIR* dirPtr = ::fdopendir(fd);
+    if (dirPtr == nullptr) {
+        ::close(fd);
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    struct dirent* direntPtr = ::readdir(dirPtr);
+    if (direntPtr == nullptr) {
+        ::closedir(dirPtr);
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    return std::make_optional<OpenDirEntry>(name, dirPtr, direntPtr);
+}
+
+bool MkdirAt(const DirHandle& dir, const char* name)
+{
+    return ::mkdirat(dir.Fd(), name, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0;
+}
+
+bool UnlinkAt(const DirHandle& dir, const char* name, bool isDirectory)
+{
+    return ::unlinkat(dir.Fd(), name, isDirectory ? AT_REMOVEDIR : 0) == 0;
+}
+#endif
+
+#ifdef __linux__
+DirentBatchReader::DirentBatchReader(const std::string& dirPath, int dirFd, size_t bufferSize)
+    : m_dirPath(dirPath), m_fd(dirFd), m_buffer(bufferSize) {}
+
+DirentBatchReader::DirentBatchReader(DirentBatchReader&& other) noexcept
+    : m_dirPath(std::move(other.m_dirPath)), m_fd(other.m_fd),
+    m_buffer(std::move(other.m_buffer)), m_error(other.m_error)
+{
+    other.m_fd = -1;
+}
+
+DirentBatchReader& DirentBatchReader::operator = (DirentBatchReader&& other) noexcept
+{
+    if (this != &other) {
+        Close();
+        m_dirPath = std::move(other.m_dirPath);
+        m_fd = other.m_fd;
+        m_buffer = std::move(other.m_buffer);
+        m_error = other.m_error;
+        other.m_fd = -1;
+    }
+    return *this;
+}
+
+DirentBatchReader::~DirentBatchReader()
+{
+    Close();
+}
+
+bool DirentBatchReader::NextBatch(std::vector<DirentView>& batch)
+{
+    batch.clear();
+    if (m_fd < 0) {
+        return false;
+    }
+    long nbytes = ::syscall(SYS_getdents64, m_fd, m_buffer.data(), m_buffer.size());
+    if (nbytes <= 0) {
+        m_error = nbytes < 0 ? errno : 0;
+        return false;
+    }
+    for (long pos = 0; pos < nbytes;) {
+        const LinuxDirent64* dirent = reinterpret_cast<const LinuxDirent64*>(m_buffer.data() + pos);
+        batch.push_back(DirentView { std::string_view(dirent->d_name), dirent->d_ino, dirent->d_type });
+        pos += dirent->d_reclen;
+    }
+    return true;
+}
+
+int DirentBatchReader::Error() const { return m_error; }
+
+int DirentBatchReader::Fd() const { return m_fd; }
+
+const std::string& DirentBatchReader::DirPath() const { return m_dirPath; }
+
+void DirentBatchReader::Close()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+std::optional<DirentBatchReader> OpenDirBatch(const std::string& path, size_t bufferSize)
+{
+    /* the buffer must be able to hold at least one record with the longest name */
+    if (bufferSize < offsetof(LinuxDirent64, d_name) + NAME_MAX + 1) {
+        errno = EINVAL;
+        return std::nullopt;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    return std::make_optional<DirentBatchReader>(path, fd, bufferSize);
+}
+
+std::optional<std::vector<StatDirEntry>> StatDir(const std::string& path, const StatDirOptions& options)
+{
+    static const std::string EMPTY_PATH;
+    std::optional<DirentBatchReader> reader = OpenDirBatch(path, options.bufferSize);
+    if (!reader) {
+        return std::nullopt;
+    }
+    std::vector<StatDirEntry> entries;
+    std::vector<DirentView> batch;
+    while (reader->NextBatch(batch)) {
+        /* the views are only valid until the next batch, stat the whole batch before reading further */
+        if (options.inodeOrder) {
+            std::sort(batch.begin(), batch.end(),
+                [](const DirentView& lhs, const DirentView& rhs) { return lhs.inode < rhs.inode; });
+        }
+        for (const DirentView& dirent : batch) {
+            if (dirent.name == "." || dirent.name == "..") {
+                continue;
+            }
+            StatDirEntry entry { std::string(dirent.name), dirent.inode, dirent.type, std::nullopt };
+            entry.statResult = StatAtFd(reader->Fd(), entry.name.c_str(), EMPTY_PATH, options.flags, STATX_BASIC_STATS);
+            entries.push_back(std::move(entry));
+        }
+    }
+    if (reader->Error() != 0) {
+        errno = reader->Error();
+        return std::nullopt;
+    }
+    return std::make_optional(std::move(entries));
+}
+#endif
+
+namespace {
+enum class GlobToken : uint8_t {
+    Byte,           /* the byte itself */
+    Any,            /* "?", any byte except '/' */
+    Class,          /* "[...]", never matches '/' */
+    Star,           /* "*", any bytes except '/' */
+    GlobStarDir,    /* "**" + "/", nothing or any bytes ending with '/' */
+    AnyAll,         /* any byte */
+    StarAll,        /* any bytes */
+    Accept          /* end of a rule */
+};
+
+struct PathFilterNfaState {
+    GlobToken token;
+    uint8_t byte;
+    uint32_t index; /* index of the byte class for Class, of the rule for Accept */
+};
+
+struct PathFilterRule {
+    bool negate;
+    bool dirOnly;
+};
+
+struct PathFilterDfaState {
+    std::vector<uint32_t> nfaStates; /* sorted, closed over the empty transitions */
+    int32_t fileRule = -1; /* last rule matching a file, -1 if none */
+    int32_t dirRule = -1; /* last rule matching a directory */
+    /**
+    * transition of every byte, PATH_FILTER_UNKNOWN until computed,
+    * nullptr once PATH_FILTER_MAX_TABLES is reached, the transitions are then stepped from nfaStates every time
+    */
+    std::unique_ptr<std::atomic<uint32_t>[]> next;
+};
+
+const uint32_t PATH_FILTER_DEAD = 0;
+/* every state id was used, excludes everything below rather than letting it through */
+const uint32_t PATH_FILTER_EXHAUSTED = 1;
+const uint32_t PATH_FILTER_UNKNOWN = UINT32_MAX;
+const size_t PATH_FILTER_CHUNK_SIZE = 1024; /* dfa states are allocated by chunks, never moved */
+const size_t PATH_FILTER_MAX_CHUNKS = 4096;
+const uint32_t PATH_FILTER_MAX_TABLES = 16384; /* states with a 1 KiB transition table, 16 MiB at most */
+}
+
+struct PathFilterAutomaton {
+    std::vector<PathFilterNfaState> nfa;
+    std::vector<std::vector<bool>> classes;
+    std::vector<PathFilterRule> rules;
+    uint32_t root = PATH_FILTER_DEAD;
+
+    /* dfa states are only added under mutex, readers find them by ids published through the atomic transitions */
+    std::mutex mutex;
+    std::unique_ptr<std::unique_ptr<PathFilterDfaState[]>[]> chunks;
+    uint32_t stateCount = 0;
+    std::unordered_map<std::string, uint32_t> stateIndex;
+
+    PathFilterDfaState& State(uint32_t id) const
+    {
+        return chunks[id / PATH_FILTER_CHUNK_SIZE][id % PATH_FILTER_CHUNK_SIZE];
+    }
+
+    void Close(std::vector<uint32_t>& states, bool componentStart) const;
+    std::vector<uint32_t> Step(const std::vector<uint32_t>& states, uint8_t byte) const;
+    void AddExhaustedState();
+    uint32_t AddState(std::vector<uint32_t> states);
+    uint32_t Transition(uint32_t id, uint8_t byte);
+};
+
+/**
+* add the targets of the empty transitions, then sort
+* "**" + "/" only matches nothing at the start of a component, at the root or right after a '/',
+* once it has consumed other bytes it has to reach the next '/' first
+*/
+void PathFilterAutomaton::Close(std::vector<uint32_t>& states, bool componentStart) const
+{
+    for (size_t index = 0; index < states.size(); ++index) {
+        GlobToken token = nfa[states[index]].token;
+        if (token == GlobToken::Star || token == GlobToken::StarAll ||
+            (token == GlobToken::GlobStarDir && componentStart)) {
+            states.push_back(states[index] + 1);
+        }
+    }
+    std::sort(states.begin(), states.end());
+    states.erase(std::unique(states.begin(), states.end()), states.end());
+}
+
+/* return the id of the dfa state of a closed nfa state set, mutex is held */
+uint32_t PathFilterAutomaton::AddState(std::vector<uint32_t> states)
+{
+    std::string key(reinterpret_cast<const char*>(states.data()), states.size() * sizeof(uint32_t));
+    auto it = stateIndex.find(key);
+    if (it != stateIndex.end()) {
+        return it->second;
+    }
+    if (stateCount >= PATH_FILTER_CHUNK_SIZE * PATH_FILTER_MAX_CHUNKS) {
+        return PATH_FILTER_EXHAUSTED;
+    }
+    if (stateCount % PATH_FILTER_CHUNK_SIZE == 0) {
+        chunks[stateCount / PATH_FILTER_CHUNK_SIZE].reset(new PathFilterDfaState[PATH_FILTER_CHUNK_SIZE]);
+    }
+    uint32_t id = stateCount++;
+    PathFilterDfaState& state = State(id);
+    for (uint32_t nfaState : states) {
+        if (nfa[nfaState].token != GlobToken::Accept) {
+            continue;
+        }
+        int32_t rule = static_cast<int32_t>(nfa[nfaState].index);
+        state.dirRule = std::max(state.dirRule, rule);
+        if (!rules[rule].dirOnly) {
+            state.fileRule = std::max(state.fileRule, rule);
+        }
+    }
+    if (id < PATH_FILTER_MAX_TABLES) {
+        state.next.reset(new std::atomic<uint32_t>[256]);
+        for (int byte = 0; byte < 256; ++byte) {
+            state.next[byte].store(states.empty() ? PATH_FILTER_DEAD : PATH_FILTER_UNKNOWN, std::memory_order_relaxed);
+        }
+    }
+    state.nfaStates = std::move(states);
+    stateIndex.emplace(std::move(key), id);
+    return id;
+}
+
+/* nfa states reached from a dfa state by byte, closed */
+std::vector<uint32_t> PathFilterAutomaton::Step(const std::vector<uint32_t>& states, uint8_t byte) const
+{
+    std::vector<uint32_t> targets;
+    for (uint32_t nfaState : states) {
+        const PathFilterNfaState& current = nfa[nfaState];
+        switch (current.token) {
+            case GlobToken::Byte:
+                if (byte == current.byte) {
+                    targets.push_back(nfaState + 1);
+                }
+                break;
+            case GlobToken::Any:
+                if (byte != '/') {
+                    targets.push_back(nfaState + 1);
+                }
+                break;
+            case GlobToken::Class:
+                if (byte != '/' && classes[current.index][byte]) {
+                    targets.push_back(nfaState + 1);
+                }
+                break;
+            case GlobToken::Star:
+                if (byte != '/') {
+                    targets.push_back(nfaState);
+                }
+                break;
+            case GlobToken::GlobStarDir:
+                targets.push_back(nfaState);
+                if (byte == '/') {
+                    targets.push_back(nfaState + 1);
+                }
+                break;
+            case GlobToken::AnyAll:
+                targets.push_back(nfaState + 1);
+                break;
+            case GlobToken::StarAll:
+                targets.push_back(nfaState);
+                break;
+            case GlobToken::Accept:
+                break;
+        }
+    }
+    Close(targets, byte == '/');
+    return targets;
+}
+
+/* the exhausted state is a sink whose entries are all excluded, it's always the second one */
+void PathFilterAutomaton::AddExhaustedState()
+{
+    int32_t rule = static_cast<int32_t>(rules.size());
+    rules.push_back(PathFilterRule { false, false });
+    chunks[0][PATH_FILTER_EXHAUSTED].fileRule = rule;
+    chunks[0][PATH_FILTER_EXHAUSTED].dirRule = rule;
+    chunks[0][PATH_FILTER_EXHAUSTED].next.reset(new std::atomic<uint32_t>[256]);
+    for (int byte = 0; byte < 256; ++byte) {
+        chunks[0][PATH_FILTER_EXHAUSTED].next[byte].store(PATH_FILTER_EXHAUSTED, std::memory_order_relaxed);
+    }
+    stateCount++;
+}
+
+uint32_t PathFilterAutomaton::Transition(uint32_t id, uint8_t byte)
+{
+    PathFilterDfaState& state = State(id);
+    if (!state.next) {
+        /* beyond the cached tables, step the nfa states every time rather than giving up on matching */
+        std::lock_guard<std::mutex> lock(mutex);
+        return AddState(Step(state.nfaStates, byte));
+    }
+    uint32_t next = state.next[byte].load(std::memory_order_acquire);
+    if (next != PATH_FILTER_UNKNOWN) {
+        return next;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    next = state.next[byte].load(std::memory_order_relaxed);
+    if (next != PATH_FILTER_UNKNOWN) {
+        return next;
+    }
+    next = AddState(Step(state.nfaStates, byte));
+    state.next[byte].store(next, std::memory_order_release);
+    return next;
+}
+
+/* parse "[...]" starting at pattern[pos] == '[', return false if not terminated */
+static bool ParseGlobClass(std::string_view pattern, size_t& pos, std::vector<bool>& byteClass)
+{
+    size_t index = pos + 1;
+    bool negate = index < pattern.size() && (pattern[index] == '!' || pattern[index] == '^');
+    if (negate) {
+        index++;
+    }
+    byteClass.assign(256, false);
+    bool first = true;
+    for (; index < pattern.size(); first = false) {
+        if (pattern[index] == ']' && !first) {
+            if (negate) {
+                byteClass.flip();
+            }
+            pos = index + 1;
+            return true;
+        }
+        if (pattern[index] == '\\' && index + 1 < pattern.size()) {
+            index++;
+        }
+        uint8_t low = static_cast<uint8_t>(pattern[index++]);
+        uint8_t high = low;
+        if (index + 1 < pattern.size() && pattern[index] == '-' && pattern[index + 1] != ']') {
+            index++;
+            if (pattern[index] == '\\' && index + 1 < pattern.size()) {
+                index++;
+            }
+            high = static_cast<uint8_t>(pattern[index++]);
+        }
+        for (int byte = low; byte <= high; ++byte) {
+            byteClass[byte] = true;
+        }
+    }
+    return false;
+}
+
+/* compile one gitignore line into nfa states, blank lines and comments are ignored */
+static void CompilePathFilterRule(std::string_view line, PathFilterAutomaton& automaton)
+{
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) {
+        line.remove_suffix(1);
+    }
+    /* trailing spaces are ignored unless escaped */
+    while (!line.empty() && line.back() == ' ' && !(line.size() >= 2 && line[line.size() - 2] == '\\')) {
+        line.remove_suffix(1);
+    }
+    if (line.empty() || line[0] == '#') {
+        return;
+    }
+    PathFilterRule rule { false, false };
+    if (line[0] == '!') {
+        rule.negate = true;
+        line.remove_prefix(1);
+    }
+    if (!line.empty() && line.back() == '/') {
+        rule.dirOnly = true;
+        line.remove_suffix(1);
+    }
+    bool anchored = line.find('/') != std::string_view::npos;
+    if (!line.empty() && line[0] == '/') {
+        line.remove_prefix(1);
+    }
+    if (line.empty()) {
+        return;
+    }
+    uint32_t ruleIndex = static_cast<uint32_t>(automaton.rules.size());
+    std::vector<PathFilterNfaState>& nfa = automaton.nfa;
+    if (!anchored) {
+        nfa.push_back(PathFilterNfaState { GlobToken::GlobStarDir, 0, 0 });
+    }
+    for (size_t pos = 0; pos < line.size();) {
+        char c = line[pos];
+        bool atComponentStart = pos == 0 || line[pos - 1] == '/';
+        if (c == '*' && pos + 1 < line.size() && line[pos + 1] == '*' && atComponentStart) {
+            if (pos + 2 == line.size()) {
+                /* trailing "/" + "**", everything inside */
+                nfa.push_back(PathFilterNfaState { GlobToken::AnyAll, 0, 0 });
+                nfa.push_back(PathFilterNfaState { GlobToken::StarAll, 0, 0 });
+                pos += 2;
+                continue;
+            }
+            if (line[pos + 2] == '/') {
+                nfa.push_back(PathFilterNfaState { GlobToken::GlobStarDir, 0, 0 });
+                pos += 3;
+                continue;
+            }
+        }
+        if (c == '*') {
+            if (nfa.empty() || nfa.back().token != GlobToken::Star || pos == 0) {
+                nfa.push_back(PathFilterNfaState { GlobToken::Star, 0, 0 });
+            }
+            pos++;
+        } else if (c == '?') {
+            nfa.push_back(PathFilterNfaState { GlobToken::Any, 0, 0 });
+            pos++;
+        } else if (c == '[') {
+            std::vector<bool> byteClass;
+            size_t end = pos;
+            if (ParseGlobClass(line, end, byteClass)) {
+                nfa.push_back(PathFilterNfaState {
+                    GlobToken::Class, 0, static_cast<uint32_t>(automaton.classes.size()) });
+                automaton.classes.push_back(std::move(byteClass));
+                pos = end;
+            } else {
+                nfa.push_back(PathFilterNfaState { GlobToken::Byte, static_cast<uint8_t>(c), 0 });
+                pos++;
+            }
+        } else {
+            if (c == '\\' && pos + 1 < line.size()) {
+                c = line[++pos];
+            }
+            nfa.push_back(PathFilterNfaState { GlobToken::Byte, static_cast<uint8_t>(c), 0 });
+            pos++;
+        }
+    }
+    nfa.push_back(PathFilterNfaState { GlobToken::Accept, 0, ruleIndex });
+    automaton.rules.push_back(rule);
+}
+
+PathFilter::PathFilter(std::shared_ptr<PathFilterAutomaton> automaton) : m_automaton(std::move(automaton)) {}
+
+bool PathFilter::Empty() const { return m_automaton == nullptr; }
+
+PathFilter::State PathFilter::Root() const { return m_automaton ? m_automaton->root : PATH_FILTER_DEAD; }
+
+PathFilter::State PathFilter::Next(State dirState, std::string_view name) const
+{
+    for (size_t index = 0; index < name.size() && dirState != PATH_FILTER_DEAD; ++index) {
+        dirState = m_automaton->Transition(dirState, static_cast<uint8_t>(name[index]));
+    }
+    return dirState;
+}
+
+PathFilter::State PathFilter::Enter(State entryState) const
+{
+    return entryState == PATH_FILTER_DEAD ? entryState : m_automaton->Transition(entryState, '/');
+}
+
+bool PathFilter::Excluded(State entryState, bool isDirectory) const
+{
+    if (entryState == PATH_FILTER_DEAD) {
+        return false;
+    }
+    const PathFilterDfaState& state = m_automaton->State(entryState);
+    int32_t rule = isDirectory ? state.dirRule : state.fileRule;
+    return rule >= 0 && !m_automaton->rules[rule].negate;
+}
+
+bool PathFilter::DependsOnType(State entryState) const
+{
+    return Excluded(entryState, true) != Excluded(entryState, false);
+}
+
+bool PathFilter::Dead(State state) const { return state == PATH_FILTER_DEAD; }
+
+bool PathFilter::ExcludedPath(std::string_view relativePath, bool isDirectory) const
+{
+    State state = Root();
+    size_t begin = 0;
+    while (!Dead(state)) {
+        size_t end = std::min(relativePath.find('/', begin), relativePath.size());
+        state = Next(state, relativePath.substr(begin, end - begin));
+        if (end >= relativePath.size()) {
+            return Excluded(state, isDirectory);
+        }
+        if (Excluded(state, true)) {
+            return true;
+        }
+        state = Enter(state);
+        begin = end + 1;
+    }
+    return false;
+}
+
+PathFilter CompilePathFilter(const std::vector<std::string>& rules)
+{
+    std::shared_ptr<PathFilterAutomaton> automaton = std::make_shared<PathFilterAutomaton>();
+    for (const std::string& rule : rules) {
+        CompilePathFilterRule(rule, *automaton);
+    }
+    if (automaton->rules.empty()) {
+        return PathFilter();
+    }
+    automaton->chunks.reset(new std::unique_ptr<PathFilterDfaState[]>[PATH_FILTER_MAX_CHUNKS]);
+    /* the dead state is the empty set, it's always the first one */
+    automaton->AddState(std::vector<uint32_t>());
+    automaton->AddExhaustedState();
+    std::vector<uint32_t> starts;
+    for (size_t index = 0; index < automaton->nfa.size(); ++index) {
+        /* every rule starts right after the Accept of the previous one */
+        if (index == 0 || automaton->nfa[index - 1].token == GlobToken::Accept) {
+            starts.push_back(static_cast<uint32_t>(index));
+        }
+    }
+    automaton->Close(starts, true);
+    automaton->root = automaton->AddState(std::move(starts));
+    return PathFilter(std::move(automaton));
+}
+
+std::optional<PathFilter> LoadPathFilter(const std::string& rulesPath)
+{
+    std::ifstream file(rulesPath);
+    if (!file) {
+        return std::nullopt;
+    }
+    std::vector<std::string> rules;
+    for (std::string line; std::getline(file, line);) {
+        rules.push_back(std::move(line));
+    }
+    return CompilePathFilter(rules);
+}
+
+namespace {
+struct WalkTreeTask {
+    std::string path;
+    int depth; /* depth of the directory itself, root is 0 */
+    PathFilter::State filterState; /* state of WalkTreeOptions::filter after "path/" */
+};
+
+struct WalkTreeWorkQueue {
+    std::mutex mutex;
+    std::deque<WalkTreeTask> tasks;
+};
+
+/* shared state of a WalkTree() invocation */
+struct WalkTreeState {
+    std::unique_ptr<WalkTreeWorkQueue[]> queues;
+    int threads = 1;
+    std::atomic<uint64_t> pendingTasks { 0 }; /* directories queued or being read */
+    std::atomic<int> idleWorkers { 0 };
+    std::mutex idleMutex;
+    std::condition_variable idleCondition;
+    /* (device, unique id) of the directories entered, only tracked when links are followed */
+    std::mutex visitedMutex;
+    std::set<std::pair<uint64_t, uint64_t>> visitedDirectories;
+};
+
+const int WALK_TREE_SPIN_BEFORE_PARK = 16;
+const int WALK_TREE_PARK_MILLISECONDS = 1;
+}
+
+/**
+* stat the entry into statResult, the StatResult of the worker, on LINUX its path is reassigned in place
+* so that no allocation happens once the storage is as long as the deepest path
+*/
+static bool WalkTreeStat(
+    const OpenDirEntry& entry, const PathBuffer& path, bool followSymlink, std::optional<StatResult>& statResult)
+{
+#ifdef __linux__
+    FSUTIL_METRICS_SCOPE(Stat);
+    FSUTIL_METRICS_SYSCALLS(Stat, 1);
+    struct stat statbuff {};
+    int flags = followSymlink ? 0 : AT_SYMLINK_NOFOLLOW;
+    if (::fstatat(entry.DirFd(), entry.NameView().data(), &statbuff, flags) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    if (statResult) {
+        statResult->Assign(path.View(), statbuff);
+    } else {
+        statResult.emplace(std::string(path.View()), statbuff);
+    }
+    return true;
+#endif
+#ifdef _WIN32
+    /* StatW() opens the reparse point itself rather than the target, links are followed by the walker */
+    static_cast<void>(entry);
+    static_cast<void>(followSymlink);
+    statResult = Stat(std::string(path.View()));
+    return statResult.has_value();
+#endif
+}
+
+static bool IsWalkableDirectory(
+    const OpenDirEntry& entry, const std::optional<StatResult>& statResult, bool followSymlink)
+{
+#ifdef __linux__
+    if (statResult) {
+        return statResult->IsDirectory();
+    }
+    /* d_type of a symbolic link is DT_LNK, the target is only stat'ed if links are followed */
+    if (followSymlink && entry.IsSymLink()) {
+        struct stat statbuff {};
+        return ::fstatat(entry.DirFd(), entry.NameView().data(), &statbuff, 0) == 0 && S_ISDIR(statbuff.st_mode);
+    }
+    return entry.IsDirectory();
+#endif
+#ifdef _WIN32
+    bool isDirectory = statResult ? statResult->IsDirectory() : entry.IsDirectory();
+    bool isReparsePoint = statResult ? statResult->IsReparsePoint() : entry.IsReparsePoint();
+    return isDirectory && (followSymlink || !isReparsePoint);
+#endif
+}
+
+/**
+* (device, unique id) of the directory at path, symbolic links and junctions are followed,
+* relative to the directory of entry on LINUX unless it's nullptr
+*/
+static std::optional<std::pair<uint64_t, uint64_t>> FollowedDirectoryId(
+    const OpenDirEntry* entry, std::string_view path)
+{
+#ifdef __linux__
+    struct stat statbuff {};
+    int result = entry != nullptr ? ::fstatat(entry->DirFd(), entry->NameView().data(), &statbuff, 0) :
+        ::stat(std::string(path).c_str(), &statbuff);
+    if (result < 0) {
+        return std::nullopt;
+    }
+    return std::make_pair(static_cast<uint64_t>(statbuff.st_dev), static_cast<uint64_t>(statbuff.st_ino));
+#endif
+#ifdef _WIN32
+    HANDLE hFile = ::CreateFileW(
+        ConvertWin32UnicodePath(Utf8ToUtf16(std::string(path))).c_str(),
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        0);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    BY_HANDLE_FILE_INFORMATION handleFileInformation {};
+    BOOL success = ::GetFileInformationByHandle(hFile, &handleFileInformation);
+    ::CloseHandle(hFile);
+    if (success == 0) {
+        return std::nullopt;
+    }
+    return std::make_pair(static_cast<uint64_t>(handleFileInformation.dwVolumeSerialNumber),
+        CombineDWORD(handleFileInformation.nFileIndexLow, handleFileInformation.nFileIndexHigh));
+#endif
+}
+
+/**
+* true the first time a directory is reached, like find -L and du -L a followed link can lead back to an
+* ancestor (a cycle) or into a subtree already walked, those are skipped
+*/
+static bool MarkDirectoryVisited(WalkTreeState& state, const std::optional<std::pair<uint64_t, uint64_t>>& id)
+{
+    if (!id) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(state.visitedMutex);
+    return state.visitedDirectories.insert(id.value()).second;
+}
+
+/* pop from the back of the local deque (depth first), otherwise steal from the front of the others */
+static std::optional<WalkTreeTask> PopWalkTreeTask(WalkTreeState& state, int workerIndex)
+{
+    {
+        WalkTreeWorkQueue& local = state.queues[workerIndex];
+        std::lock_guard<std::mutex> lock(local.mutex);
+        if (!local.tasks.empty()) {
+            WalkTreeTask task = std::move(local.tasks.back());
+            local.tasks.pop_back();
+            return task;
+        }
+    }
+    for (int i = 1; i < state.threads; ++i) {
+        WalkTreeWorkQueue& victim = state.queues[(workerIndex + i) % state.threads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            WalkTreeTask task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return task;
+        }
+    }
+    return std::nullopt;
+}
+
+/* path and statStorage are the buffers of the worker, only directories pushed as new tasks allocate */
+static void WalkTreeDirectory(
+    const WalkTreeTask& task,
+    const WalkTreeOptions& options,
+    const WalkTreeVisitor& visitor,
+    WalkTreeState& state,
+    int workerIndex,
+    PathBuffer& path,
+    std::optional<StatResult>& statStorage)
+{
+    static const std::optional<StatResult> NO_STAT_RESULT;
+    std::optional<OpenDirEntry> openDirEntry = OpenDir(task.path);
+    if (!openDirEntry) {
+        return;
+    }
+    WalkTreeContext context { task.depth + 1, workerIndex, task.path };
+    bool descend = options.maxDepth < 0 || context.depth < options.maxDepth;
+    path.Assign(task.path);
+    do {
+        std::string_view name = openDirEntry->NameView();
+        if (name == "." || name == "..") {
+            continue;
+        }
+        PathFilter::State filterState = options.filter.Next(task.filterState, name);
+        path.Push(name);
+        const std::optional<StatResult>* statResult = &NO_STAT_RESULT;
+        bool statDone = false;
+        if (!options.filter.Dead(filterState)) {
+            /* the type only matters if a directory rule decides differently than the others */
+            bool isDirectory = false;
+            if (options.filter.DependsOnType(filterState) && options.statEntries) {
+                if (WalkTreeStat(openDirEntry.value(), path, options.followSymlink, statStorage)) {
+                    statResult = &statStorage;
+                }
+                statDone = true;
+                isDirectory = *statResult ? (*statResult)->IsDirectory() : openDirEntry->IsDirectory();
+            } else if (options.filter.DependsOnType(filterState)) {
+                isDirectory = openDirEntry->IsDirectory();
+            }
+            if (options.filter.Excluded(filterState, isDirectory)) {
+                path.Pop();
+                continue;
+            }
+        }
+        if (options.statEntries && !statDone &&
+            WalkTreeStat(openDirEntry.value(), path, options.followSymlink, statStorage)) {
+            statResult = &statStorage;
+        }
+        if (visitor(openDirEntry.value(), *statResult, context) &&
+            descend && IsWalkableDirectory(openDirEntry.value(), *statResult, options.followSymlink) &&
+            (!options.followSymlink ||
+                MarkDirectoryVisited(state, FollowedDirectoryId(&openDirEntry.value(), path.View())))) {
+            /* count the subtree before the parent is finished, so pending never drops to zero too early */
+            state.pendingTasks.fetch_add(1);
+            {
+                WalkTreeWorkQueue& local = state.queues[workerIndex];
+                std::lock_guard<std::mutex> lock(local.mutex);
+                local.tasks.push_back(
+                    WalkTreeTask { std::string(path.View()), context.depth, options.filter.Enter(filterState) });
+            }
+            if (state.idleWorkers.load() > 0) {
+                state.idleCondition.notify_one();
+            }
+        }
+        path.Pop();
+    } while (openDirEntry->Next());
+}
+
+bool WalkTree(const std::string& root, const WalkTreeOptions& options, const WalkTreeVisitor& visitor)
+{
+    if (!IsDirectory(root)) {
+        return false;
+    }
+    WalkTreeState state;
+    state.threads = options.threads > 0 ?
+        options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    state.queues.reset(new WalkTreeWorkQueue[state.threads]);
+    state.pendingTasks.store(1);
+    state.queues[0].tasks.push_back(WalkTreeTask { root, 0, options.filter.Root() });
+    if (options.followSymlink) {
+        MarkDirectoryVisited(state, FollowedDirectoryId(nullptr, root));
+    }
+
+    auto worker = [&](int workerIndex) {
+        int idleRounds = 0;
+        PathBuffer path;
+        std::optional<StatResult> statStorage;
+        while (state.pendingTasks.load() != 0) {
+            std::optional<WalkTreeTask> task = PopWalkTreeTask(state, workerIndex);
+            if (!task) {
+                if (++idleRounds < WALK_TREE_SPIN_BEFORE_PARK) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                /* park until a subtree is published, the timeout covers a missed notification */
+                state.idleWorkers.fetch_add(1);
+                {
+                    std::unique_lock<std::mutex> lock(state.idleMutex);
+                    state.idleCondition.wait_for(lock, std::chrono::milliseconds(WALK_TREE_PARK_MILLISECONDS));
+                }
+                state.idleWorkers.fetch_sub(1);
+                continue;
+            }
+            idleRounds = 0;
+            WalkTreeDirectory(task.value(), options, visitor, state, workerIndex, path, statStorage);
+            if (state.pendingTasks.fetch_sub(1) == 1) {
+                state.idleCondition.notify_all(); /* walk completed */
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int workerIndex = 1; workerIndex < state.threads; ++workerIndex) {
+        workers.emplace_back(worker, workerIndex);
+    }
+    worker(0);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+    return true;
+}
+
+
+namespace {
+const char TREE_SNAPSHOT_MAGIC[8] = { 'F', 'S', 'U', 'S', 'N', 'A', 'P', '\0' };
+
+/* sections follow the header in the order of their offsets, every section is 8 bytes aligned */
+struct TreeSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t restartInterval;
+    uint64_t count;
+    uint64_t recordsOffset;
+    uint64_t restartsOffset;
+    uint64_t namesOffset;
+    uint64_t namesLength;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(TreeSnapshotHeader) == 64, "snapshot header must be 64 bytes");
+static_assert(sizeof(TreeSnapshotRecord) == 56, "snapshot record must be 56 bytes");
+}
+
+static void AppendVarint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool ReadVarint(const char*& pos, const char* end, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* decode one "<shared length><suffix length><suffix>" entry, path keeps the prefix of the previous one */
+static bool DecodeSnapshotPath(const char*& pos, const char* end, std::string& path)
+{
+    uint64_t shared = 0;
+    uint64_t suffixLength = 0;
+    /* the shared prefix can't be longer than the previous path, a restart entry shares nothing */
+    if (!ReadVarint(pos, end, shared) || !ReadVarint(pos, end, suffixLength) ||
+        shared > path.size() || suffixLength > static_cast<uint64_t>(end - pos)) {
+        return false;
+    }
+    path.resize(shared);
+    path.append(pos, suffixLength);
+    pos += suffixLength;
+    return true;
+}
+
+TreeSnapshotRecord MakeTreeSnapshotRecord(const StatResult& statResult)
+{
+    TreeSnapshotRecord record {};
+    record.uniqueId = statResult.UniqueID();
+    record.deviceId = statResult.DeviceID();
+    record.size = statResult.Size();
+    record.accessTimeNano = statResult.AccessTimeNano();
+    record.modifyTimeNano = statResult.ModifyTimeNano();
+    record.creationTimeNano = statResult.CreationTimeNano();
+#ifdef __linux__
+    record.mode = static_cast<uint32_t>(statResult.Mode());
+#endif
+#ifdef _WIN32
+    record.mode = static_cast<uint32_t>(statResult.Attribute());
+#endif
+    record.linksCount = static_cast<uint32_t>(statResult.LinksCount());
+    return record;
+}
+
+void TreeSnapshotWriter::Add(std::string path, const TreeSnapshotRecord& record)
+{
+    m_entries.emplace_back(std::move(path), record);
+}
+
+size_t TreeSnapshotWriter::Size() const { return m_entries.size(); }
+
+/* flush a written and closed file to the disk, so a rename can't expose it before its content */
+static bool SyncFile(const std::string& path)
+{
+#ifdef _WIN32
+    HANDLE hFile = ::CreateFileW(ConvertWin32UnicodePath(Utf8ToUtf16(path)).c_str(), GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool success = ::FlushFileBuffers(hFile) != 0;
+    ::CloseHandle(hFile);
+    return success;
+#endif
+#ifdef __linux__
+    ScopedFd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    return fd.Get() >= 0 && ::fsync(fd.Get()) == 0;
+#endif
+}
+
+static void RemoveFile(const std::string& path)
+{
+#ifdef _WIN32
+    ::DeleteFileW(ConvertWin32UnicodePath(Utf8ToUtf16(path)).c_str());
+#endif
+#ifdef __linux__
+    ::unlink(path.c_str());
+#endif
+}
+
+bool TreeSnapshotWriter::Write(const std::string& snapshotPath)
+{
+    std::sort(m_entries.begin(), m_entries.end(),
+        [](const std::pair<std::string, TreeSnapshotRecord>& lhs, const std::pair<std::string, TreeSnapshotRecord>& rhs) {
+            return lhs.first < rhs.first;
+        });
+    std::string names;
+    std::vector<uint64_t> restarts;
+    restarts.reserve(m_entries.size() / TREE_SNAPSHOT_RESTART_INTERVAL + 1);
+    for (size_t index = 0; index < m_entries.size(); ++index) {
+        const std::string& path = m_entries[index].first;
+        size_t shared = 0;
+        if (index % TREE_SNAPSHOT_RESTART_INTERVAL == 0) {
+            restarts.push_back(names.size());
+        } else {
+            const std::string& previous = m_entries[index - 1].first;
+            size_t limit = std::min(previous.size(), path.size());
+            while (shared < limit && previous[shared] == path[shared]) {
+                ++shared;
+            }
+        }
+        AppendVarint(names, shared);
+        AppendVarint(names, path.size() - shared);
+        names.append(path, shared, std::string::npos);
+    }
+
+    TreeSnapshotHeader header {};
+    std::copy(std::begin(TREE_SNAPSHOT_MAGIC), std::end(TREE_SNAPSHOT_MAGIC), header.magic);
+    header.version = TREE_SNAPSHOT_VERSION;
+    header.restartInterval = TREE_SNAPSHOT_RESTART_INTERVAL;
+    header.count = m_entries.size();
+    header.recordsOffset = sizeof(TreeSnapshotHeader);
+    header.restartsOffset = header.recordsOffset + header.count * sizeof(TreeSnapshotRecord);
+    header.namesOffset = header.restartsOffset + restarts.size() * sizeof(uint64_t);
+    header.namesLength = names.size();
+
+    /**
+    * write aside, sync and rename, so neither a crash nor a power loss leaves a truncated snapshot at snapshotPath,
+    * the directory is synced too for the rename itself to be durable
+    */
+    std::string tmpPath = snapshotPath + ".tmp";
+#ifdef _WIN32
+    std::ofstream out(Utf8ToUtf16(tmpPath), std::ios::binary | std::ios::trunc);
+#endif
+#ifdef __linux__
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+#endif
+    if (!out) {
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const std::pair<std::string, TreeSnapshotRecord>& entry : m_entries) {
+        out.write(reinterpret_cast<const char*>(&entry.second), sizeof(TreeSnapshotRecord));
+    }
+    out.write(reinterpret_cast<const char*>(restarts.data()), restarts.size() * sizeof(uint64_t));
+    out.write(names.data(), names.size());
+    out.close();
+    if (!out || !SyncFile(tmpPath)) {
+        RemoveFile(tmpPath);
+        return false;
+    }
+#ifdef _WIN32
+    if (!::MoveFileExW(Utf8ToUtf16(tmpPath).c_str(), Utf8ToUtf16(snapshotPath).c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        RemoveFile(tmpPath);
+        return false;
+    }
+    return true;
+#endif
+#ifdef __linux__
+    if (::rename(tmpPath.c_str(), snapshotPath.c_str()) != 0) {
+        RemoveFile(tmpPath);
+        return false;
+    }
+    std::string directoryPath = ParentDirectoryPath(snapshotPath);
+    if (directoryPath.empty()) {
+        directoryPath = "/";
+    }
+    ScopedFd directory(::open(directoryPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    return directory.Get() >= 0 && ::fsync(directory.Get()) == 0;
+#endif
+}
+
+TreeSnapshot::TreeSnapshot(const char* base, uint64_t length) : m_base(base), m_length(length)
+{
+    const TreeSnapshotHeader* header = reinterpret_cast<const TreeSnapshotHeader*>(m_base);
+    m_count = header->count;
+    m_records = reinterpret_cast<const TreeSnapshotRecord*>(m_base + header->recordsOffset);
+    m_restarts = reinterpret_cast<const uint64_t*>(m_base + header->restartsOffset);
+    m_names = m_base + header->namesOffset;
+    m_namesLength = header->namesLength;
+}
+
+TreeSnapshot::TreeSnapshot(TreeSnapshot&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+TreeSnapshot& TreeSnapshot::operator = (TreeSnapshot&& other) noexcept
+{
+    if (this != &other) {
+        Close();
+        m_base = other.m_base;
+        m_length = other.m_length;
+        m_count = other.m_count;
+        m_records = other.m_records;
+        m_restarts = other.m_restarts;
+        m_names = other.m_names;
+        m_namesLength = other.m_namesLength;
+        other.m_base = nullptr;
+        other.m_length = 0;
+        other.m_count = 0;
+    }
+    return *this;
+}
+
+TreeSnapshot::~TreeSnapshot()
+{
+    Close();
+}
+
+uint64_t TreeSnapshot::Size() const { return m_count; }
+
+const TreeSnapshotRecord& TreeSnapshot::Record(uint64_t index) const { return m_records[index]; }
+
+std::string TreeSnapshot::Path(uint64_t index) const
+{
+    std::string path;
+    if (index >= m_count) {
+        return path;
+    }
+    const char* pos = m_names + m_restarts[index / TREE_SNAPSHOT_RESTART_INTERVAL];
+    const char* end = m_names + m_namesLength;
+    for (uint64_t i = index - index % TREE_SNAPSHOT_RESTART_INTERVAL; i <= index; ++i) {
+        if (!DecodeSnapshotPath(pos, end, path)) {
+            return std::string();
+        }
+    }
+    return path;
+}
+
+/* paths at restart points share no prefix, so they are viewed in place */
+std::string_view TreeSnapshot::RestartPath(uint64_t block) const
+{
+    const char* pos = m_names + m_restarts[block];
+    const char* end = m_names + m_namesLength;
+    uint64_t shared = 0;
+    uint64_t length = 0;
+    if (!ReadVarint(pos, end, shared) || !ReadVarint(pos, end, length) ||
+        shared != 0 || length > static_cast<uint64_t>(end - pos)) {
+        return std::string_view();
+    }
+    return std::string_view(pos, length);
+}
+
+uint64_t TreeSnapshot::LowerBound(std::string_view path) const
+{
+    uint64_t blocks = (m_count + TREE_SNAPSHOT_RESTART_INTERVAL - 1) / TREE_SNAPSHOT_RESTART_INTERVAL;
+    /* find the last block starting with a path not greater than the target */
+    uint64_t low = 0;
+    uint64_t high = blocks;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (RestartPath(mid) <= path) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return 0;
+    }
+    uint64_t result = std::min(low * TREE_SNAPSHOT_RESTART_INTERVAL, m_count);
+    uint64_t blockEnd = result;
+    Scan((low - 1) * TREE_SNAPSHOT_RESTART_INTERVAL,
+        [&](uint64_t index, std::string_view entryPath, const TreeSnapshotRecord&) {
+            if (index >= blockEnd) {
+                return false;
+            }
+            if (entryPath >= path) {
+                result = index;
+                return false;
+            }
+            return true;
+        });
+    return result;
+}
+
+std::optional<uint64_t> TreeSnapshot::Find(std::string_view path) const
+{
+    uint64_t index = LowerBound(path);
+    if (index < m_count && Path(index) == path) {
+        return index;
+    }
+    return std::nullopt;
+}
+
+bool TreeSnapshot::Scan(uint64_t startIndex, const std::function<bool(
+    uint64_t index, std::string_view path, const TreeSnapshotRecord& record)>& visitor) const
+{
+    TreeSnapshotCursor cursor(*this, startIndex);
+    for (; cursor.Valid(); cursor.Next()) {
+        if (!visitor(cursor.Index(), cursor.Path(), cursor.Record())) {
+            return true;
+        }
+    }
+    return !cursor.Corrupted();
+}
+
+void TreeSnapshot::Close()
+{
+    if (m_base == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    ::UnmapViewOfFile(m_base);
+#endif
+#ifdef __linux__
+    ::munmap(const_cast<char*>(m_base), m_length);
+#endif
+    m_base = nullptr;
+    m_length = 0;
+    m_count = 0;
+}
+
+TreeSnapshotCursor::TreeSnapshotCursor(const TreeSnapshot& snapshot, uint64_t startIndex) : m_snapshot(&snapshot)
+{
+    if (startIndex >= snapshot.m_count) {
+        m_index = snapshot.m_count;
+        return;
+    }
+    /* decode from the restart point of the block containing startIndex */
+    m_index = startIndex - startIndex % TREE_SNAPSHOT_RESTART_INTERVAL;
+    m_pos = snapshot.m_names + snapshot.m_restarts[startIndex / TREE_SNAPSHOT_RESTART_INTERVAL];
+    m_corrupted = !DecodeSnapshotPath(m_pos, snapshot.m_names + snapshot.m_namesLength, m_path);
+    while (m_index < startIndex && Next()) {}
+}
+
+bool TreeSnapshotCursor::Valid() const { return !m_corrupted && m_index < m_snapshot->m_count; }
+
+bool TreeSnapshotCursor::Corrupted() const { return m_corrupted; }
+
+uint64_t TreeSnapshotCursor::Index() const { return m_index; }
+
+std::string_view TreeSnapshotCursor::Path() const { return m_path; }
+
+const TreeSnapshotRecord& TreeSnapshotCursor::Record() const { return m_snapshot->m_records[m_index]; }
+
+bool TreeSnapshotCursor::Next()
+{
+    if (!Valid() || ++m_index >= m_snapshot->m_count) {
+        return false;
+    }
+    m_corrupted = !DecodeSnapshotPath(m_pos, m_snapshot->m_names + m_snapshot->m_namesLength, m_path);
+    return !m_corrupted;
+}
+
+/**
+* check the header and the restart table against the mapped length, so that lookups and cursors never
+* index past the mapping, the entries themselves are bounds checked by DecodeSnapshotPath()
+*/
+static bool ValidateTreeSnapshot(const char* base, uint64_t length)
+{
+    if (length < sizeof(TreeSnapshotHeader)) {
+        return false;
+    }
+    const TreeSnapshotHeader* header = reinterpret_cast<const TreeSnapshotHeader*>(base);
+    uint64_t blocks = (header->count + TREE_SNAPSHOT_RESTART_INTERVAL - 1) / TREE_SNAPSHOT_RESTART_INTERVAL;
+    bool headerValid = std::equal(std::begin(TREE_SNAPSHOT_MAGIC), std::end(TREE_SNAPSHOT_MAGIC), header->magic) &&
+        header->version == TREE_SNAPSHOT_VERSION &&
+        header->restartInterval == TREE_SNAPSHOT_RESTART_INTERVAL &&
+        header->count <= length / sizeof(TreeSnapshotRecord) &&
+        header->recordsOffset == sizeof(TreeSnapshotHeader) &&
+        header->restartsOffset == header->recordsOffset + header->count * sizeof(TreeSnapshotRecord) &&
+        header->namesOffset == header->restartsOffset + blocks * sizeof(uint64_t) &&
+        header->namesOffset <= length &&
+        header->namesLength <= length - header->namesOffset;
+    if (!headerValid) {
+        return false;
+    }
+    /* every restart points to an entry inside the names section, in increasing order */
+    const uint64_t* restarts = reinterpret_cast<const uint64_t*>(base + header->restartsOffset);
+    for (uint64_t block = 0; block < blocks; ++block) {
+        if (restarts[block] >= header->namesLength || (block > 0 && restarts[block] <= restarts[block - 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::optional<TreeSnapshot> OpenTreeSnapshot(const std::string& snapshotPath)
+{
+#ifdef _WIN32
+    HANDLE hFile = ::CreateFileW(Utf8ToUtf16(snapshotPath).c_str(), GENERIC_READ, FILE_SHARE_READ,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    LARGE_INTEGER fileSize {};
+    if (!::GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(TreeSnapshotHeader))) {
+        ::CloseHandle(hFile);
+        return std::nullopt;
+    }
+    /* the view keeps the mapping object alive after both handles are closed */
+    HANDLE hMapping = ::CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    ::CloseHandle(hFile);
+    if (hMapping == nullptr) {
+        return std::nullopt;
+    }
+    const char* base = static_cast<const char*>(::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+    ::CloseHandle(hMapping);
+    if (base == nullptr) {
+        return std::nullopt;
+    }
+    uint64_t length = static_cast<uint64_t>(fileSize.QuadPart);
+    if (!ValidateTreeSnapshot(base, length)) {
+        ::UnmapViewOfFile(base);
+        return std::nullopt;
+    }
+    return std::make_optional<TreeSnapshot>(base, length);
+#endif
+#ifdef __linux__
+    ScopedFd fd(::open(snapshotPath.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat statbuff {};
+    if (fd.Get() < 0 || ::fstat(fd.Get(), &statbuff) < 0 ||
+        statbuff.st_size < static_cast<off_t>(sizeof(TreeSnapshotHeader))) {
+        return std::nullopt;
+    }
+    uint64_t length = static_cast<uint64_t>(statbuff.st_size);
+    void* base = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd.Get(), 0);
+    if (base == MAP_FAILED) {
+        return std::nullopt;
+    }
+    if (!ValidateTreeSnapshot(static_cast<const char*>(base), length)) {
+        ::munmap(base, length);
+        return std::nullopt;
+    }
+    return std::make_optional<TreeSnapshot>(static_cast<const char*>(base), length);
+#endif
+}
+
+bool CaptureTreeSnapshot(const std::string& root, const std::string& snapshotPath, const WalkTreeOptions& options)
+{
+    WalkTreeOptions walkOptions = options;
+    walkOptions.statEntries = true;
+    walkOptions.threads = options.threads > 0 ?
+        options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+#ifdef _WIN32
+    const char separator = '\\';
+#endif
+#ifdef __linux__
+    const char separator = '/';
+#endif
+    size_t prefixLength = root.size();
+    if (!root.empty() && root.back() != separator) {
+        ++prefixLength;
+    }
+    std::vector<std::vector<std::pair<std::string, TreeSnapshotRecord>>> workerEntries(walkOptions.threads);
+    bool walked = WalkTree(root, walkOptions,
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext& context) {
+            if (statResult) {
+                std::string path = entry.FullPath().substr(prefixLength);
+#ifdef _WIN32
+                std::replace(path.begin(), path.end(), '\\', '/');
+#endif
+                workerEntries[context.workerIndex].emplace_back(std::move(path), MakeTreeSnapshotRecord(*statResult));
+            }
+            return true;
+        });
+    if (!walked) {
+        return false;
+    }
+    TreeSnapshotWriter writer;
+    for (std::vector<std::pair<std::string, TreeSnapshotRecord>>& entries : workerEntries) {
+        for (std::pair<std::string, TreeSnapshotRecord>& entry : entries) {
+            writer.Add(std::move(entry.first), entry.second);
+        }
+        entries.clear();
+        entries.shrink_to_fit();
+    }
+    return writer.Write(snapshotPath);
+}
+
+namespace {
+/* side of a rename candidate, Removed ones sort first within the same inode */
+const uint64_t TREE_DIFF_SIDE_OLD = 0;
+const uint64_t TREE_DIFF_SIDE_NEW = 1;
+const size_t TREE_DIFF_RUN_READ_BUFFER = 64 * 1024;
+
+struct TreeDiffCandidate {
+    uint64_t deviceId;
+    uint64_t uniqueId;
+    uint64_t side;
+    uint64_t index; /* index of the entry in the snapshot of its side */
+
+    bool operator < (const TreeDiffCandidate& other) const
+    {
+        if (deviceId != other.deviceId) {
+            return deviceId < other.deviceId;
+        }
+        if (uniqueId != other.uniqueId) {
+            return uniqueId < other.uniqueId;
+        }
+        if (side != other.side) {
+            return side < other.side;
+        }
+        return index < other.index;
+    }
+
+    bool SameInode(const TreeDiffCandidate& other) const
+    {
+        return deviceId == other.deviceId && uniqueId == other.uniqueId;
+    }
+};
+
+struct TreeDiffRunReader {
+    std::ifstream stream;
+    std::vector<TreeDiffCandidate> buffer;
+    size_t position = 0;
+    bool failed = false;
+
+    bool Next(TreeDiffCandidate& candidate)
+    {
+        if (position == buffer.size()) {
+            buffer.resize(TREE_DIFF_RUN_READ_BUFFER / sizeof(TreeDiffCandidate));
+            stream.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(TreeDiffCandidate));
+            failed = stream.bad();
+            buffer.resize(static_cast<size_t>(stream.gcount()) / sizeof(TreeDiffCandidate));
+            position = 0;
+            if (buffer.empty()) {
+                return false;
+            }
+        }
+        candidate = buffer[position++];
+        return true;
+    }
+};
+
+/* sort candidates in runs of bounded size, spill full runs to temporary files and merge them back */
+class TreeDiffCandidateSorter {
+public:
+    TreeDiffCandidateSorter(uint64_t memoryLimit, const std::string& tempDir);
+    ~TreeDiffCandidateSorter();
+    bool Add(const TreeDiffCandidate& candidate);
+    /* visit the candidates in order, return false if a run failed to be written/read */
+    bool Merge(const std::function<bool(const TreeDiffCandidate&)>& visitor);
+
+private:
+    bool Spill();
+
+    size_t m_capacity;
+    std::string m_tempDir;
+    std::vector<TreeDiffCandidate> m_buffer;
+    std::vector<std::string> m_runPaths;
+};
+}
+
+static std::string DefaultTempDirectory()
+{
+#ifdef _WIN32
+    WCHAR wTempPath[MAX_PATH + 1] = L"";
+    DWORD length = ::GetTempPathW(MAX_PATH + 1, wTempPath);
+    if (length == 0 || length > MAX_PATH) {
+        return ".";
+    }
+    return Utf16ToUtf8(std::wstring(wTempPath, length));
+#endif
+#ifdef __linux__
+    const char* tempDir = ::getenv("TMPDIR");
+    return (tempDir != nullptr && tempDir[0] != '\0') ? std::string(tempDir) : std::string("/tmp");
+#endif
+}
+
+TreeDiffCandidateSorter::TreeDiffCandidateSorter(uint64_t memoryLimit, const std::string& tempDir)
+    : m_capacity(static_cast<size_t>(std::max<uint64_t>(1, memoryLimit / sizeof(TreeDiffCandidate)))),
+    m_tempDir(tempDir.empty() ? DefaultTempDirectory() : tempDir)
+{}
+
+TreeDiffCandidateSorter::~TreeDiffCandidateSorter()
+{
+    for (const std::string& runPath : m_runPaths) {
+#ifdef _WIN32
+        ::DeleteFileW(Utf8ToUtf16(runPath).c_str());
+#endif
+#ifdef __linux__
+        ::unlink(runPath.c_str());
+#endif
+    }
+}
+
+bool TreeDiffCandidateSorter::Add(const TreeDiffCandidate& candidate)
+{
+    if (m_buffer.size() >= m_capacity && !Spill()) {
+        return false;
+    }
+    m_buffer.push_back(candidate);
+    return true;
+}
+
+bool TreeDiffCandidateSorter::Spill()
+{
+    std::sort(m_buffer.begin(), m_buffer.end());
+    const char* data = reinterpret_cast<const char*>(m_buffer.data());
+    uint64_t length = m_buffer.size() * sizeof(TreeDiffCandidate);
+    bool success = true;
+#ifdef _WIN32
+    /* CREATE_NEW fails on any existing name, a file or link planted in the shared directory is never opened */
+    static std::atomic<uint64_t> runSequence { 0 };
+    std::string prefix = m_tempDir;
+    if (!prefix.empty() && prefix.back() != '\\' && prefix.back() != '/') {
+        prefix += "\\";
+    }
+    prefix += "fsutil_diff_" + std::to_string(::GetCurrentProcessId()) + "_";
+    const int RUN_CREATE_ATTEMPTS = 16;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    std::string runPath;
+    for (int attempt = 0; attempt < RUN_CREATE_ATTEMPTS && hFile == INVALID_HANDLE_VALUE; ++attempt) {
+        runPath = prefix + std::to_string(runSequence.fetch_add(1)) + ".run";
+        hFile = ::CreateFileW(Utf8ToUtf16(runPath).c_str(), GENERIC_WRITE, 0, nullptr,
+            CREATE_NEW, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE && ::GetLastError() != ERROR_FILE_EXISTS) {
+            break;
+        }
+    }
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    m_runPaths.push_back(runPath);
+    while (success && length > 0) {
+        DWORD written = 0;
+        DWORD chunk = static_cast<DWORD>(std::min<uint64_t>(length, 1024 * 1024 * 1024));
+        success = ::WriteFile(hFile, data, chunk, &written, nullptr) && written > 0;
+        data += written;
+        length -= written;
+    }
+    ::CloseHandle(hFile);
+#endif
+#ifdef __linux__
+    /* mkostemp() creates the run with O_EXCL and mode 0600 under an unpredictable name, links are never followed */
+    std::string runPath = m_tempDir;
+    if (!runPath.empty() && runPath.back() != '/') {
+        runPath += "/";
+    }
+    runPath += "fsutil_diff_XXXXXX";
+    ScopedFd fd(::mkostemp(&runPath[0], O_CLOEXEC));
+    if (fd.Get() < 0) {
+        return false;
+    }
+    m_runPaths.push_back(runPath);
+    while (length > 0) {
+        ssize_t written = ::write(fd.Get(), data, static_cast<size_t>(length));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            success = false;
+            break;
+        }
+        data += written;
+        length -= static_cast<uint64_t>(written);
+    }
+#endif
+    m_buffer.clear();
+    return success;
+}
+
+bool TreeDiffCandidateSorter::Merge(const std::function<bool(const TreeDiffCandidate&)>& visitor)
+{
+    if (m_runPaths.empty()) {
+        std::sort(m_buffer.begin(), m_buffer.end());
+        for (const TreeDiffCandidate& candidate : m_buffer) {
+            if (!visitor(candidate)) {
+                break;
+            }
+        }
+        return true;
+    }
+    if (!m_buffer.empty() && !Spill()) {
+        return false;
+    }
+    m_buffer.shrink_to_fit();
+    std::vector<TreeDiffRunReader> readers(m_runPaths.size());
+    /* min-heap of the head candidate of every run */
+    using HeapItem = std::pair<TreeDiffCandidate, size_t>;
+    auto greater = [](const HeapItem& lhs, const HeapItem& rhs) { return rhs.first < lhs.first; };
+    std::vector<HeapItem> heap;
+    for (size_t run = 0; run < readers.size(); ++run) {
+#ifdef _WIN32
+        readers[run].stream.open(Utf8ToUtf16(m_runPaths[run]), std::ios::binary);
+#endif
+#ifdef __linux__
+        readers[run].stream.open(m_runPaths[run], std::ios::binary);
+#endif
+        TreeDiffCandidate candidate {};
+        if (!readers[run].stream) {
+            return false;
+        }
+        if (readers[run].Next(candidate)) {
+            heap.emplace_back(candidate, run);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), greater);
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        HeapItem item = heap.back();
+        heap.pop_back();
+        if (!visitor(item.first)) {
+            return true;
+        }
+        TreeDiffCandidate candidate {};
+        if (readers[item.second].Next(candidate)) {
+            heap.emplace_back(candidate, item.second);
+            std::push_heap(heap.begin(), heap.end(), greater);
+        }
+    }
+    for (const TreeDiffRunReader& reader : readers) {
+        if (reader.failed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool IsTreeSnapshotRecordModified(const TreeSnapshotRecord& oldRecord, const TreeSnapshotRecord& newRecord)
+{
+    return oldRecord.uniqueId != newRecord.uniqueId ||
+        oldRecord.size != newRecord.size ||
+        oldRecord.modifyTimeNano != newRecord.modifyTimeNano ||
+        oldRecord.mode != newRecord.mode;
+}
+
+/* pair the Removed/Added candidates of one inode in order, the rest stay Removed/Added */
+static bool EmitTreeDiffInodeGroup(
+    const TreeSnapshot& oldSnapshot,
+    const TreeSnapshot& newSnapshot,
+    const std::vector<TreeDiffCandidate>& group,
+    const TreeDiffVisitor& visitor)
+{
+    size_t removed = 0;
+    while (removed < group.size() && group[removed].side == TREE_DIFF_SIDE_OLD) {
+        ++removed;
+    }
+    size_t added = group.size() - removed;
+    for (size_t i = 0; i < std::max(removed, added); ++i) {
+        std::string oldPath = i < removed ? oldSnapshot.Path(group[i].index) : std::string();
+        std::string newPath = i < added ? newSnapshot.Path(group[removed + i].index) : std::string();
+        TreeDiffEntry entry {};
+        if (i < removed && i < added) {
+            entry = TreeDiffEntry { TreeDiffType::Renamed, newPath, oldPath,
+                &oldSnapshot.Record(group[i].index), &newSnapshot.Record(group[removed + i].index) };
+        } else if (i < removed) {
+            entry = TreeDiffEntry { TreeDiffType::Removed, oldPath, std::string_view(),
+                &oldSnapshot.Record(group[i].index), nullptr };
+        } else {
+            entry = TreeDiffEntry { TreeDiffType::Added, newPath, std::string_view(),
+                nullptr, &newSnapshot.Record(group[removed + i].index) };
+        }
+        if (!visitor(entry)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DiffTreeSnapshot(
+    const TreeSnapshot& oldSnapshot,
+    const TreeSnapshot& newSnapshot,
+    const TreeDiffOptions& options,
+    const TreeDiffVisitor& visitor)
+{
+    TreeDiffCandidateSorter sorter(options.memoryLimit, options.tempDir);
+    TreeSnapshotCursor oldCursor(oldSnapshot);
+    TreeSnapshotCursor newCursor(newSnapshot);
+    while (oldCursor.Valid() || newCursor.Valid()) {
+        int order = !oldCursor.Valid() ? 1 : (!newCursor.Valid() ? -1 : oldCursor.Path().compare(newCursor.Path()));
+        TreeDiffEntry entry {};
+        bool emit = false;
+        if (order == 0) {
+            if (IsTreeSnapshotRecordModified(oldCursor.Record(), newCursor.Record())) {
+                entry = TreeDiffEntry { TreeDiffType::Modified, newCursor.Path(), std::string_view(),
+                    &oldCursor.Record(), &newCursor.Record() };
+                emit = true;
+            }
+        } else if (order < 0) {
+            const TreeSnapshotRecord& record = oldCursor.Record();
+            if (options.detectRename) {
+                if (!sorter.Add(TreeDiffCandidate {
+                    record.deviceId, record.uniqueId, TREE_DIFF_SIDE_OLD, oldCursor.Index() })) {
+                    return false;
+                }
+            } else {
+                entry = TreeDiffEntry { TreeDiffType::Removed, oldCursor.Path(), std::string_view(), &record, nullptr };
+                emit = true;
+            }
+        } else {
+            const TreeSnapshotRecord& record = newCursor.Record();
+            if (options.detectRename) {
+                if (!sorter.Add(TreeDiffCandidate {
+                    record.deviceId, record.uniqueId, TREE_DIFF_SIDE_NEW, newCursor.Index() })) {
+                    return false;
+                }
+            } else {
+                entry = TreeDiffEntry { TreeDiffType::Added, newCursor.Path(), std::string_view(), nullptr, &record };
+                emit = true;
+            }
+        }
+        if (emit && !visitor(entry)) {
+            return true;
+        }
+        if (order <= 0) {
+            oldCursor.Next();
+        }
+        if (order >= 0) {
+            newCursor.Next();
+        }
+    }
+    if (oldCursor.Corrupted() || newCursor.Corrupted()) {
+        return false;
+    }
+    if (!options.detectRename) {
+        return true;
+    }
+    std::vector<TreeDiffCandidate> group;
+    bool stopped = false;
+    bool merged = sorter.Merge([&](const TreeDiffCandidate& candidate) {
+        if (!group.empty() && !group.front().SameInode(candidate)) {
+            stopped = !EmitTreeDiffInodeGroup(oldSnapshot, newSnapshot, group, visitor);
+            group.clear();
+        }
+        group.push_back(candidate);
+        return !stopped;
+    });
+    if (!merged) {
+        return false;
+    }
+    if (!stopped && !group.empty()) {
+        EmitTreeDiffInodeGroup(oldSnapshot, newSnapshot, group, visitor);
+    }
+    return true;
+}
+
+
+SparseRangeResult QuerySparseAllocateRanges(const std::string& path)
+{
+    std::optional<StatResult> statResult = Stat(path);
+    /* check if is a file */
+    if (!statResult || statResult->IsDirectory()) {
+        return std::nullopt;
+    }
+#ifdef _WIN32
+    if (!statResult->IsSparseFile()) {
+        return std::nullopt;
+    }
+    return QuerySparseWin32AllocateRangesW(Utf8ToUtf16(path));
+#endif
+#ifdef __linux__
+    return QuerySparsePosixAllocateRanges(path);
+#endif
+}
+
+static bool IsZeroBufferScalar(const unsigned char* data, size_t length)
+{
+    size_t index = 0;
+    for (; index + sizeof(uint64_t) <= length; index += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + index, sizeof(word));
+        if (word != 0) {
+            return false;
+        }
+    }
+    for (; index < length; ++index) {
+        if (data[index] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef FSUTIL_HAVE_X86_SIMD
+/* 64 bytes per iteration, the loads are OR'ed so there is one compare per cache line */
+static bool IsZeroBufferSse2(const unsigned char* data, size_t length)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t index = 0;
+    for (; index + 64 <= length; index += 64) {
+        __m128i bits = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + index)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + index + 16))),
+            _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + index + 32)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + index + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return IsZeroBufferScalar(data + index, length - index);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+static bool IsZeroBufferAvx2(const unsigned char* data, size_t length)
+{
+    size_t index = 0;
+    for (; index + 128 <= length; index += 128) {
+        __m256i bits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + index)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + index + 32))),
+            _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + index + 64)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + index + 96))));
+        if (!_mm256_testz_si256(bits, bits)) {
+            return false;
+        }
+    }
+    return IsZeroBufferSse2(data + index, length - index);
+}
+
+static bool CpuSupportsAvx2()
+{
+#ifdef _MSC_VER
+    int info[4] {};
+    ::__cpuid(info, 1);
+    /* the OS must save the YMM registers on context switch */
+    if ((info[2] & (1 << 27)) == 0 || (::_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    ::__cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+namespace {
+struct ZeroScan {
+    bool (*scan)(const unsigned char* data, size_t length);
+    const char* name;
+};
+}
+
+/* picked once, the CPU doesn't change during the process lifetime */
+static const ZeroScan& SelectedZeroScan()
+{
+#ifdef FSUTIL_HAVE_X86_SIMD
+    static const ZeroScan selected = CpuSupportsAvx2() ?
+        ZeroScan { IsZeroBufferAvx2, "avx2" } : ZeroScan { IsZeroBufferSse2, "sse2" };
+#else
+    static const ZeroScan selected { IsZeroBufferScalar, "scalar" };
+#endif
+    return selected;
+}
+
+bool IsZeroBuffer(const void* data, size_t length)
+{
+    return SelectedZeroScan().scan(static_cast<const unsigned char*>(data), length);
+}
+
+const char* IsZeroBufferImplementation()
+{
+    return SelectedZeroScan().name;
+}
+
+bool CopySparseFile(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    SparseCopyStrategy strategy = SparseCopyStrategy::None;
+    return CopySparseFile(srcPath, dstPath, ranges, strategy);
+}
+
+bool CopySparseFile(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, SparseCopyStrategy& strategy)
+{
+    return CopySparseFile(srcPath, dstPath, ranges, SparseCopyOptions(), strategy);
+}
+
+bool CopySparseFile(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, const SparseCopyOptions& options,
+    SparseCopyStrategy& strategy)
+{
+    strategy = SparseCopyStrategy::None;
+    std::optional<StatResult> srcResult = Stat(srcPath);
+    std::optional<StatResult> dstResult = Stat(dstPath);
+    /* check if is a file */
+    if (!srcResult || dstResult || srcResult->IsDirectory()) {
+        return false;
+    }
+#ifdef _WIN32
+    if (!srcResult->IsSparseFile()) {
+        return false;
+    }
+    if (!CopySparseFileWin32W(Utf8ToUtf16(srcPath), Utf8ToUtf16(dstPath), ranges)) {
+        return false;
+    }
+    strategy = SparseCopyStrategy::ReadWrite;
+    return options.hasher == nullptr || HashFile(dstPath, *options.hasher);
+#endif
+#ifdef __linux__
+    return CopySparseFilePosix(srcPath, dstPath, ranges, options, strategy);
+#endif
+}
+
+bool CopySparseFileParallel(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, const ParallelCopyOptions& options)
+{
+#ifdef _WIN32
+    return CopySparseFile(srcPath, dstPath, ranges);
+#endif
+#ifdef __linux__
+    std::optional<StatResult> srcResult = Stat(srcPath);
+    std::optional<StatResult> dstResult = Stat(dstPath);
+    /* check if is a file */
+    if (!srcResult || dstResult || srcResult->IsDirectory()) {
+        return false;
+    }
+    return CopySparseFileParallelPosix(srcPath, dstPath, ranges, options);
+#endif
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> SparseExtentsToRanges(
+    const std::vector<SparseExtent>& extents, bool unwrittenAsHole)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (const SparseExtent& extent : extents) {
+        if (unwrittenAsHole && extent.unwritten) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == extent.logicalOffset) {
+            ranges.back().second += extent.length; /* contiguous in file, merge */
+        } else {
+            ranges.emplace_back(extent.logicalOffset, extent.length);
+        }
+    }
+    return ranges;
+}
+
+#ifdef _WIN32
+/*
+ * Invoke Stat() and check if it's sparse file
+ * Represent the range using [<offset, length>] in bytes
+ * Exmple from:
+ * https://github.com/microsoft/cpprestsdk/blob/master/Release/tests/functional/streams/CppSparseFile.cpp
+ */
+SparseRangeResult QuerySparseWin32AllocateRangesW(const std::wstring& wPath)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    /* Open the file for read */
+    std::wstring unicodePath = ConvertWin32UnicodePath(wPath);
+    HANDLE hFile = ::CreateFileW(
+                        unicodePath.c_str(),
+                        GENERIC_READ,
+                        FILE_SHARE_READ,
+                        nullptr,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    LARGE_INTEGER liFileSize;
+    GetFileSizeEx(hFile, &liFileSize);
+    /* Range to be examined (the whole file) */
+    FILE_ALLOCATED_RANGE_BUFFER queryRange;
+    queryRange.FileOffset.QuadPart = 0;
+    queryRange.Length = liFileSize;
+    /* Allocated areas info */
+    FILE_ALLOCATED_RANGE_BUFFER allocRanges[1024];
+    DWORD nbytes;
+    bool fFinished;
+    do
+    {
+        fFinished = DeviceIoControl(
+                        hFile,
+                        FSCTL_QUERY_ALLOCATED_RANGES,
+                        &queryRange,
+                        sizeof(queryRange),
+                        allocRanges,
+                        sizeof(allocRanges),
+                        &nbytes,
+                        nullptr);
+        if (!fFinished) {
+            DWORD dwError = GetLastError();
+            /* ERROR_MORE_DATA is the only error that is normal */
+            if (dwError != ERROR_MORE_DATA) {
+                ::CloseHandle(hFile);
+                return std::nullopt;
+            }
+        }
+        /* Calculate the number of records returned */
+        DWORD dwAllocRangeCount = nbytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        /* Print each allocated range */
+        for (DWORD i = 0; i < dwAllocRangeCount; i++) {
+            ranges.emplace_back(allocRanges[i].FileOffset.QuadPart, allocRanges[i].Length.QuadPart);
+        }
+        // Set starting address and size for the next query
+        if (!fFinished && dwAllocRangeCount > 0)
+        {
+            queryRange.FileOffset.QuadPart = 
+                allocRanges[dwAllocRangeCount - 1].FileOffset.QuadPart +
+                allocRanges[dwAllocRangeCount - 1].Length.QuadPart;
+            queryRange.Length.QuadPart = liFileSize.QuadPart - queryRange.FileOffset.QuadPart;
+        }
+    } while (!fFinished);
+    ::CloseHandle(hFile);
+    return std::make_optional(ranges);
+}
+
+bool CopySparseFileWin32W(const std::wstring& wSrcPath, const std::wstring& wDstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    const int DEFAULT_BUFF_SIZE = 1024;
+    char buff[DEFAULT_BUFF_SIZE] = "\0";
+    /* open file for read */
+    std::wstring wSrcUnicodePath = ConvertWin32UnicodePath(wSrcPath);
+    HANDLE hInFile = ::CreateFileW(
+        wSrcUnicodePath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        0,
+        nullptr);
+    if (hInFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    /* open file for write */
+    std::wstring wDstUnicodePath = ConvertWin32UnicodePath(wDstPath);
+    HANDLE hOutFile = ::CreateFileW(
+        wDstUnicodePath.c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr,
+        CREATE_NEW,
+        0,
+        nullptr);
+    if (hOutFile == INVALID_HANDLE_VALUE) {
+        ::CloseHandle(hInFile);
+        return false;
+    }
+    /* set taget file sparse */
+    DWORD dwTemp; /* store the setted attribute */
+    ::DeviceIoControl(hOutFile,
+        FSCTL_SET_SPARSE,
+        nullptr,
+        0,
+        nullptr,
+        0,
+        &dwTemp,
+        nullptr);
+    /* truncate target file at first */
+    LARGE_INTEGER sizeEx;
+    if (!::GetFileSizeEx(hInFile, &sizeEx)) {
+        ::CloseHandle(hInFile);
+        return false;
+    }
+    ::SetFilePointerEx(hOutFile, sizeEx, nullptr, FILE_BEGIN);
+    ::SetEndOfFile(hOutFile);
+    /* write allocated range */
+    for (const std::pair<uint64_t, uint64_t>& range : ranges) {
+        uint64_t offset = range.first;
+        uint64_t len = range.second;
+        sizeEx.QuadPart = offset;
+        do {
+            DWORD nbytes = 0; /* n bytes to copy in this batch */
+            ::SetFilePointerEx(hInFile, sizeEx, nullptr, FILE_BEGIN); /* set fd to the beginning of the range */
+            ::SetFilePointerEx(hOutFile, sizeEx, nullptr, FILE_BEGIN);
+            nbytes = len < sizeof(buff) ? static_cast<DWORD>(len): sizeof(buff); /* if the range can be copied in this batch */
+            if (!::ReadFile(hInFile, buff, nbytes, nullptr, nullptr)) {
+                /* read failed */
+                ::CloseHandle(hInFile);
+                ::CloseHandle(hOutFile);
+                return false;
+            }
+            DWORD nWritten = 0;
+            if (!::WriteFile(hOutFile, buff, nbytes, &nWritten, nullptr)) {
+                /* write failed */
+                ::CloseHandle(hInFile);
+                ::CloseHandle(hOutFile);
+                return false;
+            }
+            offset = offset + nbytes; /* reset offset and length */
+            len = len - nbytes;
+        } while (len != 0);
+    }
+    /* copy success */
+    ::CloseHandle(hInFile);
+    ::CloseHandle(hOutFile);
+    return true;
+}
+#endif
+
+#ifdef __linux__
+/* alternate SEEK_DATA/SEEK_HOLE from the beginning of an opened file, two syscalls per range */
+static SparseRangeResult QuerySeekDataRanges(int fd)
+{
+#ifdef SEEK_HOLE
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    off_t end = ::lseek(fd, 0, SEEK_END);
+    off_t cur = 0, offset = 0 , len = 0;
+    FSUTIL_METRICS_SYSCALLS(QuerySparseRanges, 1);
+    while (cur < end) {
+        FSUTIL_METRICS_SYSCALLS(QuerySparseRanges, 2);
+        cur = ::lseek(fd, cur, SEEK_DATA);
+        if (cur == -1 && errno == ENXIO) {
+            cur = end;
+            continue;
+        }
+        if (cur < 0) {
+            return std::nullopt; /* query failed */
+        }
+        offset = cur;
+        cur = ::lseek(fd, cur, SEEK_HOLE);
+        if (cur < 0) {
+            return std::nullopt; /* query failed */
+        }
+        len = cur - offset;
+        ranges.emplace_back(offset, len);
+    }
+    return std::make_optional(ranges);
+#else
+    /* kernel not support sparse file */
+    return std::nullopt;
+#endif
+}
+
+SparseRangeResult QuerySparsePosixAllocateRanges(const std::string& path)
+{
+    FSUTIL_METRICS_SCOPE(QuerySparseRanges);
+    FSUTIL_METRICS_SYSCALLS(QuerySparseRanges, 2); /* open() and close() */
+    ScopedFd fd(::open(path.c_str() , O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    if (fd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    SparseRangeResult ranges = QuerySeekDataRanges(fd.Get());
+    if (!ranges) {
+        FSUTIL_METRICS_FAILED();
+    }
+    return ranges;
+}
+
+SparseExtentResult QuerySparsePosixExtents(const std::string& path)
+{
+    const uint32_t FIEMAP_BATCH_EXTENT_COUNT = 512;
+    FSUTIL_METRICS_SCOPE(QuerySparseRanges);
+    FSUTIL_METRICS_SYSCALLS(QuerySparseRanges, 3); /* open(), fstat() and close() */
+    ScopedFd fd(::open(path.c_str() , O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    if (fd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    struct stat statbuff {};
+    if (::fstat(fd.Get(), &statbuff) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(statbuff.st_size);
+    std::vector<SparseExtent> extents;
+    std::vector<char> buffer(sizeof(struct fiemap) + FIEMAP_BATCH_EXTENT_COUNT * sizeof(struct fiemap_extent));
+    struct fiemap* fiemap = reinterpret_cast<struct fiemap*>(buffer.data());
+    uint64_t start = 0;
+    while (start < fileSize) {
+        std::memset(buffer.data(), 0, buffer.size());
+        fiemap->fm_start = start;
+        fiemap->fm_length = FIEMAP_MAX_OFFSET - start;
+        fiemap->fm_flags = FIEMAP_FLAG_SYNC; /* flush delayed allocation so dirty data is mapped */
+        fiemap->fm_extent_count = FIEMAP_BATCH_EXTENT_COUNT;
+        FSUTIL_METRICS_SYSCALLS(QuerySparseRanges, 1);
+        if (::ioctl(fd.Get(), FS_IOC_FIEMAP, fiemap) < 0) {
+            if (errno != EOPNOTSUPP && errno != ENOTTY) {
+                FSUTIL_METRICS_FAILED();
+                return std::nullopt;
+            }
+            /* filesystem without FIEMAP (tmpfs, NFS ...) */
+            SparseRangeResult ranges = QuerySeekDataRanges(fd.Get());
+            if (!ranges) {
+                FSUTIL_METRICS_FAILED();
+                return std::nullopt;
+            }
+            extents.clear();
+            for (const std::pair<uint64_t, uint64_t>& range : ranges.value()) {
+                extents.push_back(SparseExtent { range.first, 0, range.second, false, false, false });
+            }
+            if (!extents.empty()) {
+                extents.back().last = true;
+            }
+            return std::make_optional(extents);
+        }
+        if (fiemap->fm_mapped_extents == 0) {
+            break;
+        }
+        bool reachedLast = false;
+        for (uint32_t index = 0; index < fiemap->fm_mapped_extents; ++index) {
+            const struct fiemap_extent& extent = fiemap->fm_extents[index];
+            start = extent.fe_logical + extent.fe_length;
+            reachedLast = (extent.fe_flags & FIEMAP_EXTENT_LAST) != 0;
+            if (extent.fe_logical >= fileSize) {
+                continue; /* preallocated beyond EOF */
+            }
+            extents.push_back(SparseExtent {
+                extent.fe_logical,
+                (extent.fe_flags & FIEMAP_EXTENT_UNKNOWN) != 0 ? 0 : extent.fe_physical,
+                std::min<uint64_t>(extent.fe_length, fileSize - extent.fe_logical),
+                (extent.fe_flags & FIEMAP_EXTENT_UNWRITTEN) != 0,
+                (extent.fe_flags & FIEMAP_EXTENT_SHARED) != 0,
+                false });
+        }
+        if (reachedLast) {
+            break;
+        }
+    }
+    if (!extents.empty()) {
+        extents.back().last = true;
+    }
+    return std::make_optional(extents);
+}
+
+std::optional<uint64_t> QueryFirstPhysicalOffset(const std::string& path)
+{
+    ScopedFd fd(::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    if (fd.Get() < 0) {
+        return std::nullopt;
+    }
+    char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] {};
+    struct fiemap* fiemap = reinterpret_cast<struct fiemap*>(buffer);
+    fiemap->fm_start = 0;
+    fiemap->fm_length = FIEMAP_MAX_OFFSET;
+    fiemap->fm_extent_count = 1;
+    FSUTIL_METRICS_SYSCALLS(QuerySparseRanges, 3); /* open(), FIEMAP and close() */
+    if (::ioctl(fd.Get(), FS_IOC_FIEMAP, fiemap) < 0 || fiemap->fm_mapped_extents == 0) {
+        return std::nullopt;
+    }
+    const struct fiemap_extent& extent = fiemap->fm_extents[0];
+    if ((extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)) != 0) {
+        return std::nullopt;
+    }
+    return extent.fe_physical;
+}
+
+std::vector<size_t> PhysicalReadOrder(const std::vector<std::string>& paths, int threads)
+{
+    const uint64_t NOT_MAPPED = UINT64_MAX;
+    std::vector<uint64_t> offsets(paths.size(), NOT_MAPPED);
+    /* FIEMAP only reads the extent tree, several in flight help on network storage */
+    threads = threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    ParallelFor(paths.size(), threads, [&](size_t index, int) {
+        offsets[index] = QueryFirstPhysicalOffset(paths[index]).value_or(NOT_MAPPED);
+    });
+    std::vector<size_t> order(paths.size());
+    for (size_t index = 0; index < order.size(); ++index) {
+        order[index] = index;
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t lhs, size_t rhs) { return offsets[lhs] < offsets[rhs]; });
+    return order;
+}
+
+/* return false if range [offset, offset + length) is not copied completely */
+static bool CopyRangeReadWrite(int inFd, int outFd, uint64_t offset, uint64_t length, std::vector<char>& buffer)
+{
+    const size_t READ_WRITE_BUFFER_SIZE = 1024 * 1024;
+    if (buffer.empty()) {
+        buffer.resize(READ_WRITE_BUFFER_SIZE);
+    }
+    while (length != 0) {
+        size_t nbytes = static_cast<size_t>(std::min<uint64_t>(length, buffer.size()));
+        ssize_t nread = ::pread(inFd, buffer.data(), nbytes, static_cast<off_t>(offset));
+        FSUTIL_METRICS_SYSCALLS(CopySparseFile, 1);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return false; /* read failed or source truncated */
+        }
+        for (ssize_t written = 0; written < nread;) {
+            ssize_t n = ::pwrite(outFd, buffer.data() + written, nread - written, offset + written);
+            FSUTIL_METRICS_SYSCALLS(CopySparseFile, 1);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        offset += nread;
+        length -= nread;
+        FSUTIL_METRICS_BYTES(CopySparseFile, static_cast<uint64_t>(nread));
+    }
+    return true;
+}
+
+/* copy_file_range with explicit offsets, copied counts the bytes done even on failure */
+static bool CopyRangeInKernel(int inFd, int outFd, uint64_t offset, uint64_t length, uint64_t& copied)
+{
+    copied = 0;
+#ifdef __NR_copy_file_range
+    loff_t inOffset = static_cast<loff_t>(offset);
+    loff_t outOffset = static_cast<loff_t>(offset);
+    while (copied < length) {
+        long n = ::syscall(__NR_copy_file_range, inFd, &inOffset, outFd, &outOffset,
+            static_cast<size_t>(length - copied), 0U);
+        FSUTIL_METRICS_SYSCALLS(CopySparseFile, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            /* source shorter than expected or a filesystem copy_file_range() can't read, let read/write tell */
+            errno = EINVAL;
+            return false;
+        }
+        if (n < 0) {
+            return false;
+        }
+        copied += static_cast<uint64_t>(n);
+        FSUTIL_METRICS_BYTES(CopySparseFile, static_cast<uint64_t>(n));
+    }
+    return true;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+/* block size of the filesystem, the unit of clones, st_blksize is only the preferred I/O size */
+static uint64_t FilesystemBlockSize(int fd, const struct stat& statbuff)
+{
+    struct statfs statfsbuff {};
+    if (::fstatfs(fd, &statfsbuff) == 0 && statfsbuff.f_bsize > 0) {
+        return static_cast<uint64_t>(statfsbuff.f_bsize);
+    }
+    return statbuff.st_blksize > 0 ? static_cast<uint64_t>(statbuff.st_blksize) : 1;
+}
+
+/* true if every byte of data in fd is inside ranges, a whole file clone then copies nothing more */
+static bool RangesCoverData(int fd, const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    SparseRangeResult dataRanges = QuerySeekDataRanges(fd);
+    if (!dataRanges) {
+        return false;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> sorted = ranges;
+    std::sort(sorted.begin(), sorted.end());
+    size_t index = 0;
+    for (const std::pair<uint64_t, uint64_t>& dataRange : dataRanges.value()) {
+        uint64_t offset = dataRange.first;
+        uint64_t end = dataRange.first + dataRange.second;
+        while (offset < end) {
+            while (index < sorted.size() && sorted[index].first + sorted[index].second <= offset) {
+                ++index;
+            }
+            if (index == sorted.size() || sorted[index].first > offset) {
+                return false;
+            }
+            offset = sorted[index].first + sorted[index].second;
+        }
+    }
+    return true;
+}
+
+/* clone [offset, offset + length), offset and length must be aligned to the block size unless reaching EOF */
+static bool CloneRange(int inFd, int outFd, uint64_t offset, uint64_t length)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range cloneRange {};
+    cloneRange.src_fd = inFd;
+    cloneRange.src_offset = offset;
+    cloneRange.src_length = length;
+    cloneRange.dest_offset = offset;
+    FSUTIL_METRICS_SYSCALLS(CopySparseFile, 1);
+    if (::ioctl(outFd, FICLONERANGE, &cloneRange) != 0) {
+        return false;
+    }
+    FSUTIL_METRICS_BYTES(CopySparseFile, length);
+    return true;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+bool CopySparseFilePosix(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+    SparseCopyStrategy strategy = SparseCopyStrategy::None;
+    return CopySparseFilePosix(srcPath, dstPath, ranges, strategy);
+}
+
+/* read all of [offset, offset + length) into data, fail if the file is shorter */
+static bool PreadFully(int fd, char* data, uint64_t length, uint64_t offset)
+{
+    for (uint64_t nread = 0; nread < length;) {
+        ssize_t n = ::pread(fd, data + nread, length - nread, static_cast<off_t>(offset + nread));
+        FSUTIL_METRICS_SYSCALLS(CopySparseFile, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        nread += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+/* write all of [data, data + length) at offset, retrying short writes */
+static bool PwriteFully(int fd, const char* data, uint64_t length, uint64_t offset)
+{
+    for (uint64_t written = 0; written < length;) {
+        ssize_t n = ::pwrite(fd, data + written, length - written, static_cast<off_t>(offset + written));
+        FSUTIL_METRICS_SYSCALLS(CopySparseFile, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        written += static_cast<uint64_t>(n);
+    }
+    FSUTIL_METRICS_BYTES(CopySparseFile, length);
+    return true;
+}
+
+/**
+* write [data, data + length) at offset a filesystem block at a time, blocks of zeros are not written so they
+* stay holes of the truncated target, adjacent data blocks are coalesced into one write
+*/
+static bool PwriteSkipZeros(int fd, const char* data, uint64_t length, uint64_t offset, uint64_t blockSize)
+{
+    uint64_t dataBegin = length; /* first of the data blocks not written yet, length if none */
+    for (uint64_t begin = 0; begin < length;) {
+        uint64_t end = std::min<uint64_t>(length, begin + blockSize - (offset + begin) % blockSize);
+        bool zero = IsZeroBuffer(data + begin, static_cast<size_t>(end - begin));
+        if (!zero && dataBegin == length) {
+            dataBegin = begin;
+        } else if (zero && dataBegin != length) {
+            if (!PwriteFully(fd, data + dataBegin, begin - dataBegin, offset + dataBegin)) {
+                return false;
+            }
+            dataBegin = length;
+        }
+        begin = end;
+    }
+    return dataBegin == length || PwriteFully(fd, data + dataBegin, length - dataBegin, offset + dataBegin);
+}
+
+namespace {
+/* one of the two buffers of CopyRangesBuffered(), filled by the reader thread and drained by the caller */
+struct CopyBufferSlot {
+    std::vector<char> data;
+    bool full = false;
+};
+}
+
+/**
+* copy the ranges through two user space buffers, a reader thread fills one while the calling thread hashes
+* and writes the other, zero blocks are skipped if skipZeros, holes are fed to the hasher without being read
+*/
+static bool CopyRangesBuffered(int inFd, int outFd, const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    uint64_t fileSize, uint64_t blockSize, bool skipZeros, Hasher* hasher)
+{
+    const size_t COPY_BUFFER_SIZE = 1024 * 1024;
+    size_t bufferSize = std::max<size_t>(COPY_BUFFER_SIZE / blockSize, 1) * blockSize;
+    /* every chunk but the first one of a range starts on a block boundary */
+    std::vector<std::pair<uint64_t, uint64_t>> chunks;
+    for (const std::pair<uint64_t, uint64_t>& range: ranges) {
+        uint64_t offset = range.first;
+        uint64_t end = std::min(range.first + range.second, fileSize);
+        while (offset < end) {
+            uint64_t chunk = std::min<uint64_t>(end - offset, bufferSize - offset % blockSize);
+            chunks.emplace_back(offset, chunk);
+            offset += chunk;
+        }
+    }
+    uint64_t hashed = 0; /* logical bytes fed to the hasher */
+    auto consume = [&](const char* data, uint64_t offset, uint64_t length) {
+        if (hasher != nullptr) {
+            if (offset < hashed) {
+                return false; /* ranges not sorted, the digest would be wrong */
+            }
+            hasher->UpdateZeros(offset - hashed);
+            hasher->Update(data, static_cast<size_t>(length));
+            hashed = offset + length;
+        }
+        return skipZeros ? PwriteSkipZeros(outFd, data, length, offset, blockSize) :
+            PwriteFully(outFd, data, length, offset);
+    };
+    CopyBufferSlot slots[2];
+    slots[0].data.resize(bufferSize);
+    if (chunks.size() <= 1) {
+        /* nothing to overlap */
+        for (const std::pair<uint64_t, uint64_t>& chunk: chunks) {
+            if (!PreadFully(inFd, slots[0].data.data(), chunk.second, chunk.first) ||
+                !consume(slots[0].data.data(), chunk.first, chunk.second)) {
+                return false;
+            }
+        }
+    } else {
+        slots[1].data.resize(bufferSize);
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool failed = false; /* set by either side to stop the other one */
+        std::thread reader([&]() {
+            for (size_t index = 0; index < chunks.size(); ++index) {
+                CopyBufferSlot& slot = slots[index % 2];
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&]() { return !slot.full || failed; });
+                    if (failed) {
+                        return;
+                    }
+                }
+                /* read failed or source truncated */
+                bool success = PreadFully(inFd, slot.data.data(), chunks[index].second, chunks[index].first);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot.full = success;
+                    failed = failed || !success;
+                }
+                condition.notify_all();
+                if (!success) {
+                    return;
+                }
+            }
+        });
+        bool success = true;
+        for (size_t index = 0; index < chunks.size() && success; ++index) {
+            CopyBufferSlot& slot = slots[index % 2];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]() { return slot.full || failed; });
+                if (!slot.full) {
+                    success = false;
+                    break;
+                }
+            }
+            success = consume(slot.data.data(), chunks[index].first, chunks[index].second);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.full = false;
+                failed = failed || !success;
+            }
+            condition.notify_all();
+        }
+        reader.join();
+        if (!success) {
+            return false;
+        }
+    }
+    if (hasher != nullptr) {
+        hasher->UpdateZeros(fileSize - hashed);
+    }
+    return true;
+}
+
+bool CopySparseFilePosix(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, SparseCopyStrategy& strategy)
+{
+    return CopySparseFilePosix(srcPath, dstPath, ranges, SparseCopyOptions(), strategy);
+}
+
+bool CopySparseFilePosix(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, const SparseCopyOptions& options,
+    SparseCopyStrategy& strategy)
+{
+    FSUTIL_METRICS_SCOPE(CopySparseFile);
+    FSUTIL_METRICS_SYSCALLS(CopySparseFile, 7); /* open(), close() of both files, fstat(), FICLONE and ftruncate() */
+    strategy = SparseCopyStrategy::None;
+    ScopedFd inFd(::open(srcPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (inFd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    ScopedFd outFd(::open(dstPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if (outFd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    struct stat srcStat {};
+    if (::fstat(inFd.Get(), &srcStat) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    /* zero detection and hashing need the data in user space */
+    bool buffered = options.mode == SparseMode::Always || options.hasher != nullptr;
+#ifdef FICLONE
+    /* share all extents of the source, holes stay holes on XFS/Btrfs, a subset is cloned range by range */
+    if (!buffered && RangesCoverData(inFd.Get(), ranges) && ::ioctl(outFd.Get(), FICLONE, inFd.Get()) == 0) {
+        strategy = SparseCopyStrategy::Reflink;
+        return true;
+    }
+#endif
+    /* truncate target file at first */
+    if (::ftruncate(outFd.Get(), srcStat.st_size) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    uint64_t blockSize = FilesystemBlockSize(inFd.Get(), srcStat);
+    if (buffered) {
+        /* holes can only be made of whole blocks of the target filesystem */
+        struct stat dstStat {};
+        uint64_t dstBlockSize = ::fstat(outFd.Get(), &dstStat) == 0 && dstStat.st_blksize > 0 ?
+            static_cast<uint64_t>(dstStat.st_blksize) : blockSize;
+        bool skipZeros = options.mode == SparseMode::Always;
+        if (!CopyRangesBuffered(inFd.Get(), outFd.Get(), ranges, static_cast<uint64_t>(srcStat.st_size),
+            dstBlockSize, skipZeros, options.hasher)) {
+            FSUTIL_METRICS_FAILED();
+            return false;
+        }
+        strategy = skipZeros ? SparseCopyStrategy::ZeroDetect : SparseCopyStrategy::ReadWrite;
+        return true;
+    }
+    bool reflinkUsable = true;
+    bool copyFileRangeUsable = true;
+    std::vector<char> buffer;
+    for (const std::pair<uint64_t, uint64_t>& range: ranges) {
+        uint64_t offset = range.first;
+        uint64_t length = range.second;
+        if (length == 0) {
+            continue;
+        }
+        bool aligned = offset % blockSize == 0 &&
+            (length % blockSize == 0 || offset + length >= static_cast<uint64_t>(srcStat.st_size));
+        if (reflinkUsable && aligned) {
+            if (CloneRange(inFd.Get(), outFd.Get(), offset, length)) {
+                strategy = std::max(strategy, SparseCopyStrategy::ReflinkRange);
+                continue;
+            }
+            reflinkUsable = false; /* filesystem can't share extents, don't retry for every range */
+        }
+        if (copyFileRangeUsable) {
+            uint64_t copied = 0;
+            bool success = CopyRangeInKernel(inFd.Get(), outFd.Get(), offset, length, copied);
+            if (copied != 0) {
+                strategy = std::max(strategy, SparseCopyStrategy::CopyFileRange);
+            }
+            if (success) {
+                continue;
+            }
+            if (errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL && copied == 0) {
+                FSUTIL_METRICS_FAILED();
+                return false; /* real I/O error */
+            }
+            copyFileRangeUsable = false;
+            offset += copied;
+            length -= copied;
+        }
+        if (!CopyRangeReadWrite(inFd.Get(), outFd.Get(), offset, length, buffer)) {
+            FSUTIL_METRICS_FAILED();
+            return false;
+        }
+        strategy = std::max(strategy, SparseCopyStrategy::ReadWrite);
+    }
+    /* copy success */
+    return true;
+}
+
+std::optional<uint64_t> PunchZeroHoles(const std::string& path)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    const size_t ZERO_DETECT_BUFFER_SIZE = 1024 * 1024;
+    ScopedFd fd(::open(path.c_str(), O_RDWR | O_CLOEXEC));
+    struct stat statbuff {};
+    if (fd.Get() < 0 || ::fstat(fd.Get(), &statbuff) < 0) {
+        return std::nullopt;
+    }
+    SparseRangeResult ranges = QuerySeekDataRanges(fd.Get());
+    if (!ranges) {
+        return std::nullopt;
+    }
+    uint64_t blockSize = statbuff.st_blksize > 0 ? static_cast<uint64_t>(statbuff.st_blksize) : 1;
+    std::vector<char> buffer(std::max<size_t>(ZERO_DETECT_BUFFER_SIZE / blockSize, 1) * blockSize);
+    uint64_t punched = 0;
+    for (const std::pair<uint64_t, uint64_t>& range : ranges.value()) {
+        /* only whole blocks can be deallocated, partial blocks at both ends are left */
+        uint64_t offset = (range.first + blockSize - 1) / blockSize * blockSize;
+        uint64_t end = (range.first + range.second) / blockSize * blockSize;
+        uint64_t holeBegin = end; /* first of the zero blocks not punched yet, end if none */
+        while (offset < end) {
+            uint64_t chunk = std::min<uint64_t>(end - offset, buffer.size());
+            if (!PreadFully(fd.Get(), buffer.data(), chunk, offset)) {
+                return std::nullopt;
+            }
+            for (uint64_t begin = 0; begin <= chunk; begin += blockSize) {
+                bool zero = begin < chunk && IsZeroBuffer(buffer.data() + begin, static_cast<size_t>(blockSize));
+                if (zero && holeBegin == end) {
+                    holeBegin = offset + begin;
+                } else if (!zero && holeBegin != end && (begin < chunk || offset + chunk == end)) {
+                    uint64_t holeLength = offset + begin - holeBegin;
+                    if (::fallocate(fd.Get(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        static_cast<off_t>(holeBegin), static_cast<off_t>(holeLength)) < 0) {
+                        return std::nullopt;
+                    }
+                    punched += holeLength;
+                    holeBegin = end;
+                }
+            }
+            offset += chunk;
+        }
+    }
+    return punched;
+#else
+    errno = EOPNOTSUPP;
+    return std::nullopt;
+#endif
+}
+#endif
+
+#ifdef __linux__
+bool CopySparseFileParallelPosix(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, const ParallelCopyOptions& options)
+{
+    FSUTIL_METRICS_SCOPE(CopySparseFile);
+    ScopedFd inFd(::open(srcPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (inFd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    ScopedFd outFd(::open(dstPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if (outFd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    off_t srcSize = ::lseek(inFd.Get(), 0, SEEK_END);
+    if (srcSize < 0 || ::ftruncate(outFd.Get(), srcSize) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    /* split ranges into chunks, unallocated parts are never touched so holes are kept */
+    uint64_t chunkSize = std::max<uint64_t>(1, options.chunkSize);
+    std::vector<std::pair<uint64_t, uint64_t>> chunks;
+    for (const std::pair<uint64_t, uint64_t>& range : ranges) {
+        for (uint64_t done = 0; done < range.second; done += chunkSize) {
+            chunks.emplace_back(range.first + done, std::min(chunkSize, range.second - done));
+        }
+    }
+    int concurrency = std::max(1, options.concurrency);
+    std::vector<std::vector<char>> buffers(concurrency);
+    std::atomic<bool> copyFileRangeUsable { true };
+    std::atomic<bool> failed { false };
+    ParallelFor(chunks.size(), concurrency, [&](size_t index, int workerIndex) {
+        if (failed.load(std::memory_order_relaxed)) {
+            return;
+        }
+        uint64_t offset = chunks[index].first;
+        uint64_t length = chunks[index].second;
+        if (copyFileRangeUsable.load(std::memory_order_relaxed)) {
+            uint64_t copied = 0;
+            if (CopyRangeInKernel(inFd.Get(), outFd.Get(), offset, length, copied)) {
+                return;
+            }
+            if (errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL && copied == 0) {
+                failed.store(true, std::memory_order_relaxed); /* real I/O error */
+                return;
+            }
+            copyFileRangeUsable.store(false, std::memory_order_relaxed);
+            offset += copied;
+            length -= copied;
+        }
+        if (!CopyRangeReadWrite(inFd.Get(), outFd.Get(), offset, length, buffers[workerIndex])) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+    });
+    if (failed.load()) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    return true;
+}
+#endif
+
+namespace {
+const size_t HASH_ZERO_BLOCK_SIZE = 64 * 1024;
+const size_t HASH_BUFFER_ALIGNMENT = 4096;
+const uint64_t HASH_MMAP_WINDOW_SIZE = 64 * 1024 * 1024;
+const char HASH_SEGMENT_HOLE = 0;
+const char HASH_SEGMENT_DATA = 1;
+
+const char ZERO_BLOCK[HASH_ZERO_BLOCK_SIZE] = {};
+
+inline uint64_t RotateLeft64(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+inline uint32_t RotateRight32(uint32_t value, int bits) { return (value >> bits) | (value << (32 - bits)); }
+
+inline uint64_t ReadLE64(const unsigned char* p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+inline uint32_t ReadLE32(const unsigned char* p)
+{
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+        (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+std::string ToHex(const unsigned char* digest, size_t length)
+{
+    const char* HEX_DIGITS = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(length * 2);
+    for (size_t i = 0; i < length; ++i) {
+        hex.push_back(HEX_DIGITS[digest[i] >> 4]);
+        hex.push_back(HEX_DIGITS[digest[i] & 0x0F]);
+    }
+    return hex;
+}
+
+/* streaming XXH64, https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+class Xxh64Hasher : public Hasher {
+public:
+    void Update(const void* data, size_t length) override;
+    std::string Final() override;
+    uint64_t Digest() const; /* Final() as a number */
+
+private:
+    static uint64_t Round(uint64_t acc, uint64_t input);
+    static uint64_t MergeRound(uint64_t acc, uint64_t value);
+
+    static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+    static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t m_acc[4] = { PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1 };
+    unsigned char m_buffer[32] = {};
+    size_t m_buffered = 0;
+    uint64_t m_totalLength = 0;
+};
+
+/* FIPS 180-4 SHA-256 */
+class Sha256Hasher : public Hasher {
+public:
+    void Update(const void* data, size_t length) override;
+    std::string Final() override;
+
+private:
+    void Transform(const unsigned char* block);
+
+    uint32_t m_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    unsigned char m_buffer[64] = {};
+    size_t m_buffered = 0;
+    uint64_t m_totalLength = 0;
+};
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+}
+
+void Hasher::UpdateZeros(uint64_t length)
+{
+    while (length > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(length, HASH_ZERO_BLOCK_SIZE));
+        Update(ZERO_BLOCK, chunk);
+        length -= chunk;
+    }
+}
+
+uint64_t Xxh64Hasher::Round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = RotateLeft64(acc, 31);
+    return acc * PRIME1;
+}
+
+uint64_t Xxh64Hasher::MergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= Round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+void Xxh64Hasher::Update(const void* data, size_t length)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + length;
+    m_totalLength += length;
+    if (m_buffered + length < sizeof(m_buffer)) {
+        std::copy(p, end, m_buffer + m_buffered);
+        m_buffered += length;
+        return;
+    }
+    if (m_buffered > 0) {
+        size_t fill = sizeof(m_buffer) - m_buffered;
+        std::copy(p, p + fill, m_buffer + m_buffered);
+        for (int lane = 0; lane < 4; ++lane) {
+            m_acc[lane] = Round(m_acc[lane], ReadLE64(m_buffer + lane * 8));
+        }
+        p += fill;
+        m_buffered = 0;
+    }
+    for (; p + 32 <= end; p += 32) {
+        m_acc[0] = Round(m_acc[0], ReadLE64(p));
+        m_acc[1] = Round(m_acc[1], ReadLE64(p + 8));
+        m_acc[2] = Round(m_acc[2], ReadLE64(p + 16));
+        m_acc[3] = Round(m_acc[3], ReadLE64(p + 24));
+    }
+    std::copy(p, end, m_buffer);
+    m_buffered = static_cast<size_t>(end - p);
+}
+
+std::string Xxh64Hasher::Final()
+{
+    uint64_t hash = Digest();
+    /* canonical representation is big endian */
+    unsigned char digest[8];
+    for (int i = 0; i < 8; ++i) {
+        digest[i] = static_cast<unsigned char>(hash >> (56 - i * 8));
+    }
+    return ToHex(digest, sizeof(digest));
+}
+
+uint64_t Xxh64Hasher::Digest() const
+{
+    uint64_t hash = 0;
+    if (m_totalLength >= 32) {
+        hash = RotateLeft64(m_acc[0], 1) + RotateLeft64(m_acc[1], 7) +
+            RotateLeft64(m_acc[2], 12) + RotateLeft64(m_acc[3], 18);
+        for (int lane = 0; lane < 4; ++lane) {
+            hash = MergeRound(hash, m_acc[lane]);
+        }
+    } else {
+        hash = m_acc[2] + PRIME5; /* seed */
+    }
+    hash += m_totalLength;
+    const unsigned char* p = m_buffer;
+    const unsigned char* end = m_buffer + m_buffered;
+    for (; p + 8 <= end; p += 8) {
+        hash ^= Round(0, ReadLE64(p));
+        hash = RotateLeft64(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        hash ^= static_cast<uint64_t>(ReadLE32(p)) * PRIME1;
+        hash = RotateLeft64(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        hash ^= (*p) * PRIME5;
+        hash = RotateLeft64(hash, 11) * PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void Sha256Hasher::Transform(const unsigned char* block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (static_cast<uint32_t>(block[i * 4 + 1]) << 16) |
+            (static_cast<uint32_t>(block[i * 4 + 2]) << 8) | static_cast<uint32_t>(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = RotateRight32(e, 6) ^ RotateRight32(e, 11) ^ RotateRight32(e, 25);
+        uint32_t choose = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choose + SHA256_K[i] + w[i];
+        uint32_t s0 = RotateRight32(a, 2) ^ RotateRight32(a, 13) ^ RotateRight32(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
+
+void Sha256Hasher::Update(const void* data, size_t length)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + length;
+    m_totalLength += length;
+    if (m_buffered > 0) {
+        size_t fill = std::min(sizeof(m_buffer) - m_buffered, length);
+        std::copy(p, p + fill, m_buffer + m_buffered);
+        m_buffered += fill;
+        p += fill;
+        if (m_buffered < sizeof(m_buffer)) {
+            return;
+        }
+        Transform(m_buffer);
+        m_buffered = 0;
+    }
+    for (; p + 64 <= end; p += 64) {
+        Transform(p);
+    }
+    std::copy(p, end, m_buffer);
+    m_buffered = static_cast<size_t>(end - p);
+}
+
+std::string Sha256Hasher::Final()
+{
+    uint64_t bitLength = m_totalLength * 8;
+    unsigned char padding[72] = { 0x80 };
+    size_t paddingLength = (m_buffered < 56 ? 56 : 120) - m_buffered;
+    for (int i = 0; i < 8; ++i) {
+        padding[paddingLength + i] = static_cast<unsigned char>(bitLength >> (56 - i * 8));
+    }
+    Update(padding, paddingLength + 8);
+    unsigned char digest[32];
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            digest[i * 4 + j] = static_cast<unsigned char>(m_state[i] >> (24 - j * 8));
+        }
+    }
+    return ToHex(digest, sizeof(digest));
+}
+
+std::unique_ptr<Hasher> CreateHasher(HashAlgorithm algorithm)
+{
+    switch (algorithm) {
+        case HashAlgorithm::SHA256: return std::unique_ptr<Hasher>(new Sha256Hasher());
+        default: return std::unique_ptr<Hasher>(new Xxh64Hasher());
+    }
+}
+
+/* "<type><offset><length>" prefix of a segment when holes are not hashed as zeros */
+static void UpdateSegmentHeader(Hasher& hasher, char type, uint64_t offset, uint64_t length)
+{
+    unsigned char header[17] = { static_cast<unsigned char>(type) };
+    for (int i = 0; i < 8; ++i) {
+        header[1 + i] = static_cast<unsigned char>(offset >> (i * 8));
+        header[9 + i] = static_cast<unsigned char>(length >> (i * 8));
+    }
+    hasher.Update(header, sizeof(header));
+}
+
+static void UpdateHole(Hasher& hasher, uint64_t offset, uint64_t length, bool holesAsZeros)
+{
+    if (length == 0) {
+        return;
+    }
+    if (holesAsZeros) {
+        hasher.UpdateZeros(length);
+    } else {
+        UpdateSegmentHeader(hasher, HASH_SEGMENT_HOLE, offset, length);
+    }
+}
+
+static char* AlignedHashBuffer(std::vector<char>& storage, size_t bufferSize)
+{
+    if (storage.size() < bufferSize + HASH_BUFFER_ALIGNMENT) {
+        storage.resize(bufferSize + HASH_BUFFER_ALIGNMENT);
+    }
+    size_t misalignment = reinterpret_cast<uintptr_t>(storage.data()) % HASH_BUFFER_ALIGNMENT;
+    return storage.data() + (misalignment == 0 ? 0 : HASH_BUFFER_ALIGNMENT - misalignment);
+}
+
+#ifdef __linux__
+static bool HashRangeRead(int fd, uint64_t offset, uint64_t length, char* buffer, size_t bufferSize, Hasher& hasher)
+{
+    while (length > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(length, bufferSize));
+        ssize_t ret = ::pread(fd, buffer, chunk, static_cast<off_t>(offset));
+        FSUTIL_METRICS_SYSCALLS(HashFile, 1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false; /* read failed or file truncated meanwhile */
+        }
+        hasher.Update(buffer, static_cast<size_t>(ret));
+        offset += static_cast<uint64_t>(ret);
+        length -= static_cast<uint64_t>(ret);
+    }
+    return true;
+}
+
+/* SIGBUS is raised if the file is truncated while mapped, useMmap is for files not modified concurrently */
+static bool HashRangeMmap(int fd, uint64_t offset, uint64_t length, Hasher& hasher)
+{
+    const uint64_t pageSize = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    while (length > 0) {
+        uint64_t alignedOffset = offset - offset % pageSize;
+        uint64_t delta = offset - alignedOffset;
+        uint64_t chunk = std::min<uint64_t>(length, HASH_MMAP_WINDOW_SIZE - delta);
+        size_t mapLength = static_cast<size_t>(chunk + delta);
+        void* mapped = ::mmap(nullptr, mapLength, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(alignedOffset));
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        ::madvise(mapped, mapLength, MADV_SEQUENTIAL);
+        hasher.Update(static_cast<const char*>(mapped) + delta, static_cast<size_t>(chunk));
+        ::munmap(mapped, mapLength);
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+#endif
+
+#ifdef _WIN32
+static bool HashRangeRead(HANDLE hFile, uint64_t offset, uint64_t length, char* buffer, size_t bufferSize, Hasher& hasher)
+{
+    while (length > 0) {
+        DWORD chunk = static_cast<DWORD>(std::min<uint64_t>(length, bufferSize));
+        OVERLAPPED overlapped {};
+        overlapped.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD nbytes = 0;
+        FSUTIL_METRICS_SYSCALLS(HashFile, 1);
+        if (!::ReadFile(hFile, buffer, chunk, &nbytes, &overlapped) || nbytes == 0) {
+            return false;
+        }
+        hasher.Update(buffer, nbytes);
+        offset += nbytes;
+        length -= nbytes;
+    }
+    return true;
+}
+#endif
+
+static bool HashFileWithBuffer(
+    const std::string& path, Hasher& hasher, const HashFileOptions& options, std::vector<char>& storage)
+{
+    FSUTIL_METRICS_SCOPE(HashFile);
+    size_t bufferSize = std::max<size_t>(options.bufferSize, HASH_BUFFER_ALIGNMENT);
+    char* buffer = AlignedHashBuffer(storage, bufferSize);
+#ifdef __linux__
+    FSUTIL_METRICS_SYSCALLS(HashFile, 4); /* open(), fstat(), posix_fadvise() and close() */
+    ScopedFd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat statbuff {};
+    if (fd.Get() < 0 || ::fstat(fd.Get(), &statbuff) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(statbuff.st_size);
+    ::posix_fadvise(fd.Get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    SparseRangeResult ranges = QuerySeekDataRanges(fd.Get());
+#endif
+#ifdef _WIN32
+    HANDLE hFile = ::CreateFileW(ConvertWin32UnicodePath(Utf8ToUtf16(path)).c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    std::unique_ptr<void, decltype(&::CloseHandle)> fileGuard(hFile, &::CloseHandle);
+    LARGE_INTEGER liFileSize {};
+    if (!::GetFileSizeEx(hFile, &liFileSize)) {
+        FSUTIL_METRICS_FAILED();
+        return false;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(liFileSize.QuadPart);
+    SparseRangeResult ranges = QuerySparseWin32AllocateRangesW(Utf8ToUtf16(path));
+#endif
+    if (!ranges) {
+        /* no hole information, hash the whole file */
+        ranges = std::vector<std::pair<uint64_t, uint64_t>> { { 0, fileSize } };
+    }
+    uint64_t offset = 0;
+    for (const std::pair<uint64_t, uint64_t>& range : ranges.value()) {
+        if (range.first >= fileSize) {
+            break;
+        }
+        uint64_t length = std::min(range.second, fileSize - range.first);
+        UpdateHole(hasher, offset, range.first - offset, options.holesAsZeros);
+        if (!options.holesAsZeros) {
+            UpdateSegmentHeader(hasher, HASH_SEGMENT_DATA, range.first, length);
+        }
+#ifdef __linux__
+        bool success = options.useMmap ?
+            HashRangeMmap(fd.Get(), range.first, length, hasher) :
+            HashRangeRead(fd.Get(), range.first, length, buffer, bufferSize, hasher);
+#endif
+#ifdef _WIN32
+        bool success = HashRangeRead(hFile, range.first, length, buffer, bufferSize, hasher);
+#endif
+        if (!success) {
+            FSUTIL_METRICS_FAILED();
+            return false;
+        }
+        FSUTIL_METRICS_BYTES(HashFile, length);
+        offset = range.first + length;
+    }
+    UpdateHole(hasher, offset, fileSize - offset, options.holesAsZeros);
+    return true;
+}
+
+bool HashFile(const std::string& path, Hasher& hasher, const HashFileOptions& options)
+{
+    std::vector<char> storage;
+    return HashFileWithBuffer(path, hasher, options, storage);
+}
+
+std::optional<std::string> HashFile(const std::string& path, const HashFileOptions& options)
+{
+    std::unique_ptr<Hasher> hasher = CreateHasher(options.algorithm);
+    if (!HashFile(path, *hasher, options)) {
+        return std::nullopt;
+    }
+    return hasher->Final();
+}
+
+#ifdef __linux__
+/* make [offset, offset + length) a hole, zeros are written if the filesystem can't punch holes */
+static bool PunchOrZeroRange(int fd, uint64_t offset, uint64_t length, std::vector<char>& buffer)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        static_cast<off_t>(offset), static_cast<off_t>(length)) == 0) {
+        return true;
+    }
+    if (errno != EOPNOTSUPP) {
+        return false;
+    }
+#endif
+    std::fill(buffer.begin(), buffer.end(), 0);
+    while (length != 0) {
+        uint64_t chunk = std::min<uint64_t>(length, buffer.size());
+        if (!PwriteFully(fd, buffer.data(), chunk, offset)) {
+            return false;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/* write [begin, end) of the source chunk read at offset */
+static bool WriteDeltaRun(int fd, const char* data, uint64_t begin, uint64_t end, uint64_t offset,
+    DeltaCopyStats& stats)
+{
+    if (!PwriteFully(fd, data + begin, end - begin, offset + begin)) {
+        return false;
+    }
+    stats.bytesWritten += end - begin;
+    return true;
+}
+
+std::optional<DeltaCopyStats> CopySparseFileDelta(const std::string& srcPath, const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges, const DeltaCopyOptions& options)
+{
+    FSUTIL_METRICS_SCOPE(CopySparseFile);
+    const size_t DELTA_BUFFER_SIZE = 1024 * 1024;
+    ScopedFd inFd(::open(srcPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (inFd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    /* no O_EXCL, the point is to reuse the blocks already there */
+    ScopedFd outFd(::open(dstPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if (outFd.Get() < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    struct stat srcStat {};
+    struct stat dstStat {};
+    if (::fstat(inFd.Get(), &srcStat) < 0 || ::fstat(outFd.Get(), &dstStat) < 0 || !S_ISREG(dstStat.st_mode)) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    /* blocks past the old end read as zeros once extended, so they are holes to compare against */
+    uint64_t fileSize = static_cast<uint64_t>(srcStat.st_size);
+    if (static_cast<uint64_t>(dstStat.st_size) != fileSize && ::ftruncate(outFd.Get(), srcStat.st_size) < 0) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    uint64_t fsBlockSize = dstStat.st_blksize > 0 ? static_cast<uint64_t>(dstStat.st_blksize) : 1;
+    uint64_t blockSize = (std::max<uint64_t>(options.blockSize, 1) + fsBlockSize - 1) / fsBlockSize * fsBlockSize;
+    std::vector<char> buffer(std::max<size_t>(DELTA_BUFFER_SIZE / blockSize, 1) * blockSize);
+    std::vector<char> dstBuffer(buffer.size());
+    DeltaCopyStats stats;
+    uint64_t nextBlock = 0;
+    for (const std::pair<uint64_t, uint64_t>& range : ranges) {
+        uint64_t block = std::max(range.first / blockSize, nextBlock);
+        uint64_t endBlock = (std::min(range.first + range.second, fileSize) + blockSize - 1) / blockSize;
+        while (block < endBlock) {
+            uint64_t count = std::min<uint64_t>(endBlock - block, buffer.size() / blockSize);
+            uint64_t offset = block * blockSize;
+            uint64_t length = std::min(count * blockSize, fileSize - offset);
+            /**
+            * bytes of the block outside the ranges are holes of the source and read as zeros, so do target holes,
+            * the blocks are compared byte by byte, a checksum would leave a colliding stale block in place
+            */
+            if (!PreadFully(inFd.Get(), buffer.data(), length, offset) ||
+                !PreadFully(outFd.Get(), dstBuffer.data(), length, offset)) {
+                FSUTIL_METRICS_FAILED();
+                return std::nullopt;
+            }
+            /* only the differing file system blocks are written, equal zeros stay holes of the target */
+            uint64_t runBegin = length; /* start of the differing bytes not written yet, length if none */
+            uint64_t changedBlock = UINT64_MAX;
+            for (uint64_t position = 0; position < length; position += fsBlockSize) {
+                size_t chunk = static_cast<size_t>(std::min(fsBlockSize, length - position));
+                if (std::memcmp(buffer.data() + position, dstBuffer.data() + position, chunk) != 0) {
+                    runBegin = std::min(runBegin, position);
+                    if (position / blockSize != changedBlock) {
+                        changedBlock = position / blockSize;
+                        stats.changedBlocks++;
+                    }
+                } else if (runBegin != length) {
+                    if (!WriteDeltaRun(outFd.Get(), buffer.data(), runBegin, position, offset, stats)) {
+                        FSUTIL_METRICS_FAILED();
+                        return std::nullopt;
+                    }
+                    runBegin = length;
+                }
+            }
+            if (runBegin != length && !WriteDeltaRun(outFd.Get(), buffer.data(), runBegin, length, offset, stats)) {
+                FSUTIL_METRICS_FAILED();
+                return std::nullopt;
+            }
+            stats.blocks += count;
+            block += count;
+        }
+        nextBlock = std::max(nextBlock, endBlock);
+    }
+    /* target data left where the source has holes, ranges are sorted */
+    SparseRangeResult dstRanges = QuerySeekDataRanges(outFd.Get());
+    if (!dstRanges) {
+        FSUTIL_METRICS_FAILED();
+        return std::nullopt;
+    }
+    size_t srcIndex = 0;
+    for (const std::pair<uint64_t, uint64_t>& dstRange : dstRanges.value()) {
+        uint64_t offset = dstRange.first;
+        uint64_t end = std::min(dstRange.first + dstRange.second, fileSize);
+        while (offset < end) {
+            while (srcIndex < ranges.size() && ranges[srcIndex].first + ranges[srcIndex].second <= offset) {
+                ++srcIndex;
+            }
+            uint64_t holeEnd = srcIndex < ranges.size() ? std::min(end, ranges[srcIndex].first) : end;
+            if (offset < holeEnd) {
+                if (!PunchOrZeroRange(outFd.Get(), offset, holeEnd - offset, buffer)) {
+                    FSUTIL_METRICS_FAILED();
+                    return std::nullopt;
+                }
+                stats.bytesPunched += holeEnd - offset;
+                offset = holeEnd;
+            } else {
+                offset = std::min(end, ranges[srcIndex].first + ranges[srcIndex].second);
+            }
+        }
+    }
+    return stats;
+}
+#endif
+
+bool HashTree(const std::string& root, const HashTreeOptions& options, const HashTreeVisitor& visitor)
+{
+    WalkTreeOptions walkOptions;
+    walkOptions.threads = options.threads > 0 ?
+        options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    walkOptions.followSymlink = options.followSymlink;
+    std::vector<std::vector<std::pair<std::string, StatResult>>> workerFiles(walkOptions.threads);
+    bool walked = WalkTree(root, walkOptions,
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext& context) {
+            if (statResult && !statResult->IsDirectory()) {
+#ifdef __linux__
+                if (!statResult->IsRegular()) {
+                    return true;
+                }
+#endif
+                workerFiles[context.workerIndex].emplace_back(entry.FullPath(), statResult.value());
+            }
+            return true;
+        });
+    if (!walked) {
+        return false;
+    }
+    std::vector<std::pair<std::string, StatResult>> files;
+    for (std::vector<std::pair<std::string, StatResult>>& entries : workerFiles) {
+        std::move(entries.begin(), entries.end(), std::back_inserter(files));
+        entries.clear();
+    }
+    /* largest first, so a huge file picked last does not leave the other workers idle */
+    std::sort(files.begin(), files.end(),
+        [](const std::pair<std::string, StatResult>& lhs, const std::pair<std::string, StatResult>& rhs) {
+            return lhs.second.Size() > rhs.second.Size();
+        });
+#ifdef __linux__
+    if (options.physicalOrder) {
+        /* workers pick the files by increasing index, so the reads follow the disk head */
+        std::vector<std::string> paths;
+        paths.reserve(files.size());
+        for (const std::pair<std::string, StatResult>& file : files) {
+            paths.push_back(file.first);
+        }
+        std::vector<size_t> order = PhysicalReadOrder(paths, walkOptions.threads);
+        std::vector<std::pair<std::string, StatResult>> ordered;
+        ordered.reserve(files.size());
+        for (size_t index : order) {
+            ordered.push_back(std::move(files[index]));
+        }
+        files.swap(ordered);
+    }
+#endif
+    std::vector<std::vector<char>> workerBuffers(walkOptions.threads);
+    ParallelFor(files.size(), walkOptions.threads, [&](size_t index, int workerIndex) {
+        std::unique_ptr<Hasher> hasher = CreateHasher(options.fileOptions.algorithm);
+        std::optional<std::string> digest;
+        if (HashFileWithBuffer(files[index].first, *hasher, options.fileOptions, workerBuffers[workerIndex])) {
+            digest = hasher->Final();
+        }
+        visitor(files[index].first, files[index].second, digest);
+    });
+    return true;
+}
+
+
+namespace {
+struct DuplicateCandidate {
+    std::string path;
+    uint64_t size;
+    uint64_t deviceId;
+    uint64_t uniqueId;
+    std::string digest; /* digest of the sample, then of the full content */
+};
+
+using DuplicateCandidateEqual = std::function<bool(const DuplicateCandidate&, const DuplicateCandidate&)>;
+}
+
+/* keep only the candidates belonging to a run of at least two equal neighbours */
+static void KeepDuplicateRuns(std::vector<DuplicateCandidate>& candidates, const DuplicateCandidateEqual& equal)
+{
+    std::vector<DuplicateCandidate> survivors;
+    for (size_t begin = 0, end = 0; begin < candidates.size(); begin = end) {
+        for (end = begin + 1; end < candidates.size() && equal(candidates[begin], candidates[end]); ++end) {}
+        if (end - begin >= 2) {
+            std::move(candidates.begin() + begin, candidates.begin() + end, std::back_inserter(survivors));
+        }
+    }
+    candidates.swap(survivors);
+}
+
+static void SortByDigest(std::vector<DuplicateCandidate>& candidates)
+{
+    std::sort(candidates.begin(), candidates.end(), [](const DuplicateCandidate& lhs, const DuplicateCandidate& rhs) {
+        return lhs.size != rhs.size ? lhs.size > rhs.size : (lhs.digest != rhs.digest ? lhs.digest < rhs.digest : lhs.path < rhs.path);
+    });
+}
+
+static bool SameDigest(const DuplicateCandidate& lhs, const DuplicateCandidate& rhs)
+{
+    return lhs.size == rhs.size && !lhs.digest.empty() && lhs.digest == rhs.digest;
+}
+
+/* hash sampleSize bytes at the head and at the tail, the whole content if the file is smaller than both */
+static std::optional<std::string> HashFileSample(
+    const DuplicateCandidate& candidate, const FindDuplicatesOptions& options, std::vector<char>& storage)
+{
+    size_t bufferSize = static_cast<size_t>(std::max<uint64_t>(options.sampleSize, HASH_BUFFER_ALIGNMENT));
+    char* buffer = AlignedHashBuffer(storage, bufferSize);
+    uint64_t headLength = std::min(candidate.size, options.sampleSize);
+    uint64_t tailOffset = std::max(headLength, candidate.size - std::min(candidate.size, options.sampleSize));
+    std::unique_ptr<Hasher> hasher = CreateHasher(options.algorithm);
+#ifdef __linux__
+    ScopedFd fd(::open(candidate.path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0 ||
+        !HashRangeRead(fd.Get(), 0, headLength, buffer, bufferSize, *hasher) ||
+        !HashRangeRead(fd.Get(), tailOffset, candidate.size - tailOffset, buffer, bufferSize, *hasher)) {
+        return std::nullopt;
+    }
+#endif
+#ifdef _WIN32
+    HANDLE hFile = ::CreateFileW(ConvertWin32UnicodePath(Utf8ToUtf16(candidate.path)).c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    std::unique_ptr<void, decltype(&::CloseHandle)> fileGuard(hFile, &::CloseHandle);
+    if (!HashRangeRead(hFile, 0, headLength, buffer, bufferSize, *hasher) ||
+        !HashRangeRead(hFile, tailOffset, candidate.size - tailOffset, buffer, bufferSize, *hasher)) {
+        return std::nullopt;
+    }
+#endif
+    return hasher->Final();
+}
+
+std::optional<FindDuplicatesResult> FindDuplicates(const std::string& root, const FindDuplicatesOptions& options)
+{
+    WalkTreeOptions walkOptions;
+    walkOptions.threads = options.threads > 0 ?
+        options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    walkOptions.followSymlink = options.followSymlink;
+    std::vector<std::vector<DuplicateCandidate>> workerCandidates(walkOptions.threads);
+    bool walked = WalkTree(root, walkOptions,
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext& context) {
+#ifdef __linux__
+            bool regular = statResult && statResult->IsRegular();
+#endif
+#ifdef _WIN32
+            bool regular = statResult && !statResult->IsDirectory() && !statResult->IsReparsePoint();
+#endif
+            if (regular && statResult->Size() >= options.minSize) {
+                workerCandidates[context.workerIndex].push_back(DuplicateCandidate {
+                    entry.FullPath(), statResult->Size(), statResult->DeviceID(), statResult->UniqueID(), "" });
+            }
+            return true;
+        });
+    if (!walked) {
+        return std::nullopt;
+    }
+    FindDuplicatesResult result;
+    std::vector<DuplicateCandidate> candidates;
+    for (std::vector<DuplicateCandidate>& entries : workerCandidates) {
+        std::move(entries.begin(), entries.end(), std::back_inserter(candidates));
+        entries.clear();
+    }
+    result.files = candidates.size();
+
+    /* tier 1: size, hardlinks of the same inode are collapsed to the smallest path */
+    std::sort(candidates.begin(), candidates.end(), [](const DuplicateCandidate& lhs, const DuplicateCandidate& rhs) {
+        if (lhs.size != rhs.size) {
+            return lhs.size > rhs.size;
+        }
+        if (lhs.deviceId != rhs.deviceId) {
+            return lhs.deviceId < rhs.deviceId;
+        }
+        return lhs.uniqueId != rhs.uniqueId ? lhs.uniqueId < rhs.uniqueId : lhs.path < rhs.path;
+    });
+    candidates.erase(std::unique(candidates.begin(), candidates.end(),
+        [](const DuplicateCandidate& lhs, const DuplicateCandidate& rhs) {
+            return lhs.deviceId == rhs.deviceId && lhs.uniqueId == rhs.uniqueId;
+        }), candidates.end());
+    for (const DuplicateCandidate& candidate : candidates) {
+        result.totalBytes += candidate.size;
+    }
+    KeepDuplicateRuns(candidates, [](const DuplicateCandidate& lhs, const DuplicateCandidate& rhs) {
+        return lhs.size == rhs.size;
+    });
+
+    /* tier 2: head/tail sample */
+    std::atomic<uint64_t> bytesHashed { 0 };
+    std::vector<std::vector<char>> workerBuffers(walkOptions.threads);
+    ParallelFor(candidates.size(), walkOptions.threads, [&](size_t index, int workerIndex) {
+        DuplicateCandidate& candidate = candidates[index];
+        std::optional<std::string> digest = HashFileSample(candidate, options, workerBuffers[workerIndex]);
+        candidate.digest = digest ? digest.value() : std::string();
+        bytesHashed += std::min(candidate.size, options.sampleSize * 2);
+    });
+    SortByDigest(candidates);
+    KeepDuplicateRuns(candidates, SameDigest);
+
+    /* tier 3: full content of the files not entirely covered by the sample */
+    HashFileOptions fileOptions;
+    fileOptions.algorithm = options.algorithm;
+    ParallelFor(candidates.size(), walkOptions.threads, [&](size_t index, int workerIndex) {
+        DuplicateCandidate& candidate = candidates[index];
+        if (candidate.size <= options.sampleSize * 2) {
+            return;
+        }
+        std::unique_ptr<Hasher> hasher = CreateHasher(options.algorithm);
+        bool success = HashFileWithBuffer(candidate.path, *hasher, fileOptions, workerBuffers[workerIndex]);
+        candidate.digest = success ? hasher->Final() : std::string();
+        bytesHashed += candidate.size;
+    });
+    SortByDigest(candidates);
+    KeepDuplicateRuns(candidates, SameDigest);
+    result.bytesHashed = bytesHashed.load();
+
+    for (DuplicateCandidate& candidate : candidates) {
+        if (result.groups.empty() || result.groups.back().size != candidate.size ||
+            result.groups.back().digest != candidate.digest) {
+            result.groups.push_back(DuplicateGroup { candidate.size, candidate.digest, {} });
+        }
+        result.groups.back().paths.push_back(std::move(candidate.path));
+    }
+    return result;
+}
+
+namespace {
+/* direct content of one directory, entries of a directory are always read by the same worker in a row */
+struct DiskUsageDirectSums {
+    std::string path;
+    uint64_t apparentSize = 0;
+    uint64_t allocatedSize = 0;
+    uint64_t files = 0;
+    uint64_t directories = 0;
+};
+
+struct DiskUsageSubdirectory {
+    std::string path;
+    std::string parentPath;
+    int depth;
+    uint64_t apparentSize; /* of the directory itself */
+    uint64_t allocatedSize;
+};
+
+/* files with more than one link, counted once after the walk */
+struct DiskUsageHardlink {
+    uint64_t deviceId;
+    uint64_t uniqueId;
+    uint64_t apparentSize;
+    uint64_t allocatedSize;
+    std::string dirPath;
+};
+
+/* owned by one worker, so the visitor never takes a lock */
+struct DiskUsageAccumulator {
+    std::vector<DiskUsageDirectSums> sums;
+    std::vector<DiskUsageSubdirectory> subdirectories;
+    std::vector<DiskUsageHardlink> hardlinks;
+};
+}
+
+std::optional<DiskUsageResult> DiskUsage(const std::string& root, const DiskUsageOptions& options)
+{
+    std::optional<StatResult> rootStatResult = Stat(root);
+    WalkTreeOptions walkOptions;
+    walkOptions.threads = options.threads > 0 ?
+        options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    walkOptions.followSymlink = options.followSymlink;
+    std::vector<DiskUsageAccumulator> accumulators(walkOptions.threads);
+    bool walked = rootStatResult && WalkTree(root, walkOptions,
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext& context) {
+            DiskUsageAccumulator& accumulator = accumulators[context.workerIndex];
+            if (accumulator.sums.empty() || accumulator.sums.back().path != context.dirPath) {
+                accumulator.sums.emplace_back();
+                accumulator.sums.back().path = std::string(context.dirPath);
+            }
+            if (!statResult) {
+                return true;
+            }
+            DiskUsageDirectSums& sums = accumulator.sums.back();
+            bool isDirectory = statResult->IsDirectory();
+#ifdef _WIN32
+            isDirectory = isDirectory && (options.followSymlink || !statResult->IsReparsePoint());
+#endif
+            if (isDirectory) {
+                sums.directories++;
+                accumulator.subdirectories.push_back(DiskUsageSubdirectory { entry.FullPath(),
+                    std::string(context.dirPath), context.depth, statResult->Size(), statResult->AllocatedSize() });
+            } else if (statResult->LinksCount() > 1) {
+                accumulator.hardlinks.push_back(DiskUsageHardlink { statResult->DeviceID(), statResult->UniqueID(),
+                    statResult->Size(), statResult->AllocatedSize(), std::string(context.dirPath) });
+            } else {
+                sums.files++;
+                sums.apparentSize += statResult->Size();
+                sums.allocatedSize += statResult->AllocatedSize();
+            }
+            return true;
+        });
+    if (!walked) {
+        return std::nullopt;
+    }
+
+    DiskUsageResult result;
+    std::unordered_map<std::string, size_t> nodeIndex;
+    result.nodes.push_back(DiskUsageNode {
+        root, 0, rootStatResult->Size(), rootStatResult->AllocatedSize(), 0, 0, 0, {} });
+    nodeIndex.emplace(root, 0);
+    std::vector<DiskUsageSubdirectory> subdirectories;
+    for (DiskUsageAccumulator& accumulator : accumulators) {
+        std::move(accumulator.subdirectories.begin(), accumulator.subdirectories.end(),
+            std::back_inserter(subdirectories));
+        accumulator.subdirectories.clear();
+    }
+    /* a parent is always shallower than its children, so it's indexed first */
+    std::stable_sort(subdirectories.begin(), subdirectories.end(),
+        [](const DiskUsageSubdirectory& lhs, const DiskUsageSubdirectory& rhs) { return lhs.depth < rhs.depth; });
+    for (DiskUsageSubdirectory& subdirectory : subdirectories) {
+        size_t parent = nodeIndex[subdirectory.parentPath];
+        size_t index = result.nodes.size();
+        result.nodes[parent].children.push_back(index);
+        nodeIndex.emplace(subdirectory.path, index);
+        result.nodes.push_back(DiskUsageNode { std::move(subdirectory.path), subdirectory.depth,
+            subdirectory.apparentSize, subdirectory.allocatedSize, 0, 0, parent, {} });
+    }
+    subdirectories.clear();
+
+    std::vector<DiskUsageHardlink> hardlinks;
+    for (DiskUsageAccumulator& accumulator : accumulators) {
+        for (const DiskUsageDirectSums& sums : accumulator.sums) {
+            DiskUsageNode& node = result.nodes[nodeIndex[sums.path]];
+            node.apparentSize += sums.apparentSize;
+            node.allocatedSize += sums.allocatedSize;
+            node.files += sums.files;
+            node.directories += sums.directories;
+        }
+        std::move(accumulator.hardlinks.begin(), accumulator.hardlinks.end(), std::back_inserter(hardlinks));
+        accumulator.hardlinks.clear();
+    }
+    /* the link with the smallest directory path carries the inode */
+    std::sort(hardlinks.begin(), hardlinks.end(), [](const DiskUsageHardlink& lhs, const DiskUsageHardlink& rhs) {
+        if (lhs.deviceId != rhs.deviceId) {
+            return lhs.deviceId < rhs.deviceId;
+        }
+        return lhs.uniqueId != rhs.uniqueId ? lhs.uniqueId < rhs.uniqueId : lhs.dirPath < rhs.dirPath;
+    });
+    for (size_t index = 0; index < hardlinks.size(); ++index) {
+        if (index > 0 && hardlinks[index].deviceId == hardlinks[index - 1].deviceId &&
+            hardlinks[index].uniqueId == hardlinks[index - 1].uniqueId) {
+            continue;
+        }
+        DiskUsageNode& node = result.nodes[nodeIndex[hardlinks[index].dirPath]];
+        node.files++;
+        node.apparentSize += hardlinks[index].apparentSize;
+        node.allocatedSize += hardlinks[index].allocatedSize;
+    }
+
+    /* children follow their parent, so a reverse pass rolls every subtree up */
+    for (size_t index = result.nodes.size() - 1; index > 0; --index) {
+        const DiskUsageNode& node = result.nodes[index];
+        DiskUsageNode& parent = result.nodes[node.parent];
+        parent.apparentSize += node.apparentSize;
+        parent.allocatedSize += node.allocatedSize;
+        parent.files += node.files;
+        parent.directories += node.directories;
+    }
+    for (size_t index = 1; index < result.nodes.size(); ++index) {
+        result.top.push_back(index);
+    }
+    size_t topN = std::min(options.topN, result.top.size());
+    std::partial_sort(result.top.begin(), result.top.begin() + topN, result.top.end(), [&](size_t lhs, size_t rhs) {
+        return result.nodes[lhs].allocatedSize > result.nodes[rhs].allocatedSize;
+    });
+    result.top.resize(topN);
+    return result;
+}
+
+namespace {
+const uint32_t RESTORE_NO_ENTRY = UINT32_MAX;
+
+/* node of the restore trie, the root and the implicit parents have no manifest entry */
+struct RestoreNode {
+    std::string_view path; /* prefix of a manifest path, empty for the root */
+    uint32_t parent;
+    uint32_t entry; /* index in the manifest, RESTORE_NO_ENTRY for an implicit directory */
+    uint32_t depth;
+    bool isDirectory;
+};
+
+struct RestoreTrieKey {
+    uint32_t parent;
+    std::string_view name;
+    bool operator == (const RestoreTrieKey& other) const { return parent == other.parent && name == other.name; }
+};
+
+struct RestoreTrieKeyHash {
+    size_t operator () (const RestoreTrieKey& key) const
+    {
+        return std::hash<std::string_view>()(key.name) * 31 + key.parent;
+    }
+};
+
+struct RestoreTrie {
+    std::vector<RestoreNode> nodes; /* nodes[0] is the root, a parent always precedes its children */
+    std::vector<uint32_t> firstChild; /* children of node i are children[firstChild[i], firstChild[i + 1]) */
+    std::vector<uint32_t> children;
+    uint32_t maxDepth = 0;
+};
+}
+
+static std::string_view RestoreNodeName(const RestoreNode& node)
+{
+    size_t pos = node.path.rfind('/');
+    return pos == std::string_view::npos ? node.path : node.path.substr(pos + 1);
+}
+
+/* return the node of path, created if missing, RESTORE_NO_ENTRY if it conflicts with an existing one */
+static uint32_t InsertRestoreNode(
+    RestoreTrie& trie,
+    std::unordered_map<RestoreTrieKey, uint32_t, RestoreTrieKeyHash>& nodeIndex,
+    uint32_t parent,
+    std::string_view path,
+    uint32_t entry,
+    bool isDirectory)
+{
+    size_t pos = path.rfind('/');
+    RestoreTrieKey key { parent, pos == std::string_view::npos ? path : path.substr(pos + 1) };
+    auto it = nodeIndex.find(key);
+    if (it == nodeIndex.end()) {
+        uint32_t index = static_cast<uint32_t>(trie.nodes.size());
+        uint32_t depth = trie.nodes[parent].depth + 1;
+        trie.nodes.push_back(RestoreNode { path, parent, entry, depth, isDirectory });
+        trie.maxDepth = std::max(trie.maxDepth, depth);
+        nodeIndex.emplace(key, index);
+        return index;
+    }
+    RestoreNode& node = trie.nodes[it->second];
+    if (!node.isDirectory || !isDirectory || (entry != RESTORE_NO_ENTRY && node.entry != RESTORE_NO_ENTRY)) {
+        return RESTORE_NO_ENTRY;
+    }
+    if (entry != RESTORE_NO_ENTRY) {
+        node.entry = entry;
+    }
+    return it->second;
+}
+
+/* "", "." and ".." components are rejected, the restore never escapes the root */
+static bool IsValidRestorePath(std::string_view path)
+{
+    size_t begin = 0;
+    while (begin <= path.size()) {
+        size_t end = std::min(path.find('/', begin), path.size());
+        std::string_view name = path.substr(begin, end - begin);
+        if (name.empty() || name == "." || name == "..") {
+            return false;
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+static void BuildRestoreTrie(const std::vector<RestoreEntry>& manifest, RestoreTrie& trie, RestoreTreeResult& result)
+{
+    std::unordered_map<RestoreTrieKey, uint32_t, RestoreTrieKeyHash> nodeIndex;
+    nodeIndex.reserve(manifest.size());
+    trie.nodes.reserve(manifest.size() + 1);
+    trie.nodes.push_back(RestoreNode { std::string_view(), 0, RESTORE_NO_ENTRY, 0, true });
+    /* manifests are mostly grouped by directory, the parent of the previous entry is reused without a lookup */
+    std::string_view lastDirPath;
+    uint32_t lastDirNode = 0;
+    for (uint32_t entryIndex = 0; entryIndex < manifest.size(); ++entryIndex) {
+        const RestoreEntry& entry = manifest[entryIndex];
+        std::string_view path = entry.path;
+        if (!IsValidRestorePath(path)) {
+            result.errors.emplace_back(entry.path, EINVAL);
+            continue;
+        }
+        size_t pos = path.rfind('/');
+        std::string_view dirPath = pos == std::string_view::npos ? std::string_view() : path.substr(0, pos);
+        uint32_t parent = 0;
+        if (!dirPath.empty() && dirPath == lastDirPath) {
+            parent = lastDirNode;
+        } else {
+            for (size_t end = 0; parent != RESTORE_NO_ENTRY && end < dirPath.size();) {
+                end = std::min(dirPath.find('/', end + 1), dirPath.size());
+                parent = InsertRestoreNode(trie, nodeIndex, parent, dirPath.substr(0, end), RESTORE_NO_ENTRY, true);
+            }
+        }
+        uint32_t node = parent == RESTORE_NO_ENTRY ? RESTORE_NO_ENTRY :
+            InsertRestoreNode(trie, nodeIndex, parent, path, entryIndex, entry.isDirectory);
+        if (node == RESTORE_NO_ENTRY) {
+            /* a file is also used as a directory, or the path is duplicated */
+            result.errors.emplace_back(entry.path, EEXIST);
+            continue;
+        }
+        lastDirPath = dirPath;
+        lastDirNode = parent;
+    }
+    /* children are laid out contiguously per parent, in creation order */
+    trie.firstChild.assign(trie.nodes.size() + 1, 0);
+    for (uint32_t index = 1; index < trie.nodes.size(); ++index) {
+        trie.firstChild[trie.nodes[index].parent + 1]++;
+    }
+    for (size_t index = 1; index < trie.firstChild.size(); ++index) {
+        trie.firstChild[index] += trie.firstChild[index - 1];
+    }
+    trie.children.resize(trie.nodes.size() - 1);
+    std::vector<uint32_t> fill(trie.firstChild.begin(), trie.firstChild.end() - 1);
+    for (uint32_t index = 1; index < trie.nodes.size(); ++index) {
+        trie.children[fill[trie.nodes[index].parent]++] = index;
+    }
+}
+
+#ifdef __linux__
+namespace {
+struct RestoreTreeState {
+    RestoreTreeState(const std::vector<RestoreEntry>& manifest, const RestoreTrie& trie,
+        const RestoreTreeOptions& options, int rootFd)
+        : manifest(manifest), trie(trie), options(options), rootFd(rootFd) {}
+
+    const std::vector<RestoreEntry>& manifest;
+    const RestoreTrie& trie;
+    const RestoreTreeOptions& options;
+    int rootFd;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<uint32_t> tasks; /* directories created but not populated yet */
+    int running = 0;
+    std::atomic<uint64_t> directories { 0 };
+    std::atomic<uint64_t> files { 0 };
+};
+}
+
+/* open a restored directory relative to the root fd, the root fd itself is returned for the root */
+static int OpenRestoreDirectory(int rootFd, const RestoreNode& node, std::string& pathBuffer)
+{
+    if (node.path.empty()) {
+        return rootFd;
+    }
+    pathBuffer.assign(node.path);
+    return ::openat(rootFd, pathBuffer.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* return false if the entry keeps both of its current timestamps */
+static bool RestoreTimestamps(const RestoreEntry& entry, struct timespec times[2])
+{
+    const uint64_t NANOSECONDS_PER_SECOND = 1000000000ULL;
+    uint64_t timeNano[2] = { entry.accessTimeNano, entry.modifyTimeNano };
+    for (int index = 0; index < 2; ++index) {
+        times[index].tv_sec = static_cast<time_t>(timeNano[index] / NANOSECONDS_PER_SECOND);
+        times[index].tv_nsec = timeNano[index] == 0 ?
+            UTIME_OMIT : static_cast<long>(timeNano[index] % NANOSECONDS_PER_SECOND);
+    }
+    return entry.accessTimeNano != 0 || entry.modifyTimeNano != 0;
+}
+
+static bool ApplyRestoreMetadataAt(int dirFd, const char* name, const RestoreEntry& entry)
+{
+    if ((entry.uid >= 0 || entry.gid >= 0) && ::fchownat(dirFd, name,
+        static_cast<uid_t>(entry.uid), static_cast<gid_t>(entry.gid), AT_SYMLINK_NOFOLLOW) < 0) {
+        return false;
+    }
+    if (entry.mode != 0 && ::fchmodat(dirFd, name, static_cast<mode_t>(entry.mode & 07777), 0) < 0) {
+        return false;
+    }
+    struct timespec times[2] {};
+    return !RestoreTimestamps(entry, times) || ::utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+static int CreateRestoreFile(int dirFd, const char* name, const RestoreEntry& entry, const RestoreTreeOptions& options)
+{
+    int fd = ::openat(dirFd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+        options.applyMetadata && entry.mode != 0 ? S_IRUSR | S_IWUSR : 0666);
+    if (fd < 0) {
+        return errno;
+    }
+    ScopedFd file(fd);
+    if (options.preallocate && entry.size > 0 &&
+        ::fallocate(fd, 0, 0, static_cast<off_t>(entry.size)) < 0 &&
+        (errno != EOPNOTSUPP || ::ftruncate(fd, static_cast<off_t>(entry.size)) < 0)) {
+        return errno;
+    }
+    if (!options.applyMetadata) {
+        return 0;
+    }
+    /* the file is opened already, its metadata is applied by fd instead of a later lookup */
+    if ((entry.uid >= 0 || entry.gid >= 0) &&
+        ::fchown(fd, static_cast<uid_t>(entry.uid), static_cast<gid_t>(entry.gid)) < 0) {
+        return errno;
+    }
+    if (entry.mode != 0 && ::fchmod(fd, static_cast<mode_t>(entry.mode & 07777)) < 0) {
+        return errno;
+    }
+    struct timespec times[2] {};
+    return !RestoreTimestamps(entry, times) || ::futimens(fd, times) == 0 ? 0 : errno;
+}
+
+/* create the children of a directory, return the subdirectories to be populated */
+static void PopulateRestoreDirectory(
+    RestoreTreeState& state,
+    uint32_t nodeIndex,
+    std::string& pathBuffer,
+    std::string& nameBuffer,
+    std::vector<uint32_t>& subdirectories,
+    std::vector<std::pair<std::string, int>>& errors)
+{
+    const RestoreTrie& trie = state.trie;
+    int dirFd = OpenRestoreDirectory(state.rootFd, trie.nodes[nodeIndex], pathBuffer);
+    if (dirFd < 0) {
+        /* the whole subtree is skipped, only the directory is reported */
+        errors.emplace_back(std::string(trie.nodes[nodeIndex].path), errno);
+        return;
+    }
+    uint64_t directories = 0;
+    uint64_t files = 0;
+    for (uint32_t childIndex = trie.firstChild[nodeIndex]; childIndex < trie.firstChild[nodeIndex + 1]; ++childIndex) {
+        uint32_t child = trie.children[childIndex];
+        const RestoreNode& node = trie.nodes[child];
+        nameBuffer.assign(RestoreNodeName(node));
+        if (node.isDirectory) {
+            /* owner only until the final pass, a read-only mode must not prevent the children from being created */
+            bool deferredMode = state.options.applyMetadata && node.entry != RESTORE_NO_ENTRY &&
+                state.manifest[node.entry].mode != 0;
+            if (::mkdirat(dirFd, nameBuffer.c_str(), deferredMode ? S_IRWXU : 0777) < 0 && errno != EEXIST) {
+                errors.emplace_back(std::string(node.path), errno);
+                continue;
+            }
+            directories++;
+            subdirectories.push_back(child);
+            continue;
+        }
+        int error = CreateRestoreFile(dirFd, nameBuffer.c_str(), state.manifest[node.entry], state.options);
+        if (error != 0) {
+            errors.emplace_back(std::string(node.path), error);
+            continue;
+        }
+        files++;
+    }
+    if (dirFd != state.rootFd) {
+        ::close(dirFd);
+    }
+    state.directories += directories;
+    state.files += files;
+}
+
+static void RestoreTreeWorker(RestoreTreeState& state, std::vector<std::pair<std::string, int>>& errors)
+{
+    std::string pathBuffer;
+    std::string nameBuffer;
+    std::vector<uint32_t> subdirectories;
+    std::unique_lock<std::mutex> lock(state.mutex);
+    while (true) {
+        state.cond.wait(lock, [&state]() { return !state.tasks.empty() || state.running == 0; });
+        if (state.tasks.empty()) {
+            return;
+        }
+        /* LIFO keeps a worker inside the subtree it has just created */
+        uint32_t nodeIndex = state.tasks.back();
+        state.tasks.pop_back();
+        state.running++;
+        lock.unlock();
+        subdirectories.clear();
+        PopulateRestoreDirectory(state, nodeIndex, pathBuffer, nameBuffer, subdirectories, errors);
+        lock.lock();
+        state.running--;
+        state.tasks.insert(state.tasks.end(), subdirectories.rbegin(), subdirectories.rend());
+        if (!subdirectories.empty() || (state.running == 0 && state.tasks.empty())) {
+            state.cond.notify_all();
+        }
+    }
+}
+
+/* children before parents, a restored mode without write/search permission is applied last */
+static void ApplyRestoreDirectoryMetadata(
+    RestoreTreeState& state, int threads, std::vector<std::vector<std::pair<std::string, int>>>& workerErrors)
+{
+    const RestoreTrie& trie = state.trie;
+    std::vector<std::vector<uint32_t>> levels(trie.maxDepth + 1);
+    for (uint32_t index = 0; index < trie.nodes.size(); ++index) {
+        const RestoreNode& node = trie.nodes[index];
+        if (index != 0 && node.isDirectory && node.entry != RESTORE_NO_ENTRY &&
+            (levels[node.depth - 1].empty() || levels[node.depth - 1].back() != node.parent)) {
+            levels[node.depth - 1].push_back(node.parent);
+        }
+    }
+    std::vector<std::string> pathBuffers(threads);
+    std::vector<std::string> nameBuffers(threads);
+    for (size_t depth = levels.size(); depth > 0; --depth) {
+        std::vector<uint32_t>& parents = levels[depth - 1];
+        std::sort(parents.begin(), parents.end());
+        parents.erase(std::unique(parents.begin(), parents.end()), parents.end());
+        ParallelFor(parents.size(), threads, [&](size_t index, int workerIndex) {
+            uint32_t parent = parents[index];
+            int dirFd = OpenRestoreDirectory(state.rootFd, trie.nodes[parent], pathBuffers[workerIndex]);
+            if (dirFd < 0) {
+                return;
+            }
+            for (uint32_t childIndex = trie.firstChild[parent]; childIndex < trie.firstChild[parent + 1]; ++childIndex) {
+                const RestoreNode& node = trie.nodes[trie.children[childIndex]];
+                if (!node.isDirectory || node.entry == RESTORE_NO_ENTRY) {
+                    continue;
+                }
+                nameBuffers[workerIndex].assign(RestoreNodeName(node));
+                if (!ApplyRestoreMetadataAt(dirFd, nameBuffers[workerIndex].c_str(), state.manifest[node.entry])) {
+                    workerErrors[workerIndex].emplace_back(std::string(node.path), errno);
+                }
+            }
+            if (dirFd != state.rootFd) {
+                ::close(dirFd);
+            }
+        });
+    }
+}
+#endif
+
+#ifdef _WIN32
+static bool SetRestoreFileTimeW(HANDLE hFile, const RestoreEntry& entry)
+{
+    const uint64_t UNIX_TIME_START = 0x019DB1DED53E8000; /* January 1, 1970 (start of Unix epoch) in "ticks" */
+    const uint64_t NANOSECONDS_PER_TICK = 100;
+    if (entry.accessTimeNano == 0 && entry.modifyTimeNano == 0) {
+        return true;
+    }
+    FILETIME fileTimes[2] {};
+    uint64_t timeNano[2] = { entry.accessTimeNano, entry.modifyTimeNano };
+    for (int index = 0; index < 2; ++index) {
+        ULARGE_INTEGER ticks {};
+        ticks.QuadPart = timeNano[index] / NANOSECONDS_PER_TICK + UNIX_TIME_START;
+        fileTimes[index].dwLowDateTime = ticks.LowPart;
+        fileTimes[index].dwHighDateTime = ticks.HighPart;
+    }
+    return ::SetFileTime(hFile, nullptr,
+        entry.accessTimeNano == 0 ? nullptr : &fileTimes[0],
+        entry.modifyTimeNano == 0 ? nullptr : &fileTimes[1]) != 0;
+}
+
+/* parents precede their children in the trie, nodes are created sequentially in order */
+static void RestoreTreeWin32(
+    const std::string& root,
+    const std::vector<RestoreEntry>& manifest,
+    const RestoreTrie& trie,
+    const RestoreTreeOptions& options,
+    RestoreTreeResult& result)
+{
+    std::vector<bool> failed(trie.nodes.size(), false);
+    std::vector<std::wstring> wPaths(trie.nodes.size());
+    wPaths[0] = Utf8ToUtf16(root);
+    for (uint32_t index = 1; index < trie.nodes.size(); ++index) {
+        const RestoreNode& node = trie.nodes[index];
+        if (failed[node.parent]) {
+            failed[index] = true;
+            continue;
+        }
+        wPaths[index] = wPaths[node.parent] + L"\\" + Utf8ToUtf16(std::string(RestoreNodeName(node)));
+        std::wstring wPathUnicode = ConvertWin32UnicodePath(wPaths[index]);
+        if (node.isDirectory) {
+            if (!::CreateDirectoryW(wPathUnicode.c_str(), nullptr) && ::GetLastError() != ERROR_ALREADY_EXISTS) {
+                result.errors.emplace_back(std::string(node.path), static_cast<int>(::GetLastError()));
+                failed[index] = true;
+                continue;
+            }
+            result.directories++;
+            continue;
+        }
+        const RestoreEntry& entry = manifest[node.entry];
+        HANDLE hFile = ::CreateFileW(wPathUnicode.c_str(), GENERIC_WRITE | FILE_WRITE_ATTRIBUTES, 0, nullptr,
+            CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            result.errors.emplace_back(std::string(node.path), static_cast<int>(::GetLastError()));
+            continue;
+        }
+        bool success = true;
+        if (options.preallocate && entry.size > 0) {
+            FILE_END_OF_FILE_INFO endOfFileInfo {};
+            endOfFileInfo.EndOfFile.QuadPart = static_cast<LONGLONG>(entry.size);
+            success = ::SetFileInformationByHandle(hFile, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)) != 0;
+        }
+        if (success && options.applyMetadata) {
+            success = SetRestoreFileTimeW(hFile, entry);
+        }
+        if (!success) {
+            result.errors.emplace_back(std::string(node.path), static_cast<int>(::GetLastError()));
+        } else {
+            result.files++;
+        }
+        ::CloseHandle(hFile);
+    }
+    if (!options.applyMetadata) {
+        return;
+    }
+    /* children follow their parent, a reverse pass stamps the directories once they are populated */
+    for (uint32_t index = static_cast<uint32_t>(trie.nodes.size()) - 1; index > 0; --index) {
+        const RestoreNode& node = trie.nodes[index];
+        if (!node.isDirectory || node.entry == RESTORE_NO_ENTRY || failed[index]) {
+            continue;
+        }
+        HANDLE hDir = ::CreateFileW(ConvertWin32UnicodePath(wPaths[index]).c_str(), FILE_WRITE_ATTRIBUTES,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+        if (hDir == INVALID_HANDLE_VALUE || !SetRestoreFileTimeW(hDir, manifest[node.entry])) {
+            result.errors.emplace_back(std::string(node.path), static_cast<int>(::GetLastError()));
+        }
+        if (hDir != INVALID_HANDLE_VALUE) {
+            ::CloseHandle(hDir);
+        }
+    }
+}
+#endif
+
+std::optional<RestoreTreeResult> RestoreTree(
+    const std::string& root, const std::vector<RestoreEntry>& manifest, const RestoreTreeOptions& options)
+{
+    if (!IsDirectory(root) && !MkdirRecursive(root)) {
+        return std::nullopt;
+    }
+    RestoreTreeResult result;
+    RestoreTrie trie;
+    BuildRestoreTrie(manifest, trie, result);
+#ifdef __linux__
+    int rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        return std::nullopt;
+    }
+    ScopedFd rootDir(rootFd);
+    int threads = options.threads > 0 ?
+        options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    RestoreTreeState state(manifest, trie, options, rootFd);
+    state.tasks.push_back(0);
+    std::vector<std::vector<std::pair<std::string, int>>> workerErrors(threads);
+    std::vector<std::thread> workers;
+    for (int workerIndex = 1; workerIndex < threads; ++workerIndex) {
+        workers.emplace_back(RestoreTreeWorker, std::ref(state), std::ref(workerErrors[workerIndex]));
+    }
+    RestoreTreeWorker(state, workerErrors[0]);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (options.applyMetadata) {
+        ApplyRestoreDirectoryMetadata(state, threads, workerErrors);
+    }
+    result.directories = state.directories.load();
+    result.files = state.files.load();
+    for (std::vector<std::pair<std::string, int>>& errors : workerErrors) {
+        std::move(errors.begin(), errors.end(), std::back_inserter(result.errors));
+    }
+#endif
+#ifdef _WIN32
+    RestoreTreeWin32(root, manifest, trie, options, result);
+#endif
+    return result;
+}
+
+std::optional<RestoreTreeResult> RestoreTree(
+    const std::string& root, const TreeSnapshot& snapshot, const RestoreTreeOptions& options)
+{
+    std::vector<RestoreEntry> manifest;
+    manifest.reserve(snapshot.Size());
+    uint64_t skipped = 0;
+    for (TreeSnapshotCursor cursor(snapshot); cursor.Valid(); cursor.Next()) {
+        const TreeSnapshotRecord& record = cursor.Record();
+        RestoreEntry entry;
+#ifdef __linux__
+        if (!S_ISDIR(record.mode) && !S_ISREG(record.mode)) {
+            skipped++;
+            continue;
+        }
+        entry.isDirectory = S_ISDIR(record.mode);
+        entry.mode = record.mode;
+#endif
+#ifdef _WIN32
+        if ((record.mode & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
+            skipped++;
+            continue;
+        }
+        entry.isDirectory = (record.mode & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#endif
+        entry.path = std::string(cursor.Path());
+        entry.size = entry.isDirectory ? 0 : record.size;
+        entry.accessTimeNano = record.accessTimeNano;
+        entry.modifyTimeNano = record.modifyTimeNano;
+        manifest.push_back(std::move(entry));
+    }
+    std::optional<RestoreTreeResult> result = RestoreTree(root, manifest, options);
+    if (result) {
+        result->skipped = skipped;
+    }
+    return result;
+}
+
+#ifdef _WIN32
+/* _WIN32 Volumes related API */
+std::vector<std::wstring> GetWin32DriverListW()
+{
+    std::vector<std::wstring> wdrivers;
+    DWORD dwLen = ::GetLogicalDriveStrings(0, nullptr); /* the length of volumes str */
+    if (dwLen <= 0) {
+        return wdrivers;
+    }
+    wchar_t* pszDriver = new wchar_t[dwLen];
+    ::GetLogicalDriveStringsW(dwLen, pszDriver);
+    wchar_t* pDriver = pszDriver;
+    while (*pDriver != '\0') {
+        std::wstring wDriver = std::wstring(pDriver);
+        wdrivers.push_back(wDriver);
+        pDriver += wDriver.length() + 1;
+    }
+    delete[] pszDriver;
+    pszDriver = nullptr;
+    pDriver = nullptr;
+    return wdrivers;
+}
+
+std::vector<std::string> GetWin32DriverList()
+{
+    std::vector<std::string> drivers;
+    std::vector<std::wstring> wdrivers = GetWin32DriverListW();
+    for (const std::wstring& wDriver : wdrivers) {
+        drivers.push_back(Utf16ToUtf8(wDriver));
+    }
+    return drivers;
+}
+
+/* member methods implementation for Win32VolumeDetail */
+Win32VolumesDetail::Win32VolumesDetail(const std::wstring& wVolumeName) : m_wVolumeName(wVolumeName) {}
+
+std::wstring Win32VolumesDetail::VolumeNameW() const { return m_wVolumeName; }
+
+std::string Win32VolumesDetail::VolumeName() const { return Utf16ToUtf8(m_wVolumeName); }
+
+std::optional<std::wstring> Win32VolumesDetail::GetVolumeDeviceNameW()
+{
+    if (m_wVolumeName.size() < 4 ||
+        m_wVolumeName[0] != L'\\' ||
+        m_wVolumeName[1] != L'\\' ||
+        m_wVolumeName[2] != L'?' ||
+        m_wVolumeName[3] != L'\\' ||
+        m_wVolumeName.back() != L'\\') { /* illegal volume name */
+        return std::nullopt;
+    }
+    std::wstring wVolumeParam = m_wVolumeName;
+    wVolumeParam.pop_back(); /* QueryDosDeviceW does not allow a trailing backslash */
+    wVolumeParam = wVolumeParam.substr(4);
+    WCHAR deviceNameBuf[DEVICE_BUFFER_MAX_LEN] = L"";
+    DWORD charCount = ::QueryDosDeviceW(wVolumeParam.c_str(), deviceNameBuf, ARRAYSIZE(deviceNameBuf));
+    if (charCount == 0) {
+        return std::nullopt;
+    }
+    return std::make_optional<std::wstring>(deviceNameBuf);
+}
+
+std::optional<std::string> Win32VolumesDetail::GetVolumeDeviceName()
+{
+    std::optional<std::wstring> wDeviceName = GetVolumeDeviceNameW();
+    if (!wDeviceName) {
+        return std::nullopt;
+    }
+    return std::make_optional<std::string>(Utf16ToUtf8(wDeviceName.value()));
+}
+
+std::optional<std::vector<std::wstring>> Win32VolumesDetail::GetVolumePathListW()
+{
+    /* https://learn.microsoft.com/en-us/windows/_WIN32/fileio/displaying-volume-paths */
+    if (m_wVolumeName.size() < 4 ||
+        m_wVolumeName[0] != L'\\' ||
+        m_wVolumeName[1] != L'\\' ||
+        m_wVolumeName[2] != L'?' ||
+        m_wVolumeName[3] != L'\\' ||
+        m_wVolumeName.back() != L'\\') { /* illegal volume name */
+        return std::nullopt;
+    }
+    std::vector<std::wstring> wPathList;
+    PWCHAR devicePathNames = nullptr;
+    DWORD charCount = MAX_PATH + 1;
+    bool success = false;
+    while (true) {
+        devicePathNames = (PWCHAR) new BYTE[charCount * sizeof(WCHAR)];
+        if (!devicePathNames) { /* failed to malloc on heap */
+            return std::nullopt;
+        }
+        success = ::GetVolumePathNamesForVolumeNameW(
+            m_wVolumeName.c_str(),
+            devicePathNames,
+            charCount,
+            &charCount
+        );
+        if (success || ::GetLastError() != ERROR_MORE_DATA) {
+            break;
+        }
+        delete[] devicePathNames;
+        devicePathNames = nullptr;
+    }
+    if (success) {
+        for (PWCHAR nameIdx = devicePathNames;
+            nameIdx[0] != L'\0';
+            nameIdx += ::wcslen(nameIdx) + 1) {
+            wPathList.push_back(std::wstring(nameIdx));
+        }
+    }
+    if (devicePathNames != nullptr) {
+        delete[] devicePathNames;
+        devicePathNames = nullptr;
+    }
+    return std::make_optional<std::vector<std::wstring>>(wPathList);
+}
+
+std::optional<std::vector<std::string>> Win32VolumesDetail::GetVolumePathList()
+{
+    std::optional<std::vector<std::wstring>> wPathList = GetVolumePathListW();
+    if (!wPathList) {
+        return std::nullopt;
+    }
+    std::vector<std::string> pathList;
+    for (const std::wstring& wPath : wPathList.value()) {
+        pathList.push_back(Utf16ToUtf8(wPath));
+    }
+    return std::make_optional<std::vector<std::string>>(pathList);
+}
+
+std::optional<std::vector<Win32VolumesDetail>> GetWin32LocalVolumeList()
+{
+    std::vector<std::wstring> wVolumes;
+    std::vector<Win32VolumesDetail> volumeDetails;
+    WCHAR wVolumeNameBuffer[VOLUME_BUFFER_MAX_LEN] = L"";
+    HANDLE handle = ::FindFirstVolumeW(wVolumeNameBuffer, VOLUME_BUFFER_MAX_LEN);
+    if (handle == INVALID_HANDLE_VALUE) {
+        ::FindVolumeClose(handle);
+        /* find failed */
+        return std::nullopt;
+    }
+    wVolumes.push_back(std::wstring(wVolumeNameBuffer));
+    while (::FindNextVolumeW(handle, wVolumeNameBuffer, VOLUME_BUFFER_MAX_LEN)) {
+        wVolumes.push_back(std::wstring(wVolumeNameBuffer));
+    }
+    ::FindVolumeClose(handle);
+    handle = INVALID_HANDLE_VALUE;
+    for (const std::wstring& wVolumeName : wVolumes) {
+        Win32VolumesDetail volumeDetail(wVolumeName);
+        volumeDetails.push_back(volumeDetail);
+    }
+    return volumeDetails;
+}
+
+std::optional<std::vector<Win32VolumesDetail>> GetWin32NetworkVolumeList()
+{
+    std::vector<Win32VolumesDetail> networkVolumes;
+
+    DWORD dwResult;
+    DWORD dwSize = 0;
+    LPNETRESOURCE lpnr = NULL;
+    HANDLE hEnum = NULL;
+    DWORD dwCount = 0;
+    DWORD i;
+
+    dwResult = ::WNetOpenEnum(RESOURCE_CONNECTED, RESOURCETYPE_DISK, 0, lpnr, &hEnum);
+    if (dwResult != NO_ERROR) {
+        /* WNetOpenEnum failed with error dwResult */
+        return std::nullopt;
+    }
+
+    do
+    {
+        dwSize = 16384; 
+        lpnr = (LPNETRESOURCE)::GlobalAlloc(GPTR, dwSize);
+        if (lpnr == NULL) {
+            std::cout << "Memory allocation error." << std::endl;
+            return std::nullopt;
+        }
+        dwResult = ::WNetEnumResource(hEnum, &dwCount, lpnr, &dwSize);
+        if (dwResult == NO_ERROR) {
+            for (i = 0; i < dwCount; i++) {
+                if (lpnr[i].dwDisplayType == RESOURCEDISPLAYTYPE_SHARE) {
+                    std::wstring wstr(lpnr[i].lpRemoteName);
+                    std::wcout << wstr << std::endl;
+                }
+            }
+        }
+        ::GlobalFree((HGLOBAL)lpnr);
+        if (dwResult != ERROR_NO_MORE_ITEMS) {
+            /* WNetEnumResource failed with error dwResult */
+            return std::nullopt;
+        }
+    } while (dwResult != ERROR_NO_MORE_ITEMS);
+
+    ::WNetCloseEnum(hEnum);
+    return networkVolumes;
+}
+
+
+std::optional<std::vector<Win32VolumesDetail>> GetWin32VolumeList()
+{
+    std::vector<Win32VolumesDetail> res;
+    std::optional<std::vector<Win32VolumesDetail>> localVolumes {}; // TODO:: not support
+    std::optional<std::vector<Win32VolumesDetail>> netVolumes = GetWin32LocalVolumeList();
+    if (localVolumes) {
+        std::copy(localVolumes->begin(), localVolumes->end(), std::back_inserter(res));
+    }
+    if (netVolumes) {
+        std::copy(netVolumes->begin(), netVolumes->end(), std::back_inserter(res));
+    }
+    return res;
+}
+
+/* _WIN32 Security Descriptor related API */
+
+/**
+* https://learn.microsoft.com/en-us/windows/_WIN32/api/aclapi/nf-aclapi-getnamedsecurityinfoa?redirectedfrom=MSDN
+* https://learn.microsoft.com/en-us/previous-versions/windows/hardware/device-stage/drivers/ff556610(v=vs.85)
+* https://learn.microsoft.com/en-us/windows/_WIN32/secauthz/security-information
+* https://learn.microsoft.com/en-us/windows/_WIN32/api/accctrl/ne-accctrl-se_object_type
+* https://learn.microsoft.com/en-us/windows/_WIN32/api/aclapi/nf-aclapi-getnamedsecurityinfoa
+* https://blog.csdn.net/eggfly178/article/details/41773601
+* https://learn.microsoft.com/en-us/windows/_WIN32/secauthz/security-descriptor-string-format
+*/
+std::optional<std::wstring> GetSecurityDescriptorW(const std::wstring& wPath, DWORD& errCode)
+{
+    PSECURITY_DESCRIPTOR pSecurityDescriptor = nullptr;
+    PACL pDacl      = nullptr;
+    PACL pSacl      = nullptr;
+    PSID psidOwner  = nullptr;
+    PSID psidGroup  = nullptr;
+    LPWSTR wSddlStr = nullptr;
+    errCode = 0;
+    std::wstring wPathUnicode = ConvertWin32UnicodePath(wPath);
+
+    DWORD result = ::GetNamedSecurityInfoW(
+        wPathUnicode.c_str(),
+        SE_FILE_OBJECT,
+        DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION | OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION,
+        &psidOwner,
+        &psidGroup,
+        &pDacl,
+        &pSacl,
+        &pSecurityDescriptor);
+    if (result != ERROR_SUCCESS) {
+        errCode = result;
+        return std::nullopt;
+    }
+    bool ret = ::ConvertSecurityDescriptorToStringSecurityDescriptorW(
+        pSecurityDescriptor,
+        SDDL_REVISION_1,
+        DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION | OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION,
+        &wSddlStr,
+        nullptr);
+    if (!ret) {
+        errCode = ::GetLastError();
+        ::LocalFree(pSecurityDescriptor);
+        return std::nullopt;
+    }
+    ::LocalFree(pSecurityDescriptor);
+    std::wstring res(wSddlStr);
+    ::LocalFree(wSddlStr);
+    return std::make_optional<std::wstring>(res);
+}
+
+bool SetSecurityDescriptorW(const std::wstring& wPath, const std::wstring& wSddlStr, DWORD& errCode)
+{
+    PSECURITY_DESCRIPTOR pSecurityDescriptor = nullptr;
+    PACL pDacl      = nullptr;
+    PACL pSacl      = nullptr;
+    PSID psidOwner  = nullptr;
+    PSID psidGroup  = nullptr;
+    std::wstring wPathUnicode = ConvertWin32UnicodePath(wPath);
+
+    /* convert sddlStr back to pSecurityDescriptor */
+    if (!::ConvertStringSecurityDescriptorToSecurityDescriptor(
+            wSddlStr.c_str(),
+            SDDL_REVISION_1,
+            &pSecurityDescriptor,
+            nullptr)) {
+        errCode = ::GetLastError();
+        return false;
+    }
+
+    /* Get Owner from pSecurityDescriptor */
+    BOOL ownerDefaulted = false;
+    if (!::GetSecurityDescriptorOwner(pSecurityDescriptor, &psidOwner, &ownerDefaulted)) {
+        errCode = ::GetLastError();
+        ::LocalFree(pSecurityDescriptor);
+        return false;
+    }
+
+    /* Get Group from pSecurityDescriptor */
+    BOOL groupDefaulted = false;
+    if (!::GetSecurityDescriptorGroup(pSecurityDescriptor, &psidGroup, &groupDefaulted)) {
+        errCode = ::GetLastError();
+        ::LocalFree(pSecurityDescriptor);
+        return false;
+    }
+
+    /* Get DACL from pSecurityDescriptor */
+    BOOL bDaclPresent = false;
+    BOOL bDaclDefaulted = false;
+    if (!::GetSecurityDescriptorDacl(pSecurityDescriptor, &bDaclPresent, &pDacl, &bDaclDefaulted) || !bDaclPresent) {
+        errCode = ::GetLastError();
+        ::LocalFree(pSecurityDescriptor);
+        return false;
+    }
+
+    /* Get SACL from pSecurityDescriptor */
+    BOOL bSaclPresent = false;
+    BOOL bSaclDefaulted = false;
+    if (!::GetSecurityDescriptorSacl(pSecurityDescriptor, &bSaclPresent, &pSacl, &bSaclDefaulted) || !bSaclPresent) {
+        errCode = ::GetLastError();
+        ::LocalFree(pSecurityDescriptor);
+        return false;
+    }
+
+    // some nullptr value fields with corresponding flag set may cause the SetNamedSecurityInfo call to fail
+    DWORD securityFlags = 0;
+    if (psidOwner != nullptr) {
+        securityFlags |= OWNER_SECURITY_INFORMATION;
+    }
+    if (psidGroup != nullptr) {
+        securityFlags |= GROUP_SECURITY_INFORMATION;
+    }
+    if (pDacl != nullptr) {
+        securityFlags |= DACL_SECURITY_INFORMATION;
+    }
+    if (pSacl != nullptr) {
+        securityFlags |= SACL_SECURITY_INFORMATION;
+    }
+
+    // set pSecurityDescriptor to file
+    if (::SetNamedSecurityInfo(
+        const_cast<LPWSTR>(wPathUnicode.c_str()),
+        SE_FILE_OBJECT,
+        securityFlags,
+        psidOwner,
+        psidGroup,
+        pDacl,
+        pSacl) != ERROR_SUCCESS) {
+        errCode = ::GetLastError();
+        ::LocalFree(pSecurityDescriptor);
+        return false;
+    }
+
+    if (pSecurityDescriptor) {
+        ::LocalFree(pSecurityDescriptor);
+    }
+    errCode = 0;
+    return true;
+}
+
+bool SetSecurityDescriptor(const std::string& path, const std::string& sddlStr, DWORD& errCode)
+{
+    return SetSecurityDescriptorW(Utf8ToUtf16(path), Utf8ToUtf16(sddlStr), errCode);
+}
+
+std::optional<std::string> GetSecurityDescriptor(const std::string& path, DWORD& errCode)
+{
+    std::optional<std::wstring> result = GetSecurityDescriptorW(Utf8ToUtf16(path), errCode);
+    if (!result) {
+        return std::nullopt;
+    }
+    return std::make_optional<std::string>(Utf16ToUtf8(result.value()));
+}
+
+std::wstring NormalizeWin32PathW(std::wstring& wPath)
+{
+    std::wstring wNormalizedPath = wPath;
+    /* example: \\?\C:\Test\Dir1 => C:\Test\Dir1 */
+    if (wNormalizedPath.find(WPATH_PREFIX) == 0) {
+        wNormalizedPath = wNormalizedPath.substr(WPATH_PREFIX.length());
+    }
+    while (!wNormalizedPath.empty() && wNormalizedPath.back() == L'\\') {
+        wNormalizedPath.pop_back();
+    }
+    /* example: C: */
+    if (wNormalizedPath.length() == 2 && wNormalizedPath[1] == L':') {
+        wNormalizedPath.push_back(L'\\');
+    }
+    return wNormalizedPath;
+}
+
+/*
+ * reparse point related methods 
+ * https://github.com/googleprojectzero/symboliclink-testing-tools/blob/main/CommonUtils/ReparsePoint.cpp
+ */
+bool CreateSymbolicLinkW(
+    const std::wstring& wLinkFilePath,
+    const std::wstring& wTagetPath,
+    bool isDirectory,
+    bool isRelative)
+{
+    std::wstring wLinkFilePathFinal = ConvertWin32UnicodePath(wLinkFilePath);
+    std::wstring wTagetPathFinal = ConvertWin32UnicodePath(wTagetPath);;
+
+    /* check if target exist */
+    if (Exists(Utf16ToUtf8(wLinkFilePath))) {
+        return false;
+    }
+
+    return ::CreateSymbolicLinkW(
+        wLinkFilePathFinal.c_str(),
+        wTagetPathFinal.c_str(),
+        isDirectory ? SYMBOLIC_LINK_FLAG_DIRECTORY : 0);
+}
+
+bool CreateJunctionPointW(const std::wstring& wSrcPath, const std::wstring& wTargetPath)
+{
+    // TODO:: not support 
+    return CreateSymbolicLinkW(wSrcPath, wTargetPath, true, true);
+    return false;
+}
+
+
+/* ADS releated API */
+std::optional<AlternateDataStreamEntry> OpenAlternateDataStreamW(const std::wstring& wPath)
+{
+    std::wstring wPathUnicode = ConvertWin32UnicodePath(wPath); 
+    WIN32_FIND_STREAM_DATA findStreamData{};
+    HANDLE hStream = ::FindFirstStreamW(
+        wPathUnicode.c_str(),
+        _STREAM_INFO_LEVELS::FindStreamInfoStandard,
+        &findStreamData,
+        0
+    );
+    if (hStream == INVALID_HANDLE_VALUE) {
+        /* get stream handle failed */
+        return std::nullopt;
+    }
+    return std::make_optional<AlternateDataStreamEntry>(hStream, findStreamData);
+}
+
+AlternateDataStreamEntry::AlternateDataStreamEntry(HANDLE hStream, WIN32_FIND_STREAM_DATA findStreamData)
+ : m_hStream(hStream), m_findStreamData(findStreamData), m_eof(false) {}
+
+std::wstring AlternateDataStreamEntry::StreamNameW()
+{
+    return m_findStreamData.cStreamName;
+}
+
+bool AlternateDataStreamEntry::Eof() const
+{
+    return m_eof;
+}
+
+DWORD AlternateDataStreamEntry::Error() const
+{
+    return m_error;
+}
+
+bool AlternateDataStreamEntry::Next()
+{
+    if (m_hStream == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (::FindNextStreamW(m_hStream, &m_findStreamData)) {
+        return true;
+    }
+    m_error = ::GetLastError();
+    if (m_error == ERROR_HANDLE_EOF) {
+        /* read succeed and reached EOF */
+        m_eof = true;
+    }
+    m_hStream = INVALID_HANDLE_VALUE;
+    return false;
+}
+
+AlternateDataStreamEntry::~AlternateDataStreamEntry()
+{
+    if (m_hStream != INVALID_HANDLE_VALUE || m_hStream != nullptr) {
+        ::FindClose(m_hStream);
+    }
+    m_hStream = INVALID_HANDLE_VALUE;
+}
+
+#endif
+
+
+bool IsDirectory(const std::string& path)
+{
+    std::optional<StatResult> result = Stat(path);
+    if (!result) {
+        return false;
+    }
+    return result->IsDirectory();
+}
+
+bool IsEmptyDirectory(const std::string& path)
+{
+    std::optional<OpenDirEntry> entry = OpenDir(path);
+    if (!entry) {
+        return false;
+    }
+    do {
+        if (entry->Name() != "." || entry->Name() != "..") {
+            return false;
+        }
+    } while (entry->Next());
+    return true;
+}
+
+bool Exists(const std::string& path)
+{
+    std::optional<StatResult> result = Stat(path);
+    if (!result) {
+        return false;
+    }
+    return true;
+}
+
+bool Mkdir(const std::string& path)
+{
+#ifdef _WIN32
+    std::wstring wPathUnicode = ConvertWin32UnicodePath(Utf8ToUtf16(path));
+    return CreateDirectoryW(wPathUnicode.c_str(), nullptr);
+#endif
+#ifdef __linux__
+    int ret = mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    return ret == 0;
+#endif
+}
+
+bool MkdirRecursive(const std::string& path)
+{
+    if (!Exists(ParentDirectoryPath(path))) {
+        bool success = MkdirRecursive(ParentDirectoryPath(path));
+        if (!success) {
+            return false;
+        }
+    }
+    return Mkdir(path);
+}
+
+std::string ParentDirectoryPath(const std::string& path)
+{
+    const std::string currendDirPath = ".";
+#ifdef _WIN32
+    std::string win32Path = path;
+    std::replace(win32Path.begin(), win32Path.end(), '/', '\\');
+    if (!win32Path.empty() && win32Path.back() != '\\') {
+        win32Path.pop_back();
+    }
+    size_t pos = win32Path.find_last_of('\\');
+    if (pos == std::string::npos) {
+        return currendDirPath;
+    }
+    return win32Path.substr(0, pos);
+#endif
+#ifdef __linux__
+    std::string posixPath = path;
+    std::replace(posixPath.begin(), posixPath.end(), '\\', '/');
+    if (!posixPath.empty() && posixPath.back() != '/') {
+        posixPath.pop_back();
+    }
+    size_t pos = posixPath.find_last_of('/');
+    if (pos == std::string::npos) {
+        return currendDirPath;
+    }
+    return posixPath.substr(0, pos);
+#endif
+}
+
+#ifdef FSUTIL_HAVE_COROUTINES
+namespace {
+/* entries read by one executor call of AsyncListDir() */
+const size_t ASYNC_DIR_BATCH_SIZE = 256;
+
+/* threads are spawned on demand while no one is idle, up to maxThreads */
+class ThreadPoolIoExecutor : public IoExecutor {
+public:
+    explicit ThreadPoolIoExecutor(int maxThreads) : m_maxThreads(static_cast<size_t>(std::max(1, maxThreads))) {}
+    ~ThreadPoolIoExecutor() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cond.notify_all();
+        for (std::thread& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    void Execute(std::function<void()> work) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_works.push_back(std::move(work));
+        if (m_idle == 0 && m_threads.size() < m_maxThreads) {
+            m_threads.emplace_back([this]() { Run(); });
+        } else {
+            m_cond.notify_one();
+        }
+    }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            if (m_works.empty()) {
+                /* pending works are drained before stopping, their coroutines would leak otherwise */
+                if (m_stopping) {
+                    return;
+                }
+                m_idle++;
+                m_cond.wait(lock, [this]() { return m_stopping || !m_works.empty(); });
+                m_idle--;
+                continue;
+            }
+            std::function<void()> work = std::move(m_works.front());
+            m_works.pop_front();
+            lock.unlock();
+            work();
+            lock.lock();
+        }
+    }
+
+    size_t m_maxThreads;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::function<void()>> m_works;
+    std::vector<std::thread> m_threads;
+    size_t m_idle = 0;
+    bool m_stopping = false;
+};
+
+#ifdef FSUTIL_HAVE_IO_URING
+/**
+* stat requests are submitted under a mutex and reaped by a dedicated thread,
+* requests beyond the ring capacity wait in a backlog refilled by the reaper, every other call runs on the thread pool
+*/
+class IoUringIoExecutor : public IoExecutor {
+public:
+    explicit IoUringIoExecutor(int maxThreads) : m_pool(maxThreads) {}
+    ~IoUringIoExecutor() override
+    {
+        if (!m_reaper.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_submitMutex);
+            /* the stopping nop wakes up the reaper, it exits once the backlog and the in flight requests are completed */
+            struct io_uring_sqe* sqe = m_ring.GetSqe();
+            while (sqe == nullptr) {
+                m_ring.Submit();
+                sqe = m_ring.GetSqe();
+            }
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = STOPPING_USER_DATA;
+            m_ring.Submit();
+        }
+        m_reaper.join();
+    }
+
+    bool Init(unsigned queueDepth)
+    {
+        if (!m_ring.Init(queueDepth)) {
+            return false;
+        }
+        /* one slot is kept for the stopping nop */
+        m_capacity = std::max(1U, m_ring.Entries() - 1);
+        m_reaper = std::thread([this]() { Reap(); });
+        return true;
+    }
+
+    void Execute(std::function<void()> work) override { m_pool.Execute(std::move(work)); }
+
+    void SubmitStat(const std::string& path, std::function<void(std::optional<StatResult>)> done) override
+    {
+        std::lock_guard<std::mutex> lock(m_submitMutex);
+        m_backlog.push_back(new StatRequest { &path, {}, std::move(done) });
+        SubmitBacklog();
+    }
+
+private:
+    /* user_data of the other requests are StatRequest pointers */
+    static const uint64_t STOPPING_USER_DATA = 0;
+    static const uint64_t IGNORED_USER_DATA = 1;
+
+    struct StatRequest {
+        const std::string* path;
+        struct statx buffer;
+        std::function<void(std::optional<StatResult>)> done;
+    };
+
+    /* move backlog requests into the ring while it has room, m_submitMutex is held */
+    void SubmitBacklog()
+    {
+        m_prepared.clear();
+        while (!m_backlog.empty() && m_inflight.load() < m_capacity) {
+            struct io_uring_sqe* sqe = m_ring.GetSqe();
+            if (sqe == nullptr) {
+                break;
+            }
+            StatRequest* request = m_backlog.front();
+            m_backlog.pop_front();
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(request->path->c_str());
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = reinterpret_cast<uint64_t>(&request->buffer);
+            sqe->user_data = reinterpret_cast<uint64_t>(request);
+            m_prepared.emplace_back(sqe, request);
+            m_inflight++;
+        }
+        if (m_prepared.empty() || m_ring.Submit() >= 0) {
+            return;
+        }
+        /* nothing consumed by the kernel, turn them into ignored nops and complete the requests by the thread pool */
+        for (const std::pair<struct io_uring_sqe*, StatRequest*>& prepared : m_prepared) {
+            prepared.first->opcode = IORING_OP_NOP;
+            prepared.first->user_data = IGNORED_USER_DATA;
+            std::unique_ptr<StatRequest> request(prepared.second);
+            IoExecutor::SubmitStat(*request->path, std::move(request->done));
+            m_inflight--;
+        }
+    }
+
+    void Reap()
+    {
+        bool stopping = false;
+        std::vector<std::pair<StatRequest*, int>> completed;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(m_submitMutex);
+                if (stopping && m_inflight.load() == 0 && m_backlog.empty()) {
+                    return;
+                }
+            }
+            m_ring.Wait(1);
+            completed.clear();
+            struct io_uring_cqe cqe {};
+            while (m_ring.PopCqe(cqe)) {
+                if (cqe.user_data == STOPPING_USER_DATA) {
+                    stopping = true;
+                } else if (cqe.user_data != IGNORED_USER_DATA) {
+                    completed.emplace_back(reinterpret_cast<StatRequest*>(cqe.user_data), cqe.res);
+                    m_inflight--;
+                }
+            }
+            /* refill the ring before running the continuations */
+            {
+                std::lock_guard<std::mutex> lock(m_submitMutex);
+                SubmitBacklog();
+            }
+            for (const std::pair<StatRequest*, int>& result : completed) {
+                std::unique_ptr<StatRequest> request(result.first);
+                if (result.second == -EINVAL) {
+                    /* IORING_OP_STATX is not supported by the running kernel */
+                    IoExecutor::SubmitStat(*request->path, std::move(request->done));
+                } else if (result.second < 0) {
+                    request->done(std::nullopt);
+                } else {
+                    request->done(std::make_optional<StatResult>(*request->path, request->buffer));
+                }
+            }
+        }
+    }
+
+    ThreadPoolIoExecutor m_pool;
+    IoUringQueue m_ring;
+    std::mutex m_submitMutex;
+    std::deque<StatRequest*> m_backlog;
+    std::vector<std::pair<struct io_uring_sqe*, StatRequest*>> m_prepared;
+    std::atomic<unsigned> m_inflight { 0 };
+    unsigned m_capacity = 0;
+    std::thread m_reaper;
+};
+#endif
+}
+
+void IoExecutor::SubmitStat(const std::string& path, std::function<void(std::optional<StatResult>)> done)
+{
+    Execute([&path, done = std::move(done)]() { done(Stat(path)); });
+}
+
+std::unique_ptr<IoExecutor> CreateIoExecutor(const BulkIoOptions& options)
+{
+#ifdef FSUTIL_HAVE_IO_URING
+    if (options.engine != BulkIoEngine::ThreadPool) {
+        std::unique_ptr<IoUringIoExecutor> executor = std::make_unique<IoUringIoExecutor>(options.queueDepth);
+        if (executor->Init(static_cast<unsigned>(std::max(1, options.queueDepth)))) {
+            return executor;
+        }
+    }
+#endif
+    if (options.engine == BulkIoEngine::IoUring) {
+        return nullptr;
+    }
+    return std::make_unique<ThreadPoolIoExecutor>(options.queueDepth);
+}
+
+IoExecutor& DefaultIoExecutor()
+{
+    static std::unique_ptr<IoExecutor> executor = CreateIoExecutor();
+    return *executor;
+}
+
+AsyncStatAwaiter::AsyncStatAwaiter(std::string path, IoExecutor& executor)
+    : m_path(std::move(path)), m_executor(executor) {}
+
+void AsyncStatAwaiter::await_suspend(std::coroutine_handle<> awaiting)
+{
+    m_executor.SubmitStat(m_path, [this, awaiting](std::optional<StatResult> result) {
+        m_result = std::move(result);
+        awaiting.resume();
+    });
+}
+
+AsyncStatAwaiter AsyncStat(std::string path, IoExecutor& executor)
+{
+    return AsyncStatAwaiter(std::move(path), executor);
+}
+
+Task<bool> AsyncCopySparseFile(
+    std::string srcPath,
+    std::string dstPath,
+    std::vector<std::pair<uint64_t, uint64_t>> ranges,
+    IoExecutor& executor)
+{
+    co_return co_await AsyncCall(executor, [&]() { return CopySparseFile(srcPath, dstPath, ranges); });
+}
+
+AsyncGenerator<AsyncDirEntry> AsyncListDir(std::string path, IoExecutor& executor)
+{
+    std::optional<OpenDirEntry> entry = co_await AsyncCall(executor, [&]() { return OpenDir(path); });
+    bool more = entry.has_value();
+    while (more) {
+        std::vector<AsyncDirEntry> batch = co_await AsyncCall(executor, [&]() {
+            /* OpenDir() and the last Next() of the previous batch have read the current entry already */
+            std::vector<AsyncDirEntry> entries;
+            do {
+                std::string_view name = entry->NameView();
+                if (name != "." && name != "..") {
+                    entries.push_back(AsyncDirEntry { std::string(name), entry->IsDirectory() });
+                }
+                more = entry->Next();
+            } while (more && entries.size() < ASYNC_DIR_BATCH_SIZE);
+            return entries;
+        });
+        for (AsyncDirEntry& dirEntry : batch) {
+            co_yield std::move(dirEntry);
+        }
+    }
+}
+#endif
+
 }
\ No newline at end of file
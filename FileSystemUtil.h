@@ -1,340 +1,1580 @@
-﻿#ifndef __XURANUS_FILESYSTEM_UTIL_H__
-#define __XURANUS_FILESYSTEM_UTIL_H__
-
-#include <string>
-#include <iostream>
-#include <iterator>
-#include <optional>
-#include <vector>
-#include <cstdint>
-
-#ifdef _WIN32
-
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif
-
-#ifndef UNICODE
-#define UNICODE /* foring using WCHAR on windows */
-#endif
-/**
- * #define KEEP_WIN32_NATIVE_TIMESTAMP_VALUE
- * uncomment this macro if you need to get native windows microsecond timestamp
- */
-#include <Windows.h>
-#include <Aclapi.h>
-#endif
-
-#ifdef __linux__
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <dirent.h>
-#include <cstring>
-#endif
-
-using SparseRangeResult = std::optional<std::vector<std::pair<uint64_t, uint64_t>>>;
-
-#ifdef _WIN32
-inline uint64_t CombineDWORD(DWORD low, DWORD high) {
-    return (uint64_t)low + ((uint64_t)MAXDWORD + 1) * high;
-}
-
-inline uint64_t ConvertWin32Time(DWORD low, DWORD high)
-{
-    const uint64_t UNIX_TIME_START = 0x019DB1DED53E8000; /* January 1, 1970 (start of Unix epoch) in "ticks" */
-    const uint64_t TICKS_PER_SECOND = 10000000; /* a tick is 100ns */
-    LARGE_INTEGER li;
-    li.LowPart  = low;
-    li.HighPart = high;
-#ifdef KEEP_WIN32_NATIVE_TIMESTAMP_VALUE
-    return li.QuadPart;
-#else
-    /* Convert ticks since 1/1/1970 into seconds */
-    return (li.QuadPart - UNIX_TIME_START) / TICKS_PER_SECOND;
-#endif
-}
-#endif
-
-/**
-* wrap some cross-platform filesystem API for Windows/LINUX
-*/
-namespace FileSystemUtil {
-
-#ifdef _WIN32
-/* 
- * transform between UTF-8 and UTF-16
- * any method using _WIN32 API passing WCHAR
- */
-std::wstring Utf8ToUtf16(const std::string& str);
-std::string Utf16ToUtf8(const std::wstring& wstr);
-bool EnablePrivilege();
-#endif
-
-/**
-* wrap stat for LINUX and GetFileInformationByHandle for windows,
-* to provide file meta info query service
-*/
-class StatResult {
-public:
-#ifdef __linux__
-    StatResult(const std::string& path, const struct stat& statbuff);
-#endif
-
-#ifdef _WIN32
-    StatResult(const std::wstring& wPath, const BY_HANDLE_FILE_INFORMATION& handleFileInformation);
-#endif
-    /**
-    * user id and group id of the owner, always set to zero on windows
-    */
-    uint64_t UserID() const;
-    uint64_t GroupID() const;
-
-    /**
-    * AccessTime and CreationTime are invalid on FAT32 drives
-    */
-    uint64_t AccessTime() const;
-    uint64_t CreationTime() const;
-    uint64_t ModifyTime() const;
-
-    /**
-    * UNIX fs hardlink file share the same inode, but inode has no meaning on FAT32/HPFS/NTFS.. fs
-    * Windows use "file index" to mark a unique id of a file or a directory in a volume
-    */
-    uint64_t UniqueID() const;
-
-    uint64_t Size() const; /* size in bytes */
-    uint64_t DeviceID() const; /* id of the disk containning the file */
-    uint64_t LinksCount() const; /* no of hard links to the file, on _WIN32 always set to 1 on non - NTFS fs */
-
-    bool IsDirectory() const;
-    std::string CanonicalPath() const;
-
-#ifdef _WIN32
-    /* based on dwFileAttributes field */
-    bool IsArchive() const;
-    bool IsCompressed() const;
-    bool IsEncrypted() const;
-    bool IsSparseFile() const;
-    bool IsHidden() const;
-    bool IsOffline() const;
-    bool IsReadOnly() const;
-    bool IsSystem() const;
-    bool IsTemporary() const;
-    bool IsNormal() const;
-    bool IsReparsePoint() const;
-    uint64_t Attribute() const;
-    
-    /* reparse point related methods */
-    DWORD ReparseTag() const;
-    bool IsSymbolicLink() const;
-    bool IsJunctionPoint() const;
-    bool IsMountedDevice() const;
-    std::optional<std::wstring> MountedDeviceNameW() const;
-    std::optional<std::wstring> JunctionsPointTargetPathW() const;
-    std::optional<std::wstring> SymbolicLinkTargetPathW() const;
-    bool HasReparseSymbolicLinkTag() const;
-    bool HasReparseMountPointTag() const;
-    bool HasReparseNfsTag() const;
-    bool HasReparseOneDriveTag() const;
-    std::optional<std::wstring> FinalPathW() const; 
-
-    std::wstring CanonicalPathW() const;
-#endif
-
-#ifdef __linux__
-    /* based on st_mode field */
-    bool IsRegular() const;
-    bool IsPipe() const;
-    bool IsCharDevice() const;
-    bool IsBlockDevice() const;
-    bool IsSymLink() const;
-    bool IsSocket() const;
-    uint64_t Mode() const;
-#endif
-
-private:
-#ifdef __linux__
-    struct stat m_stat {};
-    std::string m_path; /* raw input path */
-#endif
-#ifdef _WIN32
-    BY_HANDLE_FILE_INFORMATION m_handleFileInformation{};
-    std::wstring m_wPath; /* raw input path */
-#endif
-};
-
-std::optional<StatResult> Stat(const std::string& path);
-#ifdef _WIN32
-std::optional<StatResult> StatW(const std::wstring& wPath);
-#endif
-
-class OpenDirEntry
-{
-public:
-#ifdef _WIN32
-    OpenDirEntry(
-        const std::string&          dirPath,
-        const WIN32_FIND_DATAW&     findFileData,
-        const HANDLE&               fileHandle);
-    bool IsArchive() const;
-    bool IsCompressed() const;
-    bool IsEncrypted() const;
-    bool IsSparseFile() const;
-    bool IsHidden() const;
-    bool IsOffline() const;
-    bool IsReadOnly() const;
-    bool IsSystem() const;
-    bool IsTemporary() const;
-    bool IsNormal() const;
-    bool IsReparsePoint() const;
-    uint64_t AccessTime() const;
-    uint64_t CreationTime() const;
-    uint64_t ModifyTime() const;
-    uint64_t Size() const;
-    uint64_t Attribute() const;
-#endif
-
-#ifdef __linux__
-    OpenDirEntry(const std::string& dirPath,
-    DIR* dirPtr, struct dirent* direntPtr);
-    bool IsUnknown() const;
-    bool IsPipe() const;
-    bool IsCharDevice() const;
-    bool IsBlockDevice() const;
-    bool IsSymLink() const;
-    bool IsSocket() const;
-    bool IsRegular() const;
-    uint64_t INode() const;
-#endif
-
-    bool IsDirectory() const;
-#ifdef _WIN32
-    std::wstring NameW() const;
-    std::wstring FullPathW() const;
-#endif
-    std::string Name() const;
-    std::string FullPath() const;
-    bool Next();
-    void Close();
-    
-    /* disable copy/assign construct */
-    OpenDirEntry(const OpenDirEntry&) = delete;
-    OpenDirEntry operator = (const OpenDirEntry&) = delete;
-    ~OpenDirEntry();
-
-private:
-#ifdef _WIN32
-    std::wstring m_dirPath;
-    HANDLE m_fileHandle = nullptr;
-    WIN32_FIND_DATAW m_findFileData;
-#endif
-
-#ifdef __linux__
-    std::string m_dirPath;
-    DIR* m_dir = nullptr;
-    struct dirent* m_dirent = nullptr;
-#endif
-};
-
-std::optional<OpenDirEntry> OpenDir(const std::string& path);
-
-/* Sparse File allocate range API */
-SparseRangeResult QuerySparseAllocateRanges(const std::string& path);
-bool CopySparseFile(
-    const std::string& srcPath,
-    const std::string& dstPath,
-    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
-#ifdef _WIN32
-SparseRangeResult QuerySparseWin32AllocateRangesW(const std::wstring& wPath);
-bool CopySparseFileWin32W(
-    const std::wstring& wSrcPath,
-    const std::wstring& wDstPath,
-    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
-#endif
-#ifdef __linux__
-SparseRangeResult QuerySparsePosixAllocateRanges(const std::string& path);
-bool CopySparseFilePosix(
-    const std::string& srcPath,
-    const std::string& dstPath,
-    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
-#endif
-
-#ifdef _WIN32
-/* _WIN32 Volumes related API */
-std::vector<std::wstring> GetWin32DriverListW();
-std::vector<std::string> GetWin32DriverList();
-
-class Win32VolumesDetail {
-public:
-    Win32VolumesDetail(const std::wstring& wVolumeName);
-    std::wstring VolumeNameW() const;
-    std::string VolumeName() const;
-    std::optional<std::wstring> GetVolumeDeviceNameW();
-    std::optional<std::string> GetVolumeDeviceName();
-    std::optional<std::vector<std::wstring>> GetVolumePathListW();
-    std::optional<std::vector<std::string>> GetVolumePathList();
-private:
-    std::wstring m_wVolumeName;
-};
-
-std::optional<std::vector<Win32VolumesDetail>> GetWin32VolumeList();
-
-bool EnablePrivilegeW(const wchar_t* wPrivilegeName);
-
-/* _WIN32 Security Descriptor related API */
-std::optional<std::wstring> GetSecurityDescriptorW(const std::wstring& wPath, DWORD& errCode);
-std::optional<std::string> GetSecurityDescriptor(const std::string& path, DWORD& errCode);
-bool SetSecurityDescriptorW(const std::wstring& wPath, const std::wstring& wSddlStr, DWORD& errCode);
-bool SetSecurityDescriptor(const std::string& path, const std::string& sddlStr, DWORD& errCode);
-
-/*
- * Normalize windows path, convert the path to the form like C:\Dir1\Dir2
- * Except root path like C:\, D:\, path won't ends with backslash
- */
-std::wstring NormalizeWin32PathW(std::wstring& wPath);
-
-/* reparse point related methods */
-bool CreateSymbolicLinkW(
-    const std::wstring& wLinkFilePath,
-    const std::wstring& wTargetPath,
-    bool isDirectory = false,
-    bool isRelative = true);
-bool CreateJunctionPointW(const std::wstring& wSrcPath, const std::wstring& wDstPath);
-
-
-/* ADS releated API
- * https://github.com/chenchao266/mfc/blob/b58abf9eb4c6d90ef01b9f1203b174471293dfba/wfc_sample/Sample/dump_ntfs_streams.cpp
- */
-
-const int WIN32_STREAM_ID_BUFFER_LENGTH_MAX = 4096;
-
-class AlternateDataStreamEntry {
-public:
-    AlternateDataStreamEntry(HANDLE hFile, WIN32_FIND_STREAM_DATA lpFindStreamData);
-    std::wstring StreamNameW();
-    bool Next();
-    DWORD Error() const;
-    bool Eof() const;
-    ~AlternateDataStreamEntry();
-
-private:
-    HANDLE m_hStream = INVALID_HANDLE_VALUE;
-    WIN32_FIND_STREAM_DATA m_findStreamData;
-    DWORD m_error = 0;
-    bool m_eof = false;
-};
-
-/* ADS releated API */
-std::optional<AlternateDataStreamEntry> OpenAlternateDataStreamW(const std::wstring& wPath);
-#endif
-
-/* Common cross-platform API */
-bool IsDirectory(const std::string& path);
-bool IsEmptyDirectory(const std::string& path);
-bool Exists(const std::string& path);
-bool Mkdir(const std::string& path);
-bool MkdirRecursive(const std::string& path);
-std::string ParentDirectoryPath(const std::string& path);
-}
-
-#endif
+﻿#ifndef __XURANUS_FILESYSTEM_UTIL_H__
+#define __XURANUS_FILESYSTEM_UTIL_H__
+
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+/* coroutine async API, available when compiled as C++20 (cmake -DFSUTIL_ENABLE_COROUTINES=ON) */
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <utility>
+#define FSUTIL_HAVE_COROUTINES
+#endif
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#ifndef NOMINMAX
+#define NOMINMAX /* keep std::min/std::max usable */
+#endif
+
+#ifndef UNICODE
+#define UNICODE /* foring using WCHAR on windows */
+#endif
+/**
+ * #define KEEP_WIN32_NATIVE_TIMESTAMP_VALUE
+ * uncomment this macro if you need to get native windows microsecond timestamp
+ */
+#include <Windows.h>
+#include <Aclapi.h>
+#endif
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cstring>
+
+/* statx(2) ABI constants, for glibc older than 2.28 which does not export them */
+#ifndef STATX_BASIC_STATS
+#define STATX_TYPE          0x00000001U
+#define STATX_MODE          0x00000002U
+#define STATX_NLINK         0x00000004U
+#define STATX_UID           0x00000008U
+#define STATX_GID           0x00000010U
+#define STATX_ATIME         0x00000020U
+#define STATX_MTIME         0x00000040U
+#define STATX_CTIME         0x00000080U
+#define STATX_INO           0x00000100U
+#define STATX_SIZE          0x00000200U
+#define STATX_BLOCKS        0x00000400U
+#define STATX_BASIC_STATS   0x000007ffU
+#define STATX_BTIME         0x00000800U
+#else
+#define FSUTIL_HAVE_STATX
+#endif
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC  0x4000
+#endif
+#endif
+
+using SparseRangeResult = std::optional<std::vector<std::pair<uint64_t, uint64_t>>>;
+
+/* one allocated extent of a file, as reported by FIEMAP */
+struct SparseExtent {
+    uint64_t logicalOffset;
+    uint64_t physicalOffset; /* 0 if unknown */
+    uint64_t length;
+    bool unwritten; /* preallocated but never written, reads as zeros */
+    bool shared; /* shared with other files by reflink/dedupe */
+    bool last; /* last extent of the file */
+};
+using SparseExtentResult = std::optional<std::vector<SparseExtent>>;
+
+#ifdef _WIN32
+inline uint64_t CombineDWORD(DWORD low, DWORD high) {
+    return (uint64_t)low + ((uint64_t)MAXDWORD + 1) * high;
+}
+
+inline uint64_t ConvertWin32Time(DWORD low, DWORD high)
+{
+    const uint64_t UNIX_TIME_START = 0x019DB1DED53E8000; /* January 1, 1970 (start of Unix epoch) in "ticks" */
+    const uint64_t TICKS_PER_SECOND = 10000000; /* a tick is 100ns */
+    LARGE_INTEGER li;
+    li.LowPart  = low;
+    li.HighPart = high;
+#ifdef KEEP_WIN32_NATIVE_TIMESTAMP_VALUE
+    return li.QuadPart;
+#else
+    /* Convert ticks since 1/1/1970 into seconds */
+    return (li.QuadPart - UNIX_TIME_START) / TICKS_PER_SECOND;
+#endif
+}
+
+inline uint64_t ConvertWin32TimeNano(DWORD low, DWORD high)
+{
+    const uint64_t UNIX_TIME_START = 0x019DB1DED53E8000; /* January 1, 1970 (start of Unix epoch) in "ticks" */
+    const uint64_t NANOSECONDS_PER_TICK = 100;
+    LARGE_INTEGER li;
+    li.LowPart  = low;
+    li.HighPart = high;
+    return (li.QuadPart - UNIX_TIME_START) * NANOSECONDS_PER_TICK;
+}
+#endif
+
+/**
+* wrap some cross-platform filesystem API for Windows/LINUX
+*/
+namespace FileSystemUtil {
+
+#ifdef _WIN32
+/* 
+ * transform between UTF-8 and UTF-16
+ * any method using _WIN32 API passing WCHAR
+ */
+std::wstring Utf8ToUtf16(const std::string& str);
+std::string Utf16ToUtf8(const std::wstring& wstr);
+bool EnablePrivilege();
+#endif
+
+/**
+* wrap stat for LINUX and GetFileInformationByHandle for windows,
+* to provide file meta info query service
+*/
+class StatResult {
+public:
+#ifdef __linux__
+    StatResult(const std::string& path, const struct stat& statbuff);
+#ifdef FSUTIL_HAVE_STATX
+    StatResult(const std::string& path, const struct statx& statxbuff);
+#endif
+#endif
+
+#ifdef _WIN32
+    StatResult(const std::wstring& wPath, const BY_HANDLE_FILE_INFORMATION& handleFileInformation);
+#endif
+    /**
+    * user id and group id of the owner, always set to zero on windows
+    */
+    uint64_t UserID() const;
+    uint64_t GroupID() const;
+
+    /**
+    * AccessTime and CreationTime are invalid on FAT32 drives
+    * on LINUX CreationTime is the birth time if it was queried by StatX(), otherwise the change time
+    */
+    uint64_t AccessTime() const;
+    uint64_t CreationTime() const;
+    uint64_t ModifyTime() const;
+
+    /* nanoseconds since epoch, resolution is 100ns on windows */
+    uint64_t AccessTimeNano() const;
+    uint64_t CreationTimeNano() const;
+    uint64_t ModifyTimeNano() const;
+
+    /**
+    * UNIX fs hardlink file share the same inode, but inode has no meaning on FAT32/HPFS/NTFS.. fs
+    * Windows use "file index" to mark a unique id of a file or a directory in a volume
+    */
+    uint64_t UniqueID() const;
+
+    uint64_t Size() const; /* size in bytes */
+    /**
+    * bytes allocated on disk, st_blocks * 512 on LINUX,
+    * GetCompressedFileSizeW() on windows which differs from Size() only for sparse/compressed files
+    */
+    uint64_t AllocatedSize() const;
+    uint64_t DeviceID() const; /* id of the disk containning the file */
+    uint64_t LinksCount() const; /* no of hard links to the file, on _WIN32 always set to 1 on non - NTFS fs */
+
+    bool IsDirectory() const;
+    std::string CanonicalPath() const;
+
+#ifdef _WIN32
+    /* based on dwFileAttributes field */
+    bool IsArchive() const;
+    bool IsCompressed() const;
+    bool IsEncrypted() const;
+    bool IsSparseFile() const;
+    bool IsHidden() const;
+    bool IsOffline() const;
+    bool IsReadOnly() const;
+    bool IsSystem() const;
+    bool IsTemporary() const;
+    bool IsNormal() const;
+    bool IsReparsePoint() const;
+    uint64_t Attribute() const;
+    
+    /* reparse point related methods */
+    DWORD ReparseTag() const;
+    bool IsSymbolicLink() const;
+    bool IsJunctionPoint() const;
+    bool IsMountedDevice() const;
+    std::optional<std::wstring> MountedDeviceNameW() const;
+    std::optional<std::wstring> JunctionsPointTargetPathW() const;
+    std::optional<std::wstring> SymbolicLinkTargetPathW() const;
+    bool HasReparseSymbolicLinkTag() const;
+    bool HasReparseMountPointTag() const;
+    bool HasReparseNfsTag() const;
+    bool HasReparseOneDriveTag() const;
+    std::optional<std::wstring> FinalPathW() const; 
+
+    std::wstring CanonicalPathW() const;
+#endif
+
+#ifdef __linux__
+    /* based on st_mode field */
+    bool IsRegular() const;
+    bool IsPipe() const;
+    bool IsCharDevice() const;
+    bool IsBlockDevice() const;
+    bool IsSymLink() const;
+    bool IsSocket() const;
+    uint64_t Mode() const;
+
+    /* inode change time, "ctime" of stat */
+    uint64_t ChangeTime() const;
+    uint64_t ChangeTimeNano() const;
+    bool HasBirthTime() const;
+    /* STATX_XXX bits of the fields filled by the kernel, STATX_BASIC_STATS for results of stat */
+    uint32_t FieldMask() const;
+    /* refill with the stat of another path, the storage of the path is kept so reuse does not allocate */
+    void Assign(std::string_view path, const struct stat& statbuff);
+#endif
+
+private:
+#ifdef __linux__
+    struct stat m_stat {};
+    std::string m_path; /* raw input path */
+    uint32_t m_fieldMask = STATX_BASIC_STATS;
+    struct timespec m_birthTime {};
+#endif
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION m_handleFileInformation{};
+    std::wstring m_wPath; /* raw input path */
+#endif
+};
+
+std::optional<StatResult> Stat(const std::string& path);
+#ifdef __linux__
+/**
+* stat backed by statx(2), only the fields in mask (STATX_XXX) are required to be filled,
+* flags accepts AT_SYMLINK_NOFOLLOW, AT_STATX_DONT_SYNC (skip attribute sync on NFS/CIFS) etc.
+* fallback to stat/lstat if the kernel or libc does not support statx
+*/
+std::optional<StatResult> StatX(const std::string& path, uint32_t mask = STATX_BASIC_STATS, int flags = 0);
+#endif
+
+/**
+* batched metadata engine, issues the requests of a whole list of paths concurrently,
+* io_uring (IORING_OP_STATX/IORING_OP_OPENAT) is used on LINUX 5.6+ and a thread pool otherwise
+*/
+enum class BulkIoEngine {
+    Auto,       /* io_uring if available, fallback to thread pool */
+    IoUring,    /* fail every request with ENOSYS if io_uring is not available */
+    ThreadPool
+};
+
+struct BulkIoOptions {
+    BulkIoEngine engine = BulkIoEngine::Auto;
+    int queueDepth = 64; /* requests in flight, also the number of threads of the thread pool engine */
+};
+
+struct BulkStatResult {
+    std::optional<StatResult> statResult;
+    int error = 0; /* errno (GetLastError() on windows) of the failed request */
+};
+
+/* results are in the same order as paths */
+std::vector<BulkStatResult> BulkStat(
+    const std::vector<std::string>& paths, const BulkIoOptions& options = BulkIoOptions());
+#ifdef __linux__
+std::vector<BulkStatResult> BulkStatX(
+    const std::vector<std::string>& paths,
+    uint32_t mask = STATX_BASIC_STATS,
+    int flags = 0,
+    const BulkIoOptions& options = BulkIoOptions());
+/* return the opened fd owned by caller for each path, or -errno if failed */
+std::vector<int> BulkOpen(
+    const std::vector<std::string>& paths, int openFlags, const BulkIoOptions& options = BulkIoOptions());
+#endif
+#ifdef _WIN32
+std::optional<StatResult> StatW(const std::wstring& wPath);
+#endif
+
+/**
+* path edited in place during a traversal, Push() appends a component and Pop() removes the last one,
+* the storage only grows, so a walk stops allocating once the deepest/longest path was built
+*/
+class PathBuffer {
+public:
+    PathBuffer() = default;
+    explicit PathBuffer(std::string_view root);
+    void Assign(std::string_view root); /* reset to root, keep the storage */
+    void Push(std::string_view component); /* a separator is inserted unless the path already ends with one */
+    void Pop();
+    std::string_view View() const;
+    const char* CStr() const; /* null terminated */
+    size_t Size() const;
+    size_t Depth() const; /* number of components pushed since the last Assign() */
+
+private:
+    std::string m_path;
+    std::vector<size_t> m_lengths; /* length of the path before every Push() */
+};
+
+class OpenDirEntry
+{
+public:
+#ifdef _WIN32
+    OpenDirEntry(
+        const std::string&          dirPath,
+        const WIN32_FIND_DATAW&     findFileData,
+        const HANDLE&               fileHandle);
+    bool IsArchive() const;
+    bool IsCompressed() const;
+    bool IsEncrypted() const;
+    bool IsSparseFile() const;
+    bool IsHidden() const;
+    bool IsOffline() const;
+    bool IsReadOnly() const;
+    bool IsSystem() const;
+    bool IsTemporary() const;
+    bool IsNormal() const;
+    bool IsReparsePoint() const;
+    uint64_t AccessTime() const;
+    uint64_t CreationTime() const;
+    uint64_t ModifyTime() const;
+    uint64_t Size() const;
+    uint64_t Attribute() const;
+#endif
+
+#ifdef __linux__
+    OpenDirEntry(const std::string& dirPath,
+    DIR* dirPtr, struct dirent* direntPtr);
+    bool IsUnknown() const;
+    bool IsPipe() const;
+    bool IsCharDevice() const;
+    bool IsBlockDevice() const;
+    bool IsSymLink() const;
+    bool IsSocket() const;
+    bool IsRegular() const;
+    /**
+    * d_type of the entry, only if the filesystem reports DT_UNKNOWN the type is resolved by fstatat()
+    * without following symbolic links, all of the Is*() helpers including IsDirectory() are based on it
+    */
+    unsigned char Type() const;
+    uint64_t INode() const;
+    int DirFd() const; /* fd of the opened directory, base of the fd-relative API, -1 if closed */
+#endif
+
+    bool IsDirectory() const;
+#ifdef _WIN32
+    std::wstring NameW() const;
+    std::wstring FullPathW() const;
+#endif
+    std::string Name() const;
+    std::string FullPath() const;
+    /* views are valid until the next call of Next()/Close(), no copy of the name is made on LINUX */
+    std::string_view NameView() const;
+    std::string_view DirPathView() const;
+    bool Next();
+    void Close();
+    
+    /* move only, the moved-from entry is closed */
+    OpenDirEntry(OpenDirEntry&& other) noexcept;
+    OpenDirEntry& operator = (OpenDirEntry&& other) noexcept;
+    /* disable copy/assign construct */
+    OpenDirEntry(const OpenDirEntry&) = delete;
+    OpenDirEntry operator = (const OpenDirEntry&) = delete;
+    ~OpenDirEntry();
+
+private:
+#ifdef _WIN32
+    std::wstring m_dirPath;
+    HANDLE m_fileHandle = nullptr;
+    WIN32_FIND_DATAW m_findFileData;
+    std::string m_dirPathUtf8;
+    mutable std::string m_nameUtf8; /* storage of NameView(), reused by every entry */
+#endif
+
+#ifdef __linux__
+    std::string m_dirPath;
+    DIR* m_dir = nullptr;
+    struct dirent* m_dirent = nullptr;
+    mutable int m_type = -1; /* type of m_dirent cached by Type(), -1 until resolved */
+#endif
+};
+
+std::optional<OpenDirEntry> OpenDir(const std::string& path);
+
+/**
+* range interface over a directory listing: for (const OpenDirEntry& entry : ListDir(path)) { ... }
+* the iterator is a single pass input iterator, all iterators of a range share the same entry
+*/
+struct ListDirOptions {
+    bool skipDots = true; /* skip "." and ".." */
+    /* invoked with NameView() before the entry is exposed, return false to skip it */
+    std::function<bool(std::string_view name)> filter;
+};
+
+class DirRange {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = OpenDirEntry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const OpenDirEntry*;
+        using reference = const OpenDirEntry&;
+
+        /**
+        * result of the postfix increment, the range owns a single entry that is reused by the next one
+        * so the proxy keeps a copy of the name and the type of the entry before the increment
+        */
+        class Proxy {
+        public:
+            const Proxy& operator * () const;
+            const Proxy* operator -> () const;
+            std::string_view NameView() const;
+            bool IsDirectory() const;
+
+        private:
+            friend class Iterator;
+            std::string m_name;
+            bool m_isDirectory = false;
+        };
+
+        explicit Iterator(DirRange* range = nullptr);
+        reference operator * () const;
+        pointer operator -> () const;
+        Iterator& operator ++ ();
+        Proxy operator ++ (int);
+        bool operator == (const Iterator& other) const;
+        bool operator != (const Iterator& other) const;
+
+    private:
+        DirRange* m_range; /* nullptr for the end iterator */
+    };
+
+    DirRange(std::optional<OpenDirEntry> entry, const ListDirOptions& options);
+    DirRange(DirRange&& other) noexcept;
+    DirRange& operator = (DirRange&& other) noexcept;
+    /* disable copy/assign construct */
+    DirRange(const DirRange&) = delete;
+    DirRange& operator = (const DirRange&) = delete;
+
+    bool Opened() const; /* false if the directory failed to be opened */
+    Iterator begin();
+    Iterator end();
+
+private:
+    bool Accept() const;
+    bool Advance(); /* move to the next accepted entry, false at the end */
+
+    std::optional<OpenDirEntry> m_entry;
+    ListDirOptions m_options;
+    bool m_started = false;
+    bool m_end = false;
+};
+
+DirRange ListDir(const std::string& path, const ListDirOptions& options = ListDirOptions());
+
+#ifdef __linux__
+/**
+* owned directory file descriptor, base of the fd-relative (xxxat) API
+* names are resolved relative to the handle, the kernel only looks up one component per call
+* and the directory can't be swapped by a rename/symlink between two calls
+*/
+class DirHandle {
+public:
+    explicit DirHandle(int fd);
+    DirHandle(DirHandle&& other) noexcept;
+    DirHandle& operator = (DirHandle&& other) noexcept;
+    /* disable copy/assign construct */
+    DirHandle(const DirHandle&) = delete;
+    DirHandle& operator = (const DirHandle&) = delete;
+    ~DirHandle();
+
+    int Fd() const;
+    void Close();
+
+private:
+    int m_fd = -1;
+};
+
+std::optional<DirHandle> OpenDirHandle(const std::string& path);
+std::optional<DirHandle> OpenDirHandleAt(const DirHandle& dir, const char* name);
+/* statx/fstatat relative to dir, the result carries no path so CanonicalPath() returns empty string */
+std::optional<StatResult> StatAt(
+    const DirHandle& dir, const char* name, int flags = 0, uint32_t mask = STATX_BASIC_STATS);
+/* FullPath() of the returned entry is relative to dir */
+std::optional<OpenDirEntry> OpenDirAt(const DirHandle& dir, const char* name);
+bool MkdirAt(const DirHandle& dir, const char* name);
+bool UnlinkAt(const DirHandle& dir, const char* name, bool isDirectory = false);
+#endif
+
+#ifdef __linux__
+/**
+* bulk directory reader based on getdents64, one syscall decodes as many entries as fit in the buffer,
+* entries are exposed as views into the buffer and are valid until the next call of NextBatch()
+*/
+const size_t DEFAULT_DIRENT_BATCH_BUFFER_SIZE = 256 * 1024;
+
+struct DirentView {
+    std::string_view name; /* "." and ".." are included */
+    uint64_t inode;
+    unsigned char type; /* d_type, DT_UNKNOWN if not supported by the filesystem */
+};
+
+class DirentBatchReader {
+public:
+    DirentBatchReader(const std::string& dirPath, int dirFd, size_t bufferSize);
+    DirentBatchReader(DirentBatchReader&& other) noexcept;
+    DirentBatchReader& operator = (DirentBatchReader&& other) noexcept;
+    /* disable copy/assign construct */
+    DirentBatchReader(const DirentBatchReader&) = delete;
+    DirentBatchReader& operator = (const DirentBatchReader&) = delete;
+    ~DirentBatchReader();
+
+    /* replace the content of batch with the next entries, return false at the end of directory or on error */
+    bool NextBatch(std::vector<DirentView>& batch);
+    int Error() const; /* errno of the failed getdents64 call, 0 if the end of directory is reached */
+    int Fd() const;
+    const std::string& DirPath() const;
+    void Close();
+
+private:
+    std::string m_dirPath;
+    int m_fd = -1;
+    std::vector<char> m_buffer;
+    int m_error = 0;
+};
+
+std::optional<DirentBatchReader> OpenDirBatch(
+    const std::string& path, size_t bufferSize = DEFAULT_DIRENT_BATCH_BUFFER_SIZE);
+
+/**
+* list and stat every entry of a directory, each getdents64 batch is sorted by inode before fstatat()
+* so the inode tables are visited in a sweep instead of seeking randomly on rotational/network storage
+*/
+struct StatDirOptions {
+    bool inodeOrder = true; /* false to stat in readdir order */
+    int flags = AT_SYMLINK_NOFOLLOW; /* fstatat() flags */
+    size_t bufferSize = DEFAULT_DIRENT_BATCH_BUFFER_SIZE; /* also bounds the entries sorted at once */
+};
+
+struct StatDirEntry {
+    std::string name;
+    uint64_t inode;
+    unsigned char type; /* d_type */
+    std::optional<StatResult> statResult; /* carries no path like StatAt(), std::nullopt if failed */
+};
+
+/* "." and ".." are skipped, entries are in the order they were stat'ed */
+std::optional<std::vector<StatDirEntry>> StatDir(
+    const std::string& path, const StatDirOptions& options = StatDirOptions());
+#endif
+
+/**
+* gitignore style include/exclude rules compiled into one automaton, matched a byte at a time:
+* "#" comments, "!" negation, trailing "/" for directories only, "*", "?", "[a-z]", "[!a-z]" and "**",
+* a rule containing "/" is anchored to the root, otherwise it matches the name at any depth,
+* the last matching rule wins and an excluded directory excludes everything below it.
+* the NFA of all the rules is turned into a DFA lazily, shared and thread safe,
+* so the cost per name byte is one table lookup whatever the number of rules.
+* the transition tables of at most 16384 states are cached, the rules keep matching beyond by stepping the NFA.
+* states are carried down the tree: Root() -> Next(name) -> Enter() for the children of a directory
+*/
+struct PathFilterAutomaton;
+
+class PathFilter {
+public:
+    using State = uint32_t;
+
+    PathFilter() = default; /* no rule, nothing is excluded */
+    explicit PathFilter(std::shared_ptr<PathFilterAutomaton> automaton);
+
+    bool Empty() const;
+    State Root() const;
+    /* state of an entry named name in the directory of dirState */
+    State Next(State dirState, std::string_view name) const;
+    /* state of the directory of the children of entryState */
+    State Enter(State entryState) const;
+    bool Excluded(State entryState, bool isDirectory) const;
+    /* true if the result of Excluded() differs for a file and a directory, only directory rules matched */
+    bool DependsOnType(State entryState) const;
+    /* no rule can match the entry or anything below it */
+    bool Dead(State state) const;
+    /* check a '/' separated path relative to the root, an excluded parent excludes the path */
+    bool ExcludedPath(std::string_view relativePath, bool isDirectory) const;
+
+private:
+    std::shared_ptr<PathFilterAutomaton> m_automaton;
+};
+
+PathFilter CompilePathFilter(const std::vector<std::string>& rules);
+/* one rule per line, like a .gitignore file */
+std::optional<PathFilter> LoadPathFilter(const std::string& rulesPath);
+
+/**
+* parallel recursive directory traversal,
+* subdirectories are scheduled on per-worker deques and idle workers steal from the others
+*/
+struct WalkTreeOptions {
+    int threads = 0; /* number of worker threads, 0 to use std::thread::hardware_concurrency() */
+    int maxDepth = -1; /* entries directly under root have depth 1, -1 for unlimited depth */
+    /**
+    * Stat() every entry before visiting it, disable for name only scans: the entry type is then taken
+    * from d_type on LINUX and from the find data on windows, fstatat() is only issued for DT_UNKNOWN
+    */
+    bool statEntries = true;
+    /**
+    * descend into symbolic links/junctions pointing to directories, every directory is then entered once
+    * by its (device, unique id) so link cycles terminate, like find -L
+    */
+    bool followSymlink = false;
+    /**
+    * excluded entries are neither stat'ed nor visited and excluded directories are not descended,
+    * the name is matched before Stat(), the type of the entry is only required by directory rules
+    */
+    PathFilter filter;
+};
+
+struct WalkTreeContext {
+    int depth; /* depth of the entry, entries directly under root have depth 1 */
+    int workerIndex; /* index of the worker thread in [0, threads), usable to index per-thread state */
+    std::string_view dirPath; /* path of the directory containing the entry, as passed to OpenDir() */
+};
+
+/**
+* visitor is invoked concurrently from all worker threads for every entry except "." and "..",
+* statResult is set only if WalkTreeOptions::statEntries is enabled and the stat succeeded,
+* on LINUX it's queried by fstatat() relative to entry.DirFd() into a StatResult owned by the worker,
+* so its full path is kept without an allocation per entry, copy it to use it after the visitor returns
+* return false to prevent the walker from descending into the entry if it's a directory
+*/
+using WalkTreeVisitor = std::function<bool(
+    const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext& context)>;
+
+/* return false if root cannot be opened as a directory */
+bool WalkTree(const std::string& root, const WalkTreeOptions& options, const WalkTreeVisitor& visitor);
+
+/**
+* persistent snapshot of a directory tree, laid out to be mapped into memory as is:
+* header | fixed-width records | restart index | front-coded paths sorted by byte order
+* every TREE_SNAPSHOT_RESTART_INTERVAL-th path is stored in full and indexed, the others only store
+* the suffix following the prefix shared with the previous path, integers are in native byte order
+*/
+const uint32_t TREE_SNAPSHOT_VERSION = 1;
+const uint32_t TREE_SNAPSHOT_RESTART_INTERVAL = 16;
+
+struct TreeSnapshotRecord {
+    uint64_t uniqueId; /* UniqueID(), inode on LINUX */
+    uint64_t deviceId;
+    uint64_t size;
+    uint64_t accessTimeNano;
+    uint64_t modifyTimeNano;
+    uint64_t creationTimeNano;
+    uint32_t mode; /* Mode() on LINUX, Attribute() on windows */
+    uint32_t linksCount;
+};
+
+TreeSnapshotRecord MakeTreeSnapshotRecord(const StatResult& statResult);
+
+class TreeSnapshotWriter {
+public:
+    /* path is relative to the root of the snapshot and separated by '/' */
+    void Add(std::string path, const TreeSnapshotRecord& record);
+    size_t Size() const;
+    /* sort the entries by path and write them to a temporary file, synced then renamed to snapshotPath */
+    bool Write(const std::string& snapshotPath);
+
+private:
+    std::vector<std::pair<std::string, TreeSnapshotRecord>> m_entries;
+};
+
+/**
+* read-only view of a mapped snapshot file, opening a snapshot validates the header and the restart table,
+* records are accessed in place and paths are decoded on demand from the nearest restart point
+*/
+class TreeSnapshot {
+public:
+    TreeSnapshot(const char* base, uint64_t length);
+    TreeSnapshot(TreeSnapshot&& other) noexcept;
+    TreeSnapshot& operator = (TreeSnapshot&& other) noexcept;
+    /* disable copy/assign construct */
+    TreeSnapshot(const TreeSnapshot&) = delete;
+    TreeSnapshot& operator = (const TreeSnapshot&) = delete;
+    ~TreeSnapshot();
+
+    uint64_t Size() const; /* number of entries */
+    const TreeSnapshotRecord& Record(uint64_t index) const;
+    std::string Path(uint64_t index) const;
+    /* index of the first entry whose path is not less than path, Size() if there is none */
+    uint64_t LowerBound(std::string_view path) const;
+    std::optional<uint64_t> Find(std::string_view path) const;
+    /**
+    * decode the entries in order starting from startIndex, path is only valid during the call,
+    * return false from the visitor to stop, return false if a corrupted path is met
+    */
+    bool Scan(uint64_t startIndex, const std::function<bool(
+        uint64_t index, std::string_view path, const TreeSnapshotRecord& record)>& visitor) const;
+    void Close();
+
+private:
+    friend class TreeSnapshotCursor;
+    std::string_view RestartPath(uint64_t block) const;
+
+    const char* m_base = nullptr; /* mapped view of the whole file */
+    uint64_t m_length = 0;
+    uint64_t m_count = 0;
+    const TreeSnapshotRecord* m_records = nullptr;
+    const uint64_t* m_restarts = nullptr; /* offset in m_names of every restart point */
+    const char* m_names = nullptr;
+    uint64_t m_namesLength = 0;
+};
+
+/* sequential decoder of the entries, cheaper than calling Path() for every index */
+class TreeSnapshotCursor {
+public:
+    TreeSnapshotCursor(const TreeSnapshot& snapshot, uint64_t startIndex = 0);
+    bool Valid() const; /* false at the end of the snapshot or if a corrupted path is met */
+    bool Corrupted() const;
+    uint64_t Index() const;
+    std::string_view Path() const; /* valid until the next call of Next() */
+    const TreeSnapshotRecord& Record() const;
+    bool Next();
+
+private:
+    const TreeSnapshot* m_snapshot;
+    uint64_t m_index = 0;
+    const char* m_pos = nullptr;
+    std::string m_path;
+    bool m_corrupted = false;
+};
+
+std::optional<TreeSnapshot> OpenTreeSnapshot(const std::string& snapshotPath);
+/* walk root with WalkTree() and snapshot every entry under it, entries failed to stat are skipped */
+bool CaptureTreeSnapshot(
+    const std::string& root, const std::string& snapshotPath, const WalkTreeOptions& options = WalkTreeOptions());
+
+/**
+* streaming diff of two snapshots, paths are merged in order so the time is linear to the entries,
+* Removed/Added candidates sharing (deviceId, uniqueId) are paired as Renamed after an external sort
+* by inode, sorted runs are spilled to tempDir once memoryLimit is exceeded and merged back
+*/
+enum class TreeDiffType {
+    Added,
+    Removed,
+    Modified,   /* same path, the uniqueId, size, modify time or mode changed */
+    Renamed     /* same inode, different path, records are reported to detect a modification as well */
+};
+
+struct TreeDiffEntry {
+    TreeDiffType type;
+    std::string_view path; /* path in the new snapshot, in the old one for Removed */
+    std::string_view oldPath; /* only set for Renamed */
+    const TreeSnapshotRecord* oldRecord; /* nullptr for Added */
+    const TreeSnapshotRecord* newRecord; /* nullptr for Removed */
+};
+
+struct TreeDiffOptions {
+    bool detectRename = true;
+    uint64_t memoryLimit = 64 * 1024 * 1024; /* bytes of rename candidates sorted in memory per run */
+    std::string tempDir; /* directory of the spilled runs, system temp directory if empty */
+};
+
+/**
+* Modified entries are emitted in path order first, followed by Renamed/Removed/Added entries in inode order,
+* strings in the entry are only valid during the call, return false from the visitor to stop,
+* return false if a spilled run failed to be written/read or a snapshot is corrupted
+*/
+using TreeDiffVisitor = std::function<bool(const TreeDiffEntry& entry)>;
+
+bool DiffTreeSnapshot(
+    const TreeSnapshot& oldSnapshot,
+    const TreeSnapshot& newSnapshot,
+    const TreeDiffOptions& options,
+    const TreeDiffVisitor& visitor);
+
+/* Sparse File allocate range API */
+SparseRangeResult QuerySparseAllocateRanges(const std::string& path);
+
+/* copy mechanisms tried in order, the weakest one used by any range is reported */
+enum class SparseCopyStrategy {
+    None,           /* nothing copied */
+    Reflink,        /* whole file cloned by FICLONE */
+    ReflinkRange,   /* allocated ranges cloned by FICLONERANGE */
+    CopyFileRange,  /* allocated ranges copied in kernel by copy_file_range */
+    ReadWrite,      /* allocated ranges copied through a user space buffer */
+    ZeroDetect      /* allocated ranges read through a user space buffer, zero blocks left as holes */
+};
+
+enum class SparseMode {
+    Auto,   /* keep the holes of the source, zeros allocated in the source are copied */
+    Always  /* also skip every filesystem block of zeros, like cp --sparse=always (LINUX) */
+};
+
+class Hasher;
+
+struct SparseCopyOptions {
+    SparseMode mode = SparseMode::Auto;
+    /**
+    * hash the logical content while it passes through the copy buffers, holes are fed by UpdateZeros()
+    * so the digest equals HashFile() with holesAsZeros, ranges must be sorted, Final() is left to the caller,
+    * the destination is hashed again after the copy on windows
+    */
+    Hasher* hasher = nullptr;
+};
+
+bool CopySparseFile(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+bool CopySparseFile(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    SparseCopyStrategy& strategy);
+/**
+* SparseMode::Always and a hasher never clone nor copy in kernel, the data has to be seen,
+* reads of the next chunk then overlap the hashing and writing of the current one
+*/
+bool CopySparseFile(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    const SparseCopyOptions& options,
+    SparseCopyStrategy& strategy);
+
+/* true if all the bytes are zero, scanned with AVX2 or SSE2 when the CPU supports them */
+bool IsZeroBuffer(const void* data, size_t length);
+/* "avx2", "sse2" or "scalar", the code path taken by IsZeroBuffer() on this CPU */
+const char* IsZeroBufferImplementation();
+/**
+* copy allocated ranges split into chunks on a worker pool with positional I/O,
+* holes of the source stay holes, sequential CopySparseFile() is used on windows
+*/
+struct ParallelCopyOptions {
+    uint64_t chunkSize = 8 * 1024 * 1024; /* max bytes copied by one task */
+    int concurrency = 4; /* number of workers, each one keeps one request in flight */
+};
+
+bool CopySparseFileParallel(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    const ParallelCopyOptions& options = ParallelCopyOptions());
+
+#ifdef _WIN32
+SparseRangeResult QuerySparseWin32AllocateRangesW(const std::wstring& wPath);
+bool CopySparseFileWin32W(
+    const std::wstring& wSrcPath,
+    const std::wstring& wDstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+#endif
+/* convert extents to [<offset, length>] ranges, contiguous extents are merged */
+std::vector<std::pair<uint64_t, uint64_t>> SparseExtentsToRanges(
+    const std::vector<SparseExtent>& extents, bool unwrittenAsHole = false);
+#ifdef __linux__
+SparseRangeResult QuerySparsePosixAllocateRanges(const std::string& path);
+/**
+* query extents by FS_IOC_FIEMAP in batches, fallback to SEEK_DATA/SEEK_HOLE on filesystems without FIEMAP,
+* extents returned by the fallback carry no physical offset nor unwritten/shared flags
+*/
+SparseExtentResult QuerySparsePosixExtents(const std::string& path);
+/**
+* physical offset of the first extent of the file, one FIEMAP call without sync,
+* std::nullopt if nothing is mapped yet (empty file, delayed allocation) or FIEMAP is not supported
+*/
+std::optional<uint64_t> QueryFirstPhysicalOffset(const std::string& path);
+/**
+* permutation of paths sorted by QueryFirstPhysicalOffset(), so the content of many files is read in a single
+* sweep of a rotational disk, files without physical offset keep their relative order at the end
+*/
+std::vector<size_t> PhysicalReadOrder(const std::vector<std::string>& paths, int threads = 0);
+bool CopySparseFilePosix(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+bool CopySparseFilePosix(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    SparseCopyStrategy& strategy);
+bool CopySparseFilePosix(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    const SparseCopyOptions& options,
+    SparseCopyStrategy& strategy);
+/**
+* deallocate in place the filesystem blocks of zeros of the allocated ranges by FALLOC_FL_PUNCH_HOLE,
+* the content and size are unchanged, return the bytes punched or std::nullopt if the file can't be
+* opened for writing or the filesystem does not support punching holes
+*/
+std::optional<uint64_t> PunchZeroHoles(const std::string& path);
+struct DeltaCopyOptions {
+    uint64_t blockSize = 64 * 1024; /* bytes of one block of the stats, rounded up to the target filesystem block */
+};
+
+struct DeltaCopyStats {
+    uint64_t blocks = 0;        /* blocks of the source ranges compared */
+    uint64_t changedBlocks = 0; /* blocks with at least one differing byte */
+    uint64_t bytesWritten = 0;
+    uint64_t bytesPunched = 0;  /* target data deallocated where the source has holes */
+};
+/**
+* update an existing target in place to the content of the source, opened without O_EXCL and created if missing,
+* the target is truncated or extended to the source size, source blocks of the ranges are read along with the
+* target blocks at the same offset and compared byte by byte, only the differing filesystem blocks are written,
+* target data where the source has holes is punched
+*/
+std::optional<DeltaCopyStats> CopySparseFileDelta(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    const DeltaCopyOptions& options = DeltaCopyOptions());
+bool CopySparseFileParallelPosix(
+    const std::string& srcPath,
+    const std::string& dstPath,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+    const ParallelCopyOptions& options);
+#endif
+
+/**
+* incremental content hash, Final() returns the lowercase hex digest and is called once
+*/
+class Hasher {
+public:
+    virtual ~Hasher() = default;
+    virtual void Update(const void* data, size_t length) = 0;
+    /* feed length zero bytes, no I/O is involved but the bytes are still hashed */
+    virtual void UpdateZeros(uint64_t length);
+    virtual std::string Final() = 0;
+};
+
+enum class HashAlgorithm {
+    XXH64,  /* fast non-cryptographic hash, seed 0 */
+    SHA256
+};
+
+std::unique_ptr<Hasher> CreateHasher(HashAlgorithm algorithm);
+
+/**
+* hash the content of a file reading only the allocated ranges, holes are fed to the hasher without I/O
+*/
+struct HashFileOptions {
+    HashAlgorithm algorithm = HashAlgorithm::XXH64;
+    size_t bufferSize = 1024 * 1024; /* bytes of one aligned read */
+    bool useMmap = false; /* map the ranges with madvise(MADV_SEQUENTIAL) instead of pread, ignored on windows */
+    /**
+    * true to make the digest equal to the one of the plain content,
+    * false to hash every hole as its (offset, length) in O(1), the digest then depends on the layout
+    */
+    bool holesAsZeros = true;
+};
+
+std::optional<std::string> HashFile(const std::string& path, const HashFileOptions& options = HashFileOptions());
+bool HashFile(const std::string& path, Hasher& hasher, const HashFileOptions& options = HashFileOptions());
+
+struct HashTreeOptions {
+    HashFileOptions fileOptions;
+    int threads = 0; /* walker and hashing threads, 0 to use std::thread::hardware_concurrency() */
+    bool followSymlink = false;
+    bool physicalOrder = false; /* hash in PhysicalReadOrder() instead of the largest first (LINUX) */
+};
+
+/* invoked concurrently for every regular file, digest is empty if the file failed to be read */
+using HashTreeVisitor = std::function<void(
+    const std::string& path, const StatResult& statResult, const std::optional<std::string>& digest)>;
+
+/* walk root then hash the regular files on a thread pool, the largest files first unless physicalOrder is set */
+bool HashTree(const std::string& root, const HashTreeOptions& options, const HashTreeVisitor& visitor);
+
+/**
+* duplicate file finder, candidates are narrowed down in tiers so most of the files are never read:
+* same size -> distinct (DeviceID, UniqueID) -> head/tail sample hash -> full content hash
+*/
+struct FindDuplicatesOptions {
+    int threads = 0; /* walker and hashing threads, 0 to use std::thread::hardware_concurrency() */
+    uint64_t minSize = 1; /* smaller files are ignored */
+    uint64_t sampleSize = 64 * 1024; /* bytes hashed at the head and at the tail of a candidate */
+    HashAlgorithm algorithm = HashAlgorithm::XXH64;
+    bool followSymlink = false;
+};
+
+struct DuplicateGroup {
+    uint64_t size; /* size of every file of the group */
+    std::string digest;
+    std::vector<std::string> paths; /* one path per inode, sorted, hardlinks of a listed inode are omitted */
+};
+
+struct FindDuplicatesResult {
+    std::vector<DuplicateGroup> groups; /* largest files first */
+    uint64_t files = 0; /* regular files not smaller than minSize */
+    uint64_t totalBytes = 0; /* bytes of these files, counting every inode once */
+    uint64_t bytesHashed = 0; /* bytes fed to the hashers by the sample and full hash tiers */
+};
+
+/* return empty optional if root cannot be opened as a directory */
+std::optional<FindDuplicatesResult> FindDuplicates(
+    const std::string& root, const FindDuplicatesOptions& options = FindDuplicatesOptions());
+
+/**
+* du-like usage of a tree, every directory gets a node aggregating its whole subtree,
+* files with more than one link are counted once per (DeviceID, UniqueID)
+*/
+struct DiskUsageOptions {
+    int threads = 0; /* walker threads, 0 to use std::thread::hardware_concurrency() */
+    size_t topN = 10; /* number of largest subtrees to report */
+    bool followSymlink = false;
+};
+
+struct DiskUsageNode {
+    std::string path;
+    int depth; /* root is 0 */
+    uint64_t apparentSize; /* sum of Size() */
+    uint64_t allocatedSize; /* sum of AllocatedSize() */
+    uint64_t files; /* non directory entries */
+    uint64_t directories; /* subdirectories */
+    size_t parent; /* index of the parent node, the root is its own parent */
+    std::vector<size_t> children; /* indices of the subdirectory nodes */
+};
+
+struct DiskUsageResult {
+    std::vector<DiskUsageNode> nodes; /* nodes[0] is the root, a parent always precedes its children */
+    std::vector<size_t> top; /* indices of the topN largest subtrees by allocated size, root excluded */
+};
+
+std::optional<DiskUsageResult> DiskUsage(const std::string& root, const DiskUsageOptions& options = DiskUsageOptions());
+
+/**
+* bulk restore of a directory tree layout, common prefixes of the manifest are merged into a trie,
+* directories are created top-down by mkdirat() on a worker pool where every task is a subtree,
+* files are created by O_CREAT | O_EXCL and preallocated, their metadata is applied by the opened fd,
+* directories get their metadata in a final bottom-up pass relative to the parent fd
+*/
+struct RestoreEntry {
+    std::string path; /* relative to the restore root, '/' separated, parents are created implicitly */
+    bool isDirectory = false;
+    uint64_t size = 0; /* preallocated size of a file, 0 if unknown */
+    uint32_t mode = 0; /* only the permission bits (07777) are applied, 0 to keep the default one, ignored on windows */
+    int64_t uid = -1; /* -1 to keep the owner, ignored on windows */
+    int64_t gid = -1;
+    uint64_t accessTimeNano = 0; /* nanoseconds since epoch, 0 to keep the current time */
+    uint64_t modifyTimeNano = 0;
+};
+
+struct RestoreTreeOptions {
+    int threads = 0; /* worker threads, 0 to use std::thread::hardware_concurrency() */
+    bool preallocate = true; /* fallocate() files of known size, ftruncate() if not supported */
+    bool applyMetadata = true; /* mode, owner and timestamps */
+};
+
+struct RestoreTreeResult {
+    uint64_t directories = 0; /* created or already existing */
+    uint64_t files = 0;
+    uint64_t skipped = 0; /* snapshot entries other than files and directories */
+    std::vector<std::pair<std::string, int>> errors; /* path and errno (GetLastError() on windows) of the failed entries */
+};
+
+/* the root is created if missing, return std::nullopt if it fails to be created or opened */
+std::optional<RestoreTreeResult> RestoreTree(
+    const std::string& root,
+    const std::vector<RestoreEntry>& manifest,
+    const RestoreTreeOptions& options = RestoreTreeOptions());
+/* restore the layout captured by CaptureTreeSnapshot(), only files and directories are created */
+std::optional<RestoreTreeResult> RestoreTree(
+    const std::string& root,
+    const TreeSnapshot& snapshot,
+    const RestoreTreeOptions& options = RestoreTreeOptions());
+
+/**
+* hot path metrics, only collected when built with FSUTIL_ENABLE_METRICS (cmake -DFSUTIL_ENABLE_METRICS=ON),
+* otherwise the instrumentation compiles to nothing and the snapshot is empty.
+* counters are owned by the calling thread without any lock or atomic RMW and merged on snapshot,
+* syscalls are the ones issued by the library itself and the getdents64() refills of readdir() are not seen
+*/
+enum class MetricsApi {
+    Stat,               /* Stat(), StatX() and StatAt() */
+    OpenDir,            /* OpenDir() and OpenDirAt(), including the first entry */
+    DirNext,            /* OpenDirEntry::Next() */
+    CanonicalPath,      /* StatResult::CanonicalPath() */
+    QuerySparseRanges,  /* QuerySparsePosix*(), SEEK_DATA/SEEK_HOLE issued by the others count their syscalls here */
+    CopySparseFile,     /* CopySparseFile(Parallel)Posix(), bytes are the ones copied by any strategy */
+    HashFile,           /* HashFile(), bytes are the ones read */
+    COUNT
+};
+
+/**
+* latency histogram buckets are log-linear: exact below METRICS_LINEAR_BUCKETS nanoseconds,
+* then METRICS_SUB_BUCKETS buckets per power of two, so the relative error is bounded by 12.5%
+*/
+const uint64_t METRICS_LINEAR_BUCKETS = 16;
+const uint64_t METRICS_SUB_BUCKETS = 8;
+const uint64_t METRICS_HISTOGRAM_BUCKETS = METRICS_LINEAR_BUCKETS + (64 - 4) * METRICS_SUB_BUCKETS;
+
+struct ApiMetrics {
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t errors = 0; /* calls which failed, the end of a directory is not an error of DirNext */
+    uint64_t syscalls = 0;
+    uint64_t bytes = 0;
+    uint64_t totalNanos = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> latency; /* (bucket upper bound in ns, calls) of the non-empty buckets */
+    uint64_t PercentileNanos(double percentile) const; /* upper bound of the bucket, percentile in [0, 100] */
+};
+
+struct MetricsSnapshot {
+    bool enabled = false; /* built with FSUTIL_ENABLE_METRICS */
+    std::vector<ApiMetrics> apis; /* apis which have never been called are omitted */
+    std::string ToJson() const;
+};
+
+/* merge the counters of all threads, including the exited ones, since the last ResetMetrics() */
+MetricsSnapshot GetMetricsSnapshot();
+void ResetMetrics();
+
+#ifdef _WIN32
+/* _WIN32 Volumes related API */
+std::vector<std::wstring> GetWin32DriverListW();
+std::vector<std::string> GetWin32DriverList();
+
+class Win32VolumesDetail {
+public:
+    Win32VolumesDetail(const std::wstring& wVolumeName);
+    std::wstring VolumeNameW() const;
+    std::string VolumeName() const;
+    std::optional<std::wstring> GetVolumeDeviceNameW();
+    std::optional<std::string> GetVolumeDeviceName();
+    std::optional<std::vector<std::wstring>> GetVolumePathListW();
+    std::optional<std::vector<std::string>> GetVolumePathList();
+private:
+    std::wstring m_wVolumeName;
+};
+
+std::optional<std::vector<Win32VolumesDetail>> GetWin32VolumeList();
+
+bool EnablePrivilegeW(const wchar_t* wPrivilegeName);
+
+/* _WIN32 Security Descriptor related API */
+std::optional<std::wstring> GetSecurityDescriptorW(const std::wstring& wPath, DWORD& errCode);
+std::optional<std::string> GetSecurityDescriptor(const std::string& path, DWORD& errCode);
+bool SetSecurityDescriptorW(const std::wstring& wPath, const std::wstring& wSddlStr, DWORD& errCode);
+bool SetSecurityDescriptor(const std::string& path, const std::string& sddlStr, DWORD& errCode);
+
+/*
+ * Normalize windows path, convert the path to the form like C:\Dir1\Dir2
+ * Except root path like C:\, D:\, path won't ends with backslash
+ */
+std::wstring NormalizeWin32PathW(std::wstring& wPath);
+
+/* reparse point related methods */
+bool CreateSymbolicLinkW(
+    const std::wstring& wLinkFilePath,
+    const std::wstring& wTargetPath,
+    bool isDirectory = false,
+    bool isRelative = true);
+bool CreateJunctionPointW(const std::wstring& wSrcPath, const std::wstring& wDstPath);
+
+
+/* ADS releated API
+ * https://github.com/chenchao266/mfc/blob/b58abf9eb4c6d90ef01b9f1203b174471293dfba/wfc_sample/Sample/dump_ntfs_streams.cpp
+ */
+
+const int WIN32_STREAM_ID_BUFFER_LENGTH_MAX = 4096;
+
+class AlternateDataStreamEntry {
+public:
+    AlternateDataStreamEntry(HANDLE hFile, WIN32_FIND_STREAM_DATA lpFindStreamData);
+    std::wstring StreamNameW();
+    bool Next();
+    DWORD Error() const;
+    bool Eof() const;
+    ~AlternateDataStreamEntry();
+
+private:
+    HANDLE m_hStream = INVALID_HANDLE_VALUE;
+    WIN32_FIND_STREAM_DATA m_findStreamData;
+    DWORD m_error = 0;
+    bool m_eof = false;
+};
+
+/* ADS releated API */
+std::optional<AlternateDataStreamEntry> OpenAlternateDataStreamW(const std::wstring& wPath);
+#endif
+
+/* Common cross-platform API */
+bool IsDirectory(const std::string& path);
+bool IsEmptyDirectory(const std::string& path);
+bool Exists(const std::string& path);
+bool Mkdir(const std::string& path);
+bool MkdirRecursive(const std::string& path);
+std::string ParentDirectoryPath(const std::string& path);
+
+#ifdef FSUTIL_HAVE_COROUTINES
+/**
+* executor of the async API, blocking calls run on its threads and the awaiting coroutine
+* is resumed on the executor thread completing the request
+*/
+class IoExecutor {
+public:
+    virtual ~IoExecutor() = default;
+    /* run work on an executor thread, never inline */
+    virtual void Execute(std::function<void()> work) = 0;
+    /* stat path and invoke done on an executor thread, path must stay valid until then, run Stat() by Execute() by default */
+    virtual void SubmitStat(const std::string& path, std::function<void(std::optional<StatResult>)> done);
+};
+
+/**
+* engine Auto/IoUring: stat requests are submitted to an io_uring (IORING_OP_STATX) reaped by a single thread,
+* other calls fallback to the thread pool, return nullptr for IoUring if io_uring is not available
+* engine ThreadPool: a thread pool growing on demand up to queueDepth threads
+*/
+std::unique_ptr<IoExecutor> CreateIoExecutor(const BulkIoOptions& options = BulkIoOptions());
+/* process wide executor created by CreateIoExecutor() with the default options */
+IoExecutor& DefaultIoExecutor();
+
+/**
+* lazily started coroutine producing T, started by co_await from another coroutine or by SyncWait(),
+* exceptions thrown by the coroutine are rethrown to the awaiter
+*/
+template <typename T>
+class Task;
+
+struct TaskPromiseBase {
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+    void RethrowIfFailed() const
+    {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object() noexcept;
+    template <typename U>
+    void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+    T Result()
+    {
+        RethrowIfFailed();
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void Result() const { RethrowIfFailed(); }
+};
+
+template <typename T>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    /* awaits the completion without consuming the result */
+    struct CompletionAwaiter {
+        bool await_ready() const noexcept { return handle.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+        void await_resume() const noexcept {}
+
+        Handle handle;
+    };
+
+    explicit Task(Handle handle) : m_handle(handle) {}
+    Task(Task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    Task& operator = (Task&& other) noexcept
+    {
+        if (this != &other) {
+            Destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    /* disable copy/assign construct */
+    Task(const Task&) = delete;
+    Task& operator = (const Task&) = delete;
+    ~Task() { Destroy(); }
+
+    bool Done() const { return m_handle.done(); }
+    /* result of a completed task */
+    T Result() { return m_handle.promise().Result(); }
+    CompletionAwaiter Completion() const { return CompletionAwaiter { m_handle }; }
+
+    bool await_ready() const noexcept { return m_handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+    T await_resume() { return Result(); }
+
+private:
+    void Destroy()
+    {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    Handle m_handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/* eagerly started coroutine owning its frame, drives tasks from non-coroutine code */
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+/* resume the awaiting coroutine once all tasks are completed, results are then taken by co_await task */
+template <typename T>
+class WhenAllAwaiter {
+public:
+    explicit WhenAllAwaiter(std::vector<Task<T>>& tasks) : m_tasks(tasks) {}
+    bool await_ready() const noexcept { return m_tasks.empty(); }
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+        m_awaiting = awaiting;
+        m_remaining.store(m_tasks.size() + 1);
+        for (Task<T>& task : m_tasks) {
+            Run(task);
+        }
+        /* keep running if every task has completed inline */
+        return m_remaining.fetch_sub(1) != 1;
+    }
+    void await_resume() const noexcept {}
+
+private:
+    DetachedTask Run(Task<T>& task)
+    {
+        co_await task.Completion();
+        if (m_remaining.fetch_sub(1) == 1) {
+            m_awaiting.resume();
+        }
+    }
+
+    std::vector<Task<T>>& m_tasks;
+    std::coroutine_handle<> m_awaiting;
+    std::atomic<size_t> m_remaining { 0 };
+};
+
+template <typename T>
+WhenAllAwaiter<T> WhenAll(std::vector<Task<T>>& tasks) { return WhenAllAwaiter<T>(tasks); }
+
+/* block the calling thread until the task is completed, never call it on an executor thread */
+template <typename T>
+T SyncWait(Task<T> task)
+{
+    struct Event {
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+    } event;
+    [](Task<T>& task, Event& event) -> DetachedTask {
+        co_await task.Completion();
+        std::lock_guard<std::mutex> lock(event.mutex);
+        event.done = true;
+        event.cond.notify_one();
+    }(task, event);
+    std::unique_lock<std::mutex> lock(event.mutex);
+    event.cond.wait(lock, [&event]() { return event.done; });
+    return task.Result();
+}
+
+/* run a blocking call on the executor, co_await returns its result */
+template <typename Call>
+class AsyncCallAwaiter {
+public:
+    using Result = std::invoke_result_t<Call&>;
+
+    AsyncCallAwaiter(IoExecutor& executor, Call call) : m_executor(executor), m_call(std::move(call)) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> awaiting)
+    {
+        /* the awaiter lives in the suspended frame, do not touch it after resume() */
+        m_executor.Execute([this, awaiting]() {
+            try {
+                if constexpr (std::is_void_v<Result>) {
+                    m_call();
+                } else {
+                    m_result.emplace(m_call());
+                }
+            } catch (...) {
+                m_exception = std::current_exception();
+            }
+            awaiting.resume();
+        });
+    }
+    Result await_resume()
+    {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+        if constexpr (!std::is_void_v<Result>) {
+            return std::move(*m_result);
+        }
+    }
+
+private:
+    IoExecutor& m_executor;
+    Call m_call;
+    std::optional<std::conditional_t<std::is_void_v<Result>, bool, Result>> m_result;
+    std::exception_ptr m_exception;
+};
+
+template <typename Call>
+AsyncCallAwaiter<std::decay_t<Call>> AsyncCall(IoExecutor& executor, Call&& call)
+{
+    return AsyncCallAwaiter<std::decay_t<Call>>(executor, std::forward<Call>(call));
+}
+
+/* co_await AsyncStat(path) */
+class AsyncStatAwaiter {
+public:
+    AsyncStatAwaiter(std::string path, IoExecutor& executor);
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> awaiting);
+    std::optional<StatResult> await_resume() { return std::move(m_result); }
+
+private:
+    std::string m_path;
+    IoExecutor& m_executor;
+    std::optional<StatResult> m_result;
+};
+
+AsyncStatAwaiter AsyncStat(std::string path, IoExecutor& executor = DefaultIoExecutor());
+
+Task<bool> AsyncCopySparseFile(
+    std::string srcPath,
+    std::string dstPath,
+    std::vector<std::pair<uint64_t, uint64_t>> ranges,
+    IoExecutor& executor = DefaultIoExecutor());
+
+/**
+* lazily started async generator, every co_await Next() resumes the producer until its next co_yield,
+* return std::nullopt once the producer returned
+*/
+template <typename T>
+class AsyncGenerator {
+public:
+    struct promise_type {
+        struct YieldAwaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                return handle.promise().consumer;
+            }
+            void await_resume() const noexcept {}
+        };
+
+        AsyncGenerator get_return_object() noexcept
+        {
+            return AsyncGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        YieldAwaiter final_suspend() const noexcept { return {}; }
+        YieldAwaiter yield_value(T result)
+        {
+            value.emplace(std::move(result));
+            return {};
+        }
+        void return_void() const noexcept {}
+        void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+        std::coroutine_handle<> consumer;
+        std::optional<T> value;
+        std::exception_ptr exception;
+    };
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct NextAwaiter {
+        bool await_ready() const noexcept { return handle.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().consumer = awaiting;
+            return handle;
+        }
+        std::optional<T> await_resume()
+        {
+            promise_type& promise = handle.promise();
+            if (promise.exception) {
+                std::rethrow_exception(std::exchange(promise.exception, nullptr));
+            }
+            std::optional<T> result = std::move(promise.value);
+            promise.value.reset();
+            return result;
+        }
+
+        Handle handle;
+    };
+
+    explicit AsyncGenerator(Handle handle) : m_handle(handle) {}
+    AsyncGenerator(AsyncGenerator&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    /* disable copy/assign construct */
+    AsyncGenerator(const AsyncGenerator&) = delete;
+    AsyncGenerator& operator = (const AsyncGenerator&) = delete;
+    ~AsyncGenerator()
+    {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    NextAwaiter Next() { return NextAwaiter { m_handle }; }
+
+private:
+    Handle m_handle;
+};
+
+struct AsyncDirEntry {
+    std::string name;
+    bool isDirectory;
+};
+
+/* entries except "." and "..", read from the directory in batches on the executor */
+AsyncGenerator<AsyncDirEntry> AsyncListDir(std::string path, IoExecutor& executor = DefaultIoExecutor());
+#endif
+}
+
+#endif
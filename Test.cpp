@@ -0,0 +1,408 @@
+﻿#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <mutex>
+
+#include "FileSystemUtil.h"
+
+using namespace FileSystemUtil;
+
+/* every operator new of the process is counted, to assert the hot paths don't allocate per entry */
+static std::atomic<uint64_t> g_allocations { 0 };
+
+void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace {
+struct TestCase {
+    std::string name;
+    std::function<void()> run;
+};
+
+std::vector<TestCase>& TestCases()
+{
+    static std::vector<TestCase> testCases;
+    return testCases;
+}
+
+int g_failures = 0;
+
+struct TestRegistrar {
+    TestRegistrar(const std::string& name, const std::function<void()>& run) { TestCases().push_back({ name, run }); }
+};
+}
+
+#define FSUTIL_TEST(name) \
+    static void name(); \
+    static TestRegistrar name##Registrar(#name, name); \
+    static void name()
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            ++g_failures; \
+        } \
+    } while (false)
+
+/* empty directory under the system temp directory, removed with its content on destruction */
+class ScratchDir {
+public:
+    explicit ScratchDir(const std::string& name)
+        : m_path((std::filesystem::temp_directory_path() / ("fsutil_test_" + name)).string())
+    {
+        std::filesystem::remove_all(m_path);
+        std::filesystem::create_directories(m_path);
+    }
+    ~ScratchDir() { std::filesystem::remove_all(m_path); }
+    const std::string& Path() const { return m_path; }
+    std::string Join(const std::string& relative) const { return (std::filesystem::path(m_path) / relative).string(); }
+    void MakeFile(const std::string& relative) const
+    {
+        std::filesystem::create_directories(std::filesystem::path(Join(relative)).parent_path());
+        std::ofstream(Join(relative)) << relative;
+    }
+
+private:
+    std::string m_path;
+};
+
+static uint64_t WalkAllocations(const std::string& root, uint64_t& entries)
+{
+    WalkTreeOptions options;
+    options.threads = 1;
+    entries = 0;
+    uint64_t before = g_allocations.load();
+    WalkTree(root, options, [&](const OpenDirEntry&, const std::optional<StatResult>& statResult, const WalkTreeContext&) {
+        entries += statResult ? 1 : 0;
+        return true;
+    });
+    return g_allocations.load() - before;
+}
+
+FSUTIL_TEST(WalkTreeStatResultKeepsPath)
+{
+    ScratchDir dir("walk_path");
+    dir.MakeFile("sub/file");
+    std::string expected = std::filesystem::canonical(dir.Join("sub/file")).string();
+    bool found = false;
+    WalkTree(dir.Path(), WalkTreeOptions(),
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext&) {
+            if (entry.NameView() == "file") {
+                found = true;
+                CHECK(statResult.has_value());
+                CHECK(statResult && statResult->CanonicalPath() == expected);
+            }
+            return true;
+        });
+    CHECK(found);
+}
+
+FSUTIL_TEST(WalkTreeNoAllocationPerEntry)
+{
+    ScratchDir small("walk_alloc_small");
+    ScratchDir large("walk_alloc_large");
+    /* names of the same length, so the path storage reaches its size with the first entry */
+    for (int i = 0; i < 8; ++i) {
+        small.MakeFile(std::to_string(10000 + i));
+    }
+    for (int i = 0; i < 2000; ++i) {
+        large.MakeFile(std::to_string(10000 + i));
+    }
+    uint64_t smallEntries = 0;
+    uint64_t largeEntries = 0;
+    uint64_t smallAllocations = WalkAllocations(small.Path(), smallEntries);
+    uint64_t largeAllocations = WalkAllocations(large.Path(), largeEntries);
+    CHECK(smallEntries == 8);
+    CHECK(largeEntries == 2000);
+    /* a single directory, so the walk allocates the same whatever the number of entries */
+    CHECK(largeAllocations == smallAllocations);
+}
+
+FSUTIL_TEST(ListDirPostIncrementKeepsEntry)
+{
+    ScratchDir dir("list_dir");
+    dir.MakeFile("a");
+    dir.MakeFile("b/c");
+    DirRange moved = ListDir(dir.Path());
+    DirRange range = std::move(moved);
+    CHECK(range.Opened());
+    CHECK(!moved.Opened());
+    CHECK(moved.begin() == moved.end());
+    std::vector<std::string> names;
+    bool directoryFound = false;
+    for (DirRange::Iterator it = range.begin(); it != range.end();) {
+        bool isDirectory = it->IsDirectory();
+        std::string name((*it++).NameView());
+        directoryFound |= isDirectory && name == "b";
+        names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+    CHECK(names == std::vector<std::string>({ "a", "b" }));
+    CHECK(directoryFound);
+}
+
+FSUTIL_TEST(PathFilterUnanchoredRuleMatchesWholeNames)
+{
+    PathFilter filter = CompilePathFilter({ "foo" });
+    CHECK(filter.ExcludedPath("foo", false));
+    CHECK(filter.ExcludedPath("a/foo", false));
+    CHECK(filter.ExcludedPath("a/b/foo", true));
+    CHECK(filter.ExcludedPath("foo/bar", false));
+    CHECK(!filter.ExcludedPath("xfoo", false));
+    CHECK(!filter.ExcludedPath("a/xfoo", false));
+    CHECK(!filter.ExcludedPath("foox", false));
+    CHECK(!filter.ExcludedPath("a/b/xfoo", true));
+}
+
+FSUTIL_TEST(PathFilterGlobStarMatchesWholeComponents)
+{
+    PathFilter filter = CompilePathFilter({ "a/**/b" });
+    CHECK(filter.ExcludedPath("a/b", false));
+    CHECK(filter.ExcludedPath("a/x/b", false));
+    CHECK(filter.ExcludedPath("a/x/y/b", false));
+    CHECK(!filter.ExcludedPath("a/xb", false));
+    CHECK(!filter.ExcludedPath("a/x/yb", false));
+    CHECK(!filter.ExcludedPath("xa/b", false));
+
+    PathFilter leading = CompilePathFilter({ "**/c" });
+    CHECK(leading.ExcludedPath("c", false));
+    CHECK(leading.ExcludedPath("a/b/c", false));
+    CHECK(!leading.ExcludedPath("a/bc", false));
+
+    PathFilter trailing = CompilePathFilter({ "d/**" });
+    CHECK(trailing.ExcludedPath("d/e", false));
+    CHECK(trailing.ExcludedPath("d/e/f", false));
+    CHECK(!trailing.ExcludedPath("xd/e", false));
+}
+
+FSUTIL_TEST(PathFilterKeepsMatchingBeyondCachedStates)
+{
+    /* "the 15th byte from the end is an 'a'" needs 2^15 dfa states, more than the cached tables */
+    const size_t DISTANCE = 15;
+    PathFilter filter = CompilePathFilter({ "*a" + std::string(DISTANCE - 1, '?') });
+    uint64_t seed = 42;
+    uint64_t excluded = 0;
+    for (int index = 0; index < 4000; ++index) {
+        std::string name;
+        for (int length = 0; length < 40; ++length) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            name.push_back((seed >> 33) & 1 ? 'a' : 'b');
+        }
+        bool expected = name[name.size() - DISTANCE] == 'a';
+        CHECK(filter.ExcludedPath(name, false) == expected);
+        CHECK(filter.ExcludedPath("dir/" + name, false) == expected);
+        excluded += expected ? 1 : 0;
+    }
+    CHECK(excluded > 0);
+}
+
+FSUTIL_TEST(PathFilterDirectoryRuleMatchesWholeNames)
+{
+    PathFilter filter = CompilePathFilter({ "build/", "*.o", "!keep.o" });
+    CHECK(filter.ExcludedPath("build", true));
+    CHECK(filter.ExcludedPath("src/build", true));
+    CHECK(filter.ExcludedPath("build/out", false));
+    CHECK(!filter.ExcludedPath("build", false));
+    CHECK(!filter.ExcludedPath("mybuild", true));
+    CHECK(!filter.ExcludedPath("src/mybuild", true));
+    CHECK(!filter.ExcludedPath("mybuild/out", false));
+    CHECK(filter.ExcludedPath("src/main.o", false));
+    CHECK(!filter.ExcludedPath("src/keep.o", false));
+
+    ScratchDir dir("filter_walk");
+    dir.MakeFile("build/out");
+    dir.MakeFile("mybuild/out");
+    dir.MakeFile("src/build/out");
+    dir.MakeFile("src/mybuild/out");
+    WalkTreeOptions options;
+    options.filter = filter;
+    std::vector<std::string> files;
+    std::mutex mutex;
+    WalkTree(dir.Path(), options,
+        [&](const OpenDirEntry& entry, const std::optional<StatResult>& statResult, const WalkTreeContext&) {
+            if (!entry.IsDirectory()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                files.push_back(statResult ? statResult->CanonicalPath() : std::string(entry.NameView()));
+            }
+            return true;
+        });
+    std::sort(files.begin(), files.end());
+    CHECK(files == std::vector<std::string>({
+        std::filesystem::canonical(dir.Join("mybuild/out")).string(),
+        std::filesystem::canonical(dir.Join("src/mybuild/out")).string() }));
+}
+
+FSUTIL_TEST(MetricsCountFailedCalls)
+{
+    ScratchDir dir("metrics");
+    dir.MakeFile("file");
+    ResetMetrics();
+    CHECK(Stat(dir.Join("file")).has_value());
+    CHECK(!Stat(dir.Join("missing")).has_value());
+    std::optional<OpenDirEntry> entry = OpenDir(dir.Path());
+    CHECK(entry.has_value());
+    while (entry && entry->Next()) {}
+    MetricsSnapshot snapshot = GetMetricsSnapshot();
+    if (!snapshot.enabled) {
+        CHECK(snapshot.apis.empty());
+        return;
+    }
+    for (const ApiMetrics& api : snapshot.apis) {
+        if (api.name == "Stat") {
+            CHECK(api.calls == 2);
+            CHECK(api.errors == 1);
+        } else if (api.name == "DirNext") {
+            CHECK(api.errors == 0);
+        }
+    }
+    CHECK(snapshot.ToJson().find("\"errors\": 1") != std::string::npos);
+}
+
+FSUTIL_TEST(IsZeroBufferFindsEveryNonZeroByte)
+{
+    std::string implementation = IsZeroBufferImplementation();
+    CHECK(implementation == "avx2" || implementation == "sse2" || implementation == "scalar");
+    /* lengths around the 64 and 128 bytes vector loops, with an unaligned start to cover the tails */
+    const size_t LENGTHS[] = { 0, 1, 63, 64, 127, 128, 200, 512 };
+    std::vector<unsigned char> buffer(512 + 1, 0);
+    for (size_t length : LENGTHS) {
+        const unsigned char* data = buffer.data() + 1;
+        CHECK(IsZeroBuffer(data, length));
+        for (size_t index = 0; index < length; ++index) {
+            buffer[index + 1] = 0x80;
+            CHECK(!IsZeroBuffer(data, length));
+            buffer[index + 1] = 0;
+        }
+    }
+}
+
+FSUTIL_TEST(TreeSnapshotWriteLeavesNoTemporaryFile)
+{
+    ScratchDir dir("snapshot_write");
+    TreeSnapshotWriter writer;
+    writer.Add("b", TreeSnapshotRecord {});
+    writer.Add("a", TreeSnapshotRecord {});
+    CHECK(writer.Write(dir.Join("tree.snap")));
+    CHECK(!std::filesystem::exists(dir.Join("tree.snap.tmp")));
+    std::optional<TreeSnapshot> snapshot = OpenTreeSnapshot(dir.Join("tree.snap"));
+    CHECK(snapshot && snapshot->Size() == 2);
+
+    /* the rename fails on a non empty directory, the temporary file must not be left behind */
+    dir.MakeFile("busy.snap/file");
+    CHECK(!writer.Write(dir.Join("busy.snap")));
+    CHECK(!std::filesystem::exists(dir.Join("busy.snap.tmp")));
+}
+
+FSUTIL_TEST(TreeDiffSpilledRunsAreRemoved)
+{
+    ScratchDir dir("diff_spill");
+    ScratchDir runs("diff_spill_runs");
+    const uint64_t FILES = 1000;
+    TreeSnapshotWriter oldWriter;
+    TreeSnapshotWriter newWriter;
+    for (uint64_t index = 0; index < FILES; ++index) {
+        TreeSnapshotRecord record {};
+        record.uniqueId = index + 1;
+        record.deviceId = 1;
+        oldWriter.Add("old_" + std::to_string(index), record);
+        newWriter.Add("new_" + std::to_string(index), record);
+    }
+    CHECK(oldWriter.Write(dir.Join("old.snap")));
+    CHECK(newWriter.Write(dir.Join("new.snap")));
+    std::optional<TreeSnapshot> oldSnapshot = OpenTreeSnapshot(dir.Join("old.snap"));
+    std::optional<TreeSnapshot> newSnapshot = OpenTreeSnapshot(dir.Join("new.snap"));
+    CHECK(oldSnapshot && newSnapshot);
+    if (!oldSnapshot || !newSnapshot) {
+        return;
+    }
+    TreeDiffOptions options;
+    options.memoryLimit = 4096; /* a few hundred candidates per run */
+    options.tempDir = runs.Path();
+    uint64_t renamed = 0;
+    uint64_t spilled = 0;
+    CHECK(DiffTreeSnapshot(oldSnapshot.value(), newSnapshot.value(), options, [&](const TreeDiffEntry& entry) {
+        if (spilled == 0) {
+            spilled = static_cast<uint64_t>(std::distance(
+                std::filesystem::directory_iterator(runs.Path()), std::filesystem::directory_iterator()));
+        }
+        renamed += entry.type == TreeDiffType::Renamed ? 1 : 0;
+        return true;
+    }));
+    CHECK(renamed == FILES);
+    CHECK(spilled > 1);
+    CHECK(std::filesystem::is_empty(runs.Path()));
+}
+
+#ifdef __linux__
+static std::string ReadWholeFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+FSUTIL_TEST(CopySparseFileDeltaWritesOnlyDifferingBytes)
+{
+    ScratchDir dir("delta_copy");
+    const size_t FILE_SIZE = 1024 * 1024 + 1000; /* a partial last block */
+    std::string content(FILE_SIZE, '\0');
+    for (size_t index = 0; index < content.size(); ++index) {
+        content[index] = static_cast<char>('a' + index % 23);
+    }
+    std::ofstream(dir.Join("src"), std::ios::binary) << content;
+    std::ofstream(dir.Join("dst"), std::ios::binary) << content;
+    SparseRangeResult ranges = QuerySparseAllocateRanges(dir.Join("src"));
+    CHECK(ranges.has_value());
+    if (!ranges) {
+        return;
+    }
+    std::optional<DeltaCopyStats> stats = CopySparseFileDelta(dir.Join("src"), dir.Join("dst"), ranges.value());
+    CHECK(stats && stats->changedBlocks == 0 && stats->bytesWritten == 0);
+
+    /* one byte in the middle and one in the partial last block differ */
+    std::string stale = content;
+    stale[300000] ^= 1;
+    stale[FILE_SIZE - 1] ^= 1;
+    std::ofstream(dir.Join("dst"), std::ios::binary | std::ios::trunc) << stale;
+    struct stat dstStat {};
+    CHECK(::stat(dir.Join("dst").c_str(), &dstStat) == 0);
+    stats = CopySparseFileDelta(dir.Join("src"), dir.Join("dst"), ranges.value());
+    CHECK(stats && stats->changedBlocks == 2);
+    CHECK(stats && stats->bytesWritten <= 2 * static_cast<uint64_t>(dstStat.st_blksize));
+    CHECK(ReadWholeFile(dir.Join("dst")) == content);
+}
+#endif
+
+int main()
+{
+    for (const TestCase& testCase : TestCases()) {
+        int failures = g_failures;
+        testCase.run();
+        std::cout << (g_failures == failures ? "[PASS] " : "[FAIL] ") << testCase.name << std::endl;
+    }
+    return g_failures == 0 ? 0 : 1;
+}